@@ -27,12 +27,57 @@
  * DEALINGS IN THE SOFTWARE.
  */
 
+#if defined(MANGO_SNAPSHOT)
+#define _GNU_SOURCE
+#elif defined(MANGO_JIT) || defined(MANGO_FILE_CACHE)
+#define _DEFAULT_SOURCE
+#endif
+
 #include "mango.h"
 #include "mango_metadata.h"
 
 #include <math.h>
 #include <string.h>
 
+#if defined(MANGO_JIT)
+#if !defined(MANGO_THREADED_CODE) || !defined(__x86_64__) ||                  \
+    !defined(__linux__)
+#error MANGO_JIT requires MANGO_THREADED_CODE on x86-64 Linux
+#endif
+#include <sys/mman.h>
+#endif
+
+#if defined(MANGO_SNAPSHOT)
+#if UINTPTR_MAX != UINT64_MAX || !defined(__unix__)
+#error MANGO_SNAPSHOT requires a 64-bit POSIX system
+#endif
+#include <errno.h>
+#include <stdlib.h>
+#endif
+
+#if defined(MANGO_FILE_CACHE)
+#if !defined(__unix__)
+#error MANGO_FILE_CACHE requires a POSIX system
+#endif
+#include <pthread.h>
+#endif
+
+#if defined(MANGO_LAZY_IMPORT) &&                                             \
+    (defined(MANGO_THREADED_CODE) || defined(MANGO_VERIFY))
+#error MANGO_LAZY_IMPORT requires the byte code interpreter
+#endif
+
+#if defined(MANGO_NATIVE_MODULES) && defined(MANGO_THREADED_CODE)
+#error MANGO_NATIVE_MODULES requires the byte code interpreter
+#endif
+
+#if defined(MANGO_SNAPSHOT) || defined(MANGO_FILE_CACHE)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////
 
 #pragma GCC diagnostic push
@@ -45,6 +90,10 @@
 MANGO_DECLARE_REF_TYPE(void)
 MANGO_DECLARE_REF_TYPE(uint8_t)
 MANGO_DECLARE_REF_TYPE(mango_module)
+MANGO_DECLARE_REF_TYPE(cell)
+MANGO_DECLARE_REF_TYPE(jit_state)
+MANGO_DECLARE_REF_TYPE(call_site)
+MANGO_DECLARE_REF_TYPE(syscall_entry)
 
 #pragma pack(push, 4)
 
@@ -118,13 +167,37 @@ typedef struct mango_vm {
 
   void_ref base;
 
-  uint32_t _reserved[2];
+  uint32_t fuel;
+  uint32_t _reserved[1];
+#if defined(MANGO_NESTED_CALLS)
+  uint16_t rp_base;
+  uint16_t sp_base;
+#endif
+#if defined(MANGO_SYSCALL_HANDLERS)
+  syscall_entry_ref syscalls;
+#endif
+#if defined(MANGO_JIT)
+  jit_state_ref jit;
+#endif
+#if defined(MANGO_CALL_CACHE)
+  call_site_ref calls;
+#endif
+#if defined(MANGO_LAZY_IMPORT)
+  uint8_t missing;
+#endif
 
   union {
     void *context;
     uint8_t _context[8];
   };
 
+#if defined(MANGO_PROGRAM)
+  union {
+    const mango_program *program;
+    uint8_t _program[8];
+  };
+#endif
+
   stackval stack[];
 } mango_vm;
 
@@ -146,19 +219,47 @@ typedef struct mango_module {
   uint8_t import_count;
   uint8_t_ref imports;
 
-  uint32_t _reserved[1];
+  cell_ref code;
 
   union {
     void *context;
     uint8_t _context[8];
   };
+
+#if defined(MANGO_NATIVE_MODULES)
+  union {
+    const mango_native_module *native;
+    uint8_t _native[8];
+  };
+#endif
 } mango_module;
 
 #pragma pack(pop)
 
+#if defined(MANGO_PROGRAM)
+struct mango_program {
+  uint32_t size;
+  mango_module_name startup_module_name;
+  mango_module_ref modules;
+  uint8_t modules_created;
+  uint8_t init_head;
+  uint16_t name_mask;
+  uint8_t names[];
+};
+#endif
+
+typedef union cell cell;
+typedef struct jit_state jit_state;
+typedef struct call_site call_site;
+typedef struct syscall_entry syscall_entry;
+
 MANGO_DEFINE_REF_TYPE(void, )
 MANGO_DEFINE_REF_TYPE(uint8_t, const)
 MANGO_DEFINE_REF_TYPE(mango_module, )
+MANGO_DEFINE_REF_TYPE(cell, const)
+MANGO_DEFINE_REF_TYPE(jit_state, )
+MANGO_DEFINE_REF_TYPE(call_site, )
+MANGO_DEFINE_REF_TYPE(syscall_entry, )
 
 #pragma clang diagnostic pop
 #pragma GCC diagnostic pop
@@ -178,6 +279,148 @@ typedef union packed {
 
 #pragma pack(pop)
 
+typedef struct function_header {
+  uint8_t arg_count;
+  uint8_t loc_count;
+  uint8_t max_stack;
+  uint8_t flags;
+#if defined(MANGO_JIT)
+  uint32_t hotness;
+#endif
+} function_header;
+
+// The two lowest flags of a function header hold its tier with MANGO_JIT.
+#define TIER_MASK 3
+#define INTERNAL 4
+
+typedef struct function_entry {
+  uint16_t offset;
+  uint16_t code;
+} function_entry;
+
+typedef struct code_info {
+  uint16_t function_count;
+  uint16_t functions;
+} code_info;
+
+union cell {
+  const void *handler;
+  const uint8_t *data;
+  function_header func;
+  function_entry entry;
+  code_info info;
+  function_token ftn;
+  int32_t i32;
+  uint32_t u32;
+};
+
+#if !defined(MANGO_THREADED_CODE)
+#define HALT_IP (sizeof(mango_module_def) - 1)
+#define ENTRY_IP offsetof(mango_module_def, entry_point)
+#else
+#define HALT_IP 1
+#define ENTRY_IP 2
+
+typedef enum superinstruction {
+#define SUPERINSTRUCTION(c, s, cells) c,
+#include "mango_superinstructions.inc"
+#undef SUPERINSTRUCTION
+  SUPERINSTRUCTION_COUNT
+} superinstruction;
+
+#define FUSION_COUNT DIV_I32_UNCHECKED
+#endif
+
+#if defined(MANGO_JIT)
+#if !defined(MANGO_JIT_THRESHOLD)
+#define MANGO_JIT_THRESHOLD 1000
+#endif
+#if !defined(MANGO_JIT_ARENA_SIZE)
+#define MANGO_JIT_ARENA_SIZE 0x40000
+#endif
+
+#pragma pack(push, 4)
+
+struct jit_state {
+  union {
+    uint8_t *base;
+    uint8_t _base[8];
+  };
+  uint32_t size;
+  uint32_t used;
+};
+
+#pragma pack(pop)
+
+#define JIT_MAP_CELLS(Count)                                                   \
+  (((Count) * sizeof(uint32_t) + sizeof(cell) - 1) / sizeof(cell))
+#endif
+
+#if defined(MANGO_CALL_CACHE)
+#if !defined(MANGO_CALL_CACHE_SIZE)
+#define MANGO_CALL_CACHE_SIZE 256
+#endif
+
+#pragma pack(push, 4)
+
+struct call_site {
+  uint32_t key;
+  uint8_t module;
+  uint8_t arg_count;
+  uint8_t loc_count;
+  uint8_t max_stack;
+#if !defined(MANGO_THREADED_CODE)
+  union {
+    const uint8_t *image;
+    uint8_t _image[8];
+  };
+#if defined(MANGO_NATIVE_MODULES)
+  union {
+    const mango_native_module *native;
+    uint8_t _native[8];
+  };
+#endif
+#else
+  uint32_t code;
+#endif
+};
+
+#pragma pack(pop)
+
+#define CALL_SITE_KEY(OpCode, Module, Offset)                                  \
+  ((uint32_t)(OpCode) << 24 | (uint32_t)(Module) << 16 | (uint32_t)(Offset))
+#define CALL_SITE_INDEX(Key)                                                   \
+  (((Key) ^ (Key) >> 13) & (MANGO_CALL_CACHE_SIZE - 1))
+#endif
+
+#if defined(MANGO_SYSCALL_HANDLERS)
+#if !defined(MANGO_SYSCALL_TABLE_SIZE)
+#define MANGO_SYSCALL_TABLE_SIZE 64
+#endif
+
+#pragma pack(push, 4)
+
+struct syscall_entry {
+  union {
+    mango_syscall_function *function;
+    uint8_t _function[8];
+  };
+  union {
+    void *context;
+    uint8_t _context[8];
+  };
+  int8_t adjustment;
+};
+
+#pragma pack(pop)
+#endif
+
+#if !defined(MANGO_TOS_CACHE)
+#define STACK_GUARD 0
+#else
+#define STACK_GUARD sizeof(stackval)
+#endif
+
 #if !defined(__EDG__)
 _Static_assert(sizeof(stack_frame) == 4, "Incorrect layout");
 _Static_assert(__alignof(stack_frame) == 2, "Incorrect layout");
@@ -186,13 +429,43 @@ _Static_assert(__alignof(function_token) == 2, "Incorrect layout");
 _Static_assert(sizeof(stackval) == 4, "Incorrect layout");
 _Static_assert(__alignof(stackval) == 4, "Incorrect layout");
 _Static_assert(sizeof(stackval2) == 8, "Incorrect layout");
+_Static_assert(sizeof(mango_value) == sizeof(stackval), "Incorrect layout");
 _Static_assert(__alignof(stackval2) == 4, "Incorrect layout");
-_Static_assert(sizeof(mango_vm) == 64, "Incorrect layout");
+_Static_assert(sizeof(mango_vm) == 64
+#if defined(MANGO_NESTED_CALLS)
+                   + 4
+#endif
+#if defined(MANGO_SYSCALL_HANDLERS)
+                   + 4
+#endif
+#if defined(MANGO_JIT)
+                   + 4
+#endif
+#if defined(MANGO_CALL_CACHE)
+                   + 4
+#endif
+#if defined(MANGO_LAZY_IMPORT)
+                   + 4
+#endif
+#if defined(MANGO_PROGRAM)
+                   + 8
+#endif
+               , "Incorrect layout");
 _Static_assert(__alignof(mango_vm) == 4, "Incorrect layout");
-_Static_assert(sizeof(mango_module) == 32, "Incorrect layout");
+_Static_assert(sizeof(mango_module) == 32
+#if defined(MANGO_NATIVE_MODULES)
+                   + 8
+#endif
+               , "Incorrect layout");
 _Static_assert(__alignof(mango_module) == 4, "Incorrect layout");
+#if defined(MANGO_CALL_CACHE)
+_Static_assert((MANGO_CALL_CACHE_SIZE & (MANGO_CALL_CACHE_SIZE - 1)) == 0,
+               "MANGO_CALL_CACHE_SIZE must be a power of two");
+#endif
 _Static_assert(sizeof(packed) == 4, "Incorrect layout");
 _Static_assert(__alignof(packed) == 1, "Incorrect layout");
+_Static_assert(sizeof(cell) == sizeof(void *), "Incorrect layout");
+_Static_assert(__alignof(cell) == __alignof(void *), "Incorrect layout");
 #endif
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -204,7 +477,7 @@ int mango_version_minor(void) { return MANGO_VERSION_MINOR; }
 const char *mango_version_string(void) { return MANGO_VERSION_STRING; }
 
 int mango_features(void) {
-  int features = 0;
+  int features = MANGO_FEATURE_EXPORTS;
 #if !defined(MANGO_NO_I64)
   features |= MANGO_FEATURE_I64;
 #endif
@@ -222,8 +495,41 @@ int mango_features(void) {
 
 ////////////////////////////////////////////////////////////////////////////////
 
+#define MAPPED 1
+#define CHECKPOINT 2
+#define MISSING 8
+
+// With MANGO_NESTED_CALLS, functions can be called while the program is stopped
+// in the middle of a function or from its system call handlers. Such a call
+// runs on top of the frames of the program and returns at the base of the
+// stack it started from.
+#if defined(MANGO_NESTED_CALLS)
+#define RP_BASE(Vm) ((Vm)->rp_base)
+#define SP_BASE(Vm) ((Vm)->sp_base)
+#else
+#define RP_BASE(Vm) 0
+#define SP_BASE(Vm) ((Vm)->stack_size)
+#endif
+
+static inline int _mango_calling(const mango_vm *vm) {
+  return RP_BASE(vm) != 0 || SP_BASE(vm) != vm->stack_size;
+}
+
+#if defined(MANGO_FILE_CACHE)
+static void _mango_count_file(const uint8_t *image, int delta);
+static void _mango_count_files(const mango_vm *vm, int delta);
+#endif
+
 mango_vm *mango_initialize(void *address, size_t heap_size, size_t stack_size,
                            void *context) {
+  return mango_initialize_ex(address, heap_size, stack_size, 0, context);
+}
+
+mango_vm *mango_initialize_ex(void *address, size_t heap_size,
+                              size_t stack_size, int flags, void *context) {
+  if ((flags & ~MANGO_INITIALIZE_JIT) != 0) {
+    return NULL;
+  }
   if (!address || ((uintptr_t)address & (__alignof(mango_vm) - 1)) != 0) {
     return NULL;
   }
@@ -233,7 +539,8 @@ mango_vm *mango_initialize(void *address, size_t heap_size, size_t stack_size,
   if ((stack_size & (sizeof(stackval) - 1)) != 0) {
     return NULL;
   }
-  if (heap_size < stack_size || heap_size - stack_size < sizeof(mango_vm)) {
+  if (heap_size < stack_size ||
+      heap_size - stack_size < sizeof(mango_vm) + STACK_GUARD) {
     return NULL;
   }
 #if SIZE_MAX > UINT32_MAX
@@ -246,15 +553,57 @@ mango_vm *mango_initialize(void *address, size_t heap_size, size_t stack_size,
   memset(vm, 0, sizeof(mango_vm));
   vm->version = MANGO_VERSION_MAJOR;
   vm->heap_size = (uint32_t)heap_size;
-  vm->heap_used = (uint32_t)(sizeof(mango_vm) + stack_size);
+  vm->heap_used = (uint32_t)(sizeof(mango_vm) + stack_size + STACK_GUARD);
   vm->stack_size = (uint16_t)(stack_size / sizeof(stackval));
   vm->sp_expected = vm->sp = vm->stack_size;
-  vm->sf = (stack_frame){0, 0, (uint16_t)(sizeof(mango_module_def) - 1)};
+#if defined(MANGO_NESTED_CALLS)
+  vm->sp_base = vm->stack_size;
+#endif
+  vm->sf = (stack_frame){0, 0, (uint16_t)HALT_IP};
   vm->base = void_as_ref(vm, vm);
   vm->context = context;
+
+#if defined(MANGO_JIT)
+  if ((flags & MANGO_INITIALIZE_JIT) != 0) {
+    void *base = mmap(NULL, MANGO_JIT_ARENA_SIZE, PROT_READ | PROT_EXEC,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base != MAP_FAILED) {
+      jit_state *jit = (jit_state *)mango_heap_alloc(
+          vm, 1, sizeof(jit_state), __alignof(jit_state), 0);
+      if (jit) {
+        *jit = (jit_state){{(uint8_t *)base}, MANGO_JIT_ARENA_SIZE, 0};
+        vm->jit = jit_state_as_ref(vm, jit);
+      } else {
+        munmap(base, MANGO_JIT_ARENA_SIZE);
+      }
+    }
+  }
+#endif
+
   return vm;
 }
 
+void mango_finalize(mango_vm *vm) {
+#if defined(MANGO_FILE_CACHE)
+  if (vm) {
+    _mango_count_files(vm, -1);
+  }
+#endif
+#if defined(MANGO_JIT)
+  if (vm && !jit_state_is_null(vm->jit)) {
+    jit_state *jit = jit_state_as_ptr(vm, vm->jit);
+    munmap(jit->base, jit->size);
+    vm->jit = jit_state_null();
+  }
+#endif
+#if defined(MANGO_SNAPSHOT)
+  if (vm && (vm->init_flags & MAPPED) != 0) {
+    munmap(vm, vm->heap_size);
+  }
+#endif
+  (void)vm;
+}
+
 mango_result mango_error(mango_vm *vm, mango_result error) {
   if (!vm) {
     return MANGO_E_ARGUMENT_NULL;
@@ -312,6 +661,14 @@ size_t mango_heap_available(const mango_vm *vm) {
   return vm ? (size_t)vm->heap_size - (size_t)vm->heap_used : 0;
 }
 
+uint32_t mango_heap_ref(const mango_vm *vm, const void *address) {
+  if (!vm || (uintptr_t)address <= (uintptr_t)vm ||
+      (uintptr_t)address - (uintptr_t)vm >= vm->heap_size) {
+    return 0;
+  }
+  return (uint32_t)void_as_ref(vm, (void *)(uintptr_t)address).address;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 void *mango_stack_alloc(mango_vm *vm, size_t size, int flags) {
@@ -371,6 +728,8 @@ size_t mango_stack_available(const mango_vm *vm) {
 
 #define INVALID_MODULE 255
 
+#define VISITED 1
+
 static inline mango_module *_mango_get_modules(const mango_vm *vm) {
   return mango_module_as_ptr(vm, vm->modules);
 }
@@ -380,9 +739,32 @@ static inline mango_module *_mango_get_module(const mango_vm *vm,
   return mango_module_as_ptr(vm, vm->modules) + index;
 }
 
+// A VM attached to a program has modules of its own, but their imports and
+// code are those of the program, and refs to them are relative to it.
+#if defined(MANGO_PROGRAM)
+static inline const mango_vm *
+_mango_program_base(const mango_program *program) {
+  return (const mango_vm *)(const void *)program;
+}
+#endif
+
+static inline const mango_vm *_mango_get_program(const mango_vm *vm) {
+#if defined(MANGO_PROGRAM)
+  if (vm->program) {
+    return _mango_program_base(vm->program);
+  }
+#endif
+  return vm;
+}
+
 static inline const uint8_t *
 _mango_get_module_imports(const mango_vm *vm, const mango_module *module) {
-  return uint8_t_as_ptr(vm, module->imports);
+  return uint8_t_as_ptr(_mango_get_program(vm), module->imports);
+}
+
+static inline const cell *_mango_get_module_code(const mango_vm *vm,
+                                                 const mango_module *module) {
+  return cell_as_ptr(_mango_get_program(vm), module->code);
 }
 
 static inline const mango_module_name *
@@ -395,6 +777,20 @@ _mango_get_module_name(const mango_vm *vm, const mango_module *module) {
   }
 }
 
+static inline const mango_export_def *
+_mango_get_module_exports(const mango_module *module, size_t *count) {
+  const mango_module_def *m = (const mango_module_def *)module->image;
+  if ((m->features & MANGO_FEATURE_EXPORTS) == 0) {
+    *count = 0;
+    return NULL;
+  }
+
+  const mango_exports_def *exports =
+      (const mango_exports_def *)(m->imports + m->import_count);
+  *count = FETCH(&exports->slot_count, u16);
+  return exports->slots;
+}
+
 static uint8_t _mango_get_or_create_module(mango_vm *vm,
                                            const mango_module_name *name,
                                            uint8_t name_module,
@@ -437,7 +833,10 @@ static mango_result _mango_initialize_module(mango_vm *vm, uint8_t index,
     module->imports = uint8_t_null();
   }
 
-  module->_reserved[0] = 0;
+  module->code = cell_null();
+#if defined(MANGO_NATIVE_MODULES)
+  module->native = NULL;
+#endif
 
   return MANGO_E_SUCCESS;
 }
@@ -449,7 +848,8 @@ static mango_result _mango_import_startup_module(mango_vm *vm,
   const mango_module_def *m = (const mango_module_def *)image;
 
   mango_module *modules = (mango_module *)mango_heap_alloc(
-      vm, m->module_count, sizeof(mango_module), __alignof(mango_module), 0);
+      vm, m->module_count, sizeof(mango_module), __alignof(mango_module),
+      MANGO_ALLOC_ZERO_MEMORY);
 
   if (!modules) {
     return MANGO_E_OUT_OF_MEMORY;
@@ -463,6 +863,9 @@ static mango_result _mango_import_startup_module(mango_vm *vm,
   mango_module *module = &modules[0];
   module->image = image;
   module->image_size = (uint16_t)size;
+#if defined(MANGO_FILE_CACHE)
+  _mango_count_file(image, 1);
+#endif
   module->name_module = INVALID_MODULE;
   module->name_index = INVALID_MODULE;
   module->init_next = INVALID_MODULE;
@@ -473,11 +876,35 @@ static mango_result _mango_import_startup_module(mango_vm *vm,
   return _mango_initialize_module(vm, 0, module);
 }
 
-static mango_result _mango_import_missing_module(mango_vm *vm,
+// Without lazy imports, modules are imported in the order they are created.
+// With lazy imports, any module that has been created can be imported next,
+// including after the program has started.
+
+static uint8_t _mango_find_missing_module(const mango_vm *vm,
+                                          const uint8_t *name) {
+#if !defined(MANGO_LAZY_IMPORT)
+  (void)name;
+  return vm->modules_imported;
+#else
+  for (uint_fast8_t i = 0; i < vm->modules_created; i++) {
+    const mango_module *module = _mango_get_module(vm, (uint8_t)i);
+    if (!module->image && memcmp(name, _mango_get_module_name(vm, module),
+                                 sizeof(mango_module_name)) == 0) {
+      return (uint8_t)i;
+    }
+  }
+  return INVALID_MODULE;
+#endif
+}
+
+static mango_result _mango_import_missing_module(mango_vm *vm, uint8_t index,
                                                  const uint8_t *name,
                                                  const uint8_t *image,
                                                  size_t size, void *context) {
-  uint8_t index = vm->modules_imported;
+  if (index == INVALID_MODULE) {
+    return MANGO_E_INVALID_OPERATION;
+  }
+
   mango_module *module = _mango_get_module(vm, index);
   const mango_module_name *n = _mango_get_module_name(vm, module);
 
@@ -489,6 +916,9 @@ static mango_result _mango_import_missing_module(mango_vm *vm,
 
   module->image = image;
   module->image_size = (uint16_t)size;
+#if defined(MANGO_FILE_CACHE)
+  _mango_count_file(image, 1);
+#endif
   module->init_next = INVALID_MODULE;
   module->init_prev = INVALID_MODULE;
   module->init_flags = 0;
@@ -497,77 +927,3966 @@ static mango_result _mango_import_missing_module(mango_vm *vm,
   return _mango_initialize_module(vm, index, module);
 }
 
-mango_result mango_module_import(mango_vm *vm, const uint8_t *name,
-                                 const uint8_t *image, size_t size,
-                                 void *context) {
-  if (!vm || !name || !image) {
-    return MANGO_E_ARGUMENT_NULL;
+////////////////////////////////////////////////////////////////////////////////
+
+static mango_result _mango_interpret(mango_vm *vm,
+                                     const void *const **handlers);
+
+#if defined(MANGO_THREADED_CODE) || defined(MANGO_VERIFY)
+
+#define REACHED 1
+#define DECODED 2
+#define FUNCTION 4
+#define TARGET 8
+
+static const int8_t _mango_opcode_args[] = {
+#define OPCODE(c, s, pop, push, args, i) args,
+#include "mango_opcodes.inc"
+#undef OPCODE
+};
+
+static const char *const _mango_opcode_names[] = {
+#define OPCODE(c, s, pop, push, args, i) s,
+#include "mango_opcodes.inc"
+#undef OPCODE
+};
+
+#define OPCODE_COUNT                                                           \
+  (sizeof(_mango_opcode_args) / sizeof(_mango_opcode_args[0]))
+
+typedef struct translation {
+  mango_vm *vm;
+  const void *const *handlers;
+  uint32_t *starts;
+  uint16_t *map;
+  uint16_t *flags;
+} translation;
+
+static inline int _mango_is_valid_opcode(unsigned int op) {
+  return op < OPCODE_COUNT && (_mango_opcode_args[op] != 0 ||
+                               strcmp(_mango_opcode_names[op], "unused") != 0);
+}
+
+static inline int _mango_falls_through(uint8_t op) {
+  return _mango_is_valid_opcode(op) && op != HALT && op != RET &&
+         op != RET_X32 && op != RET_X64 && op != BR_S && op != BR;
+}
+
+static size_t _mango_instruction_size(const uint8_t *image, size_t size,
+                                      size_t offset) {
+  uint8_t op = image[offset];
+  size_t n;
+
+  if (!_mango_is_valid_opcode(op)) {
+    n = 1;
+  } else if (_mango_opcode_args[op] >= 0) {
+    n = 1 + (size_t)_mango_opcode_args[op];
+  } else if (size - offset >= 5) {
+    n = 5 + (size_t)FETCH(image + offset + 1, u16) *
+                (size_t)FETCH(image + offset + 3, u16);
+  } else {
+    return 0;
   }
-  if (size < sizeof(mango_module_def) || size > UINT16_MAX) {
-    return MANGO_E_ARGUMENT;
+
+  return n <= size - offset ? n : 0;
+}
+
+static ptrdiff_t _mango_branch_target(const uint8_t *image, size_t offset) {
+  const uint8_t *ip = image + offset;
+
+  switch (*ip) {
+  case BR_S:
+  case BRFALSE_S:
+  case BRTRUE_S:
+    return (ptrdiff_t)offset + 2 + FETCH(ip + 1, i8);
+  default:
+    return (ptrdiff_t)offset + 3 + FETCH(ip + 1, i16);
   }
+}
 
-  const mango_module_def *m = (const mango_module_def *)image;
+static mango_result _mango_resolve_import(const translation *t,
+                                          uint8_t module, uint8_t import,
+                                          uint8_t *result) {
+  const mango_module *m = _mango_get_module(t->vm, module);
 
-  if (m->version != MANGO_VERSION_MAJOR ||
-      m->entry_point[sizeof(m->entry_point) - 1] != HALT ||
-      m->module_count == 0 || m->import_count > m->module_count) {
+  if (import == INVALID_MODULE) {
+    *result = module;
+  } else if (import < m->import_count) {
+    *result = _mango_get_module_imports(t->vm, m)[import];
+  } else {
     return MANGO_E_BAD_IMAGE_FORMAT;
   }
-  if ((m->features & mango_features()) != m->features) {
-    return MANGO_E_NOT_SUPPORTED;
+  return MANGO_E_SUCCESS;
+}
+
+static mango_result _mango_mark_function(translation *t, uint8_t module,
+                                         size_t offset) {
+  const mango_module *m = _mango_get_module(t->vm, module);
+
+  if (offset < sizeof(mango_module_def) ||
+      offset + sizeof(mango_func_def) >= m->image_size) {
+    return MANGO_E_BAD_IMAGE_FORMAT;
   }
 
-  if (vm->modules_imported == 0) {
-    return _mango_import_startup_module(vm, name, image, size, context);
-  } else if (vm->modules_imported < vm->modules_created) {
-    return _mango_import_missing_module(vm, name, image, size, context);
-  } else {
-    return MANGO_E_INVALID_OPERATION;
+  uint16_t *flags = t->flags + t->starts[module];
+  flags[offset] |= FUNCTION;
+  flags[offset + sizeof(mango_func_def)] |= REACHED | TARGET;
+  return MANGO_E_SUCCESS;
+}
+
+static mango_result _mango_mark_target(translation *t, uint8_t module,
+                                       ptrdiff_t target, uint16_t flags) {
+  const mango_module *m = _mango_get_module(t->vm, module);
+
+  if (target < (ptrdiff_t)offsetof(mango_module_def, entry_point) ||
+      target >= (ptrdiff_t)m->image_size) {
+    return MANGO_E_BAD_IMAGE_FORMAT;
   }
+
+  t->flags[t->starts[module] + (size_t)target] |= flags;
+  return MANGO_E_SUCCESS;
 }
 
-const uint8_t *mango_module_missing(const mango_vm *vm) {
-  if (!vm || vm->modules_imported >= vm->modules_created) {
-    return NULL;
+static mango_result _mango_decode(translation *t, uint8_t module,
+                                  size_t offset) {
+  const mango_module *m = _mango_get_module(t->vm, module);
+  const uint8_t *ip = m->image + offset;
+  size_t n = _mango_instruction_size(m->image, m->image_size, offset);
+  mango_result result = MANGO_E_SUCCESS;
+  uint8_t callee;
+
+  if (n == 0) {
+    return MANGO_E_BAD_IMAGE_FORMAT;
   }
 
-  mango_module *module = _mango_get_module(vm, vm->modules_imported);
-  return (const uint8_t *)_mango_get_module_name(vm, module);
+  switch (*ip) {
+  case BR_S:
+  case BRFALSE_S:
+  case BRTRUE_S:
+  case BR:
+  case BRFALSE:
+  case BRTRUE:
+    result = _mango_mark_target(t, module,
+                                _mango_branch_target(m->image, offset),
+                                REACHED | TARGET);
+    break;
+  case CALL_S:
+    result = _mango_mark_function(t, module, FETCH(ip + 1, u16));
+    break;
+  case CALL:
+  case LDFTN:
+    result = _mango_resolve_import(t, module, FETCH(ip + 1, u8), &callee);
+    if (result == MANGO_E_SUCCESS) {
+      result = _mango_mark_function(t, callee, FETCH(ip + 2, u16));
+    }
+    break;
+  }
+
+  if (result == MANGO_E_SUCCESS && _mango_falls_through(*ip)) {
+    result = _mango_mark_target(t, module, (ptrdiff_t)(offset + n), REACHED);
+  }
+
+  return result;
 }
 
-void *mango_module_context(const mango_vm *vm) {
-  if (!vm || vm->sf.module >= vm->modules_imported) {
-    return NULL;
+static mango_result _mango_discover(translation *t) {
+  int changed;
+
+  do {
+    changed = 0;
+
+    for (uint_fast8_t i = 0; i < t->vm->modules_created; i++) {
+      const mango_module *m = _mango_get_module(t->vm, (uint8_t)i);
+      uint16_t *flags = t->flags + t->starts[i];
+
+      for (size_t offset = 0; offset < m->image_size; offset++) {
+        if ((flags[offset] & (REACHED | DECODED)) == REACHED) {
+          flags[offset] |= DECODED;
+          changed = 1;
+
+          mango_result result = _mango_decode(t, (uint8_t)i, offset);
+          if (result != MANGO_E_SUCCESS) {
+            return result;
+          }
+        }
+      }
+    }
+  } while (changed);
+
+  return MANGO_E_SUCCESS;
+}
+
+static int _mango_constant(const uint8_t *image, size_t offset,
+                           int32_t *value) {
+  uint8_t op = image[offset];
+
+  if (op >= LDC_I32_M1 && op <= LDC_I32_8) {
+    *value = (int32_t)op - LDC_I32_0;
+  } else if (op == LDC_I32_S) {
+    *value = FETCH(image + offset + 1, i8);
+  } else if (op == LDC_X32) {
+    *value = FETCH(image + offset + 1, i32);
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+static inline uint8_t _mango_slot(const uint8_t *image, size_t offset) {
+  return FETCH(image + offset + 1, u8);
+}
+
+// The stack space a function needs at most is kept in the map entries of the
+// second and third byte of its header, which are not used otherwise.
+static inline uint32_t _mango_need(const translation *t, uint8_t module,
+                                   size_t function) {
+  const uint16_t *map = t->map + t->starts[module] + function;
+  return (uint32_t)map[1] | (uint32_t)map[2] << 16;
+}
+
+static inline void _mango_set_need(translation *t, uint8_t module,
+                                   size_t function, uint32_t need) {
+  uint16_t *map = t->map + t->starts[module] + function;
+  map[1] = (uint16_t)need;
+  map[2] = (uint16_t)(need >> 16);
+}
+
+#if defined(MANGO_VERIFY)
+
+// With MANGO_VERIFY, the code reachable from the entry points is verified once
+// the last module has been imported. The verifier follows every path through
+// each function and tracks the stack depth and the type of each local and
+// stack slot. A program is rejected with MANGO_E_INVALID_PROGRAM if a function
+// exceeds its max_stack, pops values it did not push, accesses a local outside
+// arg_count + loc_count, branches into another function, returns a value of a
+// different size than on another path, calls a function pointer it cannot
+// account for, or mixes up 32-bit values and halves of 64-bit values. In
+// threaded code, instructions whose runtime checks are proven redundant are
+// translated to unchecked handlers.
+//
+// Along the way, the verifier keeps track of which local a value was loaded
+// from, which values are not negative and which locals are known to be less
+// than another local. In a counted loop over an array, the loop condition
+// establishes that the counter is less than the length of the array, so the
+// element accesses in the loop body need no bounds check.
+//
+// Finally, the stack space each function needs at most, including everything
+// it calls, is computed from the call graph for all functions that are not
+// recursive. Functions that are only ever called from such functions, or from
+// an entry point that checks this bound once, need no stack overflow check
+// when they call a function. Calls through function pointers are always
+// checked, and so are the calls made by the functions they enter.
+
+#define EXPANDED 16
+#define UNCHECKED 32
+#define UNSAFE 64
+
+// Flags of the first byte of a function header. They share the flags of the
+// translation with those of instructions, so no two flags may share a bit.
+#define BOUNDED 128
+#define COVERED 256
+#define ESCAPED 512
+#define RETURN_SHIFT 10
+#define RETURN_MASK 0xC00
+
+#define ENTRY_UNIT offsetof(mango_module_def, entry_point)
+#define ENTRY_MAX_STACK 2
+
+#define TYPE_ANY 0
+#define TYPE_X32 1
+#define TYPE_REF 2
+#define TYPE_DIVISOR 3
+#define TYPE_LOW 4
+#define TYPE_HIGH 5
+#define TYPE_FTN 0x8000
+#define TYPE_MASK 0x000F
+#define TYPE_NONNEG 0x0010
+#define ORIGIN_SHIFT 5
+
+#define BOUND_MASK 0x03FF
+#define BOUND_SIGNED 0x8000
+
+#define PENDING 0x8000
+
+#define IS_UNCHECKED(Flags) (((Flags) & (UNCHECKED | UNSAFE)) == UNCHECKED)
+
+#define VERIFY(Condition)                                                      \
+  do {                                                                         \
+    if (!(Condition)) {                                                        \
+      return MANGO_E_INVALID_PROGRAM;                                          \
+    }                                                                          \
+  } while (0)
+
+#define DEPTH (v->frame[1])
+#define LOCAL(Index) (v->frame[2 + (Index)])
+#define STACK(Index) (v->frame[2 + v->locals + DEPTH - 1 - (Index)])
+#define BOUND(Index) (v->frame[2 + v->locals + v->max_stack + (Index)])
+
+typedef struct verification {
+  translation *t;
+  uint8_t module;
+  const uint8_t *image;
+  size_t image_size;
+  uint16_t *flags;
+  uint16_t *owners;
+  size_t unit;
+  size_t start;
+  size_t low;
+  size_t high;
+  int escaped;
+  size_t locals;
+  size_t max_stack;
+  size_t width;
+  uint16_t *frame;
+  uint16_t *states;
+  size_t state_count;
+  size_t limit;
+  size_t compare_next;
+  uint8_t compare;
+  size_t compare_left;
+  size_t compare_right;
+  size_t constant_next;
+  int32_t constant;
+} verification;
+
+static const uint8_t _mango_opcode_pops[] = {
+#define OPCODE(c, s, pop, push, args, i) pop,
+#include "mango_opcodes.inc"
+#undef OPCODE
+};
+
+static const uint8_t _mango_opcode_pushes[] = {
+#define OPCODE(c, s, pop, push, args, i) push,
+#include "mango_opcodes.inc"
+#undef OPCODE
+};
+
+static inline int _mango_is_branch(uint8_t op) {
+  return op >= BR_S && op <= BRTRUE;
+}
+
+static inline uint16_t _mango_base(uint16_t type) {
+  return (type & TYPE_FTN) != 0 ? type : type & TYPE_MASK;
+}
+
+// Returns the local a value was loaded from, plus one, or zero.
+static inline size_t _mango_origin(uint16_t type) {
+  return (type & TYPE_FTN) != 0 ? 0 : (size_t)type >> ORIGIN_SHIFT;
+}
+
+static inline int _mango_is_x32(uint16_t type) {
+  return _mango_base(type) != TYPE_LOW && _mango_base(type) != TYPE_HIGH;
+}
+
+// 64-bit values may also be assembled from two 32-bit values, like arrays
+// from an address and a length.
+static inline int _mango_is_x64(uint16_t low, uint16_t high) {
+  return _mango_base(low) != TYPE_HIGH && _mango_base(high) != TYPE_LOW;
+}
+
+static inline uint16_t _mango_join(uint16_t a, uint16_t b) {
+  uint16_t base_a = _mango_base(a);
+  uint16_t base_b = _mango_base(b);
+  uint16_t type;
+
+  if (a == b) {
+    return a;
+  }
+  if (base_a == base_b) {
+    type = base_a;
+  } else if (base_a != TYPE_ANY && base_b != TYPE_ANY && _mango_is_x32(a) &&
+             _mango_is_x32(b)) {
+    type = TYPE_X32;
+  } else {
+    type = TYPE_ANY;
+  }
+  if (((a | b) & TYPE_FTN) != 0) {
+    return type;
+  }
+  if (_mango_origin(a) == _mango_origin(b)) {
+    type |= a & ~(TYPE_MASK | TYPE_NONNEG);
+  }
+  return type | (a & b & TYPE_NONNEG);
+}
+
+// Returns the stack effect of the instructions that consume or produce
+// 64-bit values: the values popped and pushed, top first, where 'w' is a
+// 32-bit value and 'q' a 64-bit value. An array 'a' is a pair of 32-bit
+// values, the address and the length, and a 64-bit value loaded from memory
+// 'm' can be either. All other instructions only deal with 32-bit values.
+static const char *_mango_shape(uint8_t op) {
+  switch (op) {
+#if !defined(MANGO_NO_REFS) || !defined(MANGO_NO_I64) ||                      \
+    !defined(MANGO_NO_F32) || !defined(MANGO_NO_F64)
+  case NEWARR:
+    return "w>a";
+  case LDFLD_X64:
+    return "w>m";
+  case SLICE1:
+    return "wq>a";
+  case SLICE2:
+    return "wwq>a";
+  case MAKEARR:
+    return ">a";
+  case STFLD_X64:
+    return "qw>";
+  case LDELEM_I8:
+  case LDELEM_U8:
+  case LDELEM_I16:
+  case LDELEM_U16:
+  case LDELEM_X32:
+  case LDELEMA:
+    return "wq>w";
+  case LDELEM_X64:
+    return "wq>m";
+  case STELEM_X8:
+  case STELEM_X16:
+  case STELEM_X32:
+    return "wwq>";
+  case STELEM_X64:
+    return "qwq>";
+#endif
+#if !defined(MANGO_NO_I64) || !defined(MANGO_NO_F32) || !defined(MANGO_NO_F64)
+  case ADD_I64:
+  case SUB_I64:
+  case MUL_I64:
+  case DIV_I64:
+  case DIV_I64_UN:
+  case REM_I64:
+  case REM_I64_UN:
+  case AND_I64:
+  case OR_I64:
+  case XOR_I64:
+    return "qq>q";
+  case NEG_I64:
+  case NOT_I64:
+  case CONV_I64_F64:
+  case CONV_U64_F64:
+    return "q>q";
+  case SHL_I64:
+  case SHR_I64:
+  case SHR_I64_UN:
+    return "wq>q";
+  case CEQ_I64:
+  case CNE_I64:
+  case CGT_I64:
+  case CGT_I64_UN:
+  case CGE_I64:
+  case CGE_I64_UN:
+  case CLT_I64:
+  case CLT_I64_UN:
+  case CLE_I64:
+  case CLE_I64_UN:
+    return "qq>w";
+  case CONV_I8_I64:
+  case CONV_U8_I64:
+  case CONV_I16_I64:
+  case CONV_U16_I64:
+  case CONV_I32_I64:
+  case CONV_U32_I64:
+    return "q>w";
+  case CONV_I64_I32:
+  case CONV_U64_I32:
+  case CONV_I64_F32:
+  case CONV_U64_F32:
+    return "w>q";
+#endif
+#if !defined(MANGO_NO_F32) || !defined(MANGO_NO_F64)
+  case CONV_F32_I64:
+  case CONV_F32_I64_UN:
+  case CONV_F32_F64:
+    return "q>w";
+#endif
+#if !defined(MANGO_NO_F64)
+  case ADD_F64:
+  case SUB_F64:
+  case MUL_F64:
+  case DIV_F64:
+  case REM_F64:
+    return "qq>q";
+  case NEG_F64:
+  case CONV_F64_I64:
+  case CONV_F64_I64_UN:
+    return "q>q";
+  case CEQ_F64:
+  case CEQ_F64_UN:
+  case CNE_F64:
+  case CNE_F64_UN:
+  case CGT_F64:
+  case CGT_F64_UN:
+  case CGE_F64:
+  case CGE_F64_UN:
+  case CLT_F64:
+  case CLT_F64_UN:
+  case CLE_F64:
+  case CLE_F64_UN:
+    return "qq>w";
+  case CONV_I8_F64:
+  case CONV_U8_F64:
+  case CONV_I16_F64:
+  case CONV_U16_F64:
+  case CONV_I32_F64:
+  case CONV_U32_F64:
+    return "q>w";
+  case CONV_F64_I32:
+  case CONV_F64_I32_UN:
+  case CONV_F64_F32:
+    return "w>q";
+#endif
+  default:
+    return NULL;
+  }
+}
+
+static void _mango_verify_enter(verification *v, uint8_t module,
+                                size_t unit) {
+  const mango_module *m = _mango_get_module(v->t->vm, module);
+
+  v->module = module;
+  v->image = m->image;
+  v->image_size = m->image_size;
+  v->flags = v->t->flags + v->t->starts[module];
+  v->owners = v->t->map + v->t->starts[module];
+  v->unit = unit;
+
+  if (unit == ENTRY_UNIT) {
+    v->start = unit;
+    v->escaped = 0;
+    v->locals = 0;
+    v->max_stack = ENTRY_MAX_STACK;
+  } else {
+    const mango_func_def *f = (const mango_func_def *)(m->image + unit);
+    v->start = unit + sizeof(mango_func_def);
+    v->escaped = (v->flags[unit] & ESCAPED) != 0;
+    v->locals = (size_t)f->arg_count + f->loc_count;
+    v->max_stack = f->max_stack;
+  }
+  v->width = 2 + v->locals + v->max_stack + v->locals;
+}
+
+static mango_result _mango_verify_claim(verification *v, ptrdiff_t offset) {
+  VERIFY(offset >= (ptrdiff_t)ENTRY_UNIT && offset < (ptrdiff_t)v->image_size);
+
+  uint16_t *owner = &v->owners[offset];
+  if (*owner == 0) {
+    *owner = (uint16_t)v->unit;
+    v->low = (size_t)offset < v->low ? (size_t)offset : v->low;
+    v->high = (size_t)offset > v->high ? (size_t)offset : v->high;
+  }
+  VERIFY(*owner == v->unit);
+  return MANGO_E_SUCCESS;
+}
+
+// Claims all instructions reachable from the start of a unit for the unit,
+// so no two functions share code, and records in the function header what
+// the function returns and whether it takes the address of a local.
+static mango_result _mango_verify_claim_unit(verification *v) {
+  mango_result result;
+  int changed;
+
+  v->low = v->start;
+  v->high = v->start;
+  result = _mango_verify_claim(v, (ptrdiff_t)v->start);
+
+  do {
+    changed = 0;
+
+    for (size_t offset = v->low; offset <= v->high && result == 0; offset++) {
+      if (v->owners[offset] != v->unit || (v->flags[offset] & EXPANDED) != 0) {
+        continue;
+      }
+      v->flags[offset] |= EXPANDED;
+      changed = 1;
+
+      uint8_t op = v->image[offset];
+      VERIFY(_mango_is_valid_opcode(op) &&
+             (v->flags[offset] & FUNCTION) == 0);
+
+      if (op == RET || op == RET_X32 || op == RET_X64) {
+        uint16_t kind = (uint16_t)((op - RET + 1) << RETURN_SHIFT);
+        uint16_t *header = &v->flags[v->unit];
+        VERIFY(v->unit != ENTRY_UNIT &&
+               ((*header & RETURN_MASK) == 0 ||
+                (*header & RETURN_MASK) == kind));
+        *header |= kind;
+      } else if (op == LDLOCA && v->unit != ENTRY_UNIT) {
+        v->flags[v->unit] |= ESCAPED;
+      }
+
+      if (_mango_is_branch(op)) {
+        result = _mango_verify_claim(v, _mango_branch_target(v->image, offset));
+      }
+      if (result == MANGO_E_SUCCESS && _mango_falls_through(op)) {
+        result = _mango_verify_claim(
+            v, (ptrdiff_t)(offset + _mango_instruction_size(
+                                        v->image, v->image_size, offset)));
+      }
+    }
+  } while (changed && result == MANGO_E_SUCCESS);
+
+  for (size_t offset = v->low; offset <= v->high; offset++) {
+    if (v->owners[offset] == v->unit) {
+      v->flags[offset] &= (uint16_t)~EXPANDED;
+    }
+  }
+
+  return result;
+}
+
+static mango_result _mango_verify_pop(verification *v, char kind) {
+  if (kind == 'w') {
+    VERIFY(DEPTH >= 1 && _mango_is_x32(STACK(0)));
+    DEPTH -= 1;
+  } else {
+    VERIFY(DEPTH >= 2 && _mango_is_x64(STACK(0), STACK(1)));
+    DEPTH -= 2;
+  }
+  return MANGO_E_SUCCESS;
+}
+
+static mango_result _mango_verify_push(verification *v, uint16_t type) {
+  VERIFY(DEPTH < v->max_stack);
+  DEPTH += 1;
+  STACK(0) = type;
+  return MANGO_E_SUCCESS;
+}
+
+static mango_result _mango_verify_push_x64(verification *v) {
+  mango_result result = _mango_verify_push(v, TYPE_HIGH);
+  return result ? result : _mango_verify_push(v, TYPE_LOW);
+}
+
+static mango_result _mango_verify_effect(verification *v, uint8_t op,
+                                         uint16_t type) {
+  const char *shape = _mango_shape(op);
+  mango_result result = MANGO_E_SUCCESS;
+
+  if (!shape) {
+    for (uint_fast8_t i = 0; i < _mango_opcode_pops[op] && !result; i++) {
+      result = _mango_verify_pop(v, 'w');
+    }
+    for (uint_fast8_t i = 0; i < _mango_opcode_pushes[op] && !result; i++) {
+      result = _mango_verify_push(v, type);
+    }
+    return result;
+  }
+
+  for (; *shape != '>' && !result; shape++) {
+    result = _mango_verify_pop(v, *shape);
+  }
+  switch (result ? 0 : shape[1]) {
+  case 'w':
+    result = _mango_verify_push(v, type);
+    break;
+  case 'q':
+    result = _mango_verify_push_x64(v);
+    break;
+  case 'a':
+  case 'm':
+    type = shape[1] == 'a' ? TYPE_X32 : TYPE_ANY;
+    result = _mango_verify_push(v, type);
+    if (result == MANGO_E_SUCCESS) {
+      result = _mango_verify_push(v, type);
+    }
+    break;
+  }
+  return result;
+}
+
+// Returns the type of a local with the local as origin, unless it is a copy of
+// another local already.
+static uint16_t _mango_verify_copy(const verification *v, size_t index) {
+  uint16_t type = LOCAL(index);
+
+  if (v->escaped || (type & TYPE_FTN) != 0 || _mango_origin(type) != 0) {
+    return type;
+  }
+  return (uint16_t)(type | (index + 1) << ORIGIN_SHIFT);
+}
+
+// Forgets everything that is known about the value of a local before it is
+// overwritten.
+static void _mango_verify_forget(verification *v, size_t index) {
+  for (size_t i = 2; i < 2 + v->locals + DEPTH; i++) {
+    if (_mango_origin(v->frame[i]) == index + 1) {
+      v->frame[i] &= TYPE_MASK | TYPE_NONNEG;
+    }
+  }
+  for (size_t i = 0; i < v->locals; i++) {
+    if ((BOUND(i) & BOUND_MASK) == index + 1) {
+      BOUND(i) = 0;
+    }
+  }
+  BOUND(index) = 0;
+}
+
+static uint16_t _mango_verify_strip(const verification *v, uint16_t type,
+                                    size_t index, size_t count) {
+  size_t origin = _mango_origin(type);
+
+  if (v->escaped) {
+    return TYPE_ANY;
+  }
+  if (origin > index && origin <= index + count) {
+    return type & (TYPE_MASK | TYPE_NONNEG);
+  }
+  return type;
+}
+
+#if !defined(MANGO_NO_REFS) || !defined(MANGO_NO_I64) ||                      \
+    !defined(MANGO_NO_F32) || !defined(MANGO_NO_F64)
+static int _mango_verify_in_bounds(const verification *v, uint16_t index,
+                                   uint16_t length) {
+  size_t origin = _mango_origin(index);
+
+  if (origin == 0 || _mango_origin(length) == 0) {
+    return 0;
+  }
+
+  uint16_t bound = BOUND(origin - 1);
+  return (bound & BOUND_MASK) == _mango_origin(length) &&
+         ((bound & BOUND_SIGNED) == 0 || (index & TYPE_NONNEG) != 0);
+}
+#endif
+
+static uint16_t _mango_signature(const translation *t, uint8_t module,
+                                 size_t offset) {
+  const mango_module *m = _mango_get_module(t->vm, module);
+  const mango_func_def *f = (const mango_func_def *)(m->image + offset);
+  uint8_t kind =
+      (uint8_t)((t->flags[t->starts[module] + offset] & RETURN_MASK) >>
+                RETURN_SHIFT);
+
+  return (uint16_t)(TYPE_FTN | (kind ? kind - 1 : 0) << 8 | f->arg_count);
+}
+
+static mango_result _mango_verify_instruction(verification *v, size_t offset) {
+  const uint8_t *ip = v->image + offset;
+  uint8_t op = *ip;
+  mango_result result = MANGO_E_SUCCESS;
+  uint16_t type = TYPE_X32;
+  uint16_t signature;
+  uint8_t module;
+  int32_t value;
+  int safe = -1;
+
+  switch (op) {
+  case NOP:
+  case BREAK:
+  case HALT:
+  case BR_S:
+  case BR:
+    break;
+
+  case SWAP:
+  case ROT:
+  case ROT4: {
+    size_t count = op == SWAP ? 2 : op == ROT ? 3 : 4;
+    VERIFY(DEPTH >= count);
+    uint16_t top = STACK(0);
+    for (size_t i = 0; i + 1 < count; i++) {
+      STACK(i) = STACK(i + 1);
+    }
+    STACK(count - 1) = top;
+    break;
+  }
+
+  case POP_X32:
+  case POP_X64:
+    VERIFY(DEPTH >= (op == POP_X32 ? 1 : 2));
+    DEPTH -= op == POP_X32 ? 1 : 2;
+    break;
+
+  case DUP_X32:
+  case OVER:
+    VERIFY(DEPTH >= (op == DUP_X32 ? 1 : 2));
+    result = _mango_verify_push(v, STACK(op == DUP_X32 ? 0 : 1));
+    break;
+
+  case DUP_X64:
+    VERIFY(DEPTH >= 2);
+    type = STACK(0);
+    result = _mango_verify_push(v, STACK(1));
+    if (result == MANGO_E_SUCCESS) {
+      result = _mango_verify_push(v, type);
+    }
+    break;
+
+  case NIP:
+    VERIFY(DEPTH >= 2);
+    STACK(1) = STACK(0);
+    DEPTH -= 1;
+    break;
+
+  case TUCK:
+    VERIFY(DEPTH >= 2);
+    type = STACK(0);
+    result = _mango_verify_push(v, type);
+    if (result == MANGO_E_SUCCESS) {
+      STACK(1) = STACK(2);
+      STACK(2) = type;
+    }
+    break;
+
+  case LDLOC_I8:
+  case LDLOC_U8:
+  case LDLOC_I16:
+  case LDLOC_U16:
+  case LDLOC_X32: {
+    size_t slot = _mango_slot(v->image, offset);
+    VERIFY(slot >= DEPTH && slot - DEPTH < v->locals &&
+           _mango_is_x32(LOCAL(slot - DEPTH)));
+    if (op == LDLOC_X32) {
+      type = _mango_verify_copy(v, slot - DEPTH);
+    } else if (op == LDLOC_U8 || op == LDLOC_U16) {
+      type = TYPE_X32 | TYPE_NONNEG;
+    }
+    result = _mango_verify_push(v, type);
+    break;
+  }
+
+  case LDLOC_X64: {
+    size_t slot = _mango_slot(v->image, offset);
+    VERIFY(slot >= DEPTH && slot - DEPTH + 1 < v->locals);
+    uint16_t low = _mango_verify_copy(v, slot - DEPTH);
+    uint16_t high = _mango_verify_copy(v, slot - DEPTH + 1);
+    VERIFY(_mango_is_x64(low, high));
+    result = _mango_verify_push(v, high);
+    if (result == MANGO_E_SUCCESS) {
+      result = _mango_verify_push(v, low);
+    }
+    break;
+  }
+
+  case LDLOCA: {
+    size_t slot = _mango_slot(v->image, offset);
+    VERIFY(slot >= DEPTH && slot - DEPTH < v->locals);
+    result = _mango_verify_push(v, TYPE_REF);
+    break;
+  }
+
+  case STLOC_X32: {
+    size_t slot = _mango_slot(v->image, offset);
+    VERIFY(DEPTH >= 1 && slot >= DEPTH && slot - DEPTH < v->locals);
+    size_t index = slot - DEPTH;
+    type = STACK(0);
+    result = _mango_verify_pop(v, 'w');
+    _mango_verify_forget(v, index);
+    LOCAL(index) = _mango_verify_strip(v, type, index, 1);
+    break;
+  }
+
+  case STLOC_X64: {
+    size_t slot = _mango_slot(v->image, offset);
+    VERIFY(DEPTH >= 2 && slot >= DEPTH && slot - DEPTH + 1 < v->locals);
+    size_t index = slot - DEPTH;
+    uint16_t low = STACK(0);
+    uint16_t high = STACK(1);
+    result = _mango_verify_pop(v, 'q');
+    _mango_verify_forget(v, index + 0);
+    _mango_verify_forget(v, index + 1);
+    LOCAL(index + 0) = _mango_verify_strip(v, low, index, 2);
+    LOCAL(index + 1) = _mango_verify_strip(v, high, index, 2);
+    break;
+  }
+
+  case RET:
+    VERIFY(DEPTH == 0);
+    break;
+
+  case RET_X32:
+    VERIFY(DEPTH == 1 && _mango_is_x32(STACK(0)));
+    break;
+
+  case RET_X64:
+    VERIFY(DEPTH == 2 && _mango_is_x64(STACK(0), STACK(1)));
+    break;
+
+  case CALLI:
+  case CALL_S:
+  case CALL: {
+    if (op == CALLI) {
+      VERIFY(DEPTH >= 1 && (STACK(0) & TYPE_FTN) != 0);
+      signature = STACK(0);
+      DEPTH -= 1;
+    } else if (op == CALL_S) {
+      signature = _mango_signature(v->t, v->module, FETCH(ip + 1, u16));
+    } else {
+      result = _mango_resolve_import(v->t, v->module, FETCH(ip + 1, u8),
+                                     &module);
+      if (result != MANGO_E_SUCCESS) {
+        break;
+      }
+      signature = _mango_signature(v->t, module, FETCH(ip + 2, u16));
+    }
+
+    size_t arg_count = signature & 0xFF;
+    VERIFY(DEPTH >= arg_count);
+    DEPTH -= arg_count;
+    switch ((signature >> 8) & 3) {
+    case 1:
+      result = _mango_verify_push(v, TYPE_ANY);
+      break;
+    case 2:
+      result = _mango_verify_push_x64(v);
+      break;
+    }
+    break;
+  }
+
+  case SYSCALL: {
+    int adjustment = FETCH(ip + 1, i8);
+    VERIFY((int)DEPTH >= adjustment &&
+           (int)DEPTH - adjustment <= (int)v->max_stack);
+    DEPTH = (uint16_t)((int)DEPTH - adjustment);
+    for (size_t i = 0; i < DEPTH; i++) {
+      STACK(i) = TYPE_ANY;
+    }
+    break;
+  }
+
+  case LDC_I32_M1:
+  case LDC_I32_0:
+  case LDC_I32_1:
+  case LDC_I32_2:
+  case LDC_I32_3:
+  case LDC_I32_4:
+  case LDC_I32_5:
+  case LDC_I32_6:
+  case LDC_I32_7:
+  case LDC_I32_8:
+  case LDC_I32_S:
+  case LDC_X32:
+    _mango_constant(v->image, offset, &value);
+    v->constant_next = offset + 1 + (size_t)_mango_opcode_args[op];
+    v->constant = value;
+    type = value != 0 && value != -1 ? TYPE_DIVISOR : TYPE_X32;
+    result = _mango_verify_push(v, value >= 0 ? type | TYPE_NONNEG : type);
+    break;
+
+  case LDFTN:
+    result = _mango_resolve_import(v->t, v->module, FETCH(ip + 1, u8), &module);
+    if (result == MANGO_E_SUCCESS) {
+      result = _mango_verify_push(
+          v, _mango_signature(v->t, module, FETCH(ip + 2, u16)));
+    }
+    break;
+
+  case DIV_I32:
+  case DIV_I32_UN:
+  case REM_I32:
+  case REM_I32_UN:
+    safe = DEPTH >= 1 && _mango_base(STACK(0)) == TYPE_DIVISOR;
+    result = _mango_verify_effect(v, op, type);
+    break;
+
+  // Incrementing a counter that is not negative and less than another value
+  // cannot overflow.
+  case ADD_I32:
+    if (DEPTH >= 2 && v->constant_next == offset && v->constant == 1 &&
+        (STACK(1) & TYPE_NONNEG) != 0 && _mango_origin(STACK(1)) != 0 &&
+        (BOUND(_mango_origin(STACK(1)) - 1) & BOUND_SIGNED) != 0) {
+      type |= TYPE_NONNEG;
+    }
+    result = _mango_verify_effect(v, op, type);
+    break;
+
+  case CGT_I32:
+  case CGT_I32_UN:
+  case CGE_I32:
+  case CGE_I32_UN:
+  case CLT_I32:
+  case CLT_I32_UN:
+  case CLE_I32:
+  case CLE_I32_UN:
+    if (DEPTH >= 2) {
+      v->compare_next = offset + 1;
+      v->compare = op;
+      v->compare_left = _mango_origin(STACK(1));
+      v->compare_right = _mango_origin(STACK(0));
+    }
+    result = _mango_verify_effect(v, op, TYPE_X32 | TYPE_NONNEG);
+    break;
+
+#if !defined(MANGO_NO_REFS) || !defined(MANGO_NO_I64) ||                      \
+    !defined(MANGO_NO_F32) || !defined(MANGO_NO_F64)
+  case NEWOBJ:
+  case LDFLDA:
+    result = _mango_verify_effect(v, op, TYPE_REF);
+    break;
+
+  case LDFLD_X32:
+    safe = DEPTH >= 1 && _mango_base(STACK(0)) == TYPE_REF;
+    result = _mango_verify_effect(v, op, type);
+    break;
+
+  case STFLD_X32:
+    safe = DEPTH >= 2 && _mango_base(STACK(1)) == TYPE_REF;
+    result = _mango_verify_effect(v, op, type);
+    break;
+
+  case LDELEM_I8:
+  case LDELEM_U8:
+  case LDELEM_I16:
+  case LDELEM_U16:
+  case LDELEM_X32:
+    safe = DEPTH >= 3 && _mango_verify_in_bounds(v, STACK(0), STACK(2));
+    result = _mango_verify_effect(v, op, type);
+    break;
+
+  case STELEM_X8:
+  case STELEM_X16:
+  case STELEM_X32:
+    safe = DEPTH >= 4 && _mango_verify_in_bounds(v, STACK(1), STACK(3));
+    result = _mango_verify_effect(v, op, type);
+    break;
+#endif
+
+  default:
+    if (_mango_is_branch(op)) {
+      result = _mango_verify_pop(v, 'w');
+    } else {
+      result = _mango_verify_effect(v, op, type);
+    }
+    break;
+  }
+
+  if (safe >= 0) {
+    v->flags[offset] |= safe ? UNCHECKED : UNSAFE;
+  }
+  return result;
+}
+
+static mango_result _mango_verify_merge(verification *v, size_t offset) {
+  uint16_t *state = NULL;
+
+  for (size_t i = 0; i < v->state_count && !state; i++) {
+    if (v->states[i * v->width] == offset) {
+      state = v->states + i * v->width;
+    }
+  }
+
+  if (!state) {
+    state = (uint16_t *)mango_heap_alloc(v->t->vm, v->width, sizeof(uint16_t),
+                                         __alignof(uint16_t), 0);
+    if (!state || v->t->vm->heap_used > v->limit) {
+      return MANGO_E_OUT_OF_MEMORY;
+    }
+    if (v->state_count++ == 0) {
+      v->states = state;
+    }
+    memcpy(state, v->frame, v->width * sizeof(uint16_t));
+    state[0] = (uint16_t)offset;
+    state[1] |= PENDING;
+    return MANGO_E_SUCCESS;
+  }
+
+  VERIFY((state[1] & ~PENDING) == DEPTH);
+  for (size_t i = 2; i < 2 + v->locals + DEPTH; i++) {
+    uint16_t type = _mango_join(state[i], v->frame[i]);
+    if (type != state[i]) {
+      state[i] = type;
+      state[1] |= PENDING;
+    }
+  }
+  for (size_t i = 2 + v->locals + v->max_stack; i < v->width; i++) {
+    if (state[i] != 0 && state[i] != v->frame[i]) {
+      state[i] = 0;
+      state[1] |= PENDING;
+    }
+  }
+  return MANGO_E_SUCCESS;
+}
+
+// Returns whether a conditional branch right after a comparison of two locals
+// is taken (1) or not taken (0) when one local is less than the other.
+static int _mango_verify_condition(const verification *v, size_t offset,
+                                   size_t *index, uint16_t *bound) {
+  uint8_t op = v->image[offset];
+  int swap;
+  int result;
+
+  if (v->compare_next != offset || op == BR_S || op == BR) {
+    return -1;
+  }
+
+  switch (v->compare) {
+  case CLT_I32:
+  case CLT_I32_UN:
+    swap = 0;
+    result = 1;
+    break;
+  case CGT_I32:
+  case CGT_I32_UN:
+    swap = 1;
+    result = 1;
+    break;
+  case CGE_I32:
+  case CGE_I32_UN:
+    swap = 0;
+    result = 0;
+    break;
+  default:
+    swap = 1;
+    result = 0;
+    break;
+  }
+
+  size_t less = swap ? v->compare_right : v->compare_left;
+  size_t greater = swap ? v->compare_left : v->compare_right;
+  if (less == 0 || greater == 0) {
+    return -1;
+  }
+
+  int is_signed = v->compare == CLT_I32 || v->compare == CGT_I32 ||
+                  v->compare == CGE_I32 || v->compare == CLE_I32;
+  *index = less - 1;
+  *bound = (uint16_t)(greater | (is_signed ? BOUND_SIGNED : 0));
+  return result == (op == BRTRUE_S || op == BRTRUE);
+}
+
+static mango_result _mango_verify_block(verification *v, size_t offset) {
+  v->compare_next = 0;
+  v->constant_next = 0;
+
+  for (;;) {
+    uint8_t op = v->image[offset];
+    mango_result result = _mango_verify_instruction(v, offset);
+
+    if (result == MANGO_E_SUCCESS && _mango_is_branch(op)) {
+      size_t index = 0;
+      uint16_t bound = 0;
+      int taken = _mango_verify_condition(v, offset, &index, &bound);
+      uint16_t previous = taken >= 0 ? BOUND(index) : 0;
+
+      if (taken == 1) {
+        BOUND(index) = bound;
+      }
+      result = _mango_verify_merge(
+          v, (size_t)_mango_branch_target(v->image, offset));
+      if (taken >= 0) {
+        BOUND(index) = taken == 0 ? bound : previous;
+      }
+    }
+    if (result != MANGO_E_SUCCESS || !_mango_falls_through(op)) {
+      return result;
+    }
+
+    offset += _mango_instruction_size(v->image, v->image_size, offset);
+    if ((v->flags[offset] & TARGET) != 0) {
+      return _mango_verify_merge(v, offset);
+    }
+  }
+}
+
+static mango_result _mango_verify_unit(verification *v) {
+  mango_vm *vm = v->t->vm;
+  uint32_t heap_used = vm->heap_used;
+  mango_result result;
+
+  v->frame = (uint16_t *)mango_heap_alloc(vm, v->width, sizeof(uint16_t),
+                                          __alignof(uint16_t),
+                                          MANGO_ALLOC_ZERO_MEMORY);
+  v->states = NULL;
+  v->state_count = 0;
+
+  if (!v->frame || vm->heap_used > v->limit) {
+    result = MANGO_E_OUT_OF_MEMORY;
+  } else {
+    result = _mango_verify_merge(v, v->start);
+  }
+
+  while (result == MANGO_E_SUCCESS) {
+    uint16_t *state = NULL;
+
+    for (size_t i = 0; i < v->state_count && !state; i++) {
+      if ((v->states[i * v->width + 1] & PENDING) != 0) {
+        state = v->states + i * v->width;
+      }
+    }
+    if (!state) {
+      break;
+    }
+
+    state[1] &= (uint16_t)~PENDING;
+    memcpy(v->frame, state, v->width * sizeof(uint16_t));
+    result = _mango_verify_block(v, state[0]);
+  }
+
+  vm->heap_used = heap_used;
+  return result;
+}
+
+#if defined(MANGO_THREADED_CODE)
+
+#define NEED_UNKNOWN UINT32_MAX
+
+static inline uint16_t *_mango_header_flags(const translation *t,
+                                           uint8_t module, size_t function) {
+  return t->flags + t->starts[module] + function;
+}
+
+// Returns the function that the instruction at an offset calls directly or
+// takes the address of, or zero.
+static size_t _mango_callee(const translation *t, uint8_t module,
+                            size_t offset, uint8_t *callee) {
+  const uint8_t *image = _mango_get_module(t->vm, module)->image;
+
+  if ((t->flags[t->starts[module] + offset] & DECODED) == 0) {
+    return 0;
+  }
+
+  switch (image[offset]) {
+  case CALL_S:
+    *callee = module;
+    return FETCH(image + offset + 1, u16);
+  case CALL:
+  case LDFTN:
+    if (_mango_resolve_import(t, module, FETCH(image + offset + 1, u8),
+                              callee) != MANGO_E_SUCCESS) {
+      return 0;
+    }
+    return FETCH(image + offset + 2, u16);
+  default:
+    return 0;
+  }
+}
+
+// Whether a call is only ever executed with as much stack available as the
+// function containing it needs at most. The call in an entry point checks
+// the bound of the function it calls instead, if the stack is large enough.
+static int _mango_is_bounded_call(const translation *t, uint8_t module,
+                                  size_t offset, uint8_t callee,
+                                  size_t function) {
+  size_t unit = t->map[t->starts[module] + offset];
+
+  if (unit != ENTRY_UNIT) {
+    return (*_mango_header_flags(t, module, unit) & COVERED) != 0;
+  }
+  return offset == ENTRY_UNIT &&
+         _mango_get_module(t->vm, module)->image[offset] == CALL_S &&
+         (*_mango_header_flags(t, callee, function) & BOUNDED) != 0 &&
+         _mango_need(t, callee, function) <= t->vm->stack_size;
+}
+
+static void _mango_verify_calls(translation *t) {
+  mango_vm *vm = t->vm;
+  uint8_t callee;
+  int changed;
+
+  // Code overlapping a function header is rejected by the layout later on.
+  for (uint_fast8_t i = 0; i < vm->modules_created; i++) {
+    const mango_module *m = _mango_get_module(vm, (uint8_t)i);
+    const uint16_t *flags = t->flags + t->starts[i];
+
+    for (size_t offset = ENTRY_UNIT; offset < m->image_size; offset++) {
+      if ((flags[offset] & FUNCTION) != 0 &&
+          ((flags[offset + 1] | flags[offset + 2]) & REACHED) != 0) {
+        return;
+      }
+    }
+  }
+
+  // A function is bounded once all functions it calls are.
+  do {
+    changed = 0;
+
+    for (uint_fast8_t i = 0; i < vm->modules_created; i++) {
+      const mango_module *m = _mango_get_module(vm, (uint8_t)i);
+      const uint16_t *flags = t->flags + t->starts[i];
+
+      for (size_t offset = ENTRY_UNIT; offset < m->image_size; offset++) {
+        if ((flags[offset] & (FUNCTION | BOUNDED)) == FUNCTION) {
+          _mango_set_need(t, (uint8_t)i, offset, 0);
+        }
+      }
+    }
+
+    for (uint_fast8_t i = 0; i < vm->modules_created; i++) {
+      const mango_module *m = _mango_get_module(vm, (uint8_t)i);
+      const uint16_t *flags = t->flags + t->starts[i];
+      const uint16_t *owners = t->map + t->starts[i];
+
+      for (size_t offset = ENTRY_UNIT; offset < m->image_size; offset++) {
+        size_t function = _mango_callee(t, (uint8_t)i, offset, &callee);
+        size_t unit = owners[offset];
+
+        if (function == 0 || m->image[offset] == LDFTN ||
+            unit == ENTRY_UNIT || (flags[unit] & BOUNDED) != 0) {
+          continue;
+        }
+
+        uint32_t need =
+            (*_mango_header_flags(t, callee, function) & BOUNDED) != 0
+                ? _mango_need(t, callee, function)
+                : NEED_UNKNOWN;
+        if (need > _mango_need(t, (uint8_t)i, unit)) {
+          _mango_set_need(t, (uint8_t)i, unit, need);
+        }
+      }
+    }
+
+    for (uint_fast8_t i = 0; i < vm->modules_created; i++) {
+      const mango_module *m = _mango_get_module(vm, (uint8_t)i);
+      uint16_t *flags = t->flags + t->starts[i];
+
+      for (size_t offset = ENTRY_UNIT; offset < m->image_size; offset++) {
+        if ((flags[offset] & (FUNCTION | BOUNDED)) != FUNCTION) {
+          continue;
+        }
+
+        uint32_t need = _mango_need(t, (uint8_t)i, offset);
+        if (need != NEED_UNKNOWN) {
+          const mango_func_def *f = (const mango_func_def *)(m->image + offset);
+          _mango_set_need(t, (uint8_t)i, offset,
+                          1u + f->loc_count + f->max_stack + need);
+          flags[offset] |= BOUNDED | COVERED;
+          changed = 1;
+        }
+      }
+    }
+  } while (changed);
+
+  // A bounded function is covered unless it is exported, entered through a
+  // function pointer or entered from a function that is not covered.
+  for (uint_fast8_t i = 0; i < vm->modules_created; i++) {
+    size_t count;
+    const mango_export_def *exports =
+        _mango_get_module_exports(_mango_get_module(vm, (uint8_t)i), &count);
+
+    for (size_t j = 0; j < count; j++) {
+      uint16_t offset = FETCH(&exports[j].offset, u16);
+      if (offset != 0) {
+        *_mango_header_flags(t, (uint8_t)i, offset) &= (uint16_t)~COVERED;
+      }
+    }
+  }
+
+  do {
+    changed = 0;
+
+    for (uint_fast8_t i = 0; i < vm->modules_created; i++) {
+      const mango_module *m = _mango_get_module(vm, (uint8_t)i);
+
+      for (size_t offset = ENTRY_UNIT; offset < m->image_size; offset++) {
+        size_t function = _mango_callee(t, (uint8_t)i, offset, &callee);
+        if (function == 0) {
+          continue;
+        }
+
+        uint16_t *header = _mango_header_flags(t, callee, function);
+        if ((*header & COVERED) != 0 &&
+            (m->image[offset] == LDFTN ||
+             !_mango_is_bounded_call(t, (uint8_t)i, offset, callee,
+                                     function))) {
+          *header &= (uint16_t)~COVERED;
+          changed = 1;
+        }
+      }
+    }
+  } while (changed);
+
+  for (uint_fast8_t i = 0; i < vm->modules_created; i++) {
+    const mango_module *m = _mango_get_module(vm, (uint8_t)i);
+    uint16_t *flags = t->flags + t->starts[i];
+    const uint16_t *owners = t->map + t->starts[i];
+
+    // An entry point checks the bound only if the function it calls ends up
+    // covered.
+    for (size_t offset = ENTRY_UNIT; offset < m->image_size; offset++) {
+      size_t function = _mango_callee(t, (uint8_t)i, offset, &callee);
+
+      if (function != 0 && m->image[offset] != LDFTN &&
+          _mango_is_bounded_call(t, (uint8_t)i, offset, callee, function) &&
+          (owners[offset] != ENTRY_UNIT ||
+           (*_mango_header_flags(t, callee, function) & COVERED) != 0)) {
+        flags[offset] |= UNCHECKED;
+      }
+    }
+  }
+}
+
+#endif
+
+static mango_result _mango_verify(translation *t, size_t limit) {
+  mango_result result = MANGO_E_SUCCESS;
+  verification v;
+
+  v.t = t;
+  v.limit = limit;
+  memset(t->map, 0, t->starts[t->vm->modules_created] * sizeof(uint16_t));
+
+  for (int pass = 0; pass < 2; pass++) {
+    for (uint_fast8_t i = 0; i < t->vm->modules_created; i++) {
+      const mango_module *m = _mango_get_module(t->vm, (uint8_t)i);
+      const uint16_t *flags = t->flags + t->starts[i];
+
+      for (size_t offset = ENTRY_UNIT; offset < m->image_size; offset++) {
+        if (offset != ENTRY_UNIT && (flags[offset] & FUNCTION) == 0) {
+          continue;
+        }
+
+        _mango_verify_enter(&v, (uint8_t)i, offset);
+        result = pass == 0 ? _mango_verify_claim_unit(&v)
+                           : _mango_verify_unit(&v);
+        if (result != MANGO_E_SUCCESS) {
+          return result;
+        }
+      }
+    }
+  }
+
+#if defined(MANGO_THREADED_CODE)
+  _mango_verify_calls(t);
+#endif
+  return MANGO_E_SUCCESS;
+}
+
+#undef DEPTH
+#undef LOCAL
+#undef STACK
+
+#endif
+
+// Sets up the scratch space for the analysis of all modules at the top of the
+// heap, above everything that is allocated during the analysis, and marks all
+// reachable code.
+static mango_result _mango_analyze(mango_vm *vm, translation *t,
+                                   size_t *scratch_offset) {
+  size_t total = 0;
+
+  for (uint_fast8_t i = 0; i < vm->modules_created; i++) {
+    total += _mango_get_module(vm, (uint8_t)i)->image_size;
+  }
+
+  size_t scratch_size = (vm->modules_created + 1) * sizeof(uint32_t) +
+                        2 * total * sizeof(uint16_t);
+  if (mango_heap_available(vm) < scratch_size + sizeof(uint32_t)) {
+    return MANGO_E_OUT_OF_MEMORY;
+  }
+
+  uintptr_t scratch =
+      ((uintptr_t)vm + vm->heap_size - scratch_size) & ~(uintptr_t)3;
+  *scratch_offset = (size_t)(scratch - (uintptr_t)vm);
+
+  t->vm = vm;
+  t->handlers = NULL;
+  t->starts = (uint32_t *)scratch;
+  t->map = (uint16_t *)(t->starts + vm->modules_created + 1);
+  t->flags = t->map + total;
+  memset(t->flags, 0, total * sizeof(uint16_t));
+
+  t->starts[0] = 0;
+  for (uint_fast8_t i = 0; i < vm->modules_created; i++) {
+    const mango_module *m = _mango_get_module(vm, (uint8_t)i);
+    t->starts[i + 1] = t->starts[i] + m->image_size;
+    t->flags[t->starts[i] + offsetof(mango_module_def, entry_point)] |= REACHED;
+  }
+
+  for (uint_fast8_t i = 0; i < vm->modules_created; i++) {
+    size_t count;
+    const mango_export_def *exports =
+        _mango_get_module_exports(_mango_get_module(vm, (uint8_t)i), &count);
+
+    for (size_t j = 0; j < count; j++) {
+      uint16_t offset = FETCH(&exports[j].offset, u16);
+      if (offset != 0) {
+        mango_result result = _mango_mark_function(t, (uint8_t)i, offset);
+        if (result != MANGO_E_SUCCESS) {
+          return result;
+        }
+      }
+    }
+  }
+
+  mango_result result = _mango_discover(t);
+#if defined(MANGO_VERIFY)
+  if (result == MANGO_E_SUCCESS) {
+    result = _mango_verify(t, *scratch_offset);
+  }
+#endif
+  return result;
+}
+
+#endif
+
+// With MANGO_THREADED_CODE, the images of all modules are translated into
+// direct-threaded code once the last module has been imported. Each
+// instruction becomes a handler address followed by its decoded operands, so
+// the interpreter never has to look up the dispatch table or decode operands.
+// Common instruction sequences that nothing branches into are fused into the
+// superinstructions listed in mango_superinstructions.inc.
+
+#if defined(MANGO_THREADED_CODE)
+
+static const uint8_t _mango_superinstruction_cells[] = {
+#define SUPERINSTRUCTION(c, s, cells) cells,
+#include "mango_superinstructions.inc"
+#undef SUPERINSTRUCTION
+};
+
+static const char *const _mango_superinstruction_names[] = {
+#define SUPERINSTRUCTION(c, s, cells) s,
+#include "mango_superinstructions.inc"
+#undef SUPERINSTRUCTION
+};
+
+typedef struct fusion {
+  int kind;
+  size_t length;
+  size_t at[4];
+} fusion;
+
+static size_t _mango_instruction_cells(const uint8_t *image, size_t offset) {
+  uint8_t op = image[offset];
+
+  if (!_mango_is_valid_opcode(op)) {
+    return 1;
+  }
+
+  switch (op) {
+  case LDC_I32_M1:
+  case LDC_I32_0:
+  case LDC_I32_1:
+  case LDC_I32_2:
+  case LDC_I32_3:
+  case LDC_I32_4:
+  case LDC_I32_5:
+  case LDC_I32_6:
+  case LDC_I32_7:
+  case LDC_I32_8:
+    return 2;
+  case CALL:
+  case SYSCALL:
+  case LDC_X64:
+    return 3;
+#if !defined(MANGO_NO_REFS)
+  case MAKEARR:
+    return 4;
+#endif
+  default:
+    return _mango_opcode_args[op] == 0 ? 1 : 2;
+  }
+}
+
+
+static fusion _mango_fuse(const translation *t, uint8_t module,
+                          size_t offset) {
+  const mango_module *m = _mango_get_module(t->vm, module);
+  const uint8_t *image = m->image;
+  const uint16_t *flags = t->flags + t->starts[module];
+  fusion f = {-1, 0, {0}};
+  uint8_t op[4] = {NOP, NOP, NOP, NOP};
+  size_t end[4];
+  size_t count = 0;
+  int32_t value;
+
+  for (size_t next = offset; count < 4 && next < m->image_size; count++) {
+    if ((flags[next] & REACHED) == 0) {
+      break;
+    }
+    f.at[count] = next;
+    op[count] = image[next];
+    next += _mango_instruction_size(image, m->image_size, next);
+    end[count] = next;
+    if (!_mango_falls_through(op[count])) {
+      count++;
+      break;
+    }
+  }
+
+  size_t n = 0;
+
+  if (count >= 4 && op[0] == LDLOC_X32 &&
+      _mango_constant(image, f.at[1], &value) && op[2] == ADD_I32 &&
+      op[3] == STLOC_X32 && _mango_slot(image, f.at[3]) != 0) {
+    f.kind = LDLOC_LDC_ADD_STLOC_I32;
+    n = 4;
+  } else if (count >= 4 && op[0] == LDLOC_X32 &&
+             _mango_constant(image, f.at[1], &value) && op[2] == CLT_I32 &&
+             (op[3] == BRFALSE_S || op[3] == BRFALSE)) {
+    f.kind = LDLOC_LDC_CLT_BRFALSE_I32;
+    n = 4;
+  } else if (count >= 3 && op[0] == LDLOC_X32 && op[1] == LDLOC_X32 &&
+             op[2] == ADD_I32 && _mango_slot(image, f.at[1]) != 0) {
+    f.kind = LDLOC_LDLOC_ADD_I32;
+    n = 3;
+#if !defined(MANGO_NO_REFS)
+  } else if (count >= 3 && op[0] == LDLOC_X64 && op[1] == LDLOC_X32 &&
+             op[2] == LDELEM_X32 && _mango_slot(image, f.at[1]) >= 2) {
+    f.kind = LDLOC_LDLOC_LDELEM_X32;
+    n = 3;
+#endif
+  } else if (count >= 2 && op[0] == DUP_X32 &&
+             (op[1] == BRTRUE_S || op[1] == BRTRUE)) {
+    f.kind = DUP_BRTRUE_X32;
+    n = 2;
+  } else if (count >= 2 && op[0] == LDLOC_X32 && op[1] == LDLOC_X32 &&
+             _mango_slot(image, f.at[1]) != 0) {
+    f.kind = LDLOC_LDLOC_X32;
+    n = 2;
+  }
+
+#if defined(MANGO_VERIFY)
+  // Instructions whose checks the verifier proved redundant are replaced by
+  // unchecked variants.
+  if (n == 0 && IS_UNCHECKED(flags[offset])) {
+    switch (op[0]) {
+    case DIV_I32:
+      f.kind = DIV_I32_UNCHECKED;
+      break;
+    case DIV_I32_UN:
+      f.kind = DIV_I32_UN_UNCHECKED;
+      break;
+    case REM_I32:
+      f.kind = REM_I32_UNCHECKED;
+      break;
+    case REM_I32_UN:
+      f.kind = REM_I32_UN_UNCHECKED;
+      break;
+#if !defined(MANGO_NO_REFS) || !defined(MANGO_NO_I64) ||                      \
+    !defined(MANGO_NO_F32) || !defined(MANGO_NO_F64)
+    case LDFLD_X32:
+      f.kind = LDFLD_X32_UNCHECKED;
+      break;
+    case STFLD_X32:
+      f.kind = STFLD_X32_UNCHECKED;
+      break;
+    case LDELEM_I8:
+      f.kind = LDELEM_I8_UNCHECKED;
+      break;
+    case LDELEM_U8:
+      f.kind = LDELEM_U8_UNCHECKED;
+      break;
+    case LDELEM_I16:
+      f.kind = LDELEM_I16_UNCHECKED;
+      break;
+    case LDELEM_U16:
+      f.kind = LDELEM_U16_UNCHECKED;
+      break;
+    case LDELEM_X32:
+      f.kind = LDELEM_X32_UNCHECKED;
+      break;
+    case STELEM_X8:
+      f.kind = STELEM_X8_UNCHECKED;
+      break;
+    case STELEM_X16:
+      f.kind = STELEM_X16_UNCHECKED;
+      break;
+    case STELEM_X32:
+      f.kind = STELEM_X32_UNCHECKED;
+      break;
+#endif
+    case CALL_S:
+      f.kind = offset == ENTRY_UNIT ? CALL_S_BOUNDED : CALL_S_UNCHECKED;
+      break;
+    case CALL:
+      f.kind = CALL_UNCHECKED;
+      break;
+    }
+    n = f.kind >= 0 ? 1 : 0;
+#if !defined(MANGO_NO_REFS)
+  } else if (f.kind == LDLOC_LDLOC_LDELEM_X32 && IS_UNCHECKED(flags[f.at[2]])) {
+    f.kind = LDLOC_LDLOC_LDELEM_X32_UNCHECKED;
+#endif
+  }
+#endif
+
+  if (n == 0) {
+    return f;
+  }
+
+  // Only instructions that nothing jumps into can be fused.
+  f.length = end[n - 1] - offset;
+  for (size_t i = 1, j = 1; i < f.length; i++) {
+    uint16_t flag = flags[offset + i];
+    if (j < n && offset + i == f.at[j]) {
+      j++;
+    } else if (flag != 0) {
+      f.kind = -1;
+    }
+    if ((flag & (TARGET | FUNCTION)) != 0) {
+      f.kind = -1;
+    }
+  }
+
+  return f;
+}
+
+static mango_result _mango_layout(translation *t, uint8_t module,
+                                  size_t *cell_count,
+                                  size_t *function_count) {
+  const mango_module *m = _mango_get_module(t->vm, module);
+  const uint16_t *flags = t->flags + t->starts[module];
+  uint16_t *map = t->map + t->starts[module];
+  size_t index = ENTRY_IP;
+  size_t functions = 0;
+  size_t end = 0;
+
+  for (size_t offset = 0; offset < m->image_size; offset++) {
+    if ((flags[offset] & FUNCTION) != 0) {
+      if (offset < end) {
+        return MANGO_E_BAD_IMAGE_FORMAT;
+      }
+      end = offset + sizeof(mango_func_def);
+      map[offset] = (uint16_t)index;
+      index++;
+      functions++;
+    }
+    if ((flags[offset] & REACHED) != 0) {
+      if (offset < end) {
+        return MANGO_E_BAD_IMAGE_FORMAT;
+      }
+      fusion f = _mango_fuse(t, module, offset);
+      map[offset] = (uint16_t)index;
+      if (f.kind >= 0) {
+        end = offset + f.length;
+        index += _mango_superinstruction_cells[f.kind];
+        offset = end - 1;
+      } else {
+        end = offset + _mango_instruction_size(m->image, m->image_size, offset);
+        index += _mango_instruction_cells(m->image, offset);
+      }
+    }
+    if (index + functions > UINT16_MAX) {
+      return MANGO_E_NOT_SUPPORTED;
+    }
+  }
+
+  *cell_count = index + functions + FUSION_COUNT;
+  *function_count = functions;
+  return MANGO_E_SUCCESS;
+}
+
+static void _mango_emit_instruction(const translation *t, uint8_t module,
+                                    size_t offset, cell *code) {
+  const mango_module *m = _mango_get_module(t->vm, module);
+  const uint8_t *ip = m->image + offset;
+  const uint16_t *map = t->map + t->starts[module];
+  uint16_t index = map[offset];
+  cell *out = code + index;
+  uint8_t op = *ip;
+  uint8_t callee = module;
+
+  if (!_mango_is_valid_opcode(op)) {
+    out[0].handler = t->handlers[UNUSED22];
+    return;
+  }
+
+  out[0].handler = t->handlers[op];
+
+  switch (op) {
+  case LDC_I32_M1:
+  case LDC_I32_0:
+  case LDC_I32_1:
+  case LDC_I32_2:
+  case LDC_I32_3:
+  case LDC_I32_4:
+  case LDC_I32_5:
+  case LDC_I32_6:
+  case LDC_I32_7:
+  case LDC_I32_8:
+    out[0].handler = t->handlers[LDC_I32_S];
+    out[1].i32 = (int32_t)op - LDC_I32_0;
+    break;
+  case LDC_I32_S:
+    out[1].i32 = FETCH(ip + 1, i8);
+    break;
+  case LDC_X32:
+    out[1].u32 = FETCH(ip + 1, u32);
+    break;
+  case LDC_X64:
+    out[1].u32 = FETCH(ip + 1, u32);
+    out[2].u32 = FETCH(ip + 5, u32);
+    break;
+  case BR_S:
+  case BRFALSE_S:
+  case BRTRUE_S:
+  case BR:
+  case BRFALSE:
+  case BRTRUE:
+    out[1].i32 = map[_mango_branch_target(m->image, offset)] - (index + 2);
+    break;
+  case CALL_S:
+    out[1].u32 = map[FETCH(ip + 1, u16) + sizeof(mango_func_def)];
+    break;
+  case CALL:
+    _mango_resolve_import(t, module, FETCH(ip + 1, u8), &callee);
+    out[1].u32 = callee;
+    out[2].u32 = t->map[t->starts[callee] + FETCH(ip + 2, u16) +
+                        sizeof(mango_func_def)];
+    break;
+  case LDFTN:
+    _mango_resolve_import(t, module, FETCH(ip + 1, u8), &callee);
+    out[1].ftn = (function_token){0, callee, FETCH(ip + 2, u16)};
+    break;
+  case SYSCALL:
+    out[1].i32 = FETCH(ip + 1, i8);
+    out[2].u32 = FETCH(ip + 2, u16);
+    break;
+#if !defined(MANGO_NO_REFS)
+  case MAKEARR:
+    out[1].u32 = FETCH(ip + 1, u16);
+    out[2].u32 = FETCH(ip + 3, u16);
+    out[3].data = ip + 5;
+    break;
+#endif
+  default:
+    if (_mango_opcode_args[op] == 1) {
+      out[1].u32 = FETCH(ip + 1, u8);
+    } else if (_mango_opcode_args[op] == 2) {
+      out[1].u32 = FETCH(ip + 1, u16);
+    }
+    break;
+  }
+}
+
+static void _mango_emit_superinstruction(const translation *t, uint8_t module,
+                                         size_t offset, const fusion *f,
+                                         cell *code) {
+  const mango_module *m = _mango_get_module(t->vm, module);
+  const uint8_t *image = m->image;
+  const uint16_t *map = t->map + t->starts[module];
+  uint16_t index = map[offset];
+  cell *out = code + index;
+  int32_t value = 0;
+  uint8_t callee = module;
+
+  out[0].handler = t->handlers[OPCODE_COUNT + (size_t)f->kind];
+
+  switch (f->kind) {
+  case LDLOC_LDLOC_X32:
+  case LDLOC_LDLOC_ADD_I32:
+    out[1].u32 = _mango_slot(image, f->at[0]);
+    out[2].u32 = _mango_slot(image, f->at[1]) - 1u;
+    break;
+  case LDLOC_LDC_ADD_STLOC_I32:
+    _mango_constant(image, f->at[1], &value);
+    out[1].u32 = _mango_slot(image, f->at[0]);
+    out[2].i32 = value;
+    out[3].u32 = _mango_slot(image, f->at[3]) - 1u;
+    break;
+  case LDLOC_LDC_CLT_BRFALSE_I32:
+    _mango_constant(image, f->at[1], &value);
+    out[1].u32 = _mango_slot(image, f->at[0]);
+    out[2].i32 = value;
+    out[3].i32 = map[_mango_branch_target(image, f->at[3])] - (index + 4);
+    break;
+  case DUP_BRTRUE_X32:
+    out[1].i32 = map[_mango_branch_target(image, f->at[1])] - (index + 2);
+    break;
+#if !defined(MANGO_NO_REFS)
+  case LDLOC_LDLOC_LDELEM_X32:
+  case LDLOC_LDLOC_LDELEM_X32_UNCHECKED:
+    out[1].u32 = _mango_slot(image, f->at[0]);
+    out[2].u32 = _mango_slot(image, f->at[1]) - 2u;
+    break;
+#endif
+  case LDFLD_X32_UNCHECKED:
+  case STFLD_X32_UNCHECKED:
+    out[1].u32 = FETCH(image + f->at[0] + 1, u16);
+    break;
+  case CALL_S_UNCHECKED:
+    out[1].u32 = map[FETCH(image + f->at[0] + 1, u16) + sizeof(mango_func_def)];
+    break;
+  case CALL_S_BOUNDED:
+    out[1].u32 = map[FETCH(image + f->at[0] + 1, u16) + sizeof(mango_func_def)];
+    out[2].u32 = _mango_need(t, module, FETCH(image + f->at[0] + 1, u16));
+    break;
+  case CALL_UNCHECKED:
+    _mango_resolve_import(t, module, FETCH(image + f->at[0] + 1, u8), &callee);
+    out[1].u32 = callee;
+    out[2].u32 = t->map[t->starts[callee] + FETCH(image + f->at[0] + 2, u16) +
+                        sizeof(mango_func_def)];
+    break;
+  }
+}
+
+static void _mango_emit(const translation *t, uint8_t module) {
+  const mango_module *m = _mango_get_module(t->vm, module);
+  const uint16_t *flags = t->flags + t->starts[module];
+  const uint16_t *map = t->map + t->starts[module];
+  cell *code = (cell *)cell_as_ptr(t->vm, m->code);
+  size_t function_index = code[0].info.functions;
+  size_t function_count = 0;
+  cell *stats = code + function_index + code[0].info.function_count;
+
+  code[HALT_IP].handler = t->handlers[HALT];
+
+  for (size_t i = 0; i < FUSION_COUNT; i++) {
+    stats[i].u32 = 0;
+  }
+
+  for (size_t offset = 0; offset < m->image_size; offset++) {
+    if ((flags[offset] & FUNCTION) != 0) {
+      const mango_func_def *f = (const mango_func_def *)(m->image + offset);
+      code[map[offset]].func = (function_header){.arg_count = f->arg_count,
+                                                  .loc_count = f->loc_count,
+                                                  .max_stack = f->max_stack};
+#if defined(MANGO_VERIFY)
+      if ((flags[offset] & COVERED) != 0) {
+        code[map[offset]].func.flags = INTERNAL;
+      }
+#endif
+      code[function_index + function_count].entry = (function_entry){
+          (uint16_t)offset, (uint16_t)(map[offset] + 1)};
+      function_count++;
+    }
+    if ((flags[offset] & REACHED) != 0) {
+      fusion f = _mango_fuse(t, module, offset);
+      if (f.kind >= 0) {
+        _mango_emit_superinstruction(t, module, offset, &f, code);
+        if (f.kind < FUSION_COUNT) {
+          stats[f.kind].u32++;
+        }
+        offset += f.length - 1;
+      } else {
+        _mango_emit_instruction(t, module, offset, code);
+      }
+    }
+  }
+}
+
+#if defined(MANGO_JIT) || defined(MANGO_SNAPSHOT)
+static int _mango_handler_kind(const void *const *handlers,
+                               const void *handler) {
+  for (size_t i = 0; i < OPCODE_COUNT + SUPERINSTRUCTION_COUNT; i++) {
+    if (handlers[i] == handler) {
+      return (int)i;
+    }
+  }
+  return -1;
+}
+#endif
+
+static cell *_mango_alloc_cells(mango_vm *vm, size_t count) {
+  uintptr_t address = (uintptr_t)vm + vm->heap_used;
+  size_t padding = (size_t)(-address & (__alignof(cell) - 1));
+  uint8_t *block = (uint8_t *)mango_heap_alloc(
+      vm, count * sizeof(cell) + padding, sizeof(uint8_t), 1, 0);
+  return block ? (cell *)(block + padding) : NULL;
+}
+
+static mango_result _mango_translate(mango_vm *vm) {
+  uint32_t heap_used = vm->heap_used;
+  size_t scratch_offset;
+  translation t;
+
+  mango_result result = _mango_analyze(vm, &t, &scratch_offset);
+  _mango_interpret(NULL, &t.handlers);
+
+  for (uint_fast8_t i = 0; i < vm->modules_created && result == 0; i++) {
+    size_t cell_count;
+    size_t function_count;
+
+    result = _mango_layout(&t, (uint8_t)i, &cell_count, &function_count);
+    if (result != MANGO_E_SUCCESS) {
+      break;
+    }
+
+    size_t functions = cell_count - function_count - FUSION_COUNT;
+#if defined(MANGO_JIT)
+    size_t map_cells = jit_state_is_null(vm->jit) ? 0 : JIT_MAP_CELLS(functions);
+    cell_count += map_cells;
+#endif
+
+    cell *code = _mango_alloc_cells(vm, cell_count);
+    if (!code || vm->heap_used > scratch_offset) {
+      result = MANGO_E_OUT_OF_MEMORY;
+      break;
+    }
+
+    code[0].info = (code_info){(uint16_t)function_count, (uint16_t)functions};
+#if defined(MANGO_JIT)
+    memset(code + cell_count - map_cells, 0, map_cells * sizeof(cell));
+#endif
+    _mango_get_module(vm, (uint8_t)i)->code = cell_as_ref(vm, code);
+  }
+
+  if (result == MANGO_E_SUCCESS) {
+    for (uint_fast8_t i = 0; i < vm->modules_created; i++) {
+      _mango_emit(&t, (uint8_t)i);
+    }
+  } else {
+    for (uint_fast8_t i = 0; i < vm->modules_created; i++) {
+      _mango_get_module(vm, (uint8_t)i)->code = cell_null();
+    }
+    vm->heap_used = heap_used;
+  }
+
+  return result;
+}
+
+static const cell *_mango_find_function(const mango_vm *vm,
+                                        const mango_module *module,
+                                        uint16_t offset) {
+  const cell *code = _mango_get_module_code(vm, module);
+  const cell *functions = code + code[0].info.functions;
+  size_t lo = 0;
+  size_t hi = code[0].info.function_count;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (functions[mid].entry.offset < offset) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  if (lo < code[0].info.function_count &&
+      functions[lo].entry.offset == offset) {
+    return code + functions[lo].entry.code;
+  }
+  return NULL;
+}
+
+// With MANGO_JIT, functions that become hot are compiled to x86-64 machine
+// code by copying a fixed template for each instruction and patching in its
+// operands. Native code keeps the evaluation stack in memory and hands
+// control back to the interpreter at any instruction without a template, so
+// calls, returns, SYSCALL and BREAK always run in the interpreter and the
+// VM state stays the same in both tiers.
+
+#if defined(MANGO_JIT)
+
+#define TIER_INTERPRETED 0
+#define TIER_NATIVE 1
+#define TIER_PARTIAL 2
+
+#define JIT_TIMEOUT 0x80000000u
+#define JIT_SAMPLE_INTERVAL 64
+
+typedef struct jit_result {
+  stackval *sp;
+  uint32_t ip;
+  uint32_t fuel;
+} jit_result;
+
+typedef jit_result jit_code(stackval *sp, uint32_t fuel);
+
+typedef struct jit_function {
+  uint8_t *code;
+  size_t size;
+  uint32_t *map;
+  size_t start;
+  size_t end;
+  size_t origin;
+  size_t exit;
+} jit_function;
+
+enum {
+  JIT_EAX = 0,
+  JIT_ECX = 1,
+};
+
+enum {
+  JIT_ALWAYS = -1,
+  JIT_B = 0x2,
+  JIT_AE = 0x3,
+  JIT_E = 0x4,
+  JIT_NE = 0x5,
+  JIT_BE = 0x6,
+  JIT_A = 0x7,
+  JIT_L = 0xC,
+  JIT_GE = 0xD,
+  JIT_LE = 0xE,
+  JIT_G = 0xF,
+};
+
+static inline uint32_t *_mango_jit_map(const cell *code) {
+  return (uint32_t *)(code + code[0].info.functions +
+                                 code[0].info.function_count + FUSION_COUNT);
+}
+
+static void _mango_jit_emit(jit_function *f, const void *bytes, size_t count) {
+  if (f->code) {
+    memcpy(f->code + f->size, bytes, count);
+  }
+  f->size += count;
+}
+
+static void _mango_jit_byte(jit_function *f, uint8_t value) {
+  _mango_jit_emit(f, &value, sizeof(value));
+}
+
+static void _mango_jit_u32(jit_function *f, uint32_t value) {
+  _mango_jit_emit(f, &value, sizeof(value));
+}
+
+// op reg, [rdi + slot * 4]
+static void _mango_jit_slot(jit_function *f, uint8_t op, uint8_t reg,
+                            uint32_t slot) {
+  _mango_jit_byte(f, op);
+  _mango_jit_byte(f, (uint8_t)(0x87 | reg << 3));
+  _mango_jit_u32(f, slot * (uint32_t)sizeof(stackval));
+}
+
+static void _mango_jit_load(jit_function *f, uint8_t reg, uint32_t slot) {
+  _mango_jit_slot(f, 0x8B, reg, slot);
+}
+
+static void _mango_jit_store(jit_function *f, uint8_t reg, uint32_t slot) {
+  _mango_jit_slot(f, 0x89, reg, slot);
+}
+
+// add rdi, count * 4
+static void _mango_jit_pop(jit_function *f, uint8_t count) {
+  const uint8_t code[] = {0x48, 0x83, 0xC7, (uint8_t)(count * 4)};
+  _mango_jit_emit(f, code, sizeof(code));
+}
+
+// sub rdi, count * 4
+static void _mango_jit_push(jit_function *f, uint8_t count) {
+  const uint8_t code[] = {0x48, 0x83, 0xEF, (uint8_t)(count * 4)};
+  _mango_jit_emit(f, code, sizeof(code));
+}
+
+static void _mango_jit_jump(jit_function *f, int condition, size_t target) {
+  if (condition == JIT_ALWAYS) {
+    _mango_jit_byte(f, 0xE9);
+  } else {
+    _mango_jit_byte(f, 0x0F);
+    _mango_jit_byte(f, (uint8_t)(0x80 | condition));
+  }
+  _mango_jit_u32(f, (uint32_t)(target - (f->size + sizeof(uint32_t))));
+}
+
+static void _mango_jit_exit(jit_function *f, uint32_t ip) {
+  _mango_jit_byte(f, 0xBA); // mov edx, ip
+  _mango_jit_u32(f, ip);
+  _mango_jit_jump(f, JIT_ALWAYS, f->exit);
+}
+
+static inline size_t _mango_jit_target(const jit_function *f, size_t index) {
+  return (f->map[index] & ~JIT_TIMEOUT) - 1 - f->origin;
+}
+
+static int _mango_jit_branch(jit_function *f, int condition, size_t index,
+                             size_t length, int32_t offset) {
+  ptrdiff_t target = (ptrdiff_t)(index + length) + offset;
+
+  if (target < (ptrdiff_t)f->start || target >= (ptrdiff_t)f->end) {
+    return 0;
+  }
+  if (offset >= 0) {
+    _mango_jit_jump(f, condition, _mango_jit_target(f, (size_t)target));
+    return 1;
+  }
+
+  if (condition != JIT_ALWAYS) {
+    _mango_jit_jump(f, condition ^ 1, f->size + 6 + 19);
+  }
+  const uint8_t consume[] = {0x83, 0xEE, 0x01}; // sub esi, 1
+  _mango_jit_emit(f, consume, sizeof(consume));
+  _mango_jit_jump(f, JIT_NE, _mango_jit_target(f, (size_t)target));
+  _mango_jit_exit(f, (uint32_t)target | JIT_TIMEOUT);
+  return 1;
+}
+
+static int _mango_jit_instruction(jit_function *f, const cell *ip, int kind,
+                                  size_t index) {
+  static const uint8_t alu[] = {
+      [ADD_I32] = 0x01, [SUB_I32] = 0x29, [AND_I32] = 0x21,
+      [OR_I32] = 0x09,  [XOR_I32] = 0x31,
+  };
+  static const uint8_t shift[] = {
+      [SHL_I32] = 4,
+      [SHR_I32] = 7,
+      [SHR_I32_UN] = 5,
+  };
+  static const uint8_t compare[] = {
+      [CEQ_I32] = JIT_E,     [CNE_I32] = JIT_NE,    [CGT_I32] = JIT_G,
+      [CGT_I32_UN] = JIT_A,  [CGE_I32] = JIT_GE,    [CGE_I32_UN] = JIT_AE,
+      [CLT_I32] = JIT_L,     [CLT_I32_UN] = JIT_B,  [CLE_I32] = JIT_LE,
+      [CLE_I32_UN] = JIT_BE,
+  };
+  static const uint8_t convert[] = {
+      [CONV_I8_I32] = 0xBE,
+      [CONV_U8_I32] = 0xB6,
+      [CONV_I16_I32] = 0xBF,
+      [CONV_U16_I32] = 0xB7,
+  };
+
+  switch (kind) {
+  case NOP:
+    return 1;
+
+  case POP_X32:
+    _mango_jit_pop(f, 1);
+    return 1;
+
+  case DUP_X32:
+    _mango_jit_load(f, JIT_EAX, 0);
+    _mango_jit_push(f, 1);
+    _mango_jit_store(f, JIT_EAX, 0);
+    return 1;
+
+  case LDLOC_X32:
+    _mango_jit_load(f, JIT_EAX, ip[1].u32);
+    _mango_jit_push(f, 1);
+    _mango_jit_store(f, JIT_EAX, 0);
+    return 1;
+
+  case STLOC_X32:
+    _mango_jit_load(f, JIT_EAX, 0);
+    _mango_jit_store(f, JIT_EAX, ip[1].u32);
+    _mango_jit_pop(f, 1);
+    return 1;
+
+  case LDC_I32_S:
+  case LDC_X32:
+    _mango_jit_push(f, 1);
+    _mango_jit_slot(f, 0xC7, 0, 0); // mov dword [rdi], imm32
+    _mango_jit_u32(f, ip[1].u32);
+    return 1;
+
+  case ADD_I32:
+  case SUB_I32:
+  case AND_I32:
+  case OR_I32:
+  case XOR_I32:
+    _mango_jit_load(f, JIT_EAX, 0);
+    _mango_jit_pop(f, 1);
+    _mango_jit_slot(f, alu[kind], JIT_EAX, 0);
+    return 1;
+
+  case MUL_I32:
+    _mango_jit_load(f, JIT_EAX, 0);
+    _mango_jit_pop(f, 1);
+    _mango_jit_byte(f, 0x0F); // imul eax, [rdi]
+    _mango_jit_slot(f, 0xAF, JIT_EAX, 0);
+    _mango_jit_store(f, JIT_EAX, 0);
+    return 1;
+
+  case NEG_I32:
+    _mango_jit_slot(f, 0xF7, 3, 0);
+    return 1;
+
+  case NOT_I32:
+    _mango_jit_slot(f, 0xF7, 2, 0);
+    return 1;
+
+  case SHL_I32:
+  case SHR_I32:
+  case SHR_I32_UN:
+    _mango_jit_load(f, JIT_ECX, 0);
+    _mango_jit_pop(f, 1);
+    _mango_jit_slot(f, 0xD3, shift[kind], 0);
+    return 1;
+
+  case CEQ_I32:
+  case CNE_I32:
+  case CGT_I32:
+  case CGT_I32_UN:
+  case CGE_I32:
+  case CGE_I32_UN:
+  case CLT_I32:
+  case CLT_I32_UN:
+  case CLE_I32:
+  case CLE_I32_UN: {
+    const uint8_t code[] = {0x0F, (uint8_t)(0x90 | compare[kind]), 0xC0,
+                            0x0F, 0xB6, 0xC0}; // setcc al; movzx eax, al
+    _mango_jit_load(f, JIT_EAX, 0);
+    _mango_jit_pop(f, 1);
+    _mango_jit_slot(f, 0x39, JIT_EAX, 0);
+    _mango_jit_emit(f, code, sizeof(code));
+    _mango_jit_store(f, JIT_EAX, 0);
+    return 1;
+  }
+
+  case CONV_I8_I32:
+  case CONV_U8_I32:
+  case CONV_I16_I32:
+  case CONV_U16_I32:
+    _mango_jit_byte(f, 0x0F);
+    _mango_jit_slot(f, convert[kind], JIT_EAX, 0);
+    _mango_jit_store(f, JIT_EAX, 0);
+    return 1;
+
+  case BR_S:
+  case BR:
+    return _mango_jit_branch(f, JIT_ALWAYS, index, 2, ip[1].i32);
+
+  case BRFALSE_S:
+  case BRFALSE:
+  case BRTRUE_S:
+  case BRTRUE: {
+    const uint8_t code[] = {0x85, 0xC0}; // test eax, eax
+    int condition = kind == BRFALSE_S || kind == BRFALSE ? JIT_E : JIT_NE;
+    ptrdiff_t target = (ptrdiff_t)index + 2 + ip[1].i32;
+    if (target < (ptrdiff_t)f->start || target >= (ptrdiff_t)f->end) {
+      return 0;
+    }
+    _mango_jit_load(f, JIT_EAX, 0);
+    _mango_jit_pop(f, 1);
+    _mango_jit_emit(f, code, sizeof(code));
+    return _mango_jit_branch(f, condition, index, 2, ip[1].i32);
+  }
+
+  case OPCODE_COUNT + LDLOC_LDLOC_X32:
+    _mango_jit_load(f, JIT_EAX, ip[1].u32);
+    _mango_jit_load(f, JIT_ECX, ip[2].u32);
+    _mango_jit_push(f, 2);
+    _mango_jit_store(f, JIT_ECX, 0);
+    _mango_jit_store(f, JIT_EAX, 1);
+    return 1;
+
+  case OPCODE_COUNT + LDLOC_LDLOC_ADD_I32:
+    _mango_jit_load(f, JIT_EAX, ip[1].u32);
+    _mango_jit_slot(f, 0x03, JIT_EAX, ip[2].u32); // add eax, [rdi + slot]
+    _mango_jit_push(f, 1);
+    _mango_jit_store(f, JIT_EAX, 0);
+    return 1;
+
+  case OPCODE_COUNT + LDLOC_LDC_ADD_STLOC_I32:
+    _mango_jit_load(f, JIT_EAX, ip[1].u32);
+    _mango_jit_byte(f, 0x05); // add eax, imm32
+    _mango_jit_u32(f, ip[2].u32);
+    _mango_jit_store(f, JIT_EAX, ip[3].u32);
+    return 1;
+
+  case OPCODE_COUNT + LDLOC_LDC_CLT_BRFALSE_I32: {
+    ptrdiff_t target = (ptrdiff_t)index + 4 + ip[3].i32;
+    if (target < (ptrdiff_t)f->start || target >= (ptrdiff_t)f->end) {
+      return 0;
+    }
+    _mango_jit_slot(f, 0x81, 7, ip[1].u32); // cmp dword [rdi + slot], imm32
+    _mango_jit_u32(f, ip[2].u32);
+    return _mango_jit_branch(f, JIT_GE, index, 4, ip[3].i32);
+  }
+
+  case OPCODE_COUNT + DUP_BRTRUE_X32: {
+    ptrdiff_t target = (ptrdiff_t)index + 2 + ip[1].i32;
+    if (target < (ptrdiff_t)f->start || target >= (ptrdiff_t)f->end) {
+      return 0;
+    }
+    _mango_jit_slot(f, 0x81, 7, 0); // cmp dword [rdi], 0
+    _mango_jit_u32(f, 0);
+    return _mango_jit_branch(f, JIT_NE, index, 2, ip[1].i32);
+  }
+
+  default:
+    return 0;
+  }
+}
+
+static int _mango_jit_body(jit_function *f, const cell *code,
+                           const void *const *handlers) {
+  static const uint8_t exit[] = {
+      0x48, 0xC1, 0xE6, 0x20, // shl rsi, 32
+      0x48, 0x09, 0xF2,       // or rdx, rsi
+      0x48, 0x89, 0xF8,       // mov rax, rdi
+      0xC3,                   // ret
+  };
+
+  size_t cells;
+  for (size_t index = f->start; index < f->end; index += cells) {
+    int kind = _mango_handler_kind(handlers, code[index].handler);
+
+    if (kind < 0 || (kind < (int)OPCODE_COUNT &&
+                     (!_mango_is_valid_opcode((unsigned int)kind) ||
+                      (kind >= LDC_I32_M1 && kind <= LDC_I32_8)))) {
+      return 0;
+    } else if (kind < (int)OPCODE_COUNT) {
+      uint8_t op = (uint8_t)kind;
+      cells = _mango_instruction_cells(&op, 0);
+    } else {
+      cells = _mango_superinstruction_cells[kind - (int)OPCODE_COUNT];
+    }
+
+    if (!f->code) {
+      f->map[index] = (uint32_t)(f->origin + f->size + 1);
+    }
+    if (!_mango_jit_instruction(f, code + index, kind, index)) {
+      f->map[index] |= JIT_TIMEOUT;
+      _mango_jit_exit(f, (uint32_t)index);
+    }
+  }
+
+  _mango_jit_exit(f, (uint32_t)f->end);
+  f->exit = f->size;
+  _mango_jit_emit(f, exit, sizeof(exit));
+  return 1;
+}
+
+static void _mango_jit_compile(mango_vm *vm, const cell *code,
+                               size_t function) {
+  jit_state *jit = jit_state_as_ptr(vm, vm->jit);
+  const cell *functions = code + code[0].info.functions;
+  function_header *header =
+      (function_header *)&code[functions[function].entry.code - 1].func;
+  const void *const *handlers;
+  _mango_interpret(NULL, &handlers);
+
+  jit_function f;
+  f.code = NULL;
+  f.size = 0;
+  f.map = _mango_jit_map(code);
+  f.start = functions[function].entry.code;
+  f.end = function + 1 < code[0].info.function_count
+              ? functions[function + 1].entry.code - 1u
+              : code[0].info.functions;
+  f.origin = (jit->used + 15) & ~(size_t)15;
+  f.exit = 0;
+
+  header->flags = (uint8_t)((header->flags & ~TIER_MASK) | TIER_PARTIAL);
+
+  int success = _mango_jit_body(&f, code, handlers) &&
+                f.size <= jit->size - f.origin &&
+                mprotect(jit->base, jit->size, PROT_READ | PROT_WRITE) == 0;
+  if (success) {
+    f.code = jit->base + f.origin;
+    f.size = 0;
+    _mango_jit_body(&f, code, handlers);
+    success = mprotect(jit->base, jit->size, PROT_READ | PROT_EXEC) == 0;
+    jit->used = (uint32_t)(f.origin + f.size);
+  }
+
+  for (size_t index = f.start; index < f.end; index++) {
+    if (!success || (f.map[index] & JIT_TIMEOUT) != 0) {
+      f.map[index] = 0;
+    }
+  }
+  if (f.map[f.start] != 0) {
+    header->flags = (uint8_t)((header->flags & ~TIER_MASK) | TIER_NATIVE);
+  }
+}
+
+static jit_code *_mango_jit_entry(const mango_vm *vm, const cell *code,
+                                  const cell *ip) {
+  uint32_t entry = _mango_jit_map(code)[ip - code];
+  if (entry == 0) {
+    return NULL;
+  }
+
+  union {
+    const uint8_t *address;
+    jit_code *code;
+  } native = {jit_state_as_ptr(vm, vm->jit)->base + entry - 1};
+  return native.code;
+}
+
+static jit_code *_mango_jit_hot(mango_vm *vm, uint8_t module, const cell *ip,
+                                uint32_t weight) {
+  const cell *code = _mango_get_module_code(vm, _mango_get_module(vm, module));
+  jit_code *native = _mango_jit_entry(vm, code, ip);
+  if (native) {
+    return native;
+  }
+
+  const cell *functions = code + code[0].info.functions;
+  size_t index = (size_t)(ip - code);
+  size_t lo = 0;
+  size_t hi = code[0].info.function_count;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (functions[mid].entry.code <= index) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  if (lo != 0) {
+    function_header *header =
+        (function_header *)&code[functions[lo - 1].entry.code - 1].func;
+    if ((header->flags & TIER_MASK) == TIER_INTERPRETED) {
+      header->hotness += weight;
+      if (header->hotness >= MANGO_JIT_THRESHOLD) {
+        _mango_jit_compile(vm, code, lo - 1);
+      }
+    }
+  }
+
+  return _mango_jit_entry(vm, code, ip);
+}
+
+// Returns all functions of a copied VM to the interpreter and detaches it
+// from the arena of the original.
+static void _mango_jit_reset(mango_vm *vm) {
+  if (jit_state_is_null(vm->jit)) {
+    return;
+  }
+
+  for (uint_fast8_t i = 0; i < vm->modules_created; i++) {
+    const mango_module *module = _mango_get_module(vm, (uint8_t)i);
+    if (cell_is_null(module->code)) {
+      continue;
+    }
+
+    cell *code = (cell *)cell_as_ptr(vm, module->code);
+    const cell *functions = code + code[0].info.functions;
+    for (size_t j = 0; j < code[0].info.function_count; j++) {
+      function_header *header =
+          (function_header *)&code[functions[j].entry.code - 1].func;
+      header->flags &= (uint8_t)~TIER_MASK;
+      header->hotness = 0;
+    }
+    memset(_mango_jit_map(code), 0,
+           JIT_MAP_CELLS(code[0].info.functions) * sizeof(cell));
+  }
+
+  *jit_state_as_ptr(vm, vm->jit) = (jit_state){{NULL}, 0, 0};
+}
+
+static void _mango_jit_attach(mango_vm *vm) {
+  if (jit_state_is_null(vm->jit)) {
+    return;
+  }
+
+  void *base = mmap(NULL, MANGO_JIT_ARENA_SIZE, PROT_READ | PROT_EXEC,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base != MAP_FAILED) {
+    *jit_state_as_ptr(vm, vm->jit) =
+        (jit_state){{(uint8_t *)base}, MANGO_JIT_ARENA_SIZE, 0};
+  } else {
+    vm->jit = jit_state_null();
+  }
+}
+
+#endif
+
+#endif
+
+static mango_result _mango_check_image(const uint8_t *image, size_t size) {
+  if (size < sizeof(mango_module_def) || size > UINT16_MAX) {
+    return MANGO_E_ARGUMENT;
+  }
+
+  const mango_module_def *m = (const mango_module_def *)image;
+
+  if (m->version != MANGO_VERSION_MAJOR ||
+      m->entry_point[sizeof(m->entry_point) - 1] != HALT ||
+      m->module_count == 0 || m->import_count > m->module_count ||
+      size - sizeof(mango_module_def) <
+          m->import_count * sizeof(mango_module_name)) {
+    return MANGO_E_BAD_IMAGE_FORMAT;
+  }
+  if ((m->features & mango_features()) != m->features) {
+    return MANGO_E_NOT_SUPPORTED;
+  }
+  if ((m->features & MANGO_FEATURE_EXPORTS) != 0) {
+    size_t exports =
+        sizeof(mango_module_def) + m->import_count * sizeof(mango_module_name);
+    size_t slot_count = exports + sizeof(mango_exports_def) <= size
+                            ? FETCH(image + exports, u16)
+                            : 0;
+    if (slot_count == 0 || (slot_count & (slot_count - 1)) != 0 ||
+        size - exports - sizeof(mango_exports_def) <
+            slot_count * sizeof(mango_export_def)) {
+      return MANGO_E_BAD_IMAGE_FORMAT;
+    }
+  }
+
+  return MANGO_E_SUCCESS;
+}
+
+// The call-site cache takes MANGO_CALL_CACHE_SIZE entries from the heap, 4 KB
+// with the default size (6 KB with MANGO_NATIVE_MODULES, 3 KB with threaded
+// code). It is allocated when the
+// VM first runs, so VMs that only import modules or link a program don't pay
+// for it.
+static int _mango_create_call_cache(mango_vm *vm) {
+#if defined(MANGO_CALL_CACHE)
+  if (call_site_is_null(vm->calls)) {
+    call_site *calls = (call_site *)mango_heap_alloc(
+        vm, MANGO_CALL_CACHE_SIZE, sizeof(call_site), __alignof(call_site),
+        MANGO_ALLOC_ZERO_MEMORY);
+    if (!calls) {
+      return 0;
+    }
+    vm->calls = call_site_as_ref(vm, calls);
+  }
+#else
+  (void)vm;
+#endif
+  return 1;
+}
+
+// Runs a function on top of the frames of the program, returning to the HALT
+// of an entry point through a frame that pops its results, and restores the
+// state of the program afterwards. Called from a system call handler, the
+// function draws on the budget of the program; if it runs out, the program
+// is left a single unit and stops at its next call or backward branch.
+static mango_result _mango_invoke(mango_vm *vm, uint8_t module, size_t ip,
+                                  uint8_t arg_count, uint8_t loc_count,
+                                  const union mango_value *arguments,
+                                  union mango_value *results,
+                                  size_t result_count, size_t count) {
+  uint16_t rp = vm->rp;
+  uint16_t sp = vm->sp;
+  uint16_t syscall = vm->syscall;
+  stack_frame sf = vm->sf;
+  uint32_t fuel = vm->fuel;
+  stackval *args = vm->stack + sp - arg_count;
+  mango_result result = MANGO_E_SUCCESS;
+
+#if defined(MANGO_NESTED_CALLS)
+  uint16_t rp_base = vm->rp_base;
+  uint16_t sp_base = vm->sp_base;
+#else
+  if (rp != 0 || sp != vm->stack_size) {
+    return MANGO_E_NOT_SUPPORTED;
+  }
+#endif
+
+  if (!_mango_create_call_cache(vm)) {
+    return MANGO_E_OUT_OF_MEMORY;
+  }
+
+#if defined(MANGO_NESTED_CALLS)
+  vm->rp_base = rp;
+  vm->sp_base = sp;
+#endif
+
+  for (size_t i = 0; i < count && result == MANGO_E_SUCCESS; i++) {
+    if (arg_count != 0) {
+      memcpy(args, (const stackval *)arguments + i * arg_count,
+             arg_count * sizeof(stackval));
+    }
+    memset(args - loc_count, 0, loc_count * sizeof(stackval));
+
+    vm->stack[rp].sf = (stack_frame){(uint8_t)result_count, 0, HALT_IP};
+    vm->rp = (uint16_t)(rp + 1);
+    vm->sp = (uint16_t)(sp - arg_count - loc_count);
+    vm->sf = (stack_frame){(uint8_t)(arg_count + loc_count), module,
+                           (uint16_t)ip};
+
+    result = _mango_interpret(vm, NULL);
+    if (result == MANGO_E_SUCCESS && result_count != 0) {
+      memcpy((stackval *)results + i * result_count,
+             vm->stack + sp - result_count, result_count * sizeof(stackval));
+    }
+  }
+
+  vm->syscall = syscall;
+  vm->rp = rp;
+  vm->sp = vm->sp_expected = sp;
+  vm->sf = sf;
+#if defined(MANGO_NESTED_CALLS)
+  vm->rp_base = rp_base;
+  vm->sp_base = sp_base;
+#endif
+  if (fuel != 0 && vm->fuel == 0) {
+    vm->fuel = 1;
+  }
+  return result;
+}
+
+#if defined(MANGO_LAZY_IMPORT)
+
+// A module imported after the program has started is not part of the init
+// walk and is initialized as soon as it is imported. Its entry point must
+// call an initializer without arguments or do nothing at all.
+
+static inline int _mango_started(const mango_vm *vm) {
+  return vm->modules_imported != 0 &&
+         (_mango_get_modules(vm)->init_flags & VISITED) != 0;
+}
+
+static mango_result _mango_check_initializer(const uint8_t *image,
+                                             size_t size) {
+  const mango_module_def *m = (const mango_module_def *)image;
+
+  if (m->entry_point[0] == NOP && m->entry_point[1] == NOP &&
+      m->entry_point[2] == NOP) {
+    return MANGO_E_SUCCESS;
+  }
+  if (m->entry_point[0] != CALL_S) {
+    return MANGO_E_NOT_SUPPORTED;
+  }
+
+  size_t offset = FETCH(m->entry_point + 1, u16);
+  if (offset < sizeof(mango_module_def) ||
+      offset + sizeof(mango_func_def) >= size) {
+    return MANGO_E_BAD_IMAGE_FORMAT;
+  }
+  if (((const mango_func_def *)(image + offset))->arg_count != 0) {
+    return MANGO_E_NOT_SUPPORTED;
+  }
+  return MANGO_E_SUCCESS;
+}
+
+// If the program stopped on a call into the module, the initializer is
+// entered as if called from there, so the call is made once the program
+// resumes and the initializer returns. Otherwise it runs to completion.
+static mango_result _mango_initialize_lazily(mango_vm *vm, uint8_t index) {
+  mango_module *module = _mango_get_module(vm, index);
+  const mango_module_def *m = (const mango_module_def *)module->image;
+
+  module->init_flags |= VISITED;
+  if (m->entry_point[0] != CALL_S) {
+    return MANGO_E_SUCCESS;
+  }
+
+  uint16_t offset = FETCH(m->entry_point + 1, u16);
+  const mango_func_def *f = (const mango_func_def *)(module->image + offset);
+  uint16_t ip = (uint16_t)(offset + sizeof(mango_func_def));
+  uint16_t rp = vm->rp;
+  uint16_t sp = vm->sp;
+
+  if (sp - rp < 1 + f->loc_count + f->max_stack) {
+    return MANGO_E_STACK_OVERFLOW;
+  }
+  if (sp != vm->sp_expected) {
+    return MANGO_E_STACK_IMBALANCE;
+  }
+
+  if ((vm->init_flags & MISSING) == 0 || vm->missing != index) {
+    return _mango_invoke(vm, index, ip, 0, f->loc_count, NULL, NULL, 0, 1);
+  }
+
+  vm->init_flags &= (uint8_t)~MISSING;
+  memset(vm->stack + sp - f->loc_count, 0, f->loc_count * sizeof(stackval));
+  vm->stack[rp].sf = vm->sf;
+  vm->rp = (uint16_t)(rp + 1);
+  vm->sp = vm->sp_expected = (uint16_t)(sp - f->loc_count);
+  vm->sf = (stack_frame){f->loc_count, index, ip};
+  return MANGO_E_SUCCESS;
+}
+
+#endif
+
+mango_result mango_module_import(mango_vm *vm, const uint8_t *name,
+                                 const uint8_t *image, size_t size,
+                                 void *context) {
+  if (!vm || !name || !image) {
+    return MANGO_E_ARGUMENT_NULL;
+  }
+
+  mango_result result = _mango_check_image(image, size);
+  if (result != MANGO_E_SUCCESS) {
+    return result;
+  }
+
+  if (vm->modules_imported == 0) {
+    result = _mango_import_startup_module(vm, name, image, size, context);
+  } else if (vm->modules_imported < vm->modules_created) {
+    uint8_t index = _mango_find_missing_module(vm, name);
+#if !defined(MANGO_LAZY_IMPORT)
+    result = _mango_import_missing_module(vm, index, name, image, size,
+                                          context);
+#else
+    int started = _mango_started(vm);
+    if (started) {
+      result = _mango_check_initializer(image, size);
+      if (result != MANGO_E_SUCCESS) {
+        return result;
+      }
+    }
+    result = _mango_import_missing_module(vm, index, name, image, size,
+                                          context);
+    if (result == MANGO_E_SUCCESS && started) {
+      result = _mango_initialize_lazily(vm, index);
+    }
+#endif
+  } else {
+    return MANGO_E_INVALID_OPERATION;
+  }
+
+#if defined(MANGO_THREADED_CODE)
+  if (result == MANGO_E_SUCCESS &&
+      vm->modules_imported == vm->modules_created) {
+    result = _mango_translate(vm);
+    if (result != MANGO_E_SUCCESS) {
+      vm->result = result;
+    }
+  }
+#elif defined(MANGO_VERIFY)
+  if (result == MANGO_E_SUCCESS &&
+      vm->modules_imported == vm->modules_created) {
+    translation t;
+    size_t scratch_offset;
+    result = _mango_analyze(vm, &t, &scratch_offset);
+    if (result != MANGO_E_SUCCESS) {
+      vm->result = result;
+    }
+  }
+#endif
+
+  return result;
+}
+
+mango_result mango_module_import_native(mango_vm *vm, const uint8_t *name,
+                                        const mango_native_module *module,
+                                        void *context) {
+  if (!vm || !name || !module) {
+    return MANGO_E_ARGUMENT_NULL;
+  }
+
+  uint8_t index = vm->modules_imported == 0
+                      ? 0
+                      : _mango_find_missing_module(vm, name);
+  mango_result result = mango_module_import(vm, name, module->image,
+                                            module->image_size, context);
+#if defined(MANGO_NATIVE_MODULES)
+  if (result == MANGO_E_SUCCESS) {
+    _mango_get_module(vm, index)->native = module;
+  }
+#else
+  (void)index;
+#endif
+  return result;
+}
+
+typedef struct resolved_module {
+  const mango_module_name *name;
+  const uint8_t *image;
+  size_t size;
+  void *context;
+} resolved_module;
+
+// Resolves the whole module graph and checks every image before the first
+// one is imported, so a missing or unsupported module leaves the VM as it
+// was.
+mango_result mango_module_import_all(mango_vm *vm, const uint8_t *name,
+                                     mango_module_resolver *resolver,
+                                     void *context) {
+  if (!vm || !name || !resolver) {
+    return MANGO_E_ARGUMENT_NULL;
+  }
+  if (vm->modules_imported != 0) {
+    return MANGO_E_INVALID_OPERATION;
+  }
+
+  resolved_module modules[INVALID_MODULE];
+  size_t count = 1;
+  size_t limit = 1;
+  modules[0].name = (const mango_module_name *)name;
+
+  for (size_t i = 0; i < count; i++) {
+    resolved_module *module = &modules[i];
+    module->context = NULL;
+    module->image = resolver(context, module->name->bytes, &module->size,
+                             &module->context);
+    if (!module->image) {
+      return MANGO_E_ARGUMENT;
+    }
+
+    mango_result result = _mango_check_image(module->image, module->size);
+    if (result != MANGO_E_SUCCESS) {
+      return result;
+    }
+
+    const mango_module_def *m = (const mango_module_def *)module->image;
+    if (i == 0) {
+      limit = m->module_count;
+    }
+
+    for (uint_fast8_t j = 0; j < m->import_count; j++) {
+      size_t k = 0;
+      while (k < count && memcmp(&m->imports[j], modules[k].name,
+                                 sizeof(mango_module_name)) != 0) {
+        k++;
+      }
+      if (k == count) {
+        if (count == limit) {
+          return MANGO_E_BAD_IMAGE_FORMAT;
+        }
+        modules[count++].name = &m->imports[j];
+      }
+    }
+  }
+
+  mango_result result = mango_module_import(vm, name, modules[0].image,
+                                            modules[0].size,
+                                            modules[0].context);
+  const uint8_t *missing;
+
+  while (result == MANGO_E_SUCCESS &&
+         (missing = mango_module_missing(vm)) != NULL) {
+    size_t k = 0;
+    while (k < count &&
+           memcmp(missing, modules[k].name, sizeof(mango_module_name)) != 0) {
+      k++;
+    }
+    if (k == count) {
+      return MANGO_E_INVALID_OPERATION;
+    }
+    result = mango_module_import(vm, missing, modules[k].image,
+                                 modules[k].size, modules[k].context);
+  }
+
+  return result;
+}
+
+#if defined(MANGO_FILE_CACHE)
+#if !defined(MANGO_FILE_CACHE_SIZE)
+#define MANGO_FILE_CACHE_SIZE 64
+#endif
+
+typedef struct mapped_file {
+  dev_t device;
+  ino_t inode;
+  off_t size;
+  struct timespec modified;
+  const uint8_t *image;
+  uint32_t refs;
+} mapped_file;
+
+// Mapped files are shared by all VMs in the process. Every VM holds a
+// reference to each file its modules were imported from, and so do clones,
+// templates and VMs attached to a program; mango_finalize releases them.
+// Once the cache is full, a file without references is unmapped to make
+// room, and if there is none, the file cannot be mapped.
+//
+// A module file must be replaced by renaming a new file over it, never
+// rewritten in place: pages of a private mapping that were never written
+// still track the page cache, so the image would change under the VMs that
+// use it, and truncating it makes them fault with SIGBUS.
+static mapped_file _mango_files[MANGO_FILE_CACHE_SIZE];
+static size_t _mango_file_count;
+static pthread_mutex_t _mango_files_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static mapped_file *_mango_find_file(const uint8_t *image) {
+  for (size_t i = 0; i < _mango_file_count; i++) {
+    if (_mango_files[i].image == image) {
+      return &_mango_files[i];
+    }
+  }
+  return NULL;
+}
+
+static void _mango_add_files(const mango_vm *vm, int delta) {
+  for (uint_fast8_t i = 0; i < vm->modules_created; i++) {
+    const mango_module *module = _mango_get_module(vm, (uint8_t)i);
+    mapped_file *file = _mango_find_file(module->image);
+    if (file) {
+      file->refs += (uint32_t)delta;
+    }
+  }
+}
+
+static void _mango_count_file(const uint8_t *image, int delta) {
+  pthread_mutex_lock(&_mango_files_lock);
+  mapped_file *file = _mango_find_file(image);
+  if (file) {
+    file->refs += (uint32_t)delta;
+  }
+  pthread_mutex_unlock(&_mango_files_lock);
+}
+
+static void _mango_count_files(const mango_vm *vm, int delta) {
+  pthread_mutex_lock(&_mango_files_lock);
+  _mango_add_files(vm, delta);
+  pthread_mutex_unlock(&_mango_files_lock);
+}
+
+static const uint8_t *_mango_map_file(int fd, size_t *size) {
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(mango_module_def) ||
+      st.st_size > UINT16_MAX) {
+    return NULL;
+  }
+
+  mapped_file *slot = NULL;
+  for (size_t i = 0; i < _mango_file_count; i++) {
+    mapped_file *file = &_mango_files[i];
+    if (file->device == st.st_dev && file->inode == st.st_ino &&
+        file->size == st.st_size &&
+        file->modified.tv_sec == st.st_mtim.tv_sec &&
+        file->modified.tv_nsec == st.st_mtim.tv_nsec) {
+      file->refs++;
+      *size = (size_t)file->size;
+      return file->image;
+    }
+    if (file->refs == 0 && !slot) {
+      slot = file;
+    }
+  }
+
+  if (_mango_file_count < MANGO_FILE_CACHE_SIZE) {
+    slot = &_mango_files[_mango_file_count];
+  } else if (!slot) {
+    return NULL;
+  }
+
+  void *image = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (image == MAP_FAILED) {
+    return NULL;
+  }
+
+#if !defined(MANGO_THREADED_CODE)
+  // The interpreter executes straight from the image.
+  madvise(image, (size_t)st.st_size, MADV_WILLNEED);
+#else
+  // The image is read front to back once while it is translated.
+  madvise(image, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+
+  if (slot == &_mango_files[_mango_file_count]) {
+    _mango_file_count++;
+  } else {
+    munmap((void *)(uintptr_t)slot->image, (size_t)slot->size);
+  }
+  *slot = (mapped_file){st.st_dev,   st.st_ino, st.st_size,
+                        st.st_mtim, (const uint8_t *)image, 1};
+  *size = (size_t)st.st_size;
+  return (const uint8_t *)image;
+}
+#endif
+
+const uint8_t *mango_module_map_file(const char *path, size_t *size) {
+  if (!path || !size) {
+    return NULL;
+  }
+#if defined(MANGO_FILE_CACHE)
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&_mango_files_lock);
+  const uint8_t *image = _mango_map_file(fd, size);
+  pthread_mutex_unlock(&_mango_files_lock);
+
+  close(fd);
+  return image;
+#else
+  return NULL;
+#endif
+}
+
+void mango_module_unmap_file(const uint8_t *image) {
+#if defined(MANGO_FILE_CACHE)
+  _mango_count_file(image, -1);
+#else
+  (void)image;
+#endif
+}
+
+mango_result mango_module_import_file(mango_vm *vm, const uint8_t *name,
+                                      const char *path, void *context) {
+  if (!vm || !path) {
+    return MANGO_E_ARGUMENT_NULL;
+  }
+#if defined(MANGO_FILE_CACHE)
+  size_t size;
+  const uint8_t *image = mango_module_map_file(path, &size);
+  if (!image) {
+    return MANGO_E_ARGUMENT;
+  }
+  mango_result result = mango_module_import(vm, name, image, size, context);
+  mango_module_unmap_file(image);
+  return result;
+#else
+  (void)name;
+  (void)context;
+  return MANGO_E_NOT_SUPPORTED;
+#endif
+}
+
+// A program is written once from a VM whose modules have all been imported,
+// translated and verified, and which has not run yet. It holds their import
+// tables, their code and a hash table of their names, and is only read
+// afterwards, so any number of VMs, on any thread, can attach to it. The VM
+// can be finalized once the program is linked. If address is NULL or *size is
+// too small, nothing is written and *size is set to the size needed.
+
+#if defined(MANGO_PROGRAM)
+static size_t _mango_align(size_t offset, size_t alignment) {
+  return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+#if defined(MANGO_THREADED_CODE)
+static size_t _mango_code_cells(const cell *code) {
+  return code[0].info.functions + code[0].info.function_count + FUSION_COUNT;
+}
+#endif
+#endif
+
+mango_program *mango_program_link(const mango_vm *vm, void *address,
+                                  size_t *size) {
+  if (!vm || !size) {
+    return NULL;
+  }
+#if defined(MANGO_PROGRAM)
+  if (vm->modules_imported == 0 ||
+      vm->modules_imported != vm->modules_created ||
+      (vm->result > MANGO_E_SUCCESS && vm->result < MANGO_E_BREAKPOINT) ||
+      vm->init_head != 0 || vm->sf.module != 0 || vm->sf.ip != HALT_IP ||
+      ((uintptr_t)address & (__alignof(cell) - 1)) != 0) {
+    return NULL;
+  }
+
+  size_t slots = 2;
+  while (slots < 2 * (size_t)vm->modules_created) {
+    slots *= 2;
+  }
+
+  size_t modules_offset =
+      _mango_align(sizeof(mango_program) + slots, __alignof(mango_module));
+  size_t offset = modules_offset + vm->modules_created * sizeof(mango_module);
+  for (uint_fast8_t i = 0; i < vm->modules_created; i++) {
+    const mango_module *module = _mango_get_module(vm, (uint8_t)i);
+    offset += module->import_count;
+#if defined(MANGO_THREADED_CODE)
+    if (!cell_is_null(module->code)) {
+      offset = _mango_align(offset, __alignof(cell)) +
+               _mango_code_cells(_mango_get_module_code(vm, module)) *
+                   sizeof(cell);
+    }
+#endif
+  }
+
+  if (!address || *size < offset || offset > UINT32_MAX) {
+    *size = offset;
+    return NULL;
+  }
+
+  mango_program *program = (mango_program *)address;
+  const mango_vm *base = (const mango_vm *)address;
+  uint8_t *block = (uint8_t *)address;
+
+  program->size = (uint32_t)offset;
+  memcpy(&program->startup_module_name, &vm->startup_module_name,
+         sizeof(mango_module_name));
+  program->modules_created = vm->modules_created;
+  program->init_head = vm->init_head;
+  program->name_mask = (uint16_t)(slots - 1);
+  memset(program->names, INVALID_MODULE, slots);
+
+  mango_module *modules = (mango_module *)(block + modules_offset);
+  memcpy(modules, _mango_get_modules(vm),
+         vm->modules_created * sizeof(mango_module));
+  program->modules = mango_module_as_ref(base, modules);
+
+  offset = modules_offset + vm->modules_created * sizeof(mango_module);
+  for (uint_fast8_t i = 0; i < vm->modules_created; i++) {
+    const mango_module *original = _mango_get_module(vm, (uint8_t)i);
+    mango_module *module = &modules[i];
+
+    if (module->import_count != 0) {
+      memcpy(block + offset, _mango_get_module_imports(vm, original),
+             module->import_count);
+      module->imports = uint8_t_as_ref(base, block + offset);
+      offset += module->import_count;
+    }
+
+#if defined(MANGO_THREADED_CODE)
+    if (!cell_is_null(original->code)) {
+      const cell *code = _mango_get_module_code(vm, original);
+      size_t cells = _mango_code_cells(code);
+      offset = _mango_align(offset, __alignof(cell));
+      memcpy(block + offset, code, cells * sizeof(cell));
+      module->code = cell_as_ref(base, (const cell *)(block + offset));
+      offset += cells * sizeof(cell);
+    }
+#endif
+
+    size_t slot = mango_export_hash(_mango_get_module_name(vm, original)) &
+                  program->name_mask;
+    while (program->names[slot] != INVALID_MODULE) {
+      slot = (slot + 1) & program->name_mask;
+    }
+    program->names[slot] = (uint8_t)i;
+
+#if defined(MANGO_FILE_CACHE)
+    _mango_count_file(module->image, 1);
+#endif
+  }
+
+  return program;
+#else
+  (void)address;
+  return NULL;
+#endif
+}
+
+void mango_program_finalize(mango_program *program) {
+#if defined(MANGO_PROGRAM) && defined(MANGO_FILE_CACHE)
+  if (program) {
+    const mango_module *modules =
+        mango_module_as_ptr(_mango_program_base(program), program->modules);
+    for (uint_fast8_t i = 0; i < program->modules_created; i++) {
+      _mango_count_file(modules[i].image, -1);
+    }
+  }
+#endif
+  (void)program;
+}
+
+mango_result mango_attach(mango_vm *vm, const mango_program *program) {
+  if (!vm || !program) {
+    return MANGO_E_ARGUMENT_NULL;
+  }
+#if defined(MANGO_PROGRAM)
+  if (vm->modules_created != 0) {
+    return MANGO_E_INVALID_OPERATION;
+  }
+
+  mango_module *modules = (mango_module *)mango_heap_alloc(
+      vm, program->modules_created, sizeof(mango_module),
+      __alignof(mango_module), 0);
+  if (!modules) {
+    return MANGO_E_OUT_OF_MEMORY;
+  }
+
+  memcpy(modules,
+         mango_module_as_ptr(_mango_program_base(program), program->modules),
+         program->modules_created * sizeof(mango_module));
+  memcpy(&vm->startup_module_name, &program->startup_module_name,
+         sizeof(mango_module_name));
+  vm->modules = mango_module_as_ref(vm, modules);
+  vm->modules_created = program->modules_created;
+  vm->modules_imported = program->modules_created;
+  vm->init_head = program->init_head;
+  vm->program = program;
+
+#if defined(MANGO_FILE_CACHE)
+  _mango_count_files(vm, 1);
+#endif
+
+#if defined(MANGO_JIT)
+  // Compiling would write to the shared code.
+  if (!jit_state_is_null(vm->jit)) {
+    jit_state *jit = jit_state_as_ptr(vm, vm->jit);
+    munmap(jit->base, jit->size);
+    vm->jit = jit_state_null();
+  }
+#endif
+
+  return MANGO_E_SUCCESS;
+#else
+  return MANGO_E_NOT_SUPPORTED;
+#endif
+}
+
+const uint8_t *mango_module_missing(const mango_vm *vm) {
+  if (!vm || vm->modules_imported >= vm->modules_created) {
+    return NULL;
+  }
+
+#if !defined(MANGO_LAZY_IMPORT)
+  mango_module *module = _mango_get_module(vm, vm->modules_imported);
+#else
+  mango_module *module = NULL;
+  if (!_mango_started(vm)) {
+    for (uint_fast8_t i = 0; !module; i++) {
+      if (!_mango_get_module(vm, (uint8_t)i)->image) {
+        module = _mango_get_module(vm, (uint8_t)i);
+      }
+    }
+  } else if ((vm->init_flags & MISSING) != 0) {
+    module = _mango_get_module(vm, vm->missing);
+  } else {
+    return NULL;
+  }
+#endif
+  return (const uint8_t *)_mango_get_module_name(vm, module);
+}
+
+// Finds an imported module by name. A VM attached to a program looks it up in
+// the hash table of the program.
+static uint8_t _mango_find_module(const mango_vm *vm, const uint8_t *name) {
+#if defined(MANGO_PROGRAM)
+  if (vm->program) {
+    const mango_program *program = vm->program;
+    size_t slot = mango_export_hash((const mango_module_name *)name) &
+                  program->name_mask;
+    for (; program->names[slot] != INVALID_MODULE;
+         slot = (slot + 1) & program->name_mask) {
+      uint8_t index = program->names[slot];
+      if (memcmp(name, _mango_get_module_name(vm, _mango_get_module(vm, index)),
+                 sizeof(mango_module_name)) == 0) {
+        return index;
+      }
+    }
+    return INVALID_MODULE;
+  }
+#endif
+
+  for (uint_fast8_t i = 0; i < vm->modules_created; i++) {
+    const mango_module *module = _mango_get_module(vm, (uint8_t)i);
+    if (module->image &&
+        memcmp(name, _mango_get_module_name(vm, module),
+               sizeof(mango_module_name)) == 0) {
+      return (uint8_t)i;
+    }
+  }
+  return INVALID_MODULE;
+}
+
+uint32_t mango_module_export(const mango_vm *vm, const uint8_t *module,
+                             const uint8_t *name) {
+  if (!vm || !module || !name) {
+    return 0;
+  }
+
+  uint8_t index = _mango_find_module(vm, module);
+  if (index == INVALID_MODULE) {
+    return 0;
+  }
+
+  size_t count;
+  const mango_export_def *exports =
+      _mango_get_module_exports(_mango_get_module(vm, index), &count);
+  size_t mask = count - 1;
+  size_t slot = mango_export_hash((const mango_module_name *)name) & mask;
+
+  for (size_t j = 0; j < count; j++, slot = (slot + 1) & mask) {
+    uint16_t offset = FETCH(&exports[slot].offset, u16);
+    if (offset == 0) {
+      break;
+    }
+    if (memcmp(&exports[slot].name, name, sizeof(mango_module_name)) == 0) {
+      return ((stackval){.ftn = {0, index, offset}}).u32;
+    }
+  }
+
+  return 0;
+}
+
+void *mango_module_context(const mango_vm *vm) {
+  if (!vm || vm->sf.module >= vm->modules_created) {
+    return NULL;
+  }
+
+  return _mango_get_module(vm, vm->sf.module)->context;
+}
+
+mango_result mango_fusion_stats(const mango_vm *vm,
+                                mango_fusion_callback *callback,
+                                void *context) {
+  if (!vm || !callback) {
+    return MANGO_E_ARGUMENT_NULL;
+  }
+#if defined(MANGO_THREADED_CODE)
+  if (vm->modules_imported == 0 ||
+      vm->modules_imported != vm->modules_created) {
+    return MANGO_E_INVALID_OPERATION;
+  }
+
+  for (size_t i = 0; i < FUSION_COUNT; i++) {
+    uint32_t count = 0;
+
+    for (uint_fast8_t j = 0; j < vm->modules_created; j++) {
+      const mango_module *module = _mango_get_module(vm, (uint8_t)j);
+      if (cell_is_null(module->code)) {
+        return MANGO_E_INVALID_OPERATION;
+      }
+
+      const cell *code = _mango_get_module_code(vm, module);
+      count += code[code[0].info.functions + code[0].info.function_count + i]
+                   .u32;
+    }
+
+    if (count != 0) {
+      callback(context, _mango_superinstruction_names[i], count);
+    }
+  }
+
+  return MANGO_E_SUCCESS;
+#else
+  (void)context;
+  return MANGO_E_NOT_SUPPORTED;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+mango_vm *mango_clone(const mango_vm *vm, void *address, size_t heap_size,
+                      void *context) {
+  if (!vm || !address) {
+    return NULL;
+  }
+#if UINTPTR_MAX == UINT64_MAX
+  if (heap_size < vm->heap_used || heap_size > UINT32_MAX ||
+      (((uintptr_t)address ^ (uintptr_t)vm) & (__alignof(cell) - 1)) != 0 ||
+      _mango_calling(vm)) {
+    return NULL;
+  }
+
+  mango_vm *clone = (mango_vm *)memcpy(address, vm, vm->heap_used);
+  clone->heap_size = (uint32_t)heap_size;
+  clone->init_flags &= (uint8_t)~(MAPPED | CHECKPOINT);
+  clone->context = context;
+
+#if defined(MANGO_FILE_CACHE)
+  _mango_count_files(clone, 1);
+#endif
+#if defined(MANGO_JIT)
+  _mango_jit_reset(clone);
+  _mango_jit_attach(clone);
+#endif
+
+  return clone;
+#else
+  (void)heap_size;
+  (void)context;
+  return NULL;
+#endif
+}
+
+#if defined(MANGO_SNAPSHOT)
+
+#define SNAPSHOT_MAGIC 0x50534E4D
+
+typedef struct snapshot_trailer {
+  uint32_t magic;
+  uint32_t build;
+  uint32_t heap_used;
+  uint32_t heap_size;
+} snapshot_trailer;
+
+static uint32_t _mango_hash(const uint8_t *data, size_t size) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < size; i++) {
+    hash = (hash ^ data[i]) * 16777619u;
+  }
+  return hash;
+}
+
+// A snapshot can only be restored by a library built with the same options.
+static uint32_t _mango_snapshot_build(void) {
+  const uint32_t config[] = {
+      MANGO_VERSION_MAJOR,
+      MANGO_VERSION_MINOR,
+      (uint32_t)mango_features(),
+      (uint32_t)sizeof(mango_vm),
+      (uint32_t)sizeof(mango_module),
+      (uint32_t)sizeof(cell),
+#if defined(MANGO_SYSCALL_HANDLERS)
+      MANGO_SYSCALL_TABLE_SIZE,
+#endif
+#if defined(MANGO_THREADED_CODE)
+      0x100,
+      (uint32_t)OPCODE_COUNT,
+      (uint32_t)SUPERINSTRUCTION_COUNT,
+#endif
+#if defined(MANGO_TOS_CACHE)
+      0x200,
+#endif
+#if defined(MANGO_VERIFY)
+      0x300,
+#endif
+#if defined(MANGO_CALL_CACHE)
+      0x400,
+      MANGO_CALL_CACHE_SIZE,
+#endif
+#if defined(MANGO_JIT)
+      0x500,
+#endif
+  };
+  return _mango_hash((const uint8_t *)config, sizeof(config));
+}
+
+// Writes all of the data, continuing after partial writes and interrupts.
+static int _mango_write(int fd, const void *data, size_t size) {
+  const uint8_t *bytes = (const uint8_t *)data;
+  while (size != 0) {
+    ssize_t written = write(fd, bytes, size);
+    if (written < 0 && errno != EINTR) {
+      return 0;
+    }
+    if (written > 0) {
+      bytes += written;
+      size -= (size_t)written;
+    }
+  }
+  return 1;
+}
+
+#if defined(MANGO_THREADED_CODE)
+// Handlers are stored as their index in the dispatch table and the data of
+// MAKEARR as an offset into the image.
+static int _mango_relocate(const mango_module *module, cell *code,
+                           const void *const *handlers, int restore) {
+  const cell *functions = code + code[0].info.functions;
+  size_t next = 0;
+  size_t cells;
+
+#if defined(MANGO_NO_REFS)
+  (void)module;
+#endif
+
+  for (size_t index = HALT_IP; index < code[0].info.functions;
+       index += cells) {
+    if (next < code[0].info.function_count &&
+        functions[next].entry.code == index + 1) {
+      next++;
+      cells = 1;
+      continue;
+    }
+
+    int kind;
+    if (restore) {
+      if (code[index].u32 >= OPCODE_COUNT + SUPERINSTRUCTION_COUNT) {
+        return 0;
+      }
+      kind = (int)code[index].u32;
+      code[index].handler = handlers[kind];
+    } else {
+      kind = _mango_handler_kind(handlers, code[index].handler);
+      if (kind < 0) {
+        return 0;
+      }
+      code[index].u32 = (uint32_t)kind;
+    }
+
+#if !defined(MANGO_NO_REFS)
+    if (kind == MAKEARR) {
+      if (restore) {
+        code[index + 3].data = module->image + code[index + 3].u32;
+      } else {
+        code[index + 3].u32 = (uint32_t)(code[index + 3].data - module->image);
+      }
+    }
+#endif
+
+    if (kind < (int)OPCODE_COUNT) {
+      uint8_t op = (uint8_t)kind;
+      cells = _mango_instruction_cells(&op, 0);
+    } else {
+      cells = _mango_superinstruction_cells[kind - (int)OPCODE_COUNT];
+    }
+  }
+
+  return 1;
+}
+#endif
+
+static mango_result _mango_snapshot_prepare(mango_vm *copy,
+                                            const mango_vm *vm) {
+  copy->init_flags &= (uint8_t)~(MAPPED | CHECKPOINT);
+  memset(copy->_context, 0, sizeof(copy->_context));
+
+  for (uint_fast8_t i = 0; i < vm->modules_created; i++) {
+    const mango_module *original = _mango_get_module(vm, (uint8_t)i);
+    mango_module *module = _mango_get_module(copy, (uint8_t)i);
+
+#if defined(MANGO_THREADED_CODE)
+    const void *const *handlers;
+    _mango_interpret(NULL, &handlers);
+
+    cell *code = (cell *)cell_as_ptr(copy, module->code);
+    if (!_mango_relocate(original, code, handlers, 0)) {
+      return MANGO_E_INVALID_OPERATION;
+    }
+#endif
+
+    uint32_t hash = _mango_hash(original->image, original->image_size);
+    memset(module->_image, 0, sizeof(module->_image));
+    memcpy(module->_image, &hash, sizeof(hash));
+    memset(module->_context, 0, sizeof(module->_context));
+#if defined(MANGO_NATIVE_MODULES)
+    memset(module->_native, 0, sizeof(module->_native));
+    module->_native[0] = original->native != NULL;
+#endif
+  }
+
+#if defined(MANGO_SYSCALL_HANDLERS)
+  if (!syscall_entry_is_null(copy->syscalls)) {
+    memset(syscall_entry_as_ptr(copy, copy->syscalls), 0,
+           MANGO_SYSCALL_TABLE_SIZE * sizeof(syscall_entry));
+  }
+#endif
+
+#if defined(MANGO_CALL_CACHE)
+  if (!call_site_is_null(copy->calls)) {
+    memset(call_site_as_ptr(copy, copy->calls), 0,
+           MANGO_CALL_CACHE_SIZE * sizeof(call_site));
+  }
+#endif
+
+#if defined(MANGO_JIT)
+  _mango_jit_reset(copy);
+#endif
+
+  return MANGO_E_SUCCESS;
+}
+
+// Maps a heap image copy-on-write at the start of an otherwise zeroed region.
+static mango_vm *_mango_map(int fd, size_t heap_used, size_t heap_size) {
+  void *base = mmap(NULL, heap_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED) {
+    return NULL;
+  }
+  if (mmap(base, heap_used, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+           fd, 0) == MAP_FAILED) {
+    munmap(base, heap_size);
+    return NULL;
+  }
+  return (mango_vm *)base;
+}
+
+static int _mango_snapshot_link(mango_vm *vm,
+                                const mango_snapshot_module *modules,
+                                size_t count, void *context) {
+  if (vm->version != MANGO_VERSION_MAJOR || vm->modules_created != count ||
+      vm->modules_imported != count) {
+    return 0;
+  }
+
+  for (uint_fast8_t i = 0; i < vm->modules_created; i++) {
+    mango_module *module = _mango_get_module(vm, (uint8_t)i);
+    uint32_t hash;
+    memcpy(&hash, module->_image, sizeof(hash));
+
+    if (!modules[i].image ||
+        _mango_hash(modules[i].image, module->image_size) != hash) {
+      return 0;
+    }
+#if defined(MANGO_NATIVE_MODULES)
+    if ((modules[i].native != NULL) != module->_native[0]) {
+      return 0;
+    }
+    module->native = modules[i].native;
+#endif
+
+    module->image = modules[i].image;
+    module->context = modules[i].context;
+
+#if defined(MANGO_THREADED_CODE)
+    const void *const *handlers;
+    _mango_interpret(NULL, &handlers);
+
+    if (!_mango_relocate(module, (cell *)cell_as_ptr(vm, module->code),
+                         handlers, 1)) {
+      return 0;
+    }
+#endif
+  }
+
+  vm->init_flags |= MAPPED;
+  vm->context = context;
+
+#if defined(MANGO_FILE_CACHE)
+  _mango_count_files(vm, 1);
+#endif
+#if defined(MANGO_JIT)
+  _mango_jit_attach(vm);
+#endif
+
+  return 1;
+}
+
+#endif
+
+mango_result mango_snapshot_save(const mango_vm *vm, const char *path) {
+  if (!vm || !path) {
+    return MANGO_E_ARGUMENT_NULL;
+  }
+#if defined(MANGO_SNAPSHOT)
+  if (vm->modules_imported == 0 ||
+      vm->modules_imported != vm->modules_created ||
+      vm->init_head != INVALID_MODULE || _mango_calling(vm)) {
+    return MANGO_E_INVALID_OPERATION;
+  }
+  if (((uintptr_t)vm & (__alignof(cell) - 1)) != 0) {
+    return MANGO_E_NOT_SUPPORTED;
+  }
+#if defined(MANGO_PROGRAM)
+  if (vm->program) {
+    return MANGO_E_NOT_SUPPORTED;
+  }
+#endif
+
+  mango_vm *copy = (mango_vm *)malloc(vm->heap_used);
+  if (!copy) {
+    return MANGO_E_OUT_OF_MEMORY;
+  }
+  memcpy(copy, vm, vm->heap_used);
+
+  mango_result result = _mango_snapshot_prepare(copy, vm);
+  if (result == MANGO_E_SUCCESS) {
+    snapshot_trailer trailer = {SNAPSHOT_MAGIC, _mango_snapshot_build(),
+                                vm->heap_used, vm->heap_size};
+
+    // A file that was not written completely is removed rather than left
+    // for mango_snapshot_restore to reject.
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      result = MANGO_E_INVALID_OPERATION;
+    } else {
+      if (!_mango_write(fd, copy, vm->heap_used) ||
+          !_mango_write(fd, &trailer, sizeof(trailer))) {
+        result = MANGO_E_INVALID_OPERATION;
+      }
+      if (close(fd) != 0) {
+        result = MANGO_E_INVALID_OPERATION;
+      }
+      if (result != MANGO_E_SUCCESS) {
+        unlink(path);
+      }
+    }
+  }
+
+  free(copy);
+  return result;
+#else
+  return MANGO_E_NOT_SUPPORTED;
+#endif
+}
+
+mango_vm *mango_snapshot_restore(const char *path,
+                                 const mango_snapshot_module *modules,
+                                 size_t count, void *context) {
+  if (!path || (!modules && count != 0)) {
+    return NULL;
+  }
+#if defined(MANGO_SNAPSHOT)
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  mango_vm *vm = NULL;
+  snapshot_trailer trailer;
+  struct stat st;
+
+  if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(trailer) &&
+      pread(fd, &trailer, sizeof(trailer), st.st_size - sizeof(trailer)) ==
+          (ssize_t)sizeof(trailer) &&
+      trailer.magic == SNAPSHOT_MAGIC &&
+      trailer.build == _mango_snapshot_build() &&
+      st.st_size == (off_t)trailer.heap_used + (off_t)sizeof(trailer) &&
+      trailer.heap_used >= sizeof(mango_vm) &&
+      trailer.heap_used <= trailer.heap_size) {
+    vm = _mango_map(fd, trailer.heap_used, trailer.heap_size);
+  }
+
+  close(fd);
+
+  if (vm && (vm->heap_used != trailer.heap_used ||
+             vm->heap_size != trailer.heap_size ||
+             !_mango_snapshot_link(vm, modules, count, context))) {
+    munmap(vm, trailer.heap_size);
+    vm = NULL;
+  }
+  return vm;
+#else
+  (void)context;
+  return NULL;
+#endif
+}
+
+#if defined(MANGO_SNAPSHOT) && defined(__linux__)
+struct mango_template {
+  int fd;
+  uint32_t heap_used;
+};
+#endif
+
+mango_template *mango_template_create(const mango_vm *vm) {
+  if (!vm) {
+    return NULL;
+  }
+#if defined(MANGO_SNAPSHOT) && defined(__linux__)
+  if (_mango_calling(vm) ||
+      ((uintptr_t)vm & (__alignof(cell) - 1)) != 0) {
+    return NULL;
+  }
+
+  mango_template *source = (mango_template *)malloc(sizeof(mango_template));
+  mango_vm *copy = (mango_vm *)malloc(vm->heap_used);
+  int fd = memfd_create("mango", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+  int success = source && copy && fd >= 0;
+  if (success) {
+    memcpy(copy, vm, vm->heap_used);
+    copy->init_flags =
+        (uint8_t)((copy->init_flags & ~CHECKPOINT) | MAPPED);
+    memset(copy->_context, 0, sizeof(copy->_context));
+#if defined(MANGO_JIT)
+    _mango_jit_reset(copy);
+#endif
+    success = _mango_write(fd, copy, vm->heap_used) &&
+              fcntl(fd, F_ADD_SEALS,
+                    F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE) == 0;
+  }
+
+  free(copy);
+  if (!success) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    free(source);
+    return NULL;
+  }
+
+#if defined(MANGO_FILE_CACHE)
+  _mango_count_files(vm, 1);
+#endif
+
+  *source = (mango_template){fd, vm->heap_used};
+  return source;
+#else
+  return NULL;
+#endif
+}
+
+mango_vm *mango_template_clone(const mango_template *source,
+                               size_t heap_size, void *context) {
+  if (!source) {
+    return NULL;
+  }
+#if defined(MANGO_SNAPSHOT) && defined(__linux__)
+  if (heap_size < source->heap_used || heap_size > UINT32_MAX) {
+    return NULL;
+  }
+
+  mango_vm *vm = _mango_map(source->fd, source->heap_used, heap_size);
+  if (vm) {
+    vm->heap_size = (uint32_t)heap_size;
+    vm->context = context;
+#if defined(MANGO_FILE_CACHE)
+    _mango_count_files(vm, 1);
+#endif
+#if defined(MANGO_JIT)
+    _mango_jit_attach(vm);
+#endif
+  }
+  return vm;
+#else
+  (void)heap_size;
+  (void)context;
+  return NULL;
+#endif
+}
+
+void mango_template_destroy(mango_template *source) {
+#if defined(MANGO_SNAPSHOT) && defined(__linux__)
+  if (source) {
+#if defined(MANGO_FILE_CACHE)
+    void *vm = mmap(NULL, source->heap_used, PROT_READ, MAP_PRIVATE,
+                    source->fd, 0);
+    if (vm != MAP_FAILED) {
+      _mango_count_files((const mango_vm *)vm, -1);
+      munmap(vm, source->heap_used);
+    }
+#endif
+    close(source->fd);
+    free(source);
+  }
+#else
+  (void)source;
+#endif
+}
+
+// A checkpoint belongs to the mapping of the VM that took it. Clones,
+// templates and snapshots of the VM start without one.
+mango_result mango_checkpoint(mango_vm *vm) {
+  if (!vm) {
+    return MANGO_E_ARGUMENT_NULL;
+  }
+#if defined(MANGO_SNAPSHOT) && defined(__linux__)
+  if ((vm->init_flags & MAPPED) == 0) {
+    return MANGO_E_NOT_SUPPORTED;
+  }
+  if (_mango_calling(vm)) {
+    return MANGO_E_INVALID_OPERATION;
+  }
+
+  int fd = memfd_create("mango", MFD_CLOEXEC);
+  if (fd < 0) {
+    return MANGO_E_OUT_OF_MEMORY;
+  }
+
+  // Once the heap is backed by a private mapping of its own copy, the kernel
+  // keeps every page written after this point apart from the copy.
+  uint8_t init_flags = vm->init_flags;
+  vm->init_flags |= CHECKPOINT;
+
+  mango_result result = MANGO_E_SUCCESS;
+  if (!_mango_write(fd, vm, vm->heap_used) ||
+      mmap(vm, vm->heap_used, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+           fd, 0) == MAP_FAILED) {
+    vm->init_flags = init_flags;
+    result = MANGO_E_OUT_OF_MEMORY;
+  }
+
+  close(fd);
+  return result;
+#else
+  return MANGO_E_NOT_SUPPORTED;
+#endif
+}
+
+mango_result mango_reset(mango_vm *vm) {
+  if (!vm) {
+    return MANGO_E_ARGUMENT_NULL;
+  }
+#if defined(MANGO_SNAPSHOT) && defined(__linux__)
+  if ((vm->init_flags & (MAPPED | CHECKPOINT)) != (MAPPED | CHECKPOINT) ||
+      _mango_calling(vm)) {
+    return MANGO_E_INVALID_OPERATION;
   }
 
-  return _mango_get_module(vm, vm->sf.module)->context;
+#if defined(MANGO_FILE_CACHE)
+  // Modules imported since the checkpoint give up their files.
+  pthread_mutex_lock(&_mango_files_lock);
+  _mango_add_files(vm, -1);
+#endif
+  // Dropping the written pages brings back those of the checkpoint and zeros
+  // the part of the heap that was allocated after it.
+  int failed = madvise(vm, vm->heap_size, MADV_DONTNEED) != 0;
+#if defined(MANGO_FILE_CACHE)
+  _mango_add_files(vm, 1);
+  pthread_mutex_unlock(&_mango_files_lock);
+#endif
+  return failed ? MANGO_E_INVALID_OPERATION : MANGO_E_SUCCESS;
+#else
+  return MANGO_E_NOT_SUPPORTED;
+#endif
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-#define VISITED 1
+mango_result mango_run(mango_vm *vm) { return mango_run_budget(vm, 0); }
 
-static mango_result _mango_interpret(mango_vm *vm);
+// A program stopped on a call into a module that has not been imported yet
+// can be resumed once the module is imported.
+static mango_result _mango_stop(mango_vm *vm, mango_result result) {
+  vm->fuel = 0;
+#if defined(MANGO_LAZY_IMPORT)
+  if (result == MANGO_E_MODULE_MISSING) {
+    vm->init_flags |= MISSING;
+  }
+#endif
+  return vm->result = result;
+}
 
-mango_result mango_run(mango_vm *vm) {
+mango_result mango_run_budget(mango_vm *vm, uint32_t budget) {
   if (!vm) {
     return MANGO_E_ARGUMENT_NULL;
   }
-  if (vm->modules_imported == 0 ||
-      vm->modules_imported != vm->modules_created) {
+#if defined(MANGO_NO_BUDGET)
+  if (budget != 0) {
+    return MANGO_E_NOT_SUPPORTED;
+  }
+#endif
+  if (vm->modules_imported == 0) {
     return MANGO_E_INVALID_OPERATION;
   }
+#if !defined(MANGO_LAZY_IMPORT)
+  if (vm->modules_imported != vm->modules_created) {
+    return MANGO_E_INVALID_OPERATION;
+  }
+#endif
   if (vm->result > MANGO_E_SUCCESS && vm->result < MANGO_E_BREAKPOINT) {
     return vm->result;
   }
   if (vm->sp != vm->sp_expected) {
     return vm->result = MANGO_E_STACK_IMBALANCE;
   }
+  if (!_mango_create_call_cache(vm)) {
+    return MANGO_E_OUT_OF_MEMORY;
+  }
+
+  // The budget holds only while the program runs. Calls made while it is
+  // stopped are not limited; calls made from its system call handlers are.
+  vm->fuel = budget;
+#if defined(MANGO_LAZY_IMPORT)
+  vm->init_flags &= (uint8_t)~MISSING;
+#endif
 
-  mango_result result = _mango_interpret(vm);
+  mango_result result = _mango_interpret(vm, NULL);
   if (result != MANGO_E_SUCCESS) {
-    return vm->result = result;
+    return _mango_stop(vm, result);
   }
 
   mango_module *modules = _mango_get_modules(vm);
@@ -585,7 +4904,7 @@ mango_result mango_run(mango_vm *vm) {
         uint8_t p = imports[i];
         mango_module *import = &modules[p];
 
-        if ((import->init_flags & VISITED) == 0) {
+        if ((import->init_flags & VISITED) == 0 && import->image) {
           if (head != p) {
             if (import->init_prev != INVALID_MODULE) {
               modules[import->init_prev].init_next = import->init_next;
@@ -603,8 +4922,7 @@ mango_result mango_run(mango_vm *vm) {
         }
       }
     } else {
-      vm->sf = (stack_frame){0, head,
-                             (uint16_t)offsetof(mango_module_def, entry_point)};
+      vm->sf = (stack_frame){0, head, (uint16_t)ENTRY_IP};
 
       head = module->init_next;
       vm->init_head = head;
@@ -614,18 +4932,289 @@ mango_result mango_run(mango_vm *vm) {
         modules[head].init_prev = INVALID_MODULE;
       }
 
-      result = _mango_interpret(vm);
+      result = _mango_interpret(vm, NULL);
       if (result != MANGO_E_SUCCESS) {
-        return vm->result = result;
+        return _mango_stop(vm, result);
       }
     }
   }
 
+  vm->fuel = 0;
   return MANGO_E_SUCCESS;
 }
 
+// A call from the host enters a function directly, once all modules have
+// been initialized. The function returns to the HALT of an entry point
+// through a frame that pops its results; HALT checks that the stack is back
+// at the base of the call. A call can be made while the program is stopped
+// or from within a system call handler, with the frames of the call pushed
+// on top of those of the program. Functions whose calls are not checked for
+// stack overflow are never called through a function token by the program
+// itself and cannot be called this way either.
+
+mango_result mango_call(mango_vm *vm, uint32_t function,
+                        const union mango_value *arguments,
+                        size_t argument_count, union mango_value *results,
+                        size_t result_count) {
+  return mango_call_batch(vm, function, arguments, argument_count, results,
+                          result_count, 1);
+}
+
+mango_result mango_call_batch(mango_vm *vm, uint32_t function,
+                              const union mango_value *arguments,
+                              size_t argument_count,
+                              union mango_value *results, size_t result_count,
+                              size_t count) {
+  if (!vm || (!arguments && argument_count != 0 && count != 0) ||
+      (!results && result_count != 0 && count != 0)) {
+    return MANGO_E_ARGUMENT_NULL;
+  }
+  if (vm->modules_imported == 0 ||
+#if !defined(MANGO_LAZY_IMPORT)
+      vm->modules_imported != vm->modules_created ||
+#else
+      (vm->init_flags & MISSING) != 0 ||
+#endif
+      vm->init_head != INVALID_MODULE) {
+    return MANGO_E_INVALID_OPERATION;
+  }
+  if (vm->result > MANGO_E_SUCCESS && vm->result < MANGO_E_BREAKPOINT) {
+    return vm->result;
+  }
+  if (vm->sp != vm->sp_expected) {
+    return MANGO_E_STACK_IMBALANCE;
+  }
+
+  stackval token = {.u32 = function};
+  if (token.ftn.module >= vm->modules_created) {
+    return MANGO_E_ARGUMENT;
+  }
+
+  const mango_module *module = _mango_get_module(vm, token.ftn.module);
+  size_t offset = token.ftn.offset;
+#if defined(MANGO_LAZY_IMPORT)
+  if (!module->image) {
+    vm->missing = token.ftn.module;
+    return MANGO_E_MODULE_MISSING;
+  }
+#endif
+#if !defined(MANGO_THREADED_CODE)
+  if (offset < sizeof(mango_module_def) ||
+      offset + sizeof(mango_func_def) >= module->image_size) {
+    return MANGO_E_ARGUMENT;
+  }
+  const mango_func_def *f = (const mango_func_def *)(module->image + offset);
+  size_t ip = offset + sizeof(mango_func_def);
+#else
+  const cell *code = _mango_find_function(vm, module, (uint16_t)offset);
+  if (!code || (code[-1].func.flags & INTERNAL) != 0) {
+    return MANGO_E_ARGUMENT;
+  }
+  const function_header *f = &code[-1].func;
+  size_t ip = (size_t)(code - _mango_get_module_code(vm, module));
+#endif
+
+  if (argument_count != f->arg_count || result_count > UINT8_MAX) {
+    return MANGO_E_ARGUMENT;
+  }
+
+  uint16_t rp = vm->rp;
+  uint16_t sp = vm->sp;
+  if (sp - rp < (ptrdiff_t)argument_count + 1 + f->loc_count + f->max_stack) {
+    return MANGO_E_STACK_OVERFLOW;
+  }
+
+  return _mango_invoke(vm, token.ftn.module, ip, f->arg_count, f->loc_count,
+                       arguments, results, result_count, count);
+}
+
 int mango_syscall(const mango_vm *vm) { return vm ? vm->syscall : 0; }
 
+// A ring lets a program queue many requests to the host and yield only once
+// for all of them. The ring header is followed by `size` requests and `size`
+// completions. The program writes requests at submission_tail, advances it
+// and issues a system call of the host's choosing. The host then calls
+// mango_ring_process, which passes each request to a function and posts its
+// result as a completion at completion_tail, for the program to consume from
+// completion_head. All indices wrap around modulo 2^32.
+
+mango_ring *mango_ring_create(mango_vm *vm, uint32_t size) {
+  if (size == 0 || (size & (size - 1)) != 0 || size > UINT16_MAX + 1u) {
+    return NULL;
+  }
+
+  mango_ring *ring = (mango_ring *)mango_heap_alloc(
+      vm, 1,
+      sizeof(mango_ring) +
+          size * (sizeof(mango_ring_request) + sizeof(mango_ring_completion)),
+      __alignof(mango_ring), MANGO_ALLOC_ZERO_MEMORY);
+  if (ring) {
+    ring->size = size;
+  }
+  return ring;
+}
+
+uint32_t mango_ring_process(mango_vm *vm, mango_ring *ring,
+                            mango_ring_function *function, void *context) {
+  if (!vm || !ring || !function || mango_heap_ref(vm, ring) == 0) {
+    return 0;
+  }
+
+  // The program can write to the ring, so the size is checked again.
+  uint32_t size = ring->size;
+  if (size == 0 || (size & (size - 1)) != 0 || size > UINT16_MAX + 1u ||
+      (size_t)((uintptr_t)vm + vm->heap_size - (uintptr_t)ring) <
+          sizeof(mango_ring) + size * (sizeof(mango_ring_request) +
+                                       sizeof(mango_ring_completion))) {
+    return 0;
+  }
+
+  mango_ring_request *requests = (mango_ring_request *)(ring + 1);
+  mango_ring_completion *completions =
+      (mango_ring_completion *)(requests + size);
+  uint32_t count = 0;
+
+  while (ring->submission_head != ring->submission_tail &&
+         ring->completion_tail - ring->completion_head < size) {
+    mango_ring_request request = requests[ring->submission_head & (size - 1)];
+    ring->submission_head++;
+
+    completions[ring->completion_tail & (size - 1)] =
+        (mango_ring_completion){request.user_data,
+                                function(context, &request)};
+    ring->completion_tail++;
+    count++;
+  }
+
+  return count;
+}
+
+// With MANGO_SYSCALL_HANDLERS, system calls with a registered handler are
+// handled by calling the handler directly from the interpreter, without
+// leaving mango_run. A handler finds the arguments at sp and leaves the
+// results so that the stack is adjusted by the declared number of values. It
+// can return MANGO_E_SYSTEM_CALL to leave the system call to the host after
+// all. With MANGO_NESTED_CALLS, a handler can call back into the program with
+// mango_call; the values below sp that make up the results are left alone.
+//
+// With MANGO_SYSCALLS defined as the name of a file that lists handlers as
+//
+//   SYSCALL_HANDLER(Number, Adjustment, Function)
+//
+// in the style of mango_opcodes.inc, these system calls are bound at compile
+// time instead. The interpreter calls the functions directly with the context
+// of the VM, so they can be inlined when defined in a header included by that
+// file or when building with link-time optimization. They take precedence
+// over registered handlers.
+
+#if defined(MANGO_SYSCALLS)
+#define SYSCALL_HANDLER(Number, Adjustment, Function)                          \
+  mango_syscall_function Function;
+#include MANGO_SYSCALLS
+#undef SYSCALL_HANDLER
+#endif
+
+mango_result mango_syscall_register(mango_vm *vm, int syscall, int adjustment,
+                                    mango_syscall_function *function,
+                                    void *context) {
+  if (!vm) {
+    return MANGO_E_ARGUMENT_NULL;
+  }
+#if defined(MANGO_SYSCALL_HANDLERS)
+  if (syscall < 0 || syscall >= MANGO_SYSCALL_TABLE_SIZE ||
+      adjustment < INT8_MIN || adjustment > INT8_MAX) {
+    return MANGO_E_ARGUMENT;
+  }
+
+  if (syscall_entry_is_null(vm->syscalls)) {
+    if (!function) {
+      return MANGO_E_SUCCESS;
+    }
+
+    syscall_entry *syscalls = (syscall_entry *)mango_heap_alloc(
+        vm, MANGO_SYSCALL_TABLE_SIZE, sizeof(syscall_entry),
+        __alignof(syscall_entry), MANGO_ALLOC_ZERO_MEMORY);
+    if (!syscalls) {
+      return MANGO_E_OUT_OF_MEMORY;
+    }
+    vm->syscalls = syscall_entry_as_ref(vm, syscalls);
+  }
+
+  syscall_entry_as_ptr(vm, vm->syscalls)[syscall] =
+      (syscall_entry){{function}, {context}, (int8_t)adjustment};
+  return MANGO_E_SUCCESS;
+#else
+  (void)syscall;
+  (void)adjustment;
+  (void)function;
+  (void)context;
+  return MANGO_E_NOT_SUPPORTED;
+#endif
+}
+
+// Functions of a module imported with mango_module_import_native run as
+// ahead-of-time compiled C code. Such a function is entered at any of its
+// instructions when it is called or returned to, and hands control back to
+// the interpreter at instructions it does not implement, so the VM state
+// stays the same as when interpreting.
+
+#if defined(MANGO_NATIVE_MODULES)
+static mango_native_function *
+_mango_native_function(const mango_module *module, size_t offset) {
+  const mango_native_module *native = module->native;
+  size_t lo = 0;
+  size_t hi = native->function_count;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (native->offsets[mid] < offset) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo != 0 ? native->functions[lo - 1] : NULL;
+}
+#endif
+
+// With MANGO_CALL_CACHE, the targets of CALL and CALLI are looked up in a
+// direct-mapped cache keyed by call site (CALL) or function token (CALLI),
+// which holds everything needed to enter the callee. Entries are filled the
+// first time a call site is executed.
+
+#if defined(MANGO_CALL_CACHE)
+static int _mango_resolve_call_site(const mango_vm *vm, call_site *site,
+                                    uint32_t key, uint8_t module,
+                                    uint16_t offset) {
+  const mango_module *callee = _mango_get_module(vm, module);
+#if !defined(MANGO_THREADED_CODE)
+  const mango_func_def *f = (const mango_func_def *)(callee->image + offset);
+
+  *site = (call_site){key,          module,       f->arg_count,
+                      f->loc_count, f->max_stack, {callee->image},
+#if defined(MANGO_NATIVE_MODULES)
+                      {callee->native}
+#endif
+  };
+#else
+  const cell *code = _mango_find_function(vm, callee, offset);
+  if (!code) {
+    return 0;
+  }
+  const function_header *f = &code[-1].func;
+
+  *site = (call_site){key,
+                      module,
+                      f->arg_count,
+                      f->loc_count,
+                      f->max_stack,
+                      (uint32_t)(code - _mango_get_module_code(vm, callee))};
+#endif
+  return 1;
+}
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////
 
 #pragma GCC diagnostic push
@@ -634,13 +5223,49 @@ int mango_syscall(const mango_vm *vm) { return vm ? vm->syscall : 0; }
 #pragma clang diagnostic ignored "-Wgnu-label-as-value"
 #pragma clang diagnostic ignored "-Wunused-macros"
 #pragma clang diagnostic ignored "-Wfloat-equal"
+#pragma clang diagnostic ignored "-Wgnu-designator"
+
+#if defined(MANGO_TOS_CACHE)
+#pragma GCC diagnostic ignored "-Woverride-init"
+#pragma clang diagnostic ignored "-Winitializer-overrides"
+#endif
 
 #pragma region macros
 
-#if !defined(__EDG__)
-#define NEXT goto *dispatch_table[*ip]
+#if defined(__EDG__)
+#define DISPATCH goto invalid
+#elif !defined(MANGO_THREADED_CODE)
+#define DISPATCH goto *dispatch_table[*ip]
+#else
+#define DISPATCH goto *ip->handler
+#endif
+
+#if !defined(MANGO_TOS_CACHE)
+#define NEXT DISPATCH
 #else
-#define NEXT goto invalid
+#define NEXT                                                                   \
+  do {                                                                         \
+    tos = sp[0];                                                               \
+    DISPATCH;                                                                  \
+  } while (0)
+#endif
+
+#if !defined(MANGO_THREADED_CODE)
+#define OPERAND(Offset, Index, Type) FETCH(ip + (Offset), Type)
+#define LENGTH(Bytes, Cells) (Bytes)
+#define CODE(Module) ((Module)->image)
+#define IS(Address, OpCode) (*(Address) == (OpCode))
+#else
+#define OPERAND(Offset, Index, Type) (ip[Index].CELL_##Type)
+#define CELL_i8 i32
+#define CELL_u8 u32
+#define CELL_i16 i32
+#define CELL_u16 u32
+#define CELL_i32 i32
+#define CELL_u32 u32
+#define LENGTH(Bytes, Cells) (Cells)
+#define CODE(Module) _mango_get_module_code(vm, Module)
+#define IS(Address, OpCode) ((Address)->handler == dispatch_table[OpCode])
 #endif
 
 #define INVALID goto invalid
@@ -658,6 +5283,162 @@ int mango_syscall(const mango_vm *vm) { return vm ? vm->syscall : 0; }
   if (Condition)                                                               \
   goto done
 
+#if defined(MANGO_LAZY_IMPORT)
+#define REQUIRE_MODULE(Module)                                                 \
+  do {                                                                         \
+    if (!_mango_get_module(vm, (Module))->image) {                             \
+      vm->missing = (Module);                                                  \
+      RETURN(MANGO_E_MODULE_MISSING);                                          \
+    }                                                                          \
+  } while (0)
+#else
+#define REQUIRE_MODULE(Module)                                                 \
+  do {                                                                         \
+  } while (0)
+#endif
+
+// Calls and taken backward branches consume fuel. Without a budget, the
+// counter wraps around and out_of_fuel resumes immediately. MANGO_NO_BUDGET
+// compiles the counting out of the interpreter; mango_run_budget then only
+// accepts a budget of zero.
+#if !defined(MANGO_NO_BUDGET)
+#define CONSUME_FUEL                                                           \
+  if (--fuel == 0)                                                             \
+  goto out_of_fuel
+
+#define CONSUME_FUEL_IF(Condition)                                             \
+  if ((Condition) && --fuel == 0)                                              \
+  goto out_of_fuel
+#else
+#define CONSUME_FUEL
+#define CONSUME_FUEL_IF(Condition)
+#endif
+
+#if !defined(MANGO_JIT)
+#define JIT_CALL(Header)
+#define JIT_BACKEDGE(Condition)
+#define JIT_RETURN
+#else
+#define JIT_CALL(Header)                                                       \
+  if (jit && (((Header)->flags & TIER_MASK) == TIER_NATIVE ||                  \
+              (((Header)->flags & TIER_MASK) == TIER_INTERPRETED &&            \
+               ++((function_header *)(Header))->hotness >=                     \
+                   MANGO_JIT_THRESHOLD)))                                      \
+  goto jit_call
+
+#define JIT_BACKEDGE(Condition)                                                \
+  if ((Condition) && jit && --samples == 0)                                    \
+  goto jit_backedge
+
+#define JIT_RETURN                                                             \
+  if (jit)                                                                     \
+  goto jit_return
+#endif
+
+// The frame of the running function lives in locals rather than in a
+// stack_frame. The pop count needs a full register: packed next to the module
+// byte, GCC merges the dispatch jumps of all handlers into one.
+#define FRAME(Ip)                                                              \
+  (stack_frame) { (uint8_t)pop, current, (uint16_t)((Ip)-bp) }
+
+#if defined(MANGO_NATIVE_MODULES)
+#define NATIVE_ENTER(Module)                                                   \
+  if ((Module)->native)                                                        \
+  goto native_enter
+#else
+#define NATIVE_ENTER(Module)
+#endif
+
+#if defined(MANGO_TOS_CACHE)
+
+#define CACHED_OPCODES(X)                                                      \
+  X(NOP) X(POP_X32) X(DUP_X32) X(LDLOC_X32) X(STLOC_X32) X(LDC_I32_M1)         \
+  X(LDC_I32_0) X(LDC_I32_1) X(LDC_I32_2) X(LDC_I32_3) X(LDC_I32_4)             \
+  X(LDC_I32_5) X(LDC_I32_6) X(LDC_I32_7) X(LDC_I32_8) X(LDC_I32_S)             \
+  X(LDC_X32) X(ADD_I32) X(SUB_I32) X(MUL_I32) X(NEG_I32) X(SHL_I32)            \
+  X(SHR_I32) X(SHR_I32_UN) X(AND_I32) X(OR_I32) X(XOR_I32) X(NOT_I32)          \
+  X(CEQ_I32) X(CNE_I32) X(CGT_I32) X(CGT_I32_UN) X(CGE_I32) X(CGE_I32_UN)      \
+  X(CLT_I32) X(CLT_I32_UN) X(CLE_I32) X(CLE_I32_UN) X(BR_S) X(BRFALSE_S)       \
+  X(BRTRUE_S) X(BR) X(BRFALSE) X(BRTRUE)
+
+#if !defined(MANGO_NO_REFS)
+#define CACHED_REF_SUPERINSTRUCTIONS(X) X(LDLOC_LDLOC_LDELEM_X32)
+#else
+#define CACHED_REF_SUPERINSTRUCTIONS(X)
+#endif
+
+#define CACHED_SUPERINSTRUCTIONS(X)                                            \
+  X(LDLOC_LDLOC_X32) X(LDLOC_LDLOC_ADD_I32) X(LDLOC_LDC_ADD_STLOC_I32)         \
+  X(LDLOC_LDC_CLT_BRFALSE_I32) X(DUP_BRTRUE_X32) CACHED_REF_SUPERINSTRUCTIONS(X)
+
+#define CACHED_PUSH(Type, Value)                                               \
+  do {                                                                         \
+    stackval value;                                                            \
+    value.Type = (Value);                                                      \
+    sp[0] = tos;                                                               \
+    sp--;                                                                      \
+    tos = value;                                                               \
+  } while (0)
+
+#define CACHED_POP                                                             \
+  do {                                                                         \
+    tos = sp[1];                                                               \
+    sp++;                                                                      \
+  } while (0)
+
+#define CACHED_UNARY(Type, Operator)                                           \
+  tos.Type = Operator(tos.Type);                                               \
+  ip++;                                                                        \
+  DISPATCH
+
+#define CACHED_BINARY(Type, Operator)                                          \
+  tos.Type = sp[1].Type Operator tos.Type;                                     \
+  sp++;                                                                        \
+  ip++;                                                                        \
+  DISPATCH
+
+#define CACHED_SHIFT(Type, Operator)                                           \
+  tos.Type = sp[1].Type Operator(tos.i32 & 31);                                \
+  sp++;                                                                        \
+  ip++;                                                                        \
+  DISPATCH
+
+#define CACHED_COMPARE(Type, Operator)                                         \
+  tos.i32 = sp[1].Type Operator tos.Type;                                      \
+  sp++;                                                                        \
+  ip++;                                                                        \
+  DISPATCH
+
+#define CACHED_BRANCH(Condition, Bytes, Type)                                  \
+  do {                                                                         \
+    int32_t offset = (Condition) ? OPERAND(1, 1, Type) : 0;                    \
+    ip += LENGTH(Bytes, 2) + offset;                                           \
+    CACHED_CONSUME_FUEL_IF(offset < 0);                                        \
+    CACHED_JIT_BACKEDGE(offset < 0);                                           \
+  } while (0)
+
+#if !defined(MANGO_NO_BUDGET)
+#define CACHED_CONSUME_FUEL_IF(Condition)                                      \
+  if ((Condition) && --fuel == 0) {                                            \
+    sp[0] = tos;                                                               \
+    goto out_of_fuel;                                                          \
+  }
+#else
+#define CACHED_CONSUME_FUEL_IF(Condition)
+#endif
+
+#if !defined(MANGO_JIT)
+#define CACHED_JIT_BACKEDGE(Condition)
+#else
+#define CACHED_JIT_BACKEDGE(Condition)                                         \
+  if ((Condition) && jit && --samples == 0) {                                  \
+    sp[0] = tos;                                                               \
+    goto jit_backedge;                                                         \
+  }
+#endif
+
+#endif
+
 #define BINARY1(Type, Operator)                                                \
   do {                                                                         \
     sp[1].Type = sp[1].Type Operator sp[0].Type;                               \
@@ -821,26 +5602,86 @@ int mango_syscall(const mango_vm *vm) { return vm ? vm->syscall : 0; }
 
 #pragma endregion
 
-static mango_result _mango_interpret(mango_vm *vm) {
+static mango_result _mango_interpret(mango_vm *vm,
+                                     const void *const **handlers) {
+#if !defined(MANGO_THREADED_CODE) && defined(MANGO_NO_F64)
+  enum {
+    BYTE_CODE_COUNT = 0
+#define OPCODE(c, s, pop, push, args, i) +1
+#include "mango_opcodes.inc"
+#undef OPCODE
+  };
+#endif
+
   static const void *const dispatch_table[] = {
+#if !defined(MANGO_TOS_CACHE)
 #define OPCODE(c, s, pop, push, args, i) &&c,
+#define SUPERINSTRUCTION(c, s, cells) &&c,
+#else
+#define OPCODE(c, s, pop, push, args, i) &&c##_SPILL,
+#define SUPERINSTRUCTION(c, s, cells) &&c##_SPILL,
+#endif
 #include "mango_opcodes.inc"
+#if defined(MANGO_THREADED_CODE)
+#include "mango_superinstructions.inc"
+#endif
+#undef SUPERINSTRUCTION
 #undef OPCODE
+#if !defined(MANGO_THREADED_CODE) && defined(MANGO_NO_F64)
+      // Byte codes are dispatched on unchecked, so the opcodes left out of
+      // the build still need entries.
+      [BYTE_CODE_COUNT ... UINT8_MAX] = &&invalid,
+#endif
+#if defined(MANGO_TOS_CACHE)
+#define CACHED(c) [c] = &&c##_CACHED,
+      CACHED_OPCODES(CACHED)
+#undef CACHED
+#if defined(MANGO_THREADED_CODE)
+#define CACHED(c) [OPCODE_COUNT + c] = &&c##_CACHED,
+      CACHED_SUPERINSTRUCTIONS(CACHED)
+#undef CACHED
+#endif
+#endif
   };
 
+  if (handlers) {
+    *handlers = dispatch_table;
+    return MANGO_E_SUCCESS;
+  }
+
   mango_result result;
   stackval *rp = vm->stack + vm->rp;
   stackval *sp = vm->stack + vm->sp;
-  stack_frame sf = vm->sf;
-  const uint8_t *ip = _mango_get_module(vm, sf.module)->image + sf.ip;
+  unsigned int pop = vm->sf.pop;
+  uint8_t current = vm->sf.module;
+#if !defined(MANGO_THREADED_CODE)
+  const uint8_t *bp = _mango_get_module(vm, current)->image;
+  const uint8_t *ip = bp + vm->sf.ip;
+#else
+  const cell *bp = CODE(_mango_get_module(vm, current));
+  const cell *ip = bp + vm->sf.ip;
+#endif
+  uint32_t fuel = vm->fuel;
+#if defined(MANGO_CALL_CACHE)
+  call_site *calls = call_site_as_ptr(vm, vm->calls);
+#endif
+#if defined(MANGO_TOS_CACHE)
+  stackval tos;
+#endif
+#if defined(MANGO_JIT)
+  const int jit = !jit_state_is_null(vm->jit);
+  uint32_t samples = JIT_SAMPLE_INTERVAL;
+  jit_code *native;
+#endif
 
+  NATIVE_ENTER(_mango_get_module(vm, current));
   NEXT;
 
 #pragma region basic
 
 HALT: // ... -> ...
-  RETURN_IF(MANGO_E_APPLICATION, rp != vm->stack);
-  RETURN_IF(MANGO_E_STACK_IMBALANCE, sp != vm->stack + vm->stack_size);
+  RETURN_IF(MANGO_E_APPLICATION, rp != vm->stack + RP_BASE(vm));
+  RETURN_IF(MANGO_E_STACK_IMBALANCE, sp + pop != vm->stack + SP_BASE(vm));
   RETURN(MANGO_E_SUCCESS);
 
 NOP: // ... -> ...
@@ -919,11 +5760,11 @@ TUCK: // value1 value2 ... -> value1 value2 value1 ...
 
 #define LOAD_LOCAL(Cast, Type)                                                 \
   do {                                                                         \
-    uint8_t slot = FETCH(ip + 1, u8);                                          \
+    uint8_t slot = OPERAND(1, 1, u8);                                          \
     Cast value = (Cast)sp[slot].Type;                                          \
     sp--;                                                                      \
     sp[0].Type = value;                                                        \
-    ip += 2;                                                                   \
+    ip += LENGTH(2, 2);                                                        \
     NEXT;                                                                      \
   } while (0)
 
@@ -944,24 +5785,24 @@ LDLOC_X32: // ... -> value ...
 
 LDLOC_X64: // ... -> value ...
   do {
-    uint8_t slot = FETCH(ip + 1, u8);
+    uint8_t slot = OPERAND(1, 1, u8);
     uint32_t value1 = sp[slot + 0].u32;
     uint32_t value2 = sp[slot + 1].u32;
     sp -= 2;
     sp[0].u32 = value1;
     sp[1].u32 = value2;
-    ip += 2;
+    ip += LENGTH(2, 2);
     NEXT;
   } while (0);
 
 LDLOCA: // ... -> address ...
 #if !defined(MANGO_NO_REFS)
   do {
-    uint8_t slot = FETCH(ip + 1, u8);
+    uint8_t slot = OPERAND(1, 1, u8);
     void *object = &sp[slot];
     sp--;
     sp[0].ref = void_as_ref(vm, object);
-    ip += 2;
+    ip += LENGTH(2, 2);
     NEXT;
   } while (0);
 #else
@@ -970,20 +5811,20 @@ LDLOCA: // ... -> address ...
 
 STLOC_X32: // value ... -> ...
   do {
-    uint8_t slot = FETCH(ip + 1, u8);
+    uint8_t slot = OPERAND(1, 1, u8);
     sp[slot].u32 = sp[0].u32;
     sp++;
-    ip += 2;
+    ip += LENGTH(2, 2);
     NEXT;
   } while (0);
 
 STLOC_X64: // value ... -> ...
   do {
-    uint8_t slot = FETCH(ip + 1, u8);
+    uint8_t slot = OPERAND(1, 1, u8);
     sp[slot + 0].u32 = sp[0].u32;
     sp[slot + 1].u32 = sp[1].u32;
     sp += 2;
-    ip += 2;
+    ip += LENGTH(2, 2);
     NEXT;
   } while (0);
 
@@ -1007,16 +5848,22 @@ UNUSED23:
 #pragma region calls
 
 RET_X64: // value ... -> ...
-  sp[sf.pop + 1].u32 = sp[1].u32;
+  sp[pop + 1].u32 = sp[1].u32;
 
 RET_X32: // value ... -> ...
-  sp[sf.pop + 0].u32 = sp[0].u32;
+  sp[pop + 0].u32 = sp[0].u32;
 
 RET: // ... -> ...
-  sp += sf.pop;
+  sp += pop;
   --rp;
-  sf = rp->sf;
-  ip = _mango_get_module(vm, sf.module)->image + sf.ip;
+  if (rp->sf.module != current) {
+    bp = CODE(_mango_get_module(vm, rp->sf.module));
+  }
+  pop = rp->sf.pop;
+  current = rp->sf.module;
+  ip = bp + rp->sf.ip;
+  JIT_RETURN;
+  NATIVE_ENTER(_mango_get_module(vm, current));
   NEXT;
 
 CALLI: // ftn argumentN ... argument1 argument0 ... -> result ...
@@ -1024,24 +5871,58 @@ CALLI: // ftn argumentN ... argument1 argument0 ... -> result ...
     uint8_t module = sp[0].ftn.module;
     uint16_t offset = sp[0].ftn.offset;
 
-    const mango_module *modules = _mango_get_modules(vm);
-    const mango_module *caller = modules + sf.module;
-    const mango_module *callee = modules + module;
+#if !defined(MANGO_CALL_CACHE)
+    REQUIRE_MODULE(module);
+    const mango_module *callee = _mango_get_module(vm, module);
+#else
+    uint32_t key = CALL_SITE_KEY(CALLI, module, offset);
+    call_site *site = calls + CALL_SITE_INDEX(key);
+    if (site->key != key) {
+      REQUIRE_MODULE(module);
+      if (!_mango_resolve_call_site(vm, site, key, module, offset)) {
+        INVALID;
+      }
+    }
+#endif
+#if !defined(MANGO_THREADED_CODE)
+#if !defined(MANGO_CALL_CACHE)
     const mango_func_def *f = (const mango_func_def *)(callee->image + offset);
+#else
+    const call_site *callee = site;
+    const call_site *f = site;
+#endif
+    const uint8_t *base = callee->image;
+    const uint8_t *code = base + offset + sizeof(mango_func_def);
+#else
+#if !defined(MANGO_CALL_CACHE)
+    const cell *base = CODE(callee);
+    const cell *code = _mango_find_function(vm, callee, offset);
+    if (!code) {
+      INVALID;
+    }
+#else
+    const cell *base =
+        module == current ? bp : CODE(_mango_get_module(vm, module));
+    const cell *code = base + site->code;
+#endif
+    const function_header *f = &code[-1].func;
+#endif
 
     RETURN_IF(MANGO_E_STACK_OVERFLOW,
               sp - rp < 1 + f->loc_count + f->max_stack);
     sp++;
     ip++;
 
-    if (!(sf.pop == 0 && *ip == RET)) {
-      rp->sf = (stack_frame){sf.pop, sf.module, (uint16_t)(ip - caller->image)};
+    if (!(pop == 0 && IS(ip, RET))) {
+      rp->sf = FRAME(ip);
       rp++;
     }
 
-    sf = (stack_frame){(uint8_t)(f->arg_count + f->loc_count), module, 0};
+    pop = (uint8_t)(f->arg_count + f->loc_count);
+    current = module;
     sp -= f->loc_count;
-    ip = f->code;
+    ip = code;
+    bp = base;
 
     if (f->loc_count != 0) {
       for (uint_fast8_t i = 0, n = f->loc_count; i < n; i++) {
@@ -1049,30 +5930,35 @@ CALLI: // ftn argumentN ... argument1 argument0 ... -> result ...
       }
     }
 
+    CONSUME_FUEL;
+    JIT_CALL(f);
+    NATIVE_ENTER(callee);
     NEXT;
   } while (0);
 
 CALL_S: // argumentN ... argument1 argument0 ... -> result ...
   do {
+#if !defined(MANGO_THREADED_CODE)
     uint16_t offset = FETCH(ip + 1, u16);
-
-    const mango_module *modules = _mango_get_modules(vm);
-    const mango_module *caller = modules + sf.module;
-    const mango_module *callee = modules + sf.module;
-    const mango_func_def *f = (const mango_func_def *)(callee->image + offset);
+    const mango_func_def *f = (const mango_func_def *)(bp + offset);
+    const uint8_t *code = f->code;
+#else
+    const cell *code = bp + ip[1].u32;
+    const function_header *f = &code[-1].func;
+#endif
 
     RETURN_IF(MANGO_E_STACK_OVERFLOW,
               sp - rp < 1 + f->loc_count + f->max_stack);
-    ip += 3;
+    ip += LENGTH(3, 2);
 
-    if (!(sf.pop == 0 && *ip == RET)) {
-      rp->sf = (stack_frame){sf.pop, sf.module, (uint16_t)(ip - caller->image)};
+    if (!(pop == 0 && IS(ip, RET))) {
+      rp->sf = FRAME(ip);
       rp++;
     }
 
-    sf = (stack_frame){(uint8_t)(f->arg_count + f->loc_count), sf.module, 0};
+    pop = (uint8_t)(f->arg_count + f->loc_count);
     sp -= f->loc_count;
-    ip = f->code;
+    ip = code;
 
     if (f->loc_count != 0) {
       for (uint_fast8_t i = 0, n = f->loc_count; i < n; i++) {
@@ -1080,34 +5966,64 @@ CALL_S: // argumentN ... argument1 argument0 ... -> result ...
       }
     }
 
+    CONSUME_FUEL;
+    JIT_CALL(f);
+    NATIVE_ENTER(_mango_get_module(vm, current));
     NEXT;
   } while (0);
 
 CALL: // argumentN ... argument1 argument0 ... -> result ...
   do {
+#if !defined(MANGO_THREADED_CODE)
     uint8_t import = FETCH(ip + 1, u8);
     uint16_t offset = FETCH(ip + 2, u16);
-
-    const mango_module *modules = _mango_get_modules(vm);
-    const mango_module *caller = modules + sf.module;
+#if !defined(MANGO_CALL_CACHE)
     uint8_t module = import == INVALID_MODULE
-                         ? sf.module
-                         : _mango_get_module_imports(vm, caller)[import];
-    const mango_module *callee = modules + module;
+                         ? current
+                         : _mango_get_module_imports(
+                               vm, _mango_get_module(vm, current))[import];
+    REQUIRE_MODULE(module);
+    const mango_module *callee = _mango_get_module(vm, module);
     const mango_func_def *f = (const mango_func_def *)(callee->image + offset);
+#else
+    uint32_t key = CALL_SITE_KEY(CALL, current, ip - bp);
+    call_site *site = calls + CALL_SITE_INDEX(key);
+    if (site->key != key) {
+      uint8_t module = import == INVALID_MODULE
+                           ? current
+                           : _mango_get_module_imports(
+                                 vm, _mango_get_module(vm, current))[import];
+      REQUIRE_MODULE(module);
+      _mango_resolve_call_site(vm, site, key, module, offset);
+    }
+    uint8_t module = site->module;
+    const call_site *callee = site;
+    const call_site *f = site;
+#endif
+    const uint8_t *base = callee->image;
+    const uint8_t *code = base + offset + sizeof(mango_func_def);
+#else
+    uint8_t module = (uint8_t)ip[1].u32;
+    const mango_module *callee = _mango_get_module(vm, module);
+    const cell *base = CODE(callee);
+    const cell *code = base + ip[2].u32;
+    const function_header *f = &code[-1].func;
+#endif
 
     RETURN_IF(MANGO_E_STACK_OVERFLOW,
               sp - rp < 1 + f->loc_count + f->max_stack);
-    ip += 4;
+    ip += LENGTH(4, 3);
 
-    if (!(sf.pop == 0 && *ip == RET)) {
-      rp->sf = (stack_frame){sf.pop, sf.module, (uint16_t)(ip - caller->image)};
+    if (!(pop == 0 && IS(ip, RET))) {
+      rp->sf = FRAME(ip);
       rp++;
     }
 
-    sf = (stack_frame){(uint8_t)(f->arg_count + f->loc_count), module, 0};
+    pop = (uint8_t)(f->arg_count + f->loc_count);
+    current = module;
     sp -= f->loc_count;
-    ip = f->code;
+    ip = code;
+    bp = base;
 
     if (f->loc_count != 0) {
       for (uint_fast8_t i = 0, n = f->loc_count; i < n; i++) {
@@ -1115,15 +6031,70 @@ CALL: // argumentN ... argument1 argument0 ... -> result ...
       }
     }
 
+    CONSUME_FUEL;
+    JIT_CALL(f);
+    NATIVE_ENTER(callee);
     NEXT;
   } while (0);
 
 SYSCALL: // argumentN ... argument1 argument0 ... -> result ...
   do {
-    int8_t adjustment = FETCH(ip + 1, i8);
-    uint16_t syscall = FETCH(ip + 2, u16);
+    int8_t adjustment = OPERAND(1, 1, i8);
+    uint16_t syscall = OPERAND(2, 2, u16);
+
+#if defined(MANGO_SYSCALLS) || defined(MANGO_SYSCALL_HANDLERS)
+    result = MANGO_E_SYSTEM_CALL;
+    vm->rp = (uint16_t)(rp - vm->stack);
+    vm->sp = vm->sp_expected =
+        (uint16_t)((sp - vm->stack) + (adjustment < 0 ? adjustment : 0));
+    vm->sf = FRAME(ip);
+    if (vm->fuel != 0) {
+      vm->fuel = fuel;
+    }
+#if defined(MANGO_SYSCALLS)
+    switch (syscall) {
+#define SYSCALL_HANDLER(Number, Adjustment, Function)                          \
+  case (Number):                                                               \
+    RETURN_IF(MANGO_E_STACK_IMBALANCE, adjustment != (Adjustment));            \
+    RETURN_IF(MANGO_E_STACK_OVERFLOW, sp - rp < -(Adjustment));                \
+    result = Function(vm, (union mango_value *)sp, vm->context);               \
+    break;
+#include MANGO_SYSCALLS
+#undef SYSCALL_HANDLER
+    default:
+#endif
+#if defined(MANGO_SYSCALL_HANDLERS)
+      if (syscall < MANGO_SYSCALL_TABLE_SIZE &&
+          !syscall_entry_is_null(vm->syscalls)) {
+        const syscall_entry *entry =
+            syscall_entry_as_ptr(vm, vm->syscalls) + syscall;
+
+        if (entry->function) {
+          RETURN_IF(MANGO_E_STACK_IMBALANCE, entry->adjustment != adjustment);
+          RETURN_IF(MANGO_E_STACK_OVERFLOW, sp - rp < -adjustment);
+          result =
+              entry->function(vm, (union mango_value *)sp, entry->context);
+        }
+      }
+#endif
+#if defined(MANGO_SYSCALLS)
+      break;
+    }
+#endif
 
-    ip += 4;
+    if (vm->fuel != 0) {
+      fuel = vm->fuel;
+    }
+    if (result == MANGO_E_SUCCESS) {
+      sp += adjustment;
+      ip += LENGTH(4, 3);
+      NEXT;
+    } else if (result != MANGO_E_SYSTEM_CALL) {
+      goto done;
+    }
+#endif
+
+    ip += LENGTH(4, 3);
     vm->sp_expected = (uint16_t)((sp - vm->stack) + adjustment);
     vm->syscall = syscall;
 
@@ -1138,32 +6109,62 @@ UNUSED31:
 #pragma region branches
 
 BR_S: // ... -> ...
-  ip += 2 + FETCH(ip + 1, i8);
-  NEXT;
+  do {
+    int32_t offset = OPERAND(1, 1, i8);
+    ip += LENGTH(2, 2) + offset;
+    CONSUME_FUEL_IF(offset < 0);
+    JIT_BACKEDGE(offset < 0);
+    NEXT;
+  } while (0);
 
 BRFALSE_S: // value ... -> ...
-  ip += 2 + (sp[0].u32 == 0 ? FETCH(ip + 1, i8) : 0);
-  sp++;
-  NEXT;
+  do {
+    int32_t offset = sp[0].u32 == 0 ? OPERAND(1, 1, i8) : 0;
+    ip += LENGTH(2, 2) + offset;
+    sp++;
+    CONSUME_FUEL_IF(offset < 0);
+    JIT_BACKEDGE(offset < 0);
+    NEXT;
+  } while (0);
 
 BRTRUE_S: // value ... -> ...
-  ip += 2 + (sp[0].u32 != 0 ? FETCH(ip + 1, i8) : 0);
-  sp++;
-  NEXT;
+  do {
+    int32_t offset = sp[0].u32 != 0 ? OPERAND(1, 1, i8) : 0;
+    ip += LENGTH(2, 2) + offset;
+    sp++;
+    CONSUME_FUEL_IF(offset < 0);
+    JIT_BACKEDGE(offset < 0);
+    NEXT;
+  } while (0);
 
 BR: // ... -> ...
-  ip += 3 + FETCH(ip + 1, i16);
-  NEXT;
+  do {
+    int32_t offset = OPERAND(1, 1, i16);
+    ip += LENGTH(3, 2) + offset;
+    CONSUME_FUEL_IF(offset < 0);
+    JIT_BACKEDGE(offset < 0);
+    NEXT;
+  } while (0);
 
 BRFALSE: // value ... -> ...
-  ip += 3 + (sp[0].u32 == 0 ? FETCH(ip + 1, i16) : 0);
-  sp++;
-  NEXT;
+  do {
+    int32_t offset = sp[0].u32 == 0 ? OPERAND(1, 1, i16) : 0;
+    ip += LENGTH(3, 2) + offset;
+    sp++;
+    CONSUME_FUEL_IF(offset < 0);
+    JIT_BACKEDGE(offset < 0);
+    NEXT;
+  } while (0);
 
 BRTRUE: // value ... -> ...
-  ip += 3 + (sp[0].u32 != 0 ? FETCH(ip + 1, i16) : 0);
-  sp++;
-  NEXT;
+  do {
+    int32_t offset = sp[0].u32 != 0 ? OPERAND(1, 1, i16) : 0;
+    ip += LENGTH(3, 2) + offset;
+    sp++;
+    CONSUME_FUEL_IF(offset < 0);
+    JIT_BACKEDGE(offset < 0);
+    NEXT;
+  } while (0);
 
 UNUSED38:
 UNUSED39:
@@ -1183,45 +6184,56 @@ LDC_I32_5:
 LDC_I32_6:
 LDC_I32_7:
 LDC_I32_8: // ... -> value ...
+#if !defined(MANGO_THREADED_CODE)
   sp--;
   sp[0].i32 = (int)(*ip) - LDC_I32_0;
   ip++;
   NEXT;
+#else
+  INVALID;
+#endif
 
 LDC_I32_S: // ... -> value ...
   sp--;
-  sp[0].i32 = FETCH(ip + 1, i8);
-  ip += 2;
+  sp[0].i32 = OPERAND(1, 1, i8);
+  ip += LENGTH(2, 2);
   NEXT;
 
 LDC_X32: // ... -> value ...
   sp--;
-  sp[0].u32 = FETCH(ip + 1, u32);
-  ip += 5;
+  sp[0].u32 = OPERAND(1, 1, u32);
+  ip += LENGTH(5, 2);
   NEXT;
 
 LDC_X64: // ... -> value ...
   sp -= 2;
-  sp[0].u32 = FETCH(ip + 1, u32);
-  sp[1].u32 = FETCH(ip + 5, u32);
-  ip += 9;
+  sp[0].u32 = OPERAND(1, 1, u32);
+  sp[1].u32 = OPERAND(5, 2, u32);
+  ip += LENGTH(9, 3);
   NEXT;
 
 LDFTN: // ... -> ftn ...
+#if !defined(MANGO_THREADED_CODE)
   do {
     uint8_t import = FETCH(ip + 1, u8);
     uint16_t offset = FETCH(ip + 2, u16);
 
     uint8_t module = import == INVALID_MODULE
-                         ? sf.module
+                         ? current
                          : _mango_get_module_imports(
-                               vm, _mango_get_module(vm, sf.module))[import];
+                               vm, _mango_get_module(vm, current))[import];
 
     sp--;
     sp[0].ftn = (function_token){0, module, offset};
     ip += 4;
     NEXT;
   } while (0);
+#else
+  sp--;
+  sp[0].ftn = ip[1].ftn;
+  ip += 2;
+  NEXT;
+#endif
 
 UNUSED54:
 UNUSED55:
@@ -1353,13 +6365,13 @@ UNUSED95:
 
 NEWOBJ: // ... -> address ...
   do {
-    uint32_t size = FETCH(ip + 1, u16);
+    uint32_t size = OPERAND(1, 1, u16);
     void *object = mango_heap_alloc(vm, 1, size, __alignof(stackval),
                                     MANGO_ALLOC_ZERO_MEMORY);
     RETURN_IF(MANGO_E_OUT_OF_MEMORY, !object);
     sp--;
     sp[0].ref = void_as_ref(vm, object);
-    ip += 3;
+    ip += LENGTH(3, 2);
     NEXT;
   } while (0);
 
@@ -1367,13 +6379,13 @@ NEWARR: // length ... -> array length ...
   do {
     uint32_t length = sp[0].u32;
     RETURN_IF(MANGO_E_ARGUMENT, (int32_t)length < 0);
-    uint32_t size = FETCH(ip + 1, u16);
+    uint32_t size = OPERAND(1, 1, u16);
     void *array = mango_heap_alloc(vm, length, size, __alignof(stackval),
                                    MANGO_ALLOC_ZERO_MEMORY);
     RETURN_IF(MANGO_E_OUT_OF_MEMORY, !array);
     sp--;
     sp[0].ref = void_as_ref(vm, array);
-    ip += 3;
+    ip += LENGTH(3, 2);
     NEXT;
   } while (0);
 
@@ -1403,29 +6415,23 @@ SLICE2: // length' start array length ... -> array length' ...
 
 MAKEARR:
   do {
-    uint32_t size = FETCH(ip + 1, u16);
-    uint32_t length = FETCH(ip + 3, u16);
+    uint32_t size = OPERAND(1, 1, u16);
+    uint32_t length = OPERAND(3, 2, u16);
     RETURN_IF(MANGO_E_ARGUMENT, size != 1 && size != 2 && size != 4);
     void *array = mango_heap_alloc(vm, length, size, __alignof(stackval), 0);
     RETURN_IF(MANGO_E_OUT_OF_MEMORY, !array);
     sp -= 2;
     sp[0].ref = void_as_ref(vm, array);
     sp[1].u32 = length;
-    ip += 5;
-    for (uint32_t i = 0; i < length; i++) {
-      switch (size) {
-      case 1:
-        ((uint8_t*)array)[i] = FETCH(ip, u8);
-        break;
-      case 2:
-        ((uint16_t*)array)[i] = FETCH(ip, u16);
-        break;
-      case 4:
-        ((uint32_t*)array)[i] = FETCH(ip, u32);
-        break;
-      }
-      ip += size;
-    }
+#if !defined(MANGO_THREADED_CODE)
+    const uint8_t *data = ip + 5;
+    ip += 5 + size * length;
+#else
+    const uint8_t *data = ip[3].data;
+    ip += 4;
+#endif
+    memcpy(array, data, size * length);
+    NEXT;
   } while (0);
 
 UNUSED101:
@@ -1437,9 +6443,9 @@ UNUSED103:
   do {                                                                         \
     RETURN_IF(MANGO_E_NULL_REFERENCE, void_is_null(sp[0].ref));                \
     uintptr_t object = (uintptr_t)(void_as_ptr(vm, sp[0].ref));                \
-    const Cast *field = (const Cast *)(object + FETCH(ip + 1, u16));           \
+    const Cast *field = (const Cast *)(object + OPERAND(1, 1, u16));           \
     sp[0].Type = field[0];                                                     \
-    ip += 3;                                                                   \
+    ip += LENGTH(3, 2);                                                        \
     NEXT;                                                                      \
   } while (0)
 
@@ -1462,19 +6468,19 @@ LDFLD_X64: // address ... -> value ...
   do {
     RETURN_IF(MANGO_E_NULL_REFERENCE, void_is_null(sp[0].ref));
     uintptr_t object = (uintptr_t)(void_as_ptr(vm, sp[0].ref));
-    const uint32_t *field = (const uint32_t *)(object + FETCH(ip + 1, u16));
+    const uint32_t *field = (const uint32_t *)(object + OPERAND(1, 1, u16));
     sp--;
     sp[0].u32 = field[0];
     sp[1].u32 = field[1];
-    ip += 3;
+    ip += LENGTH(3, 2);
     NEXT;
   } while (0);
 
 LDFLDA: // address ... -> address ...
   do {
     RETURN_IF(MANGO_E_NULL_REFERENCE, void_is_null(sp[0].ref));
-    sp[0].ref.address += FETCH(ip + 1, u16);
-    ip += 3;
+    sp[0].ref.address += OPERAND(1, 1, u16);
+    ip += LENGTH(3, 2);
     NEXT;
   } while (0);
 
@@ -1482,10 +6488,10 @@ LDFLDA: // address ... -> address ...
   do {                                                                         \
     RETURN_IF(MANGO_E_NULL_REFERENCE, void_is_null(sp[1].ref));                \
     uintptr_t object = (uintptr_t)(void_as_ptr(vm, sp[1].ref));                \
-    Cast *field = (Cast *)(object + FETCH(ip + 1, u16));                       \
+    Cast *field = (Cast *)(object + OPERAND(1, 1, u16));                       \
     field[0] = (Cast)sp[0].Type;                                               \
     sp += 2;                                                                   \
-    ip += 3;                                                                   \
+    ip += LENGTH(3, 2);                                                        \
     NEXT;                                                                      \
   } while (0)
 
@@ -1502,11 +6508,11 @@ STFLD_X64: // value address -> ...
   do {
     RETURN_IF(MANGO_E_NULL_REFERENCE, void_is_null(sp[2].ref));
     uintptr_t object = (uintptr_t)(void_as_ptr(vm, sp[2].ref));
-    uint32_t *field = (uint32_t *)(object + FETCH(ip + 1, u16));
+    uint32_t *field = (uint32_t *)(object + OPERAND(1, 1, u16));
     field[0] = sp[0].u32;
     field[1] = sp[1].u32;
     sp += 3;
-    ip += 3;
+    ip += LENGTH(3, 2);
     NEXT;
   } while (0);
 
@@ -1566,10 +6572,10 @@ LDELEMA: // index array length ... -> address ...
     uint32_t index = sp[0].u32;
     RETURN_IF(MANGO_E_INDEX_OUT_OF_RANGE, index >= sp[2].u32);
     uint32_t address = sp[1].ref.address;
-    uint32_t size = FETCH(ip + 1, u16);
+    uint32_t size = OPERAND(1, 1, u16);
     sp += 2;
     sp[0].ref.address = address + index * size;
-    ip += 3;
+    ip += LENGTH(3, 2);
     NEXT;
   } while (0);
 
@@ -1622,7 +6628,7 @@ NEWOBJ:
 NEWARR:
 SLICE1:
 SLICE2:
-UNUSED100:
+MAKEARR:
 UNUSED101:
 UNUSED102:
 UNUSED103:
@@ -2169,6 +7175,553 @@ UNUSED255:
 
 #endif
 
+#if defined(MANGO_THREADED_CODE)
+
+#pragma region superinstructions
+
+LDLOC_LDLOC_X32: // ... -> value2 value1 ...
+  do {
+    uint32_t value1 = sp[ip[1].u32].u32;
+    uint32_t value2 = sp[ip[2].u32].u32;
+    sp -= 2;
+    sp[0].u32 = value2;
+    sp[1].u32 = value1;
+    ip += 3;
+    NEXT;
+  } while (0);
+
+LDLOC_LDLOC_ADD_I32: // ... -> result ...
+  do {
+    uint32_t value1 = sp[ip[1].u32].u32;
+    uint32_t value2 = sp[ip[2].u32].u32;
+    sp--;
+    sp[0].u32 = value1 + value2;
+    ip += 3;
+    NEXT;
+  } while (0);
+
+LDLOC_LDC_ADD_STLOC_I32: // ... -> ...
+  sp[ip[3].u32].u32 = sp[ip[1].u32].u32 + ip[2].u32;
+  ip += 4;
+  NEXT;
+
+LDLOC_LDC_CLT_BRFALSE_I32: // ... -> ...
+  do {
+    int32_t offset = !(sp[ip[1].u32].i32 < ip[2].i32) ? ip[3].i32 : 0;
+    ip += 4 + offset;
+    CONSUME_FUEL_IF(offset < 0);
+    JIT_BACKEDGE(offset < 0);
+    NEXT;
+  } while (0);
+
+DUP_BRTRUE_X32: // value ... -> value ...
+  do {
+    int32_t offset = sp[0].u32 != 0 ? ip[1].i32 : 0;
+    ip += 2 + offset;
+    CONSUME_FUEL_IF(offset < 0);
+    JIT_BACKEDGE(offset < 0);
+    NEXT;
+  } while (0);
+
+#if !defined(MANGO_NO_REFS)
+LDLOC_LDLOC_LDELEM_X32: // ... -> value ...
+  do {
+    uint32_t slot = ip[1].u32;
+    uint32_t index = sp[ip[2].u32].u32;
+    RETURN_IF(MANGO_E_INDEX_OUT_OF_RANGE, index >= sp[slot + 1].u32);
+    const uint32_t *array = (const uint32_t *)void_as_ptr(vm, sp[slot].ref);
+    sp--;
+    sp[0].u32 = array[index];
+    ip += 3;
+    NEXT;
+  } while (0);
+#endif
+
+DIV_I32_UNCHECKED: // value2 value1 ... -> result ...
+  BINARY1(i32, /);
+
+DIV_I32_UN_UNCHECKED: // value2 value1 ... -> result ...
+  BINARY1(u32, /);
+
+REM_I32_UNCHECKED: // value2 value1 ... -> result ...
+  BINARY1(i32, %);
+
+REM_I32_UN_UNCHECKED: // value2 value1 ... -> result ...
+  BINARY1(u32, %);
+
+LDFLD_X32_UNCHECKED: // address ... -> value ...
+#if !defined(MANGO_NO_REFS)
+  do {
+    uintptr_t object = (uintptr_t)(void_as_ptr(vm, sp[0].ref));
+    sp[0].u32 = *(const uint32_t *)(object + ip[1].u32);
+    ip += 2;
+    NEXT;
+  } while (0);
+#else
+  INVALID;
+#endif
+
+STFLD_X32_UNCHECKED: // value address ... -> ...
+#if !defined(MANGO_NO_REFS)
+  do {
+    uintptr_t object = (uintptr_t)(void_as_ptr(vm, sp[1].ref));
+    *(uint32_t *)(object + ip[1].u32) = sp[0].u32;
+    sp += 2;
+    ip += 2;
+    NEXT;
+  } while (0);
+#else
+  INVALID;
+#endif
+
+#if !defined(MANGO_NO_REFS)
+#define LOAD_ELEMENT_UNCHECKED(Cast, Type)                                     \
+  do {                                                                         \
+    const Cast *array = (const Cast *)void_as_ptr(vm, sp[1].ref);              \
+    sp[2].Type = array[sp[0].u32];                                             \
+    sp += 2;                                                                   \
+    ip++;                                                                      \
+    NEXT;                                                                      \
+  } while (0)
+
+#define STORE_ELEMENT_UNCHECKED(Cast)                                          \
+  do {                                                                         \
+    Cast *array = (Cast *)void_as_ptr(vm, sp[2].ref);                          \
+    array[sp[1].u32] = (Cast)sp[0].u32;                                        \
+    sp += 4;                                                                   \
+    ip++;                                                                      \
+    NEXT;                                                                      \
+  } while (0)
+#else
+#define LOAD_ELEMENT_UNCHECKED(Cast, Type) INVALID
+#define STORE_ELEMENT_UNCHECKED(Cast) INVALID
+#endif
+
+LDELEM_I8_UNCHECKED: // index array length ... -> value ...
+  LOAD_ELEMENT_UNCHECKED(int8_t, i32);
+
+LDELEM_U8_UNCHECKED: // index array length ... -> value ...
+  LOAD_ELEMENT_UNCHECKED(uint8_t, u32);
+
+LDELEM_I16_UNCHECKED: // index array length ... -> value ...
+  LOAD_ELEMENT_UNCHECKED(int16_t, i32);
+
+LDELEM_U16_UNCHECKED: // index array length ... -> value ...
+  LOAD_ELEMENT_UNCHECKED(uint16_t, u32);
+
+LDELEM_X32_UNCHECKED: // index array length ... -> value ...
+  LOAD_ELEMENT_UNCHECKED(uint32_t, u32);
+
+STELEM_X8_UNCHECKED: // value index array length ... -> ...
+  STORE_ELEMENT_UNCHECKED(uint8_t);
+
+STELEM_X16_UNCHECKED: // value index array length ... -> ...
+  STORE_ELEMENT_UNCHECKED(uint16_t);
+
+STELEM_X32_UNCHECKED: // value index array length ... -> ...
+  STORE_ELEMENT_UNCHECKED(uint32_t);
+
+#if !defined(MANGO_NO_REFS)
+LDLOC_LDLOC_LDELEM_X32_UNCHECKED: // ... -> value ...
+  do {
+    uint32_t index = sp[ip[2].u32].u32;
+    const uint32_t *array =
+        (const uint32_t *)void_as_ptr(vm, sp[ip[1].u32].ref);
+    sp--;
+    sp[0].u32 = array[index];
+    ip += 3;
+    NEXT;
+  } while (0);
+#endif
+
+#define ENTER(Module, Base, Code)                                              \
+  do {                                                                         \
+    const function_header *f = &(Code)[-1].func;                               \
+    if (!(pop == 0 && IS(ip, RET))) {                                          \
+      rp->sf = FRAME(ip);                                                      \
+      rp++;                                                                    \
+    }                                                                          \
+    pop = (uint8_t)(f->arg_count + f->loc_count);                              \
+    current = (Module);                                                        \
+    sp -= f->loc_count;                                                        \
+    ip = (Code);                                                               \
+    bp = (Base);                                                               \
+    for (uint_fast8_t i = 0, n = f->loc_count; i < n; i++) {                   \
+      sp[i].u32 = 0;                                                           \
+    }                                                                          \
+    CONSUME_FUEL;                                                              \
+    JIT_CALL(f);                                                               \
+    NEXT;                                                                      \
+  } while (0)
+
+CALL_S_UNCHECKED: // argumentN ... argument1 argument0 ... -> result ...
+  do {
+    const cell *code = bp + ip[1].u32;
+    ip += 2;
+    ENTER(current, bp, code);
+  } while (0);
+
+CALL_S_BOUNDED: // argumentN ... argument1 argument0 ... -> result ...
+  do {
+    const cell *code = bp + ip[1].u32;
+    RETURN_IF(MANGO_E_STACK_OVERFLOW, sp - rp < (ptrdiff_t)ip[2].u32);
+    ip += 3;
+    ENTER(current, bp, code);
+  } while (0);
+
+CALL_UNCHECKED: // argumentN ... argument1 argument0 ... -> result ...
+  do {
+    uint8_t module = (uint8_t)ip[1].u32;
+    const cell *base = CODE(_mango_get_module(vm, module));
+    const cell *code = base + ip[2].u32;
+    ip += 3;
+    ENTER(module, base, code);
+  } while (0);
+
+#pragma endregion
+
+#endif
+
+#if defined(MANGO_TOS_CACHE)
+
+#pragma region top of stack cache
+
+  // Handlers outside CACHED_OPCODES work on the stack in memory. They are
+  // entered through a stub that spills the cached value, and their NEXT
+  // reloads it.
+
+#define OPCODE(c, s, pop, push, args, i)                                       \
+  c##_SPILL:                                                                   \
+  sp[0] = tos;                                                                 \
+  goto c;
+#define SUPERINSTRUCTION(c, s, cells) OPCODE(c, s, 0, 0, 0, 0)
+#include "mango_opcodes.inc"
+#if defined(MANGO_THREADED_CODE)
+#include "mango_superinstructions.inc"
+#endif
+#undef SUPERINSTRUCTION
+#undef OPCODE
+
+NOP_CACHED: // ... -> ...
+  ++ip;
+  DISPATCH;
+
+POP_X32_CACHED: // value ... -> ...
+  CACHED_POP;
+  ip++;
+  DISPATCH;
+
+DUP_X32_CACHED: // value ... -> value value ...
+  sp[0] = tos;
+  sp--;
+  ip++;
+  DISPATCH;
+
+LDLOC_X32_CACHED: // ... -> value ...
+  do {
+    uint8_t slot = OPERAND(1, 1, u8);
+    sp[0] = tos;
+    tos = sp[slot];
+    sp--;
+    ip += LENGTH(2, 2);
+    DISPATCH;
+  } while (0);
+
+STLOC_X32_CACHED: // value ... -> ...
+  do {
+    uint8_t slot = OPERAND(1, 1, u8);
+    sp[slot] = tos;
+    CACHED_POP;
+    ip += LENGTH(2, 2);
+    DISPATCH;
+  } while (0);
+
+LDC_I32_M1_CACHED: // ... -> -1 ...
+  CACHED_PUSH(i32, -1);
+  ip++;
+  DISPATCH;
+
+LDC_I32_0_CACHED: // ... -> 0 ...
+  CACHED_PUSH(i32, 0);
+  ip++;
+  DISPATCH;
+
+LDC_I32_1_CACHED: // ... -> 1 ...
+  CACHED_PUSH(i32, 1);
+  ip++;
+  DISPATCH;
+
+LDC_I32_2_CACHED: // ... -> 2 ...
+  CACHED_PUSH(i32, 2);
+  ip++;
+  DISPATCH;
+
+LDC_I32_3_CACHED: // ... -> 3 ...
+  CACHED_PUSH(i32, 3);
+  ip++;
+  DISPATCH;
+
+LDC_I32_4_CACHED: // ... -> 4 ...
+  CACHED_PUSH(i32, 4);
+  ip++;
+  DISPATCH;
+
+LDC_I32_5_CACHED: // ... -> 5 ...
+  CACHED_PUSH(i32, 5);
+  ip++;
+  DISPATCH;
+
+LDC_I32_6_CACHED: // ... -> 6 ...
+  CACHED_PUSH(i32, 6);
+  ip++;
+  DISPATCH;
+
+LDC_I32_7_CACHED: // ... -> 7 ...
+  CACHED_PUSH(i32, 7);
+  ip++;
+  DISPATCH;
+
+LDC_I32_8_CACHED: // ... -> 8 ...
+  CACHED_PUSH(i32, 8);
+  ip++;
+  DISPATCH;
+
+LDC_I32_S_CACHED: // ... -> value ...
+  CACHED_PUSH(i32, OPERAND(1, 1, i8));
+  ip += LENGTH(2, 2);
+  DISPATCH;
+
+LDC_X32_CACHED: // ... -> value ...
+  CACHED_PUSH(u32, OPERAND(1, 1, u32));
+  ip += LENGTH(5, 2);
+  DISPATCH;
+
+ADD_I32_CACHED: // value2 value1 ... -> result ...
+  CACHED_BINARY(u32, +);
+
+SUB_I32_CACHED: // value2 value1 ... -> result ...
+  CACHED_BINARY(u32, -);
+
+MUL_I32_CACHED: // value2 value1 ... -> result ...
+  CACHED_BINARY(u32, *);
+
+NEG_I32_CACHED: // value ... -> result ...
+  CACHED_UNARY(u32, -);
+
+SHL_I32_CACHED: // amount value ... -> result ...
+  CACHED_SHIFT(u32, <<);
+
+SHR_I32_CACHED: // amount value ... -> result ...
+  CACHED_SHIFT(i32, >>);
+
+SHR_I32_UN_CACHED: // amount value ... -> result ...
+  CACHED_SHIFT(u32, >>);
+
+AND_I32_CACHED: // value2 value1 ... -> result ...
+  CACHED_BINARY(u32, &);
+
+OR_I32_CACHED: // value2 value1 ... -> result ...
+  CACHED_BINARY(u32, |);
+
+XOR_I32_CACHED: // value2 value1 ... -> result ...
+  CACHED_BINARY(u32, ^);
+
+NOT_I32_CACHED: // value ... -> result ...
+  CACHED_UNARY(u32, ~);
+
+CEQ_I32_CACHED: // value2 value1 ... -> result ...
+  CACHED_COMPARE(u32, ==);
+
+CNE_I32_CACHED: // value2 value1 ... -> result ...
+  CACHED_COMPARE(u32, !=);
+
+CGT_I32_CACHED: // value2 value1 ... -> result ...
+  CACHED_COMPARE(i32, >);
+
+CGT_I32_UN_CACHED: // value2 value1 ... -> result ...
+  CACHED_COMPARE(u32, >);
+
+CGE_I32_CACHED: // value2 value1 ... -> result ...
+  CACHED_COMPARE(i32, >=);
+
+CGE_I32_UN_CACHED: // value2 value1 ... -> result ...
+  CACHED_COMPARE(u32, >=);
+
+CLT_I32_CACHED: // value2 value1 ... -> result ...
+  CACHED_COMPARE(i32, <);
+
+CLT_I32_UN_CACHED: // value2 value1 ... -> result ...
+  CACHED_COMPARE(u32, <);
+
+CLE_I32_CACHED: // value2 value1 ... -> result ...
+  CACHED_COMPARE(i32, <=);
+
+CLE_I32_UN_CACHED: // value2 value1 ... -> result ...
+  CACHED_COMPARE(u32, <=);
+
+BR_S_CACHED: // ... -> ...
+  CACHED_BRANCH(1, 2, i8);
+  DISPATCH;
+
+BRFALSE_S_CACHED: // value ... -> ...
+  do {
+    uint32_t value = tos.u32;
+    CACHED_POP;
+    CACHED_BRANCH(value == 0, 2, i8);
+    DISPATCH;
+  } while (0);
+
+BRTRUE_S_CACHED: // value ... -> ...
+  do {
+    uint32_t value = tos.u32;
+    CACHED_POP;
+    CACHED_BRANCH(value != 0, 2, i8);
+    DISPATCH;
+  } while (0);
+
+BR_CACHED: // ... -> ...
+  CACHED_BRANCH(1, 3, i16);
+  DISPATCH;
+
+BRFALSE_CACHED: // value ... -> ...
+  do {
+    uint32_t value = tos.u32;
+    CACHED_POP;
+    CACHED_BRANCH(value == 0, 3, i16);
+    DISPATCH;
+  } while (0);
+
+BRTRUE_CACHED: // value ... -> ...
+  do {
+    uint32_t value = tos.u32;
+    CACHED_POP;
+    CACHED_BRANCH(value != 0, 3, i16);
+    DISPATCH;
+  } while (0);
+
+#if defined(MANGO_THREADED_CODE)
+
+LDLOC_LDLOC_X32_CACHED: // ... -> value2 value1 ...
+  do {
+    sp[0] = tos;
+    uint32_t value1 = sp[ip[1].u32].u32;
+    tos = sp[ip[2].u32];
+    sp -= 2;
+    sp[1].u32 = value1;
+    ip += 3;
+    DISPATCH;
+  } while (0);
+
+LDLOC_LDLOC_ADD_I32_CACHED: // ... -> result ...
+  do {
+    sp[0] = tos;
+    uint32_t result = sp[ip[1].u32].u32 + sp[ip[2].u32].u32;
+    sp--;
+    tos.u32 = result;
+    ip += 3;
+    DISPATCH;
+  } while (0);
+
+LDLOC_LDC_ADD_STLOC_I32_CACHED: // ... -> ...
+  sp[0] = tos;
+  sp[ip[3].u32].u32 = sp[ip[1].u32].u32 + ip[2].u32;
+  tos = sp[0];
+  ip += 4;
+  DISPATCH;
+
+LDLOC_LDC_CLT_BRFALSE_I32_CACHED: // ... -> ...
+  do {
+    sp[0] = tos;
+    int32_t offset = !(sp[ip[1].u32].i32 < ip[2].i32) ? ip[3].i32 : 0;
+    ip += 4 + offset;
+    CONSUME_FUEL_IF(offset < 0);
+    JIT_BACKEDGE(offset < 0);
+    DISPATCH;
+  } while (0);
+
+DUP_BRTRUE_X32_CACHED: // value ... -> value ...
+  CACHED_BRANCH(tos.u32 != 0, 2, i32);
+  DISPATCH;
+
+#if !defined(MANGO_NO_REFS)
+LDLOC_LDLOC_LDELEM_X32_CACHED: // ... -> value ...
+  do {
+    sp[0] = tos;
+    uint32_t slot = ip[1].u32;
+    uint32_t index = sp[ip[2].u32].u32;
+    RETURN_IF(MANGO_E_INDEX_OUT_OF_RANGE, index >= sp[slot + 1].u32);
+    const uint32_t *array = (const uint32_t *)void_as_ptr(vm, sp[slot].ref);
+    sp--;
+    tos.u32 = array[index];
+    ip += 3;
+    DISPATCH;
+  } while (0);
+#endif
+
+#endif
+
+#pragma endregion
+
+#endif
+
+#if defined(MANGO_JIT)
+jit_backedge:
+  samples = JIT_SAMPLE_INTERVAL;
+  native = _mango_jit_hot(vm, current, ip, JIT_SAMPLE_INTERVAL);
+  goto jit_enter;
+
+jit_call:
+  native = _mango_jit_hot(vm, current, ip, 0);
+  goto jit_enter;
+
+jit_return:
+  native = _mango_jit_entry(vm, bp, ip);
+
+jit_enter:
+  if (native) {
+    jit_result r = native(sp, fuel);
+    sp = r.sp;
+    fuel = r.fuel;
+    ip = bp + (r.ip & ~JIT_TIMEOUT);
+    if ((r.ip & JIT_TIMEOUT) != 0) {
+      goto out_of_fuel;
+    }
+  }
+  NEXT;
+#endif
+
+#if defined(MANGO_NATIVE_MODULES)
+native_enter:
+  do {
+    const mango_module *module = _mango_get_module(vm, current);
+    size_t offset = (size_t)(ip - bp);
+    mango_native_function *function = _mango_native_function(module, offset);
+    if (function) {
+      mango_native_frame frame = {(union mango_value *)sp, (uint8_t *)vm,
+                                  (uint32_t)offset, fuel};
+      result = function(&frame);
+      sp = (stackval *)frame.sp;
+      ip = bp + frame.ip;
+      fuel = frame.fuel;
+      if (result == MANGO_E_TIMEOUT) {
+        goto out_of_fuel;
+      } else if (result != MANGO_E_SUCCESS) {
+        goto done;
+      }
+    }
+    NEXT;
+  } while (0);
+#endif
+
+#if !defined(MANGO_NO_BUDGET) || defined(MANGO_JIT) ||                        \
+    defined(MANGO_NATIVE_MODULES)
+out_of_fuel:
+  if (vm->fuel == 0) {
+    NEXT;
+  }
+  RETURN(MANGO_E_TIMEOUT);
+#endif
+
 invalid:
   result = MANGO_E_INVALID_PROGRAM;
 
@@ -2177,9 +7730,10 @@ done:
   vm->syscall = 0;
 
 yield:
-  vm->sf =
-      (stack_frame){sf.pop, sf.module,
-                    (uint16_t)(ip - _mango_get_module(vm, sf.module)->image)};
+  if (vm->fuel != 0) {
+    vm->fuel = fuel;
+  }
+  vm->sf = FRAME(ip);
   vm->rp = (uint16_t)(rp - vm->stack);
   vm->sp = (uint16_t)(sp - vm->stack);
   return result;
@@ -74,9 +74,11 @@ typedef enum mango_result {
   MANGO_E_BREAKPOINT = 110,
   MANGO_E_TIMEOUT = 111,
   MANGO_E_SYSTEM_CALL = 112,
+  MANGO_E_MODULE_MISSING = 113,
 } mango_result;
 
 typedef enum mango_feature_flags {
+  MANGO_FEATURE_EXPORTS = 0x08,
   MANGO_FEATURE_I64 = 0x10,
   MANGO_FEATURE_F32 = 0x20,
   MANGO_FEATURE_F64 = 0x40,
@@ -87,8 +89,78 @@ typedef enum mango_alloc_flags {
   MANGO_ALLOC_ZERO_MEMORY = 0x8,
 } mango_alloc_flags;
 
+typedef enum mango_initialize_flags {
+  MANGO_INITIALIZE_JIT = 0x1,
+} mango_initialize_flags;
+
 typedef struct mango_vm mango_vm;
 
+typedef struct mango_program mango_program;
+
+typedef struct mango_template mango_template;
+
+typedef void mango_fusion_callback(void *context, const char *name,
+                                   uint32_t count);
+
+typedef union mango_value {
+  int32_t i32;
+  uint32_t u32;
+} mango_value;
+
+typedef struct mango_native_frame {
+  union mango_value *sp;
+  uint8_t *base;
+  uint32_t ip;
+  uint32_t fuel;
+} mango_native_frame;
+
+typedef mango_result mango_native_function(mango_native_frame *frame);
+
+typedef struct mango_native_module {
+  const uint8_t *image;
+  size_t image_size;
+  size_t function_count;
+  const uint16_t *offsets;
+  mango_native_function *const *functions;
+} mango_native_module;
+
+typedef const uint8_t *mango_module_resolver(void *context,
+                                             const uint8_t *name,
+                                             size_t *size,
+                                             void **module_context);
+
+typedef mango_result mango_syscall_function(mango_vm *vm,
+                                            union mango_value *sp,
+                                            void *context);
+
+typedef struct mango_ring_request {
+  uint32_t syscall;
+  uint32_t user_data;
+  uint32_t arguments[2];
+} mango_ring_request;
+
+typedef struct mango_ring_completion {
+  uint32_t user_data;
+  int32_t result;
+} mango_ring_completion;
+
+typedef struct mango_ring {
+  uint32_t size;
+  uint32_t submission_head;
+  uint32_t submission_tail;
+  uint32_t completion_head;
+  uint32_t completion_tail;
+} mango_ring;
+
+typedef struct mango_snapshot_module {
+  const uint8_t *image;
+  const mango_native_module *native;
+  void *context;
+} mango_snapshot_module;
+
+typedef int32_t mango_ring_function(void *context,
+                                    const mango_ring_request *request);
+
 MANGO_API int mango_version_major(void);
 
 MANGO_API int mango_version_minor(void);
@@ -100,6 +172,12 @@ MANGO_API int mango_features(void);
 MANGO_API mango_vm *mango_initialize(void *address, size_t heap_size,
                                      size_t stack_size, void *context);
 
+MANGO_API mango_vm *mango_initialize_ex(void *address, size_t heap_size,
+                                        size_t stack_size, int flags,
+                                        void *context);
+
+MANGO_API void mango_finalize(mango_vm *vm);
+
 MANGO_API mango_result mango_error(mango_vm *vm, mango_result error);
 
 MANGO_API void *mango_context(const mango_vm *vm);
@@ -111,6 +189,8 @@ MANGO_API size_t mango_heap_size(const mango_vm *vm);
 
 MANGO_API size_t mango_heap_available(const mango_vm *vm);
 
+MANGO_API uint32_t mango_heap_ref(const mango_vm *vm, const void *address);
+
 MANGO_API void *mango_stack_alloc(mango_vm *vm, size_t size, int flags);
 
 MANGO_API mango_result mango_stack_free(mango_vm *vm, size_t size);
@@ -125,14 +205,94 @@ MANGO_API mango_result mango_module_import(mango_vm *vm, const uint8_t *name,
                                            const uint8_t *image, size_t size,
                                            void *context);
 
+MANGO_API mango_result
+mango_module_import_native(mango_vm *vm, const uint8_t *name,
+                           const mango_native_module *module, void *context);
+
+MANGO_API mango_result mango_module_import_all(mango_vm *vm,
+                                               const uint8_t *name,
+                                               mango_module_resolver *resolver,
+                                               void *context);
+
+MANGO_API const uint8_t *mango_module_map_file(const char *path, size_t *size);
+
+MANGO_API void mango_module_unmap_file(const uint8_t *image);
+
+MANGO_API mango_result mango_module_import_file(mango_vm *vm,
+                                                const uint8_t *name,
+                                                const char *path,
+                                                void *context);
+
+MANGO_API mango_program *mango_program_link(const mango_vm *vm, void *address,
+                                            size_t *size);
+
+MANGO_API void mango_program_finalize(mango_program *program);
+
+MANGO_API mango_result mango_attach(mango_vm *vm,
+                                    const mango_program *program);
+
 MANGO_API const uint8_t *mango_module_missing(const mango_vm *vm);
 
+MANGO_API uint32_t mango_module_export(const mango_vm *vm,
+                                       const uint8_t *module,
+                                       const uint8_t *name);
+
 MANGO_API void *mango_module_context(const mango_vm *vm);
 
+MANGO_API mango_result mango_fusion_stats(const mango_vm *vm,
+                                          mango_fusion_callback *callback,
+                                          void *context);
+
 MANGO_API mango_result mango_run(mango_vm *vm);
 
+MANGO_API mango_result mango_run_budget(mango_vm *vm, uint32_t budget);
+
+MANGO_API mango_result mango_call(mango_vm *vm, uint32_t function,
+                                  const union mango_value *arguments,
+                                  size_t argument_count,
+                                  union mango_value *results,
+                                  size_t result_count);
+
+MANGO_API mango_result mango_call_batch(mango_vm *vm, uint32_t function,
+                                        const union mango_value *arguments,
+                                        size_t argument_count,
+                                        union mango_value *results,
+                                        size_t result_count, size_t count);
+
+MANGO_API mango_vm *mango_clone(const mango_vm *vm, void *address,
+                                size_t heap_size, void *context);
+
+MANGO_API mango_template *mango_template_create(const mango_vm *vm);
+
+MANGO_API mango_vm *mango_template_clone(const mango_template *source,
+                                         size_t heap_size, void *context);
+
+MANGO_API void mango_template_destroy(mango_template *source);
+
+MANGO_API mango_result mango_checkpoint(mango_vm *vm);
+
+MANGO_API mango_result mango_reset(mango_vm *vm);
+
+MANGO_API mango_result mango_snapshot_save(const mango_vm *vm,
+                                           const char *path);
+
+MANGO_API mango_vm *mango_snapshot_restore(const char *path,
+                                           const mango_snapshot_module *modules,
+                                           size_t count, void *context);
+
 MANGO_API int mango_syscall(const mango_vm *vm);
 
+MANGO_API mango_result mango_syscall_register(mango_vm *vm, int syscall,
+                                              int adjustment,
+                                              mango_syscall_function *function,
+                                              void *context);
+
+MANGO_API mango_ring *mango_ring_create(mango_vm *vm, uint32_t size);
+
+MANGO_API uint32_t mango_ring_process(mango_vm *vm, mango_ring *ring,
+                                      mango_ring_function *function,
+                                      void *context);
+
 ////////////////////////////////////////////////////////////////////////////////
 
 #if UINTPTR_MAX == UINT32_MAX
@@ -29,6 +29,7 @@
 
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -55,6 +56,31 @@ typedef struct mango_func_def {
   uint8_t code[];
 } mango_func_def;
 
+// With MANGO_FEATURE_EXPORTS, the imports of a module are followed by a hash
+// table of the functions it exports. The table has a power-of-two number of
+// slots; an export is placed in the first free slot starting at the hash of
+// its name, and unused slots have an offset of zero.
+
+typedef struct mango_export_def {
+  mango_module_name name;
+  uint16_t offset;
+  uint16_t _reserved;
+} mango_export_def;
+
+typedef struct mango_exports_def {
+  uint16_t slot_count;
+  uint16_t _reserved;
+  mango_export_def slots[];
+} mango_exports_def;
+
+static inline uint32_t mango_export_hash(const mango_module_name *name) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < sizeof(name->bytes); i++) {
+    hash = (hash ^ name->bytes[i]) * 16777619u;
+  }
+  return hash;
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,207 @@
+/*
+ *  _____ _____ _____ _____ _____
+ * |     |  _  |   | |   __|     |
+ * | | | |     | | | |  |  |  |  |
+ * |_|_|_|__|__|_|___|_____|_____|
+ *
+ * Mango Virtual Machine 1.0-dev
+ *
+ * Copyright (c) 2018 Klaus Hartke
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "mango.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Runtime support for the C code that mango-aot generates from a module
+// image. Generated functions work directly on the evaluation stack of the
+// VM and use the macros below, which mirror the interpreter handlers.
+
+#pragma pack(push, 4)
+
+typedef union mango_value2 {
+  int64_t i64;
+  uint64_t u64;
+} mango_value2;
+
+#pragma pack(pop)
+
+#if UINTPTR_MAX == UINT32_MAX
+#define MANGO_NATIVE_PTR(Address) ((uint8_t *)(uintptr_t)(Address))
+#else
+#define MANGO_NATIVE_PTR(Address) (base + (Address))
+#endif
+
+#define MANGO_EXIT(Offset, Result)                                             \
+  do {                                                                         \
+    ip = (Offset);                                                             \
+    result = (Result);                                                         \
+    goto exit;                                                                 \
+  } while (0)
+
+#define MANGO_CHECK(Offset, Result, Condition)                                 \
+  if (Condition)                                                               \
+  MANGO_EXIT(Offset, Result)
+
+#define MANGO_BACKWARD(Offset, Label)                                          \
+  do {                                                                         \
+    if (--fuel == 0) {                                                         \
+      MANGO_EXIT(Offset, MANGO_E_TIMEOUT);                                     \
+    }                                                                          \
+    goto Label;                                                                \
+  } while (0)
+
+#define MANGO_LOAD_LOCAL(Cast, Type, Slot)                                     \
+  do {                                                                         \
+    Cast value = (Cast)sp[Slot].Type;                                          \
+    sp--;                                                                      \
+    sp[0].Type = value;                                                        \
+  } while (0)
+
+#define MANGO_BINARY1(Type, Operator)                                          \
+  sp[1].Type = sp[1].Type Operator sp[0].Type;                                 \
+  sp++
+
+#define MANGO_BINARY1I(Offset, Operator)                                       \
+  MANGO_CHECK(Offset, MANGO_E_DIVIDE_BY_ZERO, sp[0].i32 == 0);                 \
+  MANGO_CHECK(Offset, MANGO_E_ARITHMETIC,                                      \
+              sp[0].i32 == -1 && sp[1].i32 == INT32_MIN);                      \
+  sp[1].i32 = sp[1].i32 Operator sp[0].i32;                                    \
+  sp++
+
+#define MANGO_BINARY1U(Offset, Operator)                                       \
+  MANGO_CHECK(Offset, MANGO_E_DIVIDE_BY_ZERO, sp[0].u32 == 0);                 \
+  sp[1].u32 = sp[1].u32 Operator sp[0].u32;                                    \
+  sp++
+
+#define MANGO_BINARY2(Type, Operator)                                          \
+  do {                                                                         \
+    mango_value2 *sp2 = (mango_value2 *)sp;                                    \
+    sp2[1].Type = sp2[1].Type Operator sp2[0].Type;                            \
+    sp += 2;                                                                   \
+  } while (0)
+
+#define MANGO_BINARY2I(Offset, Operator)                                       \
+  do {                                                                         \
+    mango_value2 *sp2 = (mango_value2 *)sp;                                    \
+    MANGO_CHECK(Offset, MANGO_E_DIVIDE_BY_ZERO, sp2[0].i64 == 0);              \
+    MANGO_CHECK(Offset, MANGO_E_ARITHMETIC,                                    \
+                sp2[0].i64 == -1 && sp2[1].i64 == INT64_MIN);                  \
+    sp2[1].i64 = sp2[1].i64 Operator sp2[0].i64;                               \
+    sp += 2;                                                                   \
+  } while (0)
+
+#define MANGO_BINARY2U(Offset, Operator)                                       \
+  do {                                                                         \
+    mango_value2 *sp2 = (mango_value2 *)sp;                                    \
+    MANGO_CHECK(Offset, MANGO_E_DIVIDE_BY_ZERO, sp2[0].u64 == 0);              \
+    sp2[1].u64 = sp2[1].u64 Operator sp2[0].u64;                               \
+    sp += 2;                                                                   \
+  } while (0)
+
+#define MANGO_UNARY1(Type, Operator) sp[0].Type = Operator(sp[0].Type)
+
+#define MANGO_UNARY2(Type, Operator)                                           \
+  do {                                                                         \
+    mango_value2 *sp2 = (mango_value2 *)sp;                                    \
+    sp2[0].Type = Operator(sp2[0].Type);                                       \
+  } while (0)
+
+#define MANGO_SHIFT1(Type, Operator)                                           \
+  sp[1].Type = sp[1].Type Operator(sp[0].i32 & 31);                            \
+  sp++
+
+#define MANGO_SHIFT2(Type, Operator)                                           \
+  do {                                                                         \
+    mango_value2 *sp2 = (mango_value2 *)(sp + 1);                              \
+    sp2[0].Type = sp2[0].Type Operator(sp[0].i32 & 63);                        \
+    sp++;                                                                      \
+  } while (0)
+
+#define MANGO_CONVERT1(Cast, Destination, Source)                              \
+  sp[0].Destination = (Cast)sp[0].Source
+
+#define MANGO_CONVERT21(Cast, Destination, Source)                             \
+  do {                                                                         \
+    Cast tmp = (Cast)sp[0].Source;                                             \
+    sp--;                                                                      \
+    ((mango_value2 *)sp)[0].Destination = tmp;                                 \
+  } while (0)
+
+#define MANGO_CONVERT12(Cast, Destination, Source)                             \
+  do {                                                                         \
+    Cast tmp = (Cast)((mango_value2 *)sp)[0].Source;                           \
+    sp++;                                                                      \
+    sp[0].Destination = tmp;                                                   \
+  } while (0)
+
+#define MANGO_COMPARE1(Type, Operator)                                         \
+  sp[1].i32 = sp[1].Type Operator sp[0].Type;                                  \
+  sp++
+
+#define MANGO_COMPARE2(Type, Operator)                                         \
+  do {                                                                         \
+    mango_value2 *sp2 = (mango_value2 *)sp;                                    \
+    int tmp = sp2[1].Type Operator sp2[0].Type;                                \
+    sp += 3;                                                                   \
+    sp[0].i32 = tmp;                                                           \
+  } while (0)
+
+#define MANGO_LOAD_FIELD(Offset, Cast, Type, Field)                            \
+  do {                                                                         \
+    MANGO_CHECK(Offset, MANGO_E_NULL_REFERENCE, sp[0].u32 == 0);               \
+    const Cast *field = (const Cast *)(MANGO_NATIVE_PTR(sp[0].u32) + (Field)); \
+    sp[0].Type = field[0];                                                     \
+  } while (0)
+
+#define MANGO_STORE_FIELD(Offset, Cast, Type, Field)                           \
+  do {                                                                         \
+    MANGO_CHECK(Offset, MANGO_E_NULL_REFERENCE, sp[1].u32 == 0);               \
+    Cast *field = (Cast *)(MANGO_NATIVE_PTR(sp[1].u32) + (Field));             \
+    field[0] = (Cast)sp[0].Type;                                               \
+    sp += 2;                                                                   \
+  } while (0)
+
+#define MANGO_LOAD_ELEMENT(Offset, Cast, Type)                                 \
+  do {                                                                         \
+    uint32_t index = sp[0].u32;                                                \
+    MANGO_CHECK(Offset, MANGO_E_INDEX_OUT_OF_RANGE, index >= sp[2].u32);       \
+    const Cast *array = (const Cast *)MANGO_NATIVE_PTR(sp[1].u32);             \
+    sp += 2;                                                                   \
+    sp[0].Type = array[index];                                                 \
+  } while (0)
+
+#define MANGO_STORE_ELEMENT(Offset, Cast)                                      \
+  do {                                                                         \
+    uint32_t index = sp[1].u32;                                                \
+    MANGO_CHECK(Offset, MANGO_E_INDEX_OUT_OF_RANGE, index >= sp[3].u32);       \
+    Cast *array = (Cast *)MANGO_NATIVE_PTR(sp[2].u32);                         \
+    array[index] = (Cast)sp[0].u32;                                            \
+    sp += 4;                                                                   \
+  } while (0)
+
+#ifdef __cplusplus
+}
+#endif
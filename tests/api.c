@@ -0,0 +1,703 @@
+/*
+ *  _____ _____ _____ _____ _____
+ * |     |  _  |   | |   __|     |
+ * | | | |     | | | |  |  |  |  |
+ * |_|_|_|__|__|_|___|_____|_____|
+ *
+ * Mango Virtual Machine 1.0-dev
+ *
+ * Copyright (c) 2018 Klaus Hartke
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+// api checks the parts of the embedding API that the images alone cannot
+// reach:
+//
+//   api images scratch
+//
+// It loads the images it needs from the images directory and writes its
+// files to the scratch directory. Each check that fails is printed; the exit
+// status is nonzero if any did. Checks of features the library was built
+// without expect MANGO_E_NOT_SUPPORTED or NULL instead.
+
+#include "mango.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(MANGO_FILE_CACHE) && MANGO_FILE_CACHE_SIZE != 2
+#error api expects MANGO_FILE_CACHE_SIZE to be 2
+#endif
+
+#define HEAP_SIZE 0x40000
+#define STACK_SIZE 0x1000
+
+#define CHECK(Condition)                                                       \
+  do {                                                                         \
+    if (!(Condition)) {                                                        \
+      printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #Condition);              \
+      failed = 1;                                                              \
+    }                                                                          \
+  } while (0)
+
+static const char *images;
+static const char *scratch;
+static int failed;
+
+static uint64_t memory[HEAP_SIZE / sizeof(uint64_t)];
+static uint64_t copy_memory[HEAP_SIZE / sizeof(uint64_t)];
+
+static const uint8_t main_name[12] = "main";
+static const uint8_t sub_name[12] = "sub";
+static const uint8_t sum_name[12] = "sum";
+static const uint8_t hook_name[12] = "hook";
+
+static void path_of(char *path, const char *directory, const char *name,
+                    const char *suffix) {
+  snprintf(path, FILENAME_MAX, "%s/%s%s", directory, name, suffix);
+}
+
+static uint8_t *load(const char *name, size_t *size) {
+  char path[FILENAME_MAX];
+  path_of(path, images, name, ".bin");
+  FILE *file = fopen(path, "rb");
+  uint8_t *image = malloc(UINT16_MAX + 1);
+
+  if (!file || !image) {
+    fprintf(stderr, "api: cannot read image: %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+  *size = fread(image, 1, UINT16_MAX + 1, file);
+  fclose(file);
+  return image;
+}
+
+// Runs the program until it stops and collects what system calls 1 and 2
+// print. Returns the number of values, or -1 if it did not succeed.
+static int run(mango_vm *vm, uint32_t budget, int64_t *values, int capacity,
+               int *timeouts) {
+  int count = 0;
+  mango_result result;
+
+  while ((result = mango_run_budget(vm, budget)) != MANGO_E_SUCCESS) {
+    if (result == MANGO_E_TIMEOUT && timeouts) {
+      (*timeouts)++;
+      continue;
+    }
+    if (result != MANGO_E_SYSTEM_CALL || count == capacity) {
+      return -1;
+    }
+
+    const uint32_t *top = mango_stack_top(vm);
+    switch (mango_syscall(vm)) {
+    case 1:
+      values[count++] = (int32_t)top[0];
+      mango_stack_free(vm, sizeof(uint32_t));
+      break;
+    case 2:
+      values[count++] = (int64_t)((uint64_t)top[1] << 32 | top[0]);
+      mango_stack_free(vm, sizeof(uint64_t));
+      break;
+    default:
+      return -1;
+    }
+  }
+  return count;
+}
+
+// Returns a VM that has run api_main, whose image must stay alive as long
+// as the VM.
+static mango_vm *start(void *address, const uint8_t *image, size_t size,
+                       void *context) {
+  mango_vm *vm = mango_initialize(address, HEAP_SIZE, STACK_SIZE, context);
+  if (!vm || mango_module_import(vm, main_name, image, size, NULL) !=
+                 MANGO_E_SUCCESS) {
+    return NULL;
+  }
+  if (run(vm, 0, NULL, 0, NULL) != 0) {
+    return NULL;
+  }
+  return vm;
+}
+
+static int32_t call_sub(mango_vm *vm, int32_t a, int32_t b) {
+  mango_value arguments[2] = {{.i32 = a}, {.i32 = b}};
+  mango_value result = {.i32 = -1};
+  uint32_t sub = mango_module_export(vm, main_name, sub_name);
+  if (mango_call(vm, sub, arguments, 2, &result, 1) != MANGO_E_SUCCESS) {
+    return -1;
+  }
+  return result.i32;
+}
+
+static void test_budget(void) {
+  size_t size;
+  uint8_t *image = load("test_loop", &size);
+  mango_vm *vm = mango_initialize(memory, HEAP_SIZE, STACK_SIZE, NULL);
+  CHECK(mango_module_import(vm, main_name, image, size, NULL) ==
+        MANGO_E_SUCCESS);
+
+  int64_t value = 0;
+  int timeouts = 0;
+#if !defined(MANGO_NO_BUDGET)
+  CHECK(run(vm, 10, &value, 1, &timeouts) == 1);
+  CHECK(value == 499500);
+  CHECK(timeouts > 10);
+#else
+  CHECK(mango_run_budget(vm, 10) == MANGO_E_NOT_SUPPORTED);
+  CHECK(run(vm, 0, &value, 1, &timeouts) == 1);
+  CHECK(value == 499500);
+  CHECK(timeouts == 0);
+#endif
+
+  mango_finalize(vm);
+  free(image);
+}
+
+static void test_call(void) {
+  size_t size;
+  uint8_t *image = load("api_main", &size);
+  mango_vm *vm = mango_initialize(memory, HEAP_SIZE, STACK_SIZE, NULL);
+  CHECK(mango_module_import(vm, main_name, image, size, NULL) ==
+        MANGO_E_SUCCESS);
+
+  uint32_t sub = mango_module_export(vm, main_name, sub_name);
+  uint32_t sum = mango_module_export(vm, main_name, sum_name);
+  CHECK(sub != 0 && sum != 0 && sub != sum);
+  CHECK(mango_module_export(vm, main_name, main_name) == 0);
+  CHECK(mango_module_export(vm, sub_name, sub_name) == 0);
+
+  mango_value arguments[6] = {{.i32 = 7}, {.i32 = 3},  {.i32 = 1},
+                              {.i32 = 5}, {.i32 = -2}, {.i32 = -2}};
+  mango_value results[3] = {{0}};
+
+  // Nothing can be called before the module initializers have run.
+  CHECK(mango_call(vm, sub, arguments, 2, results, 1) ==
+        MANGO_E_INVALID_OPERATION);
+  CHECK(run(vm, 0, NULL, 0, NULL) == 0);
+
+  CHECK(mango_call(vm, sub, arguments, 2, results, 1) == MANGO_E_SUCCESS);
+  CHECK(results[0].i32 == 4);
+
+  CHECK(mango_call_batch(vm, sub, arguments, 2, results, 1, 3) ==
+        MANGO_E_SUCCESS);
+  CHECK(results[0].i32 == 4 && results[1].i32 == -4 && results[2].i32 == 0);
+
+  mango_value n = {.i32 = 1000};
+  CHECK(mango_call(vm, sum, &n, 1, results, 1) == MANGO_E_SUCCESS);
+  CHECK(results[0].i32 == 499500);
+
+  CHECK(mango_call(NULL, sub, arguments, 2, results, 1) ==
+        MANGO_E_ARGUMENT_NULL);
+  CHECK(mango_call(vm, sub, NULL, 2, results, 1) == MANGO_E_ARGUMENT_NULL);
+  CHECK(mango_call(vm, sub, arguments, 2, NULL, 1) == MANGO_E_ARGUMENT_NULL);
+  CHECK(mango_call(vm, sub, arguments, 1, results, 1) == MANGO_E_ARGUMENT);
+  CHECK(mango_call(vm, sub, arguments, 2, results, 256) == MANGO_E_ARGUMENT);
+  CHECK(mango_call(vm, sub ^ 0xFF00, arguments, 2, results, 1) ==
+        MANGO_E_ARGUMENT);
+  CHECK(mango_call(vm, (sub & 0xFFFF) | 0x10000, arguments, 2, results, 1) ==
+        MANGO_E_ARGUMENT);
+  CHECK(mango_call(vm, (sub & 0xFFFF) | 0xFFFF0000, arguments, 2, results,
+                   1) == MANGO_E_ARGUMENT);
+
+  // A failed call leaves the VM usable.
+  CHECK(call_sub(vm, 10, 4) == 6);
+
+  mango_finalize(vm);
+  free(image);
+}
+
+#if defined(MANGO_SYSCALLS)
+mango_result api_times_ten(mango_vm *vm, union mango_value *sp,
+                           void *context);
+
+mango_result api_times_ten(mango_vm *vm, union mango_value *sp,
+                           void *context) {
+  (void)vm;
+  (*(int *)context)++;
+  sp[0].i32 *= 10;
+  return MANGO_E_SUCCESS;
+}
+#endif
+
+static mango_result times_hundred(mango_vm *vm, union mango_value *sp,
+                                  void *context) {
+  (void)vm;
+  (*(int *)context)++;
+  sp[0].i32 *= 100;
+  return MANGO_E_SUCCESS;
+}
+
+static void test_syscall(void) {
+  size_t size;
+  uint8_t *image = load("api_main", &size);
+  int calls = 0;
+  mango_vm *vm = start(memory, image, size, &calls);
+  CHECK(vm != NULL);
+
+  uint32_t hook = mango_module_export(vm, main_name, hook_name);
+  mango_value value = {.i32 = 4};
+  mango_result result = mango_call(vm, hook, &value, 1, &value, 1);
+
+#if defined(MANGO_SYSCALLS)
+  CHECK(result == MANGO_E_SUCCESS && value.i32 == 40 && calls == 1);
+#else
+  // Without a handler, the system call is left to the host.
+  CHECK(result == MANGO_E_SYSTEM_CALL && calls == 0);
+#endif
+
+#if defined(MANGO_SYSCALL_HANDLERS)
+  CHECK(mango_syscall_register(vm, 5, 0, times_hundred, &calls) ==
+        MANGO_E_SUCCESS);
+  value.i32 = 4;
+  CHECK(mango_call(vm, hook, &value, 1, &value, 1) == MANGO_E_SUCCESS);
+#if defined(MANGO_SYSCALLS)
+  // The handler bound at compile time takes precedence.
+  CHECK(value.i32 == 40 && calls == 2);
+#else
+  CHECK(value.i32 == 400 && calls == 1);
+#endif
+
+  CHECK(mango_syscall_register(vm, -1, 0, times_hundred, &calls) ==
+        MANGO_E_ARGUMENT);
+  CHECK(mango_syscall_register(vm, 0x10000, 0, times_hundred, &calls) ==
+        MANGO_E_ARGUMENT);
+  CHECK(mango_syscall_register(vm, 5, 200, times_hundred, &calls) ==
+        MANGO_E_ARGUMENT);
+  CHECK(mango_syscall_register(NULL, 5, 0, times_hundred, &calls) ==
+        MANGO_E_ARGUMENT_NULL);
+#else
+  CHECK(mango_syscall_register(vm, 5, 0, times_hundred, &calls) ==
+        MANGO_E_NOT_SUPPORTED);
+#endif
+
+  mango_finalize(vm);
+  free(image);
+}
+
+#if defined(MANGO_SYSCALL_HANDLERS) && defined(MANGO_NESTED_CALLS)
+static mango_result call_sum(mango_vm *vm, union mango_value *sp,
+                             void *context) {
+  uint32_t sum = mango_module_export(vm, main_name, sum_name);
+  mango_value value = {.i32 = -1};
+  mango_result result = mango_call(vm, sum, sp, 1, &value, 1);
+  *(mango_result *)context = result;
+  sp[0] = value;
+  return MANGO_E_SUCCESS;
+}
+
+// Runs api_nested with the budget and returns what it printed.
+static int64_t run_nested(const uint8_t *image, size_t size, uint32_t budget,
+                          mango_result *callback) {
+  mango_vm *vm = mango_initialize(memory, HEAP_SIZE, STACK_SIZE, NULL);
+  CHECK(mango_module_import(vm, main_name, image, size, NULL) ==
+        MANGO_E_SUCCESS);
+  CHECK(mango_syscall_register(vm, 6, 0, call_sum, callback) ==
+        MANGO_E_SUCCESS);
+
+  int64_t value = 0;
+  int timeouts = 0;
+  CHECK(run(vm, budget, &value, 1, &timeouts) == 1);
+  mango_finalize(vm);
+  return value;
+}
+#endif
+
+static void test_nested(void) {
+#if defined(MANGO_SYSCALL_HANDLERS) && defined(MANGO_NESTED_CALLS)
+  size_t size;
+  uint8_t *image = load("api_nested", &size);
+  mango_result callback = MANGO_E_SUCCESS;
+
+  CHECK(run_nested(image, size, 0, &callback) == 499500);
+  CHECK(callback == MANGO_E_SUCCESS);
+#if !defined(MANGO_NO_BUDGET)
+  CHECK(run_nested(image, size, 100000, &callback) == 499500);
+  CHECK(callback == MANGO_E_SUCCESS);
+  // The callback draws on the budget of the program and runs out.
+  CHECK(run_nested(image, size, 100, &callback) == -1);
+  CHECK(callback == MANGO_E_TIMEOUT);
+#endif
+
+  free(image);
+#endif
+}
+
+static int32_t twice(void *context, const mango_ring_request *request) {
+  (*(uint32_t *)context)++;
+  return (int32_t)(request->arguments[0] * 2);
+}
+
+static void submit(mango_ring *ring, uint32_t value) {
+  mango_ring_request *requests = (mango_ring_request *)(ring + 1);
+  requests[ring->submission_tail & (ring->size - 1)] =
+      (mango_ring_request){1, value, {value, 0}};
+  ring->submission_tail++;
+}
+
+static int32_t complete(mango_ring *ring, uint32_t *user_data) {
+  mango_ring_completion *completions =
+      (mango_ring_completion *)((mango_ring_request *)(ring + 1) + ring->size);
+  mango_ring_completion completion =
+      completions[ring->completion_head & (ring->size - 1)];
+  ring->completion_head++;
+  *user_data = completion.user_data;
+  return completion.result;
+}
+
+static void test_ring(void) {
+  mango_vm *vm = mango_initialize(memory, HEAP_SIZE, STACK_SIZE, NULL);
+  uint32_t calls = 0;
+  uint32_t user_data;
+
+  CHECK(mango_ring_create(vm, 0) == NULL);
+  CHECK(mango_ring_create(vm, 6) == NULL);
+  CHECK(mango_ring_create(vm, 0x20000) == NULL);
+
+  mango_ring *ring = mango_ring_create(vm, 4);
+  CHECK(ring != NULL && ring->size == 4);
+  CHECK(mango_ring_process(vm, ring, twice, &calls) == 0);
+
+  submit(ring, 1);
+  submit(ring, 2);
+  CHECK(mango_ring_process(vm, ring, twice, &calls) == 2);
+  CHECK(complete(ring, &user_data) == 2 && user_data == 1);
+  CHECK(complete(ring, &user_data) == 4 && user_data == 2);
+
+  // The indices wrap around.
+  ring->submission_head = ring->submission_tail = UINT32_MAX - 1;
+  ring->completion_head = ring->completion_tail = UINT32_MAX - 2;
+  for (uint32_t i = 0; i < 4; i++) {
+    submit(ring, 10 + i);
+  }
+  CHECK(mango_ring_process(vm, ring, twice, &calls) == 4);
+  for (uint32_t i = 0; i < 4; i++) {
+    CHECK(complete(ring, &user_data) == 20 + 2 * (int32_t)i);
+    CHECK(user_data == 10 + i);
+  }
+  CHECK(ring->completion_head == 1 && ring->submission_head == 2);
+
+  // Requests wait while the completions are full.
+  for (uint32_t i = 0; i < 4; i++) {
+    submit(ring, i);
+  }
+  CHECK(mango_ring_process(vm, ring, twice, &calls) == 4);
+  submit(ring, 4);
+  CHECK(mango_ring_process(vm, ring, twice, &calls) == 0);
+  CHECK(complete(ring, &user_data) == 0 && user_data == 0);
+  CHECK(mango_ring_process(vm, ring, twice, &calls) == 1);
+  CHECK(calls == 11);
+
+  // A ring the program made invalid is not processed.
+  submit(ring, 5);
+  ring->size = 3;
+  CHECK(mango_ring_process(vm, ring, twice, &calls) == 0);
+  ring->size = 0x10000;
+  CHECK(mango_ring_process(vm, ring, twice, &calls) == 0);
+  ring->size = 4;
+  mango_ring other = {4, 0, 1, 0, 0};
+  CHECK(mango_ring_process(vm, &other, twice, &calls) == 0);
+  CHECK(calls == 11);
+
+  mango_finalize(vm);
+}
+
+static void test_snapshot(void) {
+  size_t size;
+  uint8_t *image = load("api_main", &size);
+  mango_vm *vm = start(memory, image, size, NULL);
+  CHECK(vm != NULL);
+
+  char path[FILENAME_MAX];
+  path_of(path, scratch, "api", ".snapshot");
+  mango_snapshot_module module = {image, NULL, NULL};
+
+#if defined(MANGO_SNAPSHOT)
+  CHECK(mango_snapshot_save(vm, path) == MANGO_E_SUCCESS);
+  mango_finalize(vm);
+
+  int context;
+  mango_vm *restored = mango_snapshot_restore(path, &module, 1, &context);
+  CHECK(restored != NULL);
+  CHECK(mango_context(restored) == &context);
+  CHECK(call_sub(restored, 9, 2) == 7);
+  mango_finalize(restored);
+
+  // The snapshot only fits the images it was taken with.
+  uint8_t *other = malloc(size);
+  memcpy(other, image, size);
+  other[size - 1] ^= 1;
+  module.image = other;
+  CHECK(mango_snapshot_restore(path, &module, 1, NULL) == NULL);
+  module.image = image;
+  CHECK(mango_snapshot_restore(path, &module, 0, NULL) == NULL);
+  free(other);
+
+  // A truncated snapshot is refused, and one that cannot be written is not
+  // left behind.
+  FILE *file = fopen(path, "rb");
+  uint8_t *data = malloc(HEAP_SIZE);
+  size_t length = fread(data, 1, HEAP_SIZE, file);
+  fclose(file);
+  file = fopen(path, "wb");
+  CHECK(length > 1 && fwrite(data, 1, length - 1, file) == length - 1);
+  fclose(file);
+  free(data);
+  CHECK(mango_snapshot_restore(path, &module, 1, NULL) == NULL);
+  remove(path);
+
+  vm = start(memory, image, size, NULL);
+  path_of(path, scratch, "missing/api", ".snapshot");
+  CHECK(mango_snapshot_save(vm, path) == MANGO_E_INVALID_OPERATION);
+  CHECK(fopen(path, "rb") == NULL);
+#else
+  CHECK(mango_snapshot_save(vm, path) == MANGO_E_NOT_SUPPORTED);
+  CHECK(mango_snapshot_restore(path, &module, 1, NULL) == NULL);
+#endif
+
+  mango_finalize(vm);
+  free(image);
+}
+
+static void test_clone(void) {
+  size_t size;
+  uint8_t *image = load("api_main", &size);
+  mango_vm *vm = start(memory, image, size, NULL);
+  CHECK(vm != NULL);
+
+#if UINTPTR_MAX == UINT64_MAX
+  int context;
+  mango_vm *clone = mango_clone(vm, copy_memory, HEAP_SIZE, &context);
+  CHECK(clone != NULL && mango_context(clone) == &context);
+  CHECK(call_sub(clone, 5, 8) == -3);
+  CHECK(mango_clone(vm, copy_memory, 64, NULL) == NULL);
+  mango_finalize(clone);
+#endif
+
+  mango_template *source = mango_template_create(vm);
+#if defined(MANGO_SNAPSHOT) && defined(__linux__)
+  CHECK(source != NULL);
+  mango_vm *first = mango_template_clone(source, HEAP_SIZE, NULL);
+  mango_vm *second = mango_template_clone(source, 2 * HEAP_SIZE, NULL);
+  CHECK(first != NULL && second != NULL && first != second);
+  CHECK(mango_heap_size(second) == 2 * HEAP_SIZE);
+  CHECK(call_sub(first, 1, 2) == -1);
+  CHECK(call_sub(second, 3, 2) == 1);
+  CHECK(mango_template_clone(source, 64, NULL) == NULL);
+  mango_finalize(first);
+  mango_finalize(second);
+  mango_template_destroy(source);
+#else
+  CHECK(source == NULL);
+#endif
+
+  mango_finalize(vm);
+  free(image);
+}
+
+static void test_checkpoint(void) {
+  size_t size;
+  uint8_t *image = load("api_main", &size);
+  mango_vm *vm = start(memory, image, size, NULL);
+  CHECK(vm != NULL);
+
+  // Only a VM mapped from a template or a snapshot can take a checkpoint.
+  CHECK(mango_checkpoint(vm) == MANGO_E_NOT_SUPPORTED);
+
+#if defined(MANGO_SNAPSHOT) && defined(__linux__)
+  CHECK(mango_reset(vm) == MANGO_E_INVALID_OPERATION);
+  mango_template *source = mango_template_create(vm);
+  mango_vm *mapped = mango_template_clone(source, HEAP_SIZE, NULL);
+  CHECK(mapped != NULL);
+  CHECK(mango_reset(mapped) == MANGO_E_INVALID_OPERATION);
+
+  uint32_t *block = mango_heap_alloc(mapped, 4, sizeof(uint32_t),
+                                     sizeof(uint32_t), 0);
+  block[0] = 1;
+  CHECK(mango_checkpoint(mapped) == MANGO_E_SUCCESS);
+  size_t available = mango_heap_available(mapped);
+
+  block[0] = 2;
+  uint32_t *later = mango_heap_alloc(mapped, 4, sizeof(uint32_t),
+                                     sizeof(uint32_t), 0);
+  later[0] = 3;
+  CHECK(call_sub(mapped, 2, 2) == 0);
+
+  // Copies taken after the checkpoint start without one.
+  mango_vm *clone = mango_clone(mapped, copy_memory, HEAP_SIZE, NULL);
+  CHECK(clone != NULL && mango_reset(clone) == MANGO_E_INVALID_OPERATION);
+  mango_finalize(clone);
+  mango_template *later_source = mango_template_create(mapped);
+  mango_vm *later_copy = mango_template_clone(later_source, HEAP_SIZE, NULL);
+  CHECK(later_copy != NULL &&
+        mango_reset(later_copy) == MANGO_E_INVALID_OPERATION);
+  CHECK(mango_checkpoint(later_copy) == MANGO_E_SUCCESS);
+  mango_finalize(later_copy);
+  mango_template_destroy(later_source);
+
+  CHECK(mango_reset(mapped) == MANGO_E_SUCCESS);
+  CHECK(block[0] == 1 && later[0] == 0);
+  CHECK(mango_heap_available(mapped) == available);
+  CHECK(call_sub(mapped, 6, 1) == 5);
+
+  // The checkpoint stays until the next one.
+  block[0] = 4;
+  CHECK(mango_reset(mapped) == MANGO_E_SUCCESS);
+  CHECK(block[0] == 1);
+
+  mango_finalize(mapped);
+  mango_template_destroy(source);
+#else
+  CHECK(mango_reset(vm) == MANGO_E_NOT_SUPPORTED);
+#endif
+
+  mango_finalize(vm);
+  free(image);
+}
+
+#if defined(MANGO_FILE_CACHE)
+static const uint8_t *map(const char *name, size_t *size) {
+  char path[FILENAME_MAX];
+  path_of(path, images, name, ".bin");
+  return mango_module_map_file(path, size);
+}
+#endif
+
+static void test_file(void) {
+  char path[FILENAME_MAX];
+  path_of(path, images, "test_import", ".bin");
+  mango_vm *vm = mango_initialize(memory, HEAP_SIZE, STACK_SIZE, NULL);
+
+#if defined(MANGO_FILE_CACHE)
+  size_t size;
+  size_t other_size;
+  const uint8_t *image = map("test_loop", &size);
+  CHECK(image != NULL && map("test_loop", &other_size) == image);
+  CHECK(other_size == size);
+
+  // While both files are in use, a third cannot be mapped; once one of them
+  // is no longer used, it gives up its slot.
+  const uint8_t *fib = map("test_fib", &size);
+  CHECK(fib != NULL && fib != image);
+  CHECK(map("test_calls", &size) == NULL);
+  mango_module_unmap_file(fib);
+  const uint8_t *calls = map("test_calls", &size);
+  CHECK(calls != NULL);
+  mango_module_unmap_file(calls);
+  mango_module_unmap_file(image);
+  mango_module_unmap_file(image);
+
+  // The VM holds on to the files of its modules until it is finalized.
+  CHECK(mango_module_import_file(vm, main_name, path, NULL) ==
+        MANGO_E_SUCCESS);
+  path_of(path, images, "lib", ".bin");
+  CHECK(mango_module_import_file(vm, mango_module_missing(vm), path, NULL) ==
+        MANGO_E_SUCCESS);
+  CHECK(map("test_loop", &size) == NULL);
+
+  int64_t values[4];
+  CHECK(run(vm, 0, values, 4, NULL) == 4);
+  CHECK(values[0] == -1 && values[1] == 49 && values[2] == 25 &&
+        values[3] == -15);
+
+  mango_finalize(vm);
+  image = map("test_loop", &size);
+  CHECK(image != NULL);
+  mango_module_unmap_file(image);
+#else
+  CHECK(mango_module_import_file(vm, main_name, path, NULL) ==
+        MANGO_E_NOT_SUPPORTED);
+  mango_finalize(vm);
+#endif
+}
+
+typedef struct loaded_images {
+  const char *missing;
+  uint8_t *images[4];
+  size_t count;
+} loaded_images;
+
+static const uint8_t *resolve(void *context, const uint8_t *name,
+                              size_t *size, void **module_context) {
+  loaded_images *loaded = context;
+  char file[13];
+  snprintf(file, sizeof(file), "%.12s", (const char *)name);
+
+  if (strcmp(file, loaded->missing) == 0 || loaded->count == 4) {
+    return NULL;
+  }
+  *module_context = NULL;
+  return loaded->images[loaded->count++] =
+             load(strcmp(file, "main") == 0 ? "test_link" : file, size);
+}
+
+static void test_import_all(void) {
+  mango_vm *vm = mango_initialize(memory, HEAP_SIZE, STACK_SIZE, NULL);
+  loaded_images loaded = {"link_b", {NULL}, 0};
+
+  // A module that cannot be found leaves the VM as it was.
+  CHECK(mango_module_import_all(vm, main_name, resolve, &loaded) ==
+        MANGO_E_ARGUMENT);
+  CHECK(mango_module_missing(vm) == NULL);
+  for (size_t i = 0; i < loaded.count; i++) {
+    free(loaded.images[i]);
+  }
+
+  loaded = (loaded_images){"", {NULL}, 0};
+  CHECK(mango_module_import_all(vm, main_name, resolve, &loaded) ==
+        MANGO_E_SUCCESS);
+  CHECK(loaded.count == 4);
+  CHECK(mango_module_import_all(vm, main_name, resolve, &loaded) ==
+        MANGO_E_INVALID_OPERATION);
+
+  int64_t values[5];
+  CHECK(run(vm, 0, values, 5, NULL) == 5);
+  CHECK(values[0] == 3 && values[1] == 2 && values[2] == 1 &&
+        values[3] == 1 && values[4] == 2);
+
+  mango_finalize(vm);
+  for (size_t i = 0; i < loaded.count; i++) {
+    free(loaded.images[i]);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 3) {
+    fputs("usage: api images scratch\n", stderr);
+    return EXIT_FAILURE;
+  }
+  images = argv[1];
+  scratch = argv[2];
+
+  test_budget();
+  test_call();
+  test_syscall();
+  test_nested();
+  test_ring();
+  test_snapshot();
+  test_clone();
+  test_checkpoint();
+  test_file();
+  test_import_all();
+
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,124 @@
+# Assembler for the Mango test and benchmark images.
+#
+# A Module collects the functions of one module image. Operands follow the
+# encoding in src/mango_opcodes.inc; branches, CALL_S, CALL and LDFTN take a
+# label, which is resolved when the image is built.
+
+import os
+import re
+import struct
+
+_OPCODES = {}
+with open(os.path.join(os.path.dirname(__file__), '..', 'src',
+                       'mango_opcodes.inc')) as f:
+    for line in f:
+        m = re.match(r'OPCODE\((\w+),\s*"[^"]*",\s*-?\d+,\s*-?\d+,'
+                     r'\s*(-?\d+),\s*(0x[0-9A-F]+)\)', line)
+        if m:
+            _OPCODES[m.group(1)] = (int(m.group(3), 16), int(m.group(2)))
+
+_SHORT_BRANCHES = ('BR_S', 'BRFALSE_S', 'BRTRUE_S')
+_BRANCHES = ('BR', 'BRFALSE', 'BRTRUE')
+
+FEATURE_EXPORTS = 0x08
+
+
+def _hash(name):
+    h = 2166136261
+    for c in name:
+        h = ((h ^ c) * 16777619) & 0xFFFFFFFF
+    return h
+
+
+def _name(name):
+    return name.encode().ljust(12, b'\0')
+
+
+class Module:
+    def __init__(self, name, imports=(), module_count=1, exports=()):
+        self.name = name
+        self.imports = list(imports)
+        self.exports = list(exports)
+        self.labels = {}
+        self.fixups = []
+        features = FEATURE_EXPORTS if self.exports else 0
+        self.code = bytearray([1, features, module_count, len(self.imports)])
+        self.code += bytes([_OPCODES['NOP'][0]] * 3 + [_OPCODES['HALT'][0]])
+        for n in self.imports:
+            self.code += _name(n)
+        if self.exports:
+            self.slots = 1 << (2 * len(self.exports) - 1).bit_length()
+            self.export_table = len(self.code)
+            self.code += struct.pack('<HH', self.slots, 0)
+            self.code += bytes(16 * self.slots)
+
+    def entry(self, label):
+        self.code[4] = _OPCODES['CALL_S'][0]
+        self.fixups.append((4, 'CALL_S', label))
+
+    def func(self, label, arg_count, loc_count, max_stack):
+        self.labels[label] = len(self.code)
+        self.code += bytes([arg_count, loc_count, max_stack])
+
+    def label(self, label):
+        self.labels[label] = len(self.code)
+
+    def op(self, name, *operands):
+        code, size = _OPCODES[name]
+        at = len(self.code)
+        self.code.append(code)
+        if name in _SHORT_BRANCHES or name in _BRANCHES or name == 'CALL_S':
+            self.fixups.append((at, name, operands[0]))
+            self.code += bytes(size)
+        elif name in ('CALL', 'LDFTN'):
+            module = operands[1] if len(operands) > 1 else 255
+            self.fixups.append((at, name, operands[0]))
+            self.code += bytes([module, 0, 0])
+        elif name == 'SYSCALL':
+            self.code += struct.pack('<bH', *operands)
+        elif name == 'LDC_I32_S':
+            self.code += struct.pack('<b', operands[0])
+        elif name == 'LDC_X32':
+            self.code += struct.pack('<I', operands[0] & 0xFFFFFFFF)
+        elif name == 'LDC_X64':
+            self.code += struct.pack('<Q', operands[0] & (1 << 64) - 1)
+        elif name == 'MAKEARR':
+            size, values = operands
+            self.code += struct.pack('<HH', size, len(values))
+            for v in values:
+                self.code += v.to_bytes(size, 'little')
+        elif size == 1:
+            self.code += struct.pack('<B', operands[0])
+        elif size == 2:
+            self.code += struct.pack('<H', operands[0])
+        elif size != 0:
+            raise ValueError(name)
+
+    def build(self, labels=None):
+        labels = dict(labels or {}, **self.labels)
+        code = bytearray(self.code)
+        for at, name, label in self.fixups:
+            target = labels[label]
+            if name in _SHORT_BRANCHES:
+                offset = target - (at + 2)
+                assert -128 <= offset < 128, (self.name, label)
+                code[at + 1] = offset & 0xFF
+            elif name in _BRANCHES:
+                code[at + 1:at + 3] = struct.pack('<h', target - (at + 3))
+            elif name == 'CALL_S':
+                code[at + 1:at + 3] = struct.pack('<H', target)
+            else:
+                code[at + 2:at + 4] = struct.pack('<H', target)
+        for n in self.exports:
+            i = _hash(_name(n)) & (self.slots - 1)
+            while struct.unpack_from('<H', code,
+                                     self.export_table + 16 + 16 * i)[0]:
+                i = (i + 1) & (self.slots - 1)
+            slot = self.export_table + 4 + 16 * i
+            code[slot:slot + 16] = _name(n) + struct.pack('<HH',
+                                                          self.labels[n], 0)
+        return bytes(code)
+
+    def save(self, path, labels=None):
+        with open(path, 'wb') as f:
+            f.write(self.build(labels))
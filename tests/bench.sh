@@ -0,0 +1,48 @@
+#!/bin/sh
+# Compares the interpreter variants on the benchmark images:
+#
+#   tests/bench.sh [runs]
+#
+# The host is built once per variant with $CC and $CFLAGS. Each image is
+# timed by the best of the given number of runs (default 5).
+
+set -e
+
+cd "$(dirname "$0")/.."
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O3}
+RUNS=${1:-5}
+BIN=$(mktemp -d)
+trap 'rm -rf "$BIN"' EXIT
+
+build() {
+  name=$1
+  shift
+  $CC $CFLAGS -std=c11 -Isrc "$@" -o "$BIN/$name" tests/host.c src/mango.c -lm
+}
+
+best() {
+  i=0
+  t=
+  while [ $i -lt "$RUNS" ]; do
+    s=$("$BIN/$1" -t "$2" 2>&1 >/dev/null)
+    t=$(printf '%s\n%s\n' "$s" "$t" | sed '/^$/d' | sort -n | head -n 1)
+    i=$((i + 1))
+  done
+  printf ' %11s' "${t}s"
+}
+
+build byte
+build byte-tos -DMANGO_TOS_CACHE
+build threaded -DMANGO_THREADED_CODE
+build threaded-tos -DMANGO_THREADED_CODE -DMANGO_TOS_CACHE
+
+printf '%-12s %11s %11s %11s %11s\n' '' 'byte code' '+TOS' 'threaded' '+TOS'
+for image in tests/images/bench_*.bin; do
+  name=$(basename "$image" .bin)
+  printf '%-12s' "${name#bench_}"
+  for variant in byte byte-tos threaded threaded-tos; do
+    best $variant "$image"
+  done
+  printf '\n'
+done
@@ -0,0 +1,196 @@
+/*
+ *  _____ _____ _____ _____ _____
+ * |     |  _  |   | |   __|     |
+ * | | | |     | | | |  |  |  |  |
+ * |_|_|_|__|__|_|___|_____|_____|
+ *
+ * Mango Virtual Machine 1.0-dev
+ *
+ * Copyright (c) 2018 Klaus Hartke
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+// host runs a module image the way an embedding application would:
+//
+//   host [-b budget] [-j] [-p] [-t] image
+//
+// Imports are loaded from name.bin next to the image. System call 1 prints
+// an i32 and system call 2 an i64 from the top of the stack. Any other result
+// than success is printed as "result n". With -b, the program runs with the
+// given budget and is resumed whenever it runs out. With -j, the VM is
+// initialized with the JIT. With -p, the modules are linked into a program
+// and run by a VM attached to it. With -t, the time spent in the interpreter
+// is written to stderr.
+//
+// Built with -DHOST_NATIVE and the output of mango-aot for the image, the
+// host imports mango_native_main instead; the image is then only used to
+// find the imports.
+
+#include "mango.h"
+#if defined(HOST_NATIVE)
+#include "mango_native.h"
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define HEAP_SIZE 0x100000
+#define STACK_SIZE 0x1000
+
+#if defined(HOST_NATIVE)
+extern const mango_native_module mango_native_main;
+#endif
+
+static const char *directory;
+static int directory_length;
+
+static uint8_t *load(const char *path, size_t *size) {
+  FILE *file = fopen(path, "rb");
+  uint8_t *image = malloc(UINT16_MAX + 1);
+
+  if (!file || !image) {
+    fprintf(stderr, "host: cannot read image: %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+  *size = fread(image, 1, UINT16_MAX + 1, file);
+  fclose(file);
+  return image;
+}
+
+static mango_result import_missing(mango_vm *vm) {
+  const uint8_t *name;
+  mango_result result = MANGO_E_SUCCESS;
+
+  while (result == MANGO_E_SUCCESS && (name = mango_module_missing(vm))) {
+    char path[FILENAME_MAX];
+    size_t size;
+    snprintf(path, sizeof(path), "%.*s%.12s.bin", directory_length, directory,
+             (const char *)name);
+    const uint8_t *image = load(path, &size);
+    result = mango_module_import(vm, name, image, size, NULL);
+  }
+  return result;
+}
+
+static double now(void) {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+  static uint64_t memory[HEAP_SIZE / sizeof(uint64_t)];
+  static const uint8_t main_name[12] = "main";
+  uint32_t budget = 0;
+  int flags = 0;
+  int linked = 0;
+  int timed = 0;
+  int arg = 1;
+
+  for (; arg < argc - 1; arg++) {
+    if (strcmp(argv[arg], "-b") == 0 && arg < argc - 2) {
+      budget = (uint32_t)strtoul(argv[++arg], NULL, 0);
+    } else if (strcmp(argv[arg], "-j") == 0) {
+      flags |= MANGO_INITIALIZE_JIT;
+    } else if (strcmp(argv[arg], "-p") == 0) {
+      linked = 1;
+    } else if (strcmp(argv[arg], "-t") == 0) {
+      timed = 1;
+    } else {
+      break;
+    }
+  }
+  if (arg != argc - 1) {
+    fputs("usage: host [-b budget] [-j] [-p] [-t] image\n", stderr);
+    return EXIT_FAILURE;
+  }
+
+  const char *path = argv[arg];
+  const char *slash = strrchr(path, '/');
+  directory = path;
+  directory_length = slash ? (int)(slash - path + 1) : 0;
+
+  mango_vm *vm =
+      mango_initialize_ex(memory, sizeof(memory), STACK_SIZE, flags, NULL);
+  if (!vm) {
+    fputs("host: cannot initialize the VM\n", stderr);
+    return EXIT_FAILURE;
+  }
+
+#if defined(HOST_NATIVE)
+  mango_result result =
+      mango_module_import_native(vm, main_name, &mango_native_main, NULL);
+#else
+  size_t size;
+  const uint8_t *image = load(path, &size);
+  mango_result result = mango_module_import(vm, main_name, image, size, NULL);
+#endif
+  if (result == MANGO_E_SUCCESS) {
+    result = import_missing(vm);
+  }
+
+  mango_program *program = NULL;
+  if (linked && result == MANGO_E_SUCCESS) {
+    static uint64_t linked_memory[HEAP_SIZE / sizeof(uint64_t)];
+    size_t linked_size = sizeof(linked_memory);
+    program = mango_program_link(vm, linked_memory, &linked_size);
+    mango_finalize(vm);
+    vm = mango_initialize_ex(memory, sizeof(memory), STACK_SIZE, flags, NULL);
+    result = program ? mango_attach(vm, program) : MANGO_E_INVALID_OPERATION;
+  }
+
+  double start = now();
+  while (result == MANGO_E_SUCCESS || result == MANGO_E_SYSTEM_CALL) {
+    do {
+      result = mango_run_budget(vm, budget);
+    } while (result == MANGO_E_TIMEOUT);
+    if (result != MANGO_E_SYSTEM_CALL) {
+      break;
+    }
+
+    const uint32_t *top = mango_stack_top(vm);
+    switch (mango_syscall(vm)) {
+    case 1:
+      printf("%d\n", (int32_t)top[0]);
+      mango_stack_free(vm, sizeof(uint32_t));
+      break;
+    case 2:
+      printf("%lld\n", (long long)((uint64_t)top[1] << 32 | top[0]));
+      mango_stack_free(vm, sizeof(uint64_t));
+      break;
+    default:
+      result = MANGO_E_SYSTEM_CALL_NOT_FOUND;
+      break;
+    }
+  }
+  if (timed) {
+    fprintf(stderr, "%.3f\n", now() - start);
+  }
+
+  if (result != MANGO_E_SUCCESS) {
+    printf("result %d\n", result);
+  }
+  mango_finalize(vm);
+  mango_program_finalize(program);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,422 @@
+# Builds the images in tests/images. Run it after changing an image below or
+# the opcode table; the generated images are checked in.
+
+import os
+import sys
+
+sys.path.insert(0, os.path.dirname(__file__))
+from asm import Module
+
+OUT = os.path.join(os.path.dirname(__file__), 'images')
+
+
+def save(m, name, labels=None, expect=None):
+    m.save(os.path.join(OUT, name + '.bin'), labels)
+    if expect is not None:
+        with open(os.path.join(OUT, name + '.out'), 'w') as f:
+            f.write(expect)
+
+
+# Benchmarks. Each prints one number through system call 1.
+
+# Sum of i for i < 50,000,000: local loads and stores, i32 arithmetic and a
+# backward branch.
+m = Module('main')
+m.entry('f')
+m.func('f', 0, 2, 4)
+m.label('loop')
+m.op('LDLOC_X32', 0); m.op('LDLOC_X32', 2); m.op('ADD_I32'); m.op('STLOC_X32', 1)
+m.op('LDLOC_X32', 1); m.op('LDC_I32_1'); m.op('ADD_I32'); m.op('DUP_X32')
+m.op('STLOC_X32', 3)
+m.op('LDC_X32', 50000000); m.op('CLT_I32'); m.op('BRTRUE_S', 'loop')
+m.op('LDLOC_X32', 0); m.op('SYSCALL', 1, 1)
+m.op('RET')
+save(m, 'bench_loop')
+
+# 20,000,000 rounds of an LCG hash chain: longer expressions on the stack.
+m = Module('main')
+m.entry('f')
+m.func('f', 0, 2, 6)
+m.label('loop')
+m.op('LDLOC_X32', 0); m.op('LDC_X32', 1103515245); m.op('MUL_I32')
+m.op('LDC_X32', 12345); m.op('ADD_I32')
+m.op('DUP_X32'); m.op('LDC_I32_S', 16); m.op('SHR_I32_UN'); m.op('XOR_I32')
+m.op('DUP_X32'); m.op('LDC_I32_5'); m.op('SHL_I32'); m.op('SUB_I32')
+m.op('NOT_I32')
+m.op('STLOC_X32', 1)
+m.op('LDLOC_X32', 1); m.op('LDC_I32_1'); m.op('ADD_I32'); m.op('DUP_X32')
+m.op('STLOC_X32', 3)
+m.op('LDC_X32', 20000000); m.op('CLT_I32'); m.op('BRTRUE_S', 'loop')
+m.op('LDLOC_X32', 0); m.op('SYSCALL', 1, 1)
+m.op('RET')
+save(m, 'bench_lcg')
+
+# Recursive fib(30): calls and returns, which spill the cached top of stack.
+m = Module('main')
+m.entry('main')
+m.func('main', 0, 0, 2)
+m.op('LDC_I32_S', 30); m.op('CALL_S', 'fib'); m.op('SYSCALL', 1, 1)
+m.op('RET')
+m.func('fib', 1, 0, 3)
+m.op('LDLOC_X32', 0); m.op('LDC_I32_2'); m.op('CLT_I32')
+m.op('BRFALSE_S', 'recurse')
+m.op('LDLOC_X32', 0); m.op('RET_X32')
+m.label('recurse')
+m.op('LDLOC_X32', 0); m.op('LDC_I32_1'); m.op('SUB_I32'); m.op('CALL_S', 'fib')
+m.op('LDLOC_X32', 1); m.op('LDC_I32_2'); m.op('SUB_I32'); m.op('CALL_S', 'fib')
+m.op('ADD_I32'); m.op('RET_X32')
+save(m, 'bench_fib')
+
+
+# Regression tests. Each test_ image is run by tests/run.sh, directly and
+# through mango-opt and mango-aot, and its output compared with the .out file
+# next to it. Imports are resolved from the other images in this directory.
+
+# Locals, i32 arithmetic and a backward branch.
+m = Module('main')
+m.entry('f')
+m.func('f', 0, 2, 4)
+m.label('loop')
+m.op('LDLOC_X32', 0); m.op('LDLOC_X32', 2); m.op('ADD_I32'); m.op('STLOC_X32', 1)
+m.op('LDLOC_X32', 1); m.op('LDC_I32_1'); m.op('ADD_I32'); m.op('DUP_X32')
+m.op('STLOC_X32', 3)
+m.op('LDC_X32', 1000); m.op('CLT_I32'); m.op('BRTRUE_S', 'loop')
+m.op('LDLOC_X32', 0); m.op('SYSCALL', 1, 1)
+m.op('RET')
+save(m, 'test_loop', expect='499500\n')
+
+# Recursion through CALL_S and RET_X32.
+m = Module('main')
+m.entry('main')
+m.func('main', 0, 0, 2)
+m.op('LDC_I32_S', 25); m.op('CALL_S', 'fib'); m.op('SYSCALL', 1, 1)
+m.op('RET')
+m.func('fib', 1, 0, 3)
+m.op('LDLOC_X32', 0); m.op('LDC_I32_2'); m.op('CLT_I32')
+m.op('BRFALSE_S', 'recurse')
+m.op('LDLOC_X32', 0); m.op('RET_X32')
+m.label('recurse')
+m.op('LDLOC_X32', 0); m.op('LDC_I32_1'); m.op('SUB_I32'); m.op('CALL_S', 'fib')
+m.op('LDLOC_X32', 1); m.op('LDC_I32_2'); m.op('SUB_I32'); m.op('CALL_S', 'fib')
+m.op('ADD_I32'); m.op('RET_X32')
+save(m, 'test_fib', expect='75025\n')
+
+# Calls into an imported module, directly and through a function token, the
+# initializer of the import and i64 arithmetic.
+lib = Module('lib')
+lib.entry('init')
+lib.func('init', 0, 0, 1)
+lib.op('LDC_I32_S', -1); lib.op('SYSCALL', 1, 1)
+lib.op('RET')
+lib.func('square', 1, 0, 2)
+lib.op('LDLOC_X32', 0); lib.op('LDLOC_X32', 1); lib.op('MUL_I32')
+lib.op('RET_X32')
+save(lib, 'lib')
+m = Module('main', imports=['lib'], module_count=2)
+m.entry('main')
+m.func('main', 0, 0, 4)
+m.op('LDC_I32_7'); m.op('CALL', 'square', 0); m.op('SYSCALL', 1, 1)
+m.op('LDC_I32_5'); m.op('LDFTN', 'square', 0); m.op('CALLI')
+m.op('SYSCALL', 1, 1)
+m.op('LDC_X64', -5); m.op('LDC_X64', 3); m.op('MUL_I64'); m.op('SYSCALL', 2, 2)
+m.op('RET')
+save(m, 'test_import', lib.labels, expect='-1\n49\n25\n-15\n')
+
+# Array stores and loads in counted loops, then a load out of range.
+m = Module('main')
+m.entry('main')
+m.func('main', 0, 4, 8)
+m.op('LDC_I32_S', 100); m.op('NEWARR', 4); m.op('STLOC_X64', 2)
+m.label('fill')
+m.op('LDLOC_X64', 0); m.op('LDLOC_X32', 4); m.op('LDLOC_X32', 5)
+m.op('LDLOC_X32', 6); m.op('MUL_I32'); m.op('STELEM_X32')
+m.op('LDLOC_X32', 2); m.op('LDC_I32_1'); m.op('ADD_I32'); m.op('DUP_X32')
+m.op('STLOC_X32', 4)
+m.op('LDC_I32_S', 100); m.op('CLT_I32'); m.op('BRTRUE_S', 'fill')
+m.op('LDC_I32_0'); m.op('STLOC_X32', 4); m.op('LDC_I32_0'); m.op('STLOC_X32', 3)
+m.label('sum')
+m.op('LDLOC_X32', 3); m.op('LDLOC_X64', 1); m.op('LDLOC_X32', 5)
+m.op('LDELEM_X32'); m.op('ADD_I32'); m.op('STLOC_X32', 4)
+m.op('LDLOC_X32', 2); m.op('LDC_I32_1'); m.op('ADD_I32'); m.op('DUP_X32')
+m.op('STLOC_X32', 4)
+m.op('LDC_I32_S', 100); m.op('CLT_I32'); m.op('BRTRUE_S', 'sum')
+m.op('LDLOC_X32', 3); m.op('SYSCALL', 1, 1)
+m.op('LDLOC_X64', 0); m.op('LDC_I32_S', 100); m.op('LDELEM_X32'); m.op('POP_X32')
+m.op('RET')
+save(m, 'test_array', expect='328350\nresult 86\n')
+
+# Loops whose bounds checks can be dropped, via a copied length and via the
+# length half of the array reference, and one that replaces the array inside
+# the loop and must stay checked.
+m = Module('main')
+m.entry('f')
+m.func('f', 0, 5, 8)
+m.op('LDC_I32_S', 50); m.op('NEWARR', 4); m.op('STLOC_X64', 2)
+m.op('LDLOC_X32', 1); m.op('STLOC_X32', 4)
+m.op('LDC_I32_0'); m.op('STLOC_X32', 3)
+m.label('fill')
+m.op('LDLOC_X32', 2); m.op('LDLOC_X32', 4); m.op('CLT_I32')
+m.op('BRFALSE_S', 'filled')
+m.op('LDLOC_X64', 0); m.op('LDLOC_X32', 4); m.op('LDLOC_X32', 5)
+m.op('LDC_I32_3'); m.op('MUL_I32'); m.op('STELEM_X32')
+m.op('LDLOC_X32', 2); m.op('LDC_I32_1'); m.op('ADD_I32'); m.op('STLOC_X32', 3)
+m.op('BR_S', 'fill')
+m.label('filled')
+m.op('LDC_I32_0'); m.op('STLOC_X32', 3)
+m.label('sum')
+m.op('LDLOC_X32', 2); m.op('LDLOC_X32', 2); m.op('CLT_I32_UN')
+m.op('BRFALSE_S', 'summed')
+m.op('LDLOC_X32', 4); m.op('LDLOC_X64', 1); m.op('LDLOC_X32', 5)
+m.op('LDELEM_X32'); m.op('ADD_I32'); m.op('STLOC_X32', 5)
+m.op('LDLOC_X32', 2); m.op('LDC_I32_1'); m.op('ADD_I32'); m.op('STLOC_X32', 3)
+m.op('BR_S', 'sum')
+m.label('summed')
+m.op('LDLOC_X32', 4); m.op('SYSCALL', 1, 1)
+m.op('LDC_I32_0'); m.op('STLOC_X32', 3)
+m.label('replace')
+m.op('LDLOC_X32', 2); m.op('LDLOC_X32', 4); m.op('CLT_I32')
+m.op('BRFALSE_S', 'replaced')
+m.op('LDC_I32_5'); m.op('NEWARR', 4); m.op('STLOC_X64', 2)
+m.op('LDLOC_X64', 0); m.op('LDLOC_X32', 4); m.op('LDELEM_X32'); m.op('POP_X32')
+m.op('LDLOC_X32', 2); m.op('LDC_I32_1'); m.op('ADD_I32'); m.op('STLOC_X32', 3)
+m.op('BR_S', 'replace')
+m.label('replaced')
+m.op('RET')
+save(m, 'test_bounds', expect='3675\nresult 86\n')
+
+# Sequences the interpreter fuses into superinstructions, a branch into the
+# middle of one, and a fused load out of range.
+m = Module('main')
+m.entry('main')
+m.func('main', 0, 4, 8)
+m.op('LDC_I32_S', 10); m.op('NEWARR', 4); m.op('STLOC_X64', 2)
+m.label('fill')
+m.op('LDLOC_X32', 2); m.op('LDC_I32_S', 10); m.op('CLT_I32')
+m.op('BRFALSE_S', 'filled')
+m.op('LDLOC_X64', 0); m.op('LDLOC_X32', 4); m.op('LDLOC_X32', 5)
+m.op('LDC_I32_3'); m.op('MUL_I32'); m.op('STELEM_X32')
+m.op('LDLOC_X32', 2); m.op('LDC_I32_1'); m.op('ADD_I32'); m.op('STLOC_X32', 3)
+m.op('BR_S', 'fill')
+m.label('filled')
+m.op('LDC_I32_S', 10); m.op('STLOC_X32', 3)
+m.label('sum')
+m.op('LDLOC_X32', 2); m.op('LDC_I32_M1'); m.op('ADD_I32'); m.op('STLOC_X32', 3)
+m.op('LDLOC_X32', 3); m.op('LDLOC_X64', 1); m.op('LDLOC_X32', 5)
+m.op('LDELEM_X32'); m.op('ADD_I32'); m.op('STLOC_X32', 4)
+m.op('LDLOC_X32', 2); m.op('DUP_X32'); m.op('BRTRUE_S', 'next')
+m.op('POP_X32'); m.op('BR_S', 'summed')
+m.label('next')
+m.op('POP_X32'); m.op('BR_S', 'sum')
+m.label('summed')
+m.op('LDLOC_X32', 2); m.op('BRTRUE_S', 'nonzero')
+m.op('LDC_I32_0'); m.op('BR_S', 'join')
+m.label('nonzero')
+m.op('LDLOC_X32', 3)
+m.label('join')
+m.op('LDLOC_X32', 4); m.op('ADD_I32'); m.op('SYSCALL', 1, 1)
+m.op('LDLOC_X32', 1); m.op('LDLOC_X32', 3); m.op('ADD_I32'); m.op('SYSCALL', 1, 1)
+m.op('LDC_I32_S', 10); m.op('STLOC_X32', 3)
+m.op('LDLOC_X64', 0); m.op('LDLOC_X32', 4); m.op('LDELEM_X32'); m.op('POP_X32')
+m.op('RET')
+save(m, 'test_fused', expect='135\n10\nresult 86\n')
+
+# Field access and division.
+m = Module('main')
+m.entry('f')
+m.func('f', 0, 2, 6)
+m.op('NEWOBJ', 8); m.op('STLOC_X32', 1)
+m.label('loop')
+m.op('LDLOC_X32', 0); m.op('LDLOC_X32', 1); m.op('LDFLD_X32', 0)
+m.op('LDC_I32_1'); m.op('ADD_I32'); m.op('STFLD_X32', 0)
+m.op('LDLOC_X32', 1); m.op('LDC_I32_1'); m.op('ADD_I32'); m.op('DUP_X32')
+m.op('STLOC_X32', 3)
+m.op('LDC_X32', 1000); m.op('CLT_I32'); m.op('BRTRUE_S', 'loop')
+m.op('LDLOC_X32', 0); m.op('LDFLD_X32', 0); m.op('LDC_I32_7'); m.op('DIV_I32')
+m.op('SYSCALL', 1, 1)
+m.op('LDLOC_X32', 0); m.op('LDFLD_X32', 0); m.op('LDC_I32_7'); m.op('REM_I32')
+m.op('SYSCALL', 1, 1)
+m.op('LDLOC_X32', 1); m.op('LDC_I32_3'); m.op('DIV_I32_UN'); m.op('SYSCALL', 1, 1)
+m.op('RET')
+save(m, 'test_field', expect='142\n6\n333\n')
+
+# A call graph with an acyclic chain, a function token and recursion.
+m = Module('main')
+m.entry('main')
+m.func('main', 0, 2, 6)
+m.label('loop')
+m.op('LDLOC_X32', 1); m.op('LDLOC_X32', 1); m.op('CALL_S', 'a'); m.op('ADD_I32')
+m.op('STLOC_X32', 2)
+m.op('LDLOC_X32', 0); m.op('LDC_I32_1'); m.op('ADD_I32'); m.op('DUP_X32')
+m.op('STLOC_X32', 2)
+m.op('LDC_X32', 1000); m.op('CLT_I32'); m.op('BRTRUE_S', 'loop')
+m.op('LDLOC_X32', 1); m.op('SYSCALL', 1, 1)
+m.op('LDFTN', 'c'); m.op('CALLI'); m.op('SYSCALL', 1, 1)
+m.op('LDC_I32_S', 20); m.op('CALL_S', 'r'); m.op('SYSCALL', 1, 1)
+m.op('RET')
+m.func('a', 1, 0, 3)
+m.op('LDLOC_X32', 0); m.op('CALL_S', 'b'); m.op('LDC_I32_1'); m.op('ADD_I32')
+m.op('RET_X32')
+m.func('b', 1, 0, 2)
+m.op('LDLOC_X32', 0); m.op('LDC_I32_2'); m.op('MUL_I32'); m.op('RET_X32')
+m.func('c', 0, 0, 2)
+m.op('LDC_I32_7'); m.op('CALL_S', 'b'); m.op('RET_X32')
+m.func('r', 1, 0, 3)
+m.op('LDLOC_X32', 0); m.op('BRFALSE_S', 'zero')
+m.op('LDLOC_X32', 0); m.op('LDLOC_X32', 1); m.op('LDC_I32_1'); m.op('SUB_I32')
+m.op('CALL_S', 'r'); m.op('ADD_I32'); m.op('RET_X32')
+m.label('zero')
+m.op('LDC_I32_0'); m.op('RET_X32')
+save(m, 'test_calls', expect='1000000\n14\n210\n')
+
+# A deep acyclic call chain.
+m = Module('main')
+m.entry('f0')
+for k in range(40):
+    m.func('f%d' % k, 0, 8, 2)
+    if k < 39:
+        m.op('CALL_S', 'f%d' % (k + 1))
+    m.op('RET')
+save(m, 'test_chain', expect='')
+
+# A breakpoint before a division by zero.
+m = Module('main')
+m.entry('f')
+m.func('f', 0, 0, 2)
+m.op('BREAK'); m.op('LDC_I32_1'); m.op('LDC_I32_0'); m.op('DIV_I32')
+m.op('POP_X32'); m.op('RET')
+save(m, 'test_break', expect='result 110\n')
+
+m = Module('main')
+m.entry('f')
+m.func('f', 0, 0, 2)
+m.op('LDC_I32_1'); m.op('LDC_I32_0'); m.op('DIV_I32'); m.op('POP_X32')
+m.op('RET')
+save(m, 'test_divide', expect='result 85\n')
+
+# Folding, dead stores and jump threading for mango-opt.
+m = Module('main')
+m.entry('f')
+m.func('f', 0, 3, 6)
+m.op('LDC_I32_0'); m.op('STLOC_X32', 1)
+m.op('LDC_I32_0'); m.op('STLOC_X32', 2)
+m.label('loop')
+m.op('LDLOC_X32', 0); m.op('LDC_I32_8'); m.op('MUL_I32')
+m.op('LDC_I32_S', 3); m.op('LDC_I32_4'); m.op('ADD_I32'); m.op('ADD_I32')
+m.op('LDC_I32_4'); m.op('DIV_I32_UN')
+m.op('LDLOC_X32', 2); m.op('ADD_I32'); m.op('STLOC_X32', 2)
+m.op('LDC_I32_S', 99); m.op('STLOC_X32', 3)
+m.op('LDLOC_X32', 1); m.op('CALL_S', 'leaf'); m.op('STLOC_X32', 2)
+m.op('LDLOC_X32', 0); m.op('LDC_I32_1'); m.op('ADD_I32'); m.op('STLOC_X32', 1)
+m.op('LDLOC_X32', 0); m.op('LDC_X32', 100000); m.op('CLT_I32')
+m.op('BRTRUE_S', 'again')
+m.op('BR_S', 'done')
+m.label('again')
+m.op('BR_S', 'loop')
+m.label('done')
+m.op('LDC_I32_1'); m.op('BRFALSE_S', 'end')
+m.label('end')
+m.op('LDLOC_X32', 1); m.op('LDLOC_X32', 2); m.op('LDC_I32_S', 16)
+m.op('REM_I32_UN'); m.op('ADD_I32')
+m.op('SYSCALL', 1, 1)
+m.op('RET')
+m.func('leaf', 1, 0, 2)
+m.op('LDLOC_X32', 0); m.op('LDC_I32_3'); m.op('MUL_I32'); m.op('LDC_I32_5')
+m.op('XOR_I32'); m.op('RET_X32')
+acc = 0
+for i in range(100000):
+    acc = (acc + (i * 8 + 7) // 4) & 0xFFFFFFFF
+    acc = (acc * 3 ^ 5) & 0xFFFFFFFF
+acc = (acc + acc % 16 + (1 << 31)) % (1 << 32) - (1 << 31)
+save(m, 'test_opt', expect='%d\n' % acc)
+
+# A module graph for mango-link: two imports that share a third, each with an
+# initializer and a function that is never called.
+def link_module(name, imports, value):
+    m = Module(name, imports=imports, module_count=4)
+    m.entry('init')
+    m.func('init', 0, 0, 1)
+    m.op('LDC_I32_S', value); m.op('SYSCALL', 1, 1)
+    m.op('RET')
+    m.func('unused', 0, 0, 1)
+    m.op('LDC_I32_S', 99); m.op('SYSCALL', 1, 1)
+    m.op('RET')
+    m.func('get', 0, 0, 1)
+    m.op('LDC_I32_S', value)
+    m.op('RET_X32')
+    save(m, name)
+    return m
+
+
+link_c = link_module('link_c', [], 3)
+link_a = link_module('link_a', ['link_c'], 1)
+link_b = link_module('link_b', ['link_c'], 2)
+m = Module('main', imports=['link_a', 'link_b'], module_count=4)
+m.entry('main')
+m.func('main', 0, 0, 4)
+m.op('CALL', 'get_a', 0); m.op('SYSCALL', 1, 1)
+m.op('LDFTN', 'get_b', 1); m.op('CALLI'); m.op('SYSCALL', 1, 1)
+m.op('RET')
+save(m, 'test_link', {'get_a': link_a.labels['get'],
+                      'get_b': link_b.labels['get']}, expect='3\n2\n1\n1\n2\n')
+
+
+# Modules for tests/api.c, which calls their exported functions from the host.
+# api_main has no entry point; hook leaves its argument to system call 5.
+def api_sum(m):
+    m.func('sum', 1, 2, 4)
+    m.label('loop')
+    m.op('LDLOC_X32', 0); m.op('LDLOC_X32', 2); m.op('ADD_I32')
+    m.op('STLOC_X32', 1)
+    m.op('LDLOC_X32', 1); m.op('LDC_I32_1'); m.op('ADD_I32'); m.op('DUP_X32')
+    m.op('STLOC_X32', 3)
+    m.op('LDLOC_X32', 3); m.op('CLT_I32'); m.op('BRTRUE_S', 'loop')
+    m.op('LDLOC_X32', 0); m.op('RET_X32')
+
+
+m = Module('main', exports=['sub', 'sum', 'hook'])
+m.func('sub', 2, 0, 4)
+m.op('LDLOC_X32', 0); m.op('LDLOC_X32', 2); m.op('SUB_I32'); m.op('RET_X32')
+api_sum(m)
+m.func('hook', 1, 0, 2)
+m.op('LDLOC_X32', 0); m.op('SYSCALL', 0, 5); m.op('RET_X32')
+save(m, 'api_main')
+
+# Its entry point passes 1000 to system call 6, whose handler calls back into
+# sum, and prints what the handler left.
+m = Module('main', exports=['sum'])
+m.entry('main')
+m.func('main', 0, 0, 2)
+m.op('LDC_X32', 1000); m.op('SYSCALL', 0, 6); m.op('SYSCALL', 1, 1)
+m.op('RET')
+api_sum(m)
+save(m, 'api_nested')
+
+
+# Images the verifier rejects. tests/run.sh expects each of them to fail to
+# import with MANGO_E_INVALID_PROGRAM, or MANGO_E_BAD_IMAGE_FORMAT where the
+# code runs off the end of the image.
+def reject(name, ops, arg_count=0, loc_count=0, max_stack=2,
+           expect='result 87\n'):
+    m = Module('main')
+    m.entry('f')
+    m.func('f', arg_count, loc_count, max_stack)
+    for op in ops:
+        if isinstance(op, str):
+            m.label(op)
+        else:
+            m.op(*op)
+    save(m, name, expect=expect)
+
+
+reject('reject_overflow', [('LDC_I32_1',), ('LDC_I32_1',), ('POP_X64',),
+                           ('RET',)], max_stack=1)
+reject('reject_underflow', [('POP_X32',), ('RET',)])
+reject('reject_local', [('LDLOC_X32', 1), ('POP_X32',), ('RET',)],
+       loc_count=1)
+reject('reject_merge', [('LDC_I32_1',), ('BRTRUE_S', 'a'), ('RET',), 'a',
+                        ('LDC_I32_1',), ('RET_X32',)])
+reject('reject_join', [('LDC_I32_1',), ('BRTRUE_S', 'a'), ('LDC_I32_1',), 'a',
+                       ('RET',)], max_stack=4)
+reject('reject_calli', [('LDC_I32_1',), ('CALLI',), ('RET',)])
+reject('reject_return', [('LDC_I32_1',), ('RET',)])
+reject('reject_end', [('LDC_I32_1',)], expect='result 69\n')
@@ -0,0 +1,163 @@
+#!/bin/sh
+# Runs the regression images and compares their output with the expected one:
+#
+#   tests/run.sh
+#
+# The host and the tools are built with $CC and $CFLAGS, with warnings as
+# errors. Every test_ image is run by each interpreter variant, after
+# mango-opt and as compiled by mango-aot; test_link is also run after
+# mango-link. The program variant runs them from a linked program, the
+# budget variants with a small budget that runs out many times, and on x86-64
+# the jit variants with a JIT that compiles early, once with a budget. Variants
+# built without some value types only run the images that use nothing but
+# i32. The reject_ images are only run by the variant with MANGO_VERIFY,
+# which must refuse them. tests/api checks the embedding API in several
+# configurations.
+
+set -e
+
+cd "$(dirname "$0")/.."
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O3}
+BIN=$(mktemp -d)
+trap 'rm -rf "$BIN"' EXIT
+WARNINGS="-Wall -Wextra -Werror"
+FAILED=0
+
+VARIANTS="byte byte-tos threaded threaded-tos cached verify snapshot file-cache
+no-budget"
+I32_VARIANTS="no-refs i32"
+I32_IMAGES="test_loop test_fib test_calls test_chain test_break test_divide
+test_opt test_link"
+
+build() {
+  name=$1
+  shift
+  $CC $CFLAGS $WARNINGS -std=c11 -Isrc "$@" -o "$BIN/$name" tests/host.c \
+    src/mango.c -lm
+}
+
+tool() {
+  $CC $CFLAGS $WARNINGS -std=c11 -Isrc -o "$BIN/$1" "tools/$1.c"
+}
+
+# api name [option...]
+api() {
+  name=$1
+  shift
+  $CC $CFLAGS $WARNINGS -std=c11 -Isrc -Itests "$@" -o "$BIN/$name" \
+    tests/api.c src/mango.c -lm
+  if ! "$BIN/$name" tests/images "$BIN"; then
+    echo "FAIL $name"
+    FAILED=1
+  fi
+}
+
+# check label host image expected [option...]
+check() {
+  label=$1
+  host=$2
+  input=$3
+  expected=$4
+  shift 4
+  if ! "$BIN/$host" "$@" "$input" > "$BIN/out" 2>&1 ||
+    ! cmp -s "$BIN/out" "$expected"; then
+    echo "FAIL $label"
+    diff "$expected" "$BIN/out" || true
+    FAILED=1
+  fi
+}
+
+build byte
+build byte-tos -DMANGO_TOS_CACHE
+build threaded -DMANGO_THREADED_CODE
+build threaded-tos -DMANGO_THREADED_CODE -DMANGO_TOS_CACHE
+build cached -DMANGO_CALL_CACHE -DMANGO_LAZY_IMPORT
+build verify -DMANGO_VERIFY -DMANGO_THREADED_CODE
+build program -DMANGO_PROGRAM -DMANGO_THREADED_CODE
+build snapshot -DMANGO_SNAPSHOT -DMANGO_THREADED_CODE -DMANGO_CALL_CACHE
+build file-cache -DMANGO_FILE_CACHE
+build no-budget -DMANGO_NO_BUDGET -DMANGO_THREADED_CODE -DMANGO_TOS_CACHE
+build no-refs -DMANGO_NO_REFS -DMANGO_THREADED_CODE
+build i32 -DMANGO_NO_REFS -DMANGO_NO_I64 -DMANGO_NO_F32 -DMANGO_NO_F64
+JIT=
+if [ "$(uname -m)" = x86_64 ] && [ "$(uname -s)" = Linux ]; then
+  build jit -DMANGO_JIT -DMANGO_THREADED_CODE -DMANGO_JIT_THRESHOLD=8
+  JIT=1
+fi
+tool mango-aot
+tool mango-link
+tool mango-opt
+
+for image in tests/images/test_*.bin; do
+  name=$(basename "$image" .bin)
+  for variant in $VARIANTS; do
+    check "$name ($variant)" $variant "$image" "${image%.bin}.out"
+  done
+  check "$name (program)" program "$image" "${image%.bin}.out" -p
+  check "$name (byte, budget)" byte "$image" "${image%.bin}.out" -b 7
+  check "$name (threaded-tos, budget)" threaded-tos "$image" \
+    "${image%.bin}.out" -b 7
+  if [ -n "$JIT" ]; then
+    check "$name (jit)" jit "$image" "${image%.bin}.out" -j
+    check "$name (jit, budget)" jit "$image" "${image%.bin}.out" -j -b 100
+  fi
+done
+
+for name in $I32_IMAGES; do
+  for variant in $I32_VARIANTS; do
+    check "$name ($variant)" $variant "tests/images/$name.bin" \
+      "tests/images/$name.out"
+  done
+done
+
+for image in tests/images/reject_*.bin; do
+  name=$(basename "$image" .bin)
+  check "$name" verify "$image" "${image%.bin}.out"
+done
+
+mkdir "$BIN/opt"
+for image in tests/images/*.bin; do
+  case $(basename "$image") in
+  bench_* | test_* | reject_*) ;;
+  *) cp "$image" "$BIN/opt" ;;
+  esac
+done
+for image in tests/images/test_*.bin; do
+  name=$(basename "$image" .bin)
+  "$BIN/mango-opt" main "$image" > "$BIN/opt/$name.bin"
+  check "$name (mango-opt)" byte "$BIN/opt/$name.bin" "${image%.bin}.out"
+  check "$name (mango-opt, verify)" verify "$BIN/opt/$name.bin" \
+    "${image%.bin}.out"
+done
+
+for image in tests/images/test_*.bin; do
+  name=$(basename "$image" .bin)
+  "$BIN/mango-aot" main "$image" > "$BIN/$name.c"
+  $CC $CFLAGS $WARNINGS -std=c11 -Isrc -DHOST_NATIVE -DMANGO_NATIVE_MODULES \
+    -o "$BIN/aot" tests/host.c "$BIN/$name.c" src/mango.c -lm
+  check "$name (mango-aot)" aot "$image" "${image%.bin}.out"
+done
+
+"$BIN/mango-link" main tests/images/test_link.bin \
+  link_a tests/images/link_a.bin link_b tests/images/link_b.bin \
+  link_c tests/images/link_c.bin > "$BIN/linked.bin"
+check "test_link (mango-link)" byte "$BIN/linked.bin" \
+  tests/images/test_link.out
+check "test_link (mango-link, verify)" verify "$BIN/linked.bin" \
+  tests/images/test_link.out
+
+api api
+api api-no-budget -DMANGO_NO_BUDGET -DMANGO_THREADED_CODE
+api api-handlers -DMANGO_SYSCALL_HANDLERS -DMANGO_NESTED_CALLS \
+  -DMANGO_THREADED_CODE -DMANGO_TOS_CACHE
+api api-syscalls '-DMANGO_SYSCALLS="api_syscalls.inc"' \
+  -DMANGO_SYSCALL_HANDLERS
+api api-snapshot -DMANGO_SNAPSHOT -DMANGO_THREADED_CODE -DMANGO_CALL_CACHE
+api api-file-cache -DMANGO_FILE_CACHE -DMANGO_FILE_CACHE_SIZE=2 \
+  -DMANGO_SNAPSHOT
+
+if [ $FAILED -eq 0 ]; then
+  echo "all tests passed"
+fi
+exit $FAILED
@@ -0,0 +1,684 @@
+/*
+ *  _____ _____ _____ _____ _____
+ * |     |  _  |   | |   __|     |
+ * | | | |     | | | |  |  |  |  |
+ * |_|_|_|__|__|_|___|_____|_____|
+ *
+ * Mango Virtual Machine 1.0-dev
+ *
+ * Copyright (c) 2018 Klaus Hartke
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+// mango-aot compiles the functions of a module image to C. The result is a
+// translation unit that defines a mango_native_module, which the host passes
+// to mango_module_import_native instead of the raw image. The library must be
+// built with MANGO_NATIVE_MODULES to run it:
+//
+//   mango-aot name image [name image]... > module.c
+//
+// The first module is compiled. The remaining modules are only scanned for
+// calls into the first one, so that functions called from other modules
+// are compiled as well. Instructions without a C template (calls, returns,
+// system calls, allocation and floating point) return to the interpreter.
+
+#include "mango.h"
+#include "mango_metadata.h"
+
+#include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INVALID_MODULE 255
+
+#define REACHED 1
+#define DECODED 2
+#define FUNCTION 4
+
+typedef enum opcode {
+#define OPCODE(c, s, pop, push, args, i) c,
+#include "mango_opcodes.inc"
+#undef OPCODE
+} opcode;
+
+static const int8_t opcode_args[] = {
+#define OPCODE(c, s, pop, push, args, i) args,
+#include "mango_opcodes.inc"
+#undef OPCODE
+};
+
+static const char *const opcode_names[] = {
+#define OPCODE(c, s, pop, push, args, i) s,
+#include "mango_opcodes.inc"
+#undef OPCODE
+};
+
+#define OPCODE_COUNT (sizeof(opcode_args) / sizeof(opcode_args[0]))
+
+// Templates for instructions without operands. '@' is replaced with the
+// offset of the instruction.
+static const char *const templates[] = {
+    [NOP] = ";",
+    [SWAP] = "{\n    uint32_t tmp = sp[0].u32;\n    sp[0].u32 = sp[1].u32;\n"
+             "    sp[1].u32 = tmp;\n  }",
+    [POP_X32] = "sp++;",
+    [POP_X64] = "sp += 2;",
+    [DUP_X32] = "sp--;\n  sp[0].u32 = sp[1].u32;",
+    [DUP_X64] = "sp -= 2;\n  sp[0].u32 = sp[2].u32;\n  sp[1].u32 = sp[3].u32;",
+    [OVER] = "sp--;\n  sp[0].u32 = sp[2].u32;",
+    [ROT] = "{\n    uint32_t tmp = sp[0].u32;\n    sp[0].u32 = sp[1].u32;\n"
+            "    sp[1].u32 = sp[2].u32;\n    sp[2].u32 = tmp;\n  }",
+    [NIP] = "sp[1].u32 = sp[0].u32;\n  sp++;",
+    [TUCK] = "sp--;\n  sp[0].u32 = sp[1].u32;\n  sp[1].u32 = sp[2].u32;\n"
+             "  sp[2].u32 = sp[0].u32;",
+    [ROT4] = "{\n    uint32_t tmp = sp[0].u32;\n    sp[0].u32 = sp[1].u32;\n"
+             "    sp[1].u32 = sp[2].u32;\n    sp[2].u32 = sp[3].u32;\n"
+             "    sp[3].u32 = tmp;\n  }",
+
+    [ADD_I32] = "MANGO_BINARY1(u32, +);",
+    [SUB_I32] = "MANGO_BINARY1(u32, -);",
+    [MUL_I32] = "MANGO_BINARY1(u32, *);",
+    [DIV_I32] = "MANGO_BINARY1I(@, /);",
+    [DIV_I32_UN] = "MANGO_BINARY1U(@, /);",
+    [REM_I32] = "MANGO_BINARY1I(@, %);",
+    [REM_I32_UN] = "MANGO_BINARY1U(@, %);",
+    [NEG_I32] = "MANGO_UNARY1(u32, -);",
+    [SHL_I32] = "MANGO_SHIFT1(u32, <<);",
+    [SHR_I32] = "MANGO_SHIFT1(i32, >>);",
+    [SHR_I32_UN] = "MANGO_SHIFT1(u32, >>);",
+    [AND_I32] = "MANGO_BINARY1(u32, &);",
+    [OR_I32] = "MANGO_BINARY1(u32, |);",
+    [XOR_I32] = "MANGO_BINARY1(u32, ^);",
+    [NOT_I32] = "MANGO_UNARY1(u32, ~);",
+    [CEQ_I32] = "MANGO_COMPARE1(u32, ==);",
+    [CNE_I32] = "MANGO_COMPARE1(u32, !=);",
+    [CGT_I32] = "MANGO_COMPARE1(i32, >);",
+    [CGT_I32_UN] = "MANGO_COMPARE1(u32, >);",
+    [CGE_I32] = "MANGO_COMPARE1(i32, >=);",
+    [CGE_I32_UN] = "MANGO_COMPARE1(u32, >=);",
+    [CLT_I32] = "MANGO_COMPARE1(i32, <);",
+    [CLT_I32_UN] = "MANGO_COMPARE1(u32, <);",
+    [CLE_I32] = "MANGO_COMPARE1(i32, <=);",
+    [CLE_I32_UN] = "MANGO_COMPARE1(u32, <=);",
+    [CONV_I8_I32] = "MANGO_CONVERT1(int8_t, i32, i32);",
+    [CONV_U8_I32] = "MANGO_CONVERT1(uint8_t, u32, u32);",
+    [CONV_I16_I32] = "MANGO_CONVERT1(int16_t, i32, i32);",
+    [CONV_U16_I32] = "MANGO_CONVERT1(uint16_t, u32, u32);",
+
+    [LDELEM_I8] = "MANGO_LOAD_ELEMENT(@, int8_t, i32);",
+    [LDELEM_U8] = "MANGO_LOAD_ELEMENT(@, uint8_t, u32);",
+    [LDELEM_I16] = "MANGO_LOAD_ELEMENT(@, int16_t, i32);",
+    [LDELEM_U16] = "MANGO_LOAD_ELEMENT(@, uint16_t, u32);",
+    [LDELEM_X32] = "MANGO_LOAD_ELEMENT(@, uint32_t, u32);",
+    [STELEM_X8] = "MANGO_STORE_ELEMENT(@, uint8_t);",
+    [STELEM_X16] = "MANGO_STORE_ELEMENT(@, uint16_t);",
+    [STELEM_X32] = "MANGO_STORE_ELEMENT(@, uint32_t);",
+
+    [ADD_I64] = "MANGO_BINARY2(u64, +);",
+    [SUB_I64] = "MANGO_BINARY2(u64, -);",
+    [MUL_I64] = "MANGO_BINARY2(u64, *);",
+    [DIV_I64] = "MANGO_BINARY2I(@, /);",
+    [DIV_I64_UN] = "MANGO_BINARY2U(@, /);",
+    [REM_I64] = "MANGO_BINARY2I(@, %);",
+    [REM_I64_UN] = "MANGO_BINARY2U(@, %);",
+    [NEG_I64] = "MANGO_UNARY2(u64, -);",
+    [SHL_I64] = "MANGO_SHIFT2(u64, <<);",
+    [SHR_I64] = "MANGO_SHIFT2(i64, >>);",
+    [SHR_I64_UN] = "MANGO_SHIFT2(u64, >>);",
+    [AND_I64] = "MANGO_BINARY2(u64, &);",
+    [OR_I64] = "MANGO_BINARY2(u64, |);",
+    [XOR_I64] = "MANGO_BINARY2(u64, ^);",
+    [NOT_I64] = "MANGO_UNARY2(u64, ~);",
+    [CEQ_I64] = "MANGO_COMPARE2(u64, ==);",
+    [CNE_I64] = "MANGO_COMPARE2(u64, !=);",
+    [CGT_I64] = "MANGO_COMPARE2(i64, >);",
+    [CGT_I64_UN] = "MANGO_COMPARE2(u64, >);",
+    [CGE_I64] = "MANGO_COMPARE2(i64, >=);",
+    [CGE_I64_UN] = "MANGO_COMPARE2(u64, >=);",
+    [CLT_I64] = "MANGO_COMPARE2(i64, <);",
+    [CLT_I64_UN] = "MANGO_COMPARE2(u64, <);",
+    [CLE_I64] = "MANGO_COMPARE2(i64, <=);",
+    [CLE_I64_UN] = "MANGO_COMPARE2(u64, <=);",
+    [CONV_I8_I64] = "MANGO_CONVERT12(int8_t, i32, i64);",
+    [CONV_U8_I64] = "MANGO_CONVERT12(uint8_t, u32, u64);",
+    [CONV_I16_I64] = "MANGO_CONVERT12(int16_t, i32, i64);",
+    [CONV_U16_I64] = "MANGO_CONVERT12(uint16_t, u32, u64);",
+    [CONV_I32_I64] = "MANGO_CONVERT12(int32_t, i32, i64);",
+    [CONV_U32_I64] = "MANGO_CONVERT12(uint32_t, u32, u64);",
+    [CONV_I64_I32] = "MANGO_CONVERT21(int64_t, i64, i32);",
+    [CONV_U64_I32] = "MANGO_CONVERT21(uint64_t, u64, u32);",
+};
+
+// Templates for instructions with a u8 or u16 operand. '#' is replaced with
+// the operand.
+static const char *const operand_templates[] = {
+    [LDLOC_I8] = "MANGO_LOAD_LOCAL(int8_t, i32, #);",
+    [LDLOC_U8] = "MANGO_LOAD_LOCAL(uint8_t, u32, #);",
+    [LDLOC_I16] = "MANGO_LOAD_LOCAL(int16_t, i32, #);",
+    [LDLOC_U16] = "MANGO_LOAD_LOCAL(uint16_t, u32, #);",
+    [LDLOC_X32] = "MANGO_LOAD_LOCAL(uint32_t, u32, #);",
+    [STLOC_X32] = "sp[#].u32 = sp[0].u32;\n  sp++;",
+
+    [LDFLD_I8] = "MANGO_LOAD_FIELD(@, int8_t, i32, #);",
+    [LDFLD_U8] = "MANGO_LOAD_FIELD(@, uint8_t, u32, #);",
+    [LDFLD_I16] = "MANGO_LOAD_FIELD(@, int16_t, i32, #);",
+    [LDFLD_U16] = "MANGO_LOAD_FIELD(@, uint16_t, u32, #);",
+    [LDFLD_X32] = "MANGO_LOAD_FIELD(@, uint32_t, u32, #);",
+    [LDFLDA] = "MANGO_CHECK(@, MANGO_E_NULL_REFERENCE, sp[0].u32 == 0);\n"
+               "  sp[0].u32 += #;",
+    [STFLD_X8] = "MANGO_STORE_FIELD(@, uint8_t, u32, #);",
+    [STFLD_X16] = "MANGO_STORE_FIELD(@, uint16_t, u32, #);",
+    [STFLD_X32] = "MANGO_STORE_FIELD(@, uint32_t, u32, #);",
+    [LDELEMA] = "{\n    uint32_t index = sp[0].u32;\n"
+                "    MANGO_CHECK(@, MANGO_E_INDEX_OUT_OF_RANGE, "
+                "index >= sp[2].u32);\n"
+                "    uint32_t address = sp[1].u32;\n    sp += 2;\n"
+                "    sp[0].u32 = address + index * #;\n  }",
+};
+
+typedef struct module {
+  mango_module_name name;
+  const uint8_t *image;
+  size_t size;
+  uint8_t *flags;
+  int *imports;
+} module;
+
+static size_t module_count;
+static module *modules;
+
+static int is_valid_opcode(unsigned int op) {
+  return op < OPCODE_COUNT &&
+         (opcode_args[op] != 0 || strcmp(opcode_names[op], "unused") != 0);
+}
+
+static int falls_through(uint8_t op) {
+  return is_valid_opcode(op) && op != HALT && op != RET && op != RET_X32 &&
+         op != RET_X64 && op != BR_S && op != BR;
+}
+
+static int is_branch(uint8_t op) {
+  return op == BR_S || op == BRFALSE_S || op == BRTRUE_S || op == BR ||
+         op == BRFALSE || op == BRTRUE;
+}
+
+static uint16_t fetch_u16(const uint8_t *p) {
+  return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static uint32_t fetch_u32(const uint8_t *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+         (uint32_t)p[3] << 24;
+}
+
+static size_t instruction_size(const module *m, size_t offset) {
+  uint8_t op = m->image[offset];
+  size_t n;
+
+  if (!is_valid_opcode(op)) {
+    return 0;
+  } else if (opcode_args[op] >= 0) {
+    n = 1 + (size_t)opcode_args[op];
+  } else if (m->size - offset >= 5) {
+    n = 5 + (size_t)fetch_u16(m->image + offset + 1) *
+                (size_t)fetch_u16(m->image + offset + 3);
+  } else {
+    return 0;
+  }
+
+  return n <= m->size - offset ? n : 0;
+}
+
+static ptrdiff_t branch_target(const module *m, size_t offset) {
+  const uint8_t *ip = m->image + offset;
+
+  if (*ip == BR_S || *ip == BRFALSE_S || *ip == BRTRUE_S) {
+    return (ptrdiff_t)offset + 2 + (int8_t)ip[1];
+  }
+  return (ptrdiff_t)offset + 3 + (int16_t)fetch_u16(ip + 1);
+}
+
+static void mark(size_t index, ptrdiff_t offset, uint8_t flags) {
+  module *m = &modules[index];
+
+  if (offset >= 0 && (size_t)offset < m->size) {
+    m->flags[offset] |= flags;
+  }
+}
+
+static void mark_function(size_t index, size_t offset) {
+  mark(index, (ptrdiff_t)offset, FUNCTION);
+  mark(index, (ptrdiff_t)(offset + sizeof(mango_func_def)), REACHED);
+}
+
+static void discover(void) {
+  int changed;
+
+  do {
+    changed = 0;
+
+    for (size_t i = 0; i < module_count; i++) {
+      const module *m = &modules[i];
+
+      for (size_t offset = 0; offset < m->size; offset++) {
+        if ((m->flags[offset] & (REACHED | DECODED)) != REACHED) {
+          continue;
+        }
+        m->flags[offset] |= DECODED;
+        changed = 1;
+
+        const uint8_t *ip = m->image + offset;
+        size_t n = instruction_size(m, offset);
+        if (n == 0) {
+          continue;
+        }
+
+        if (is_branch(*ip)) {
+          mark(i, branch_target(m, offset), REACHED);
+        } else if (*ip == CALL_S) {
+          mark_function(i, fetch_u16(ip + 1));
+        } else if (*ip == CALL || *ip == LDFTN) {
+          const mango_module_def *def = (const mango_module_def *)m->image;
+          if (ip[1] == INVALID_MODULE) {
+            mark_function(i, fetch_u16(ip + 2));
+          } else if (ip[1] < def->import_count && m->imports[ip[1]] >= 0) {
+            mark_function((size_t)m->imports[ip[1]], fetch_u16(ip + 2));
+          }
+        }
+
+        if (falls_through(*ip)) {
+          mark(i, (ptrdiff_t)(offset + n), REACHED);
+        }
+      }
+    }
+  } while (changed);
+}
+
+static void emit_template(FILE *out, const char *text, size_t offset,
+                          unsigned int operand) {
+  fputs("  ", out);
+  for (; *text; text++) {
+    if (*text == '@') {
+      fprintf(out, "0x%04zX", offset);
+    } else if (*text == '#') {
+      fprintf(out, "%u", operand);
+    } else {
+      fputc(*text, out);
+    }
+  }
+  fputc('\n', out);
+}
+
+static void emit_branch(FILE *out, const module *m, size_t offset,
+                        const char *condition) {
+  size_t target = (size_t)branch_target(m, offset);
+
+  if (condition) {
+    fprintf(out, "  sp++;\n  if (sp[-1].u32 %s 0)\n  ", condition);
+  }
+  if (target > offset) {
+    fprintf(out, "  goto L%04zX;\n", target);
+  } else {
+    fprintf(out, "  MANGO_BACKWARD(0x%04zX, L%04zX);\n", target, target);
+  }
+}
+
+static int emit_instruction(FILE *out, const module *m, size_t offset) {
+  const uint8_t *ip = m->image + offset;
+  uint8_t op = *ip;
+
+  if (op < sizeof(templates) / sizeof(templates[0]) && templates[op]) {
+    emit_template(out, templates[op], offset, 0);
+    return 1;
+  }
+  if (op < sizeof(operand_templates) / sizeof(operand_templates[0]) &&
+      operand_templates[op]) {
+    unsigned int operand = opcode_args[op] == 1 ? ip[1] : fetch_u16(ip + 1);
+    emit_template(out, operand_templates[op], offset, operand);
+    return 1;
+  }
+
+  switch (op) {
+  case LDLOC_X64:
+    fprintf(out, "  sp -= 2;\n  sp[0].u32 = sp[%u].u32;\n"
+                 "  sp[1].u32 = sp[%u].u32;\n",
+            ip[1] + 2u, ip[1] + 3u);
+    return 1;
+  case STLOC_X64:
+    fprintf(out, "  sp[%u].u32 = sp[0].u32;\n  sp[%u].u32 = sp[1].u32;\n"
+                 "  sp += 2;\n",
+            ip[1] + 0u, ip[1] + 1u);
+    return 1;
+  case LDC_I32_M1:
+  case LDC_I32_0:
+  case LDC_I32_1:
+  case LDC_I32_2:
+  case LDC_I32_3:
+  case LDC_I32_4:
+  case LDC_I32_5:
+  case LDC_I32_6:
+  case LDC_I32_7:
+  case LDC_I32_8:
+    fprintf(out, "  sp--;\n  sp[0].i32 = %d;\n", (int)op - LDC_I32_0);
+    return 1;
+  case LDC_I32_S:
+    fprintf(out, "  sp--;\n  sp[0].i32 = %d;\n", (int8_t)ip[1]);
+    return 1;
+  case LDC_X32:
+    fprintf(out, "  sp--;\n  sp[0].u32 = 0x%08lXu;\n",
+            (unsigned long)fetch_u32(ip + 1));
+    return 1;
+  case LDC_X64:
+    fprintf(out, "  sp -= 2;\n  sp[0].u32 = 0x%08lXu;\n  sp[1].u32 = 0x%08lXu;\n",
+            (unsigned long)fetch_u32(ip + 1), (unsigned long)fetch_u32(ip + 5));
+    return 1;
+  case BR_S:
+  case BR:
+    emit_branch(out, m, offset, NULL);
+    return 1;
+  case BRFALSE_S:
+  case BRFALSE:
+    emit_branch(out, m, offset, "==");
+    return 1;
+  case BRTRUE_S:
+  case BRTRUE:
+    emit_branch(out, m, offset, "!=");
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+static void bad_image(const module *m, size_t offset) {
+  fprintf(stderr, "mango-aot: bad image format: %.12s at 0x%04zX\n",
+          (const char *)m->name.bytes, offset);
+  exit(EXIT_FAILURE);
+}
+
+// Offsets are marked as reached when they are queued, so each one is queued
+// at most once and pending never holds more than m->size entries.
+static void emit_function(FILE *out, const module *m, size_t function) {
+  uint8_t *reached = calloc(m->size, 1);
+  size_t *pending = malloc(m->size * sizeof(size_t));
+  size_t count = 0;
+
+  if (!reached || !pending) {
+    fputs("mango-aot: out of memory\n", stderr);
+    exit(EXIT_FAILURE);
+  }
+
+  if (function + sizeof(mango_func_def) >= m->size) {
+    bad_image(m, function);
+  }
+  reached[function + sizeof(mango_func_def)] = 1;
+  pending[count++] = function + sizeof(mango_func_def);
+  while (count != 0) {
+    size_t offset = pending[--count];
+    uint8_t op = m->image[offset];
+    size_t n = instruction_size(m, offset);
+
+    if (n == 0) {
+      if (is_valid_opcode(op)) {
+        bad_image(m, offset);
+      }
+      continue;
+    }
+    if (is_branch(op)) {
+      ptrdiff_t target = branch_target(m, offset);
+      if (target < 0 || (size_t)target >= m->size) {
+        bad_image(m, offset);
+      }
+      if (!reached[target]) {
+        reached[target] = 1;
+        pending[count++] = (size_t)target;
+      }
+    }
+    if (falls_through(op)) {
+      if (offset + n >= m->size) {
+        bad_image(m, offset);
+      }
+      if (!reached[offset + n]) {
+        reached[offset + n] = 1;
+        pending[count++] = offset + n;
+      }
+    }
+  }
+
+  fprintf(out, "static mango_result f%04zX(mango_native_frame *frame) {\n",
+          function);
+  fputs("  mango_value *sp = frame->sp;\n"
+        "  uint8_t *base = frame->base;\n"
+        "  uint32_t fuel = frame->fuel;\n"
+        "  uint32_t ip;\n"
+        "  mango_result result;\n"
+        "\n"
+        "  (void)base;\n"
+        "\n"
+        "  switch (frame->ip) {\n",
+        out);
+  for (size_t offset = 0; offset < m->size; offset++) {
+    if (reached[offset]) {
+      fprintf(out, "  case 0x%04zX:\n    goto L%04zX;\n", offset, offset);
+    }
+  }
+  fputs("  default:\n"
+        "    MANGO_EXIT(frame->ip, MANGO_E_SUCCESS);\n"
+        "  }\n",
+        out);
+
+  size_t next = SIZE_MAX;
+  for (size_t offset = 0; offset < m->size; offset++) {
+    if (!reached[offset]) {
+      continue;
+    }
+    if (next != SIZE_MAX && next != offset) {
+      fprintf(out, "  goto L%04zX;\n", next);
+    }
+
+    size_t n = instruction_size(m, offset);
+    uint8_t op = m->image[offset];
+
+    fprintf(out, "\nL%04zX: // %s\n", offset,
+            is_valid_opcode(op) ? opcode_names[op] : "invalid");
+    if (n == 0 || !emit_instruction(out, m, offset)) {
+      fprintf(out, "  MANGO_EXIT(0x%04zX, MANGO_E_SUCCESS);\n", offset);
+      next = SIZE_MAX;
+    } else if (!falls_through(op)) {
+      next = SIZE_MAX;
+    } else {
+      next = offset + n;
+    }
+  }
+  if (next != SIZE_MAX) {
+    fprintf(out, "  goto L%04zX;\n", next);
+  }
+
+  fputs("\nexit:\n"
+        "  frame->sp = sp;\n"
+        "  frame->ip = ip;\n"
+        "  frame->fuel = fuel;\n"
+        "  return result;\n"
+        "}\n\n",
+        out);
+
+  free(pending);
+  free(reached);
+}
+
+static void emit_module(FILE *out, const module *m, const char *name) {
+  size_t function_count = 0;
+
+  fputs("// Generated by mango-aot. Do not edit.\n\n"
+        "#include \"mango_native.h\"\n\n",
+        out);
+
+  fputs("static const uint8_t image[] = {", out);
+  for (size_t i = 0; i < m->size; i++) {
+    fprintf(out, i % 12 == 0 ? "\n    0x%02X," : " 0x%02X,", m->image[i]);
+  }
+  fputs("\n};\n\n", out);
+
+  for (size_t offset = 0; offset < m->size; offset++) {
+    if ((m->flags[offset] & FUNCTION) != 0) {
+      emit_function(out, m, offset);
+      function_count++;
+    }
+  }
+
+  if (function_count != 0) {
+    fputs("static const uint16_t offsets[] = {\n", out);
+    for (size_t offset = 0; offset < m->size; offset++) {
+      if ((m->flags[offset] & FUNCTION) != 0) {
+        fprintf(out, "    0x%04zX,\n", offset);
+      }
+    }
+    fputs("};\n\nstatic mango_native_function *const functions[] = {\n", out);
+    for (size_t offset = 0; offset < m->size; offset++) {
+      if ((m->flags[offset] & FUNCTION) != 0) {
+        fprintf(out, "    f%04zX,\n", offset);
+      }
+    }
+    fputs("};\n\n", out);
+  }
+
+  fputs("const mango_native_module mango_native_", out);
+  for (const char *p = name; *p; p++) {
+    fputc(isalnum((unsigned char)*p) ? *p : '_', out);
+  }
+  if (function_count != 0) {
+    fprintf(out, " = {image, sizeof(image), %zu, offsets, functions};\n",
+            function_count);
+  } else {
+    fputs(" = {image, sizeof(image), 0, NULL, NULL};\n", out);
+  }
+}
+
+static uint8_t *read_image(const char *path, size_t *size) {
+  FILE *file = fopen(path, "rb");
+  uint8_t *image = malloc(UINT16_MAX + 1);
+
+  if (!file || !image) {
+    return NULL;
+  }
+
+  *size = fread(image, 1, UINT16_MAX + 1, file);
+  fclose(file);
+  if (*size < sizeof(mango_module_def) || *size > UINT16_MAX) {
+    free(image);
+    return NULL;
+  }
+  return image;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3 || argc % 2 != 1) {
+    fputs("usage: mango-aot name image [name image]...\n", stderr);
+    return EXIT_FAILURE;
+  }
+
+  module_count = (size_t)(argc - 1) / 2;
+  modules = calloc(module_count, sizeof(module));
+  if (!modules) {
+    fputs("mango-aot: out of memory\n", stderr);
+    return EXIT_FAILURE;
+  }
+
+  for (size_t i = 0; i < module_count; i++) {
+    const char *name = argv[1 + 2 * i];
+    const char *path = argv[2 + 2 * i];
+    module *m = &modules[i];
+
+    if (strlen(name) > sizeof(m->name.bytes)) {
+      fprintf(stderr, "mango-aot: module name too long: %s\n", name);
+      return EXIT_FAILURE;
+    }
+    memcpy(m->name.bytes, name, strlen(name));
+
+    uint8_t *image = read_image(path, &m->size);
+    if (!image) {
+      fprintf(stderr, "mango-aot: cannot read image: %s\n", path);
+      return EXIT_FAILURE;
+    }
+    m->image = image;
+
+    const mango_module_def *def = (const mango_module_def *)image;
+    if (sizeof(mango_module_def) +
+            def->import_count * sizeof(mango_module_name) >
+        m->size) {
+      fprintf(stderr, "mango-aot: bad image format: %s\n", path);
+      return EXIT_FAILURE;
+    }
+
+    m->flags = calloc(m->size, 1);
+    m->imports = calloc(def->import_count + 1u, sizeof(int));
+    if (!m->flags || !m->imports) {
+      fputs("mango-aot: out of memory\n", stderr);
+      return EXIT_FAILURE;
+    }
+    m->flags[offsetof(mango_module_def, entry_point)] |= REACHED;
+
+    if ((def->features & MANGO_FEATURE_EXPORTS) != 0) {
+      size_t start = sizeof(mango_module_def) +
+                     def->import_count * sizeof(mango_module_name);
+      size_t slot_count = start + sizeof(mango_exports_def) <= m->size
+                              ? fetch_u16(image + start)
+                              : 0;
+      if (slot_count == 0 ||
+          start + sizeof(mango_exports_def) +
+                  slot_count * sizeof(mango_export_def) >
+              m->size) {
+        fprintf(stderr, "mango-aot: bad image format: %s\n", path);
+        return EXIT_FAILURE;
+      }
+
+      const uint8_t *slots = image + start + sizeof(mango_exports_def);
+      for (size_t j = 0; j < slot_count; j++) {
+        uint16_t offset =
+            fetch_u16(slots + j * sizeof(mango_export_def) +
+                      offsetof(mango_export_def, offset));
+        if (offset != 0) {
+          mark_function(i, offset);
+        }
+      }
+    }
+  }
+
+  for (size_t i = 0; i < module_count; i++) {
+    const module *m = &modules[i];
+    const mango_module_def *def = (const mango_module_def *)m->image;
+
+    for (size_t j = 0; j < def->import_count; j++) {
+      m->imports[j] = -1;
+      for (size_t k = 0; k < module_count; k++) {
+        if (memcmp(&def->imports[j], &modules[k].name,
+                   sizeof(mango_module_name)) == 0) {
+          m->imports[j] = (int)k;
+        }
+      }
+    }
+  }
+
+  discover();
+  emit_module(stdout, &modules[0], argv[1]);
+  return EXIT_SUCCESS;
+}
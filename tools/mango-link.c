@@ -0,0 +1,697 @@
+/*
+ *  _____ _____ _____ _____ _____
+ * |     |  _  |   | |   __|     |
+ * | | | |     | | | |  |  |  |  |
+ * |_|_|_|__|__|_|___|_____|_____|
+ *
+ * Mango Virtual Machine 1.0-dev
+ *
+ * Copyright (c) 2018 Klaus Hartke
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+// mango-link merges a module and the modules it imports into one image,
+// which the host imports under the name of the first module:
+//
+//   mango-link name image [name image]... > linked.bin
+//
+// Every module imported by the first one, directly or indirectly, must be
+// given. Functions that cannot be reached from an initializer or an export
+// of the first module are dropped. Calls and function tokens across modules
+// are rewritten to their forms within a module, and the entry point calls
+// the initializers in the order in which mango_run would run them. Only the
+// exports of the first module are kept.
+
+#include "mango.h"
+#include "mango_metadata.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INVALID_MODULE 255
+
+#define REACHED 1
+#define DECODED 2
+#define FUNCTION 4
+#define WIDE 8
+
+typedef enum opcode {
+#define OPCODE(c, s, pop, push, args, i) c,
+#include "mango_opcodes.inc"
+#undef OPCODE
+} opcode;
+
+static const int8_t opcode_args[] = {
+#define OPCODE(c, s, pop, push, args, i) args,
+#include "mango_opcodes.inc"
+#undef OPCODE
+};
+
+static const char *const opcode_names[] = {
+#define OPCODE(c, s, pop, push, args, i) s,
+#include "mango_opcodes.inc"
+#undef OPCODE
+};
+
+#define OPCODE_COUNT (sizeof(opcode_args) / sizeof(opcode_args[0]))
+
+typedef struct module {
+  mango_module_name name;
+  const uint8_t *image;
+  size_t size;
+  uint8_t *flags;
+  int *imports;
+  uint32_t *offsets;
+  int linked;
+  int visited;
+  int init_next;
+  int init_prev;
+} module;
+
+static size_t module_count;
+static module *modules;
+
+static void fail(const char *message, const mango_module_name *name) {
+  if (name) {
+    fprintf(stderr, "mango-link: %s: %.12s\n", message,
+            (const char *)name->bytes);
+  } else {
+    fprintf(stderr, "mango-link: %s\n", message);
+  }
+  exit(EXIT_FAILURE);
+}
+
+static int is_valid_opcode(unsigned int op) {
+  return op < OPCODE_COUNT &&
+         (opcode_args[op] != 0 || strcmp(opcode_names[op], "unused") != 0);
+}
+
+static int falls_through(uint8_t op) {
+  return is_valid_opcode(op) && op != HALT && op != RET && op != RET_X32 &&
+         op != RET_X64 && op != BR_S && op != BR;
+}
+
+static int is_branch(uint8_t op) {
+  return op == BR_S || op == BRFALSE_S || op == BRTRUE_S || op == BR ||
+         op == BRFALSE || op == BRTRUE;
+}
+
+static int is_short_branch(uint8_t op) {
+  return op == BR_S || op == BRFALSE_S || op == BRTRUE_S;
+}
+
+static uint16_t fetch_u16(const uint8_t *p) {
+  return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static void store_u16(uint8_t *p, uint32_t value) {
+  p[0] = (uint8_t)value;
+  p[1] = (uint8_t)(value >> 8);
+}
+
+static size_t instruction_size(const module *m, size_t offset) {
+  uint8_t op = m->image[offset];
+  size_t n;
+
+  if (!is_valid_opcode(op)) {
+    return 0;
+  } else if (opcode_args[op] >= 0) {
+    n = 1 + (size_t)opcode_args[op];
+  } else if (m->size - offset >= 5) {
+    n = 5 + (size_t)fetch_u16(m->image + offset + 1) *
+                (size_t)fetch_u16(m->image + offset + 3);
+  } else {
+    return 0;
+  }
+
+  return n <= m->size - offset ? n : 0;
+}
+
+static ptrdiff_t branch_target(const module *m, size_t offset) {
+  const uint8_t *ip = m->image + offset;
+
+  if (is_short_branch(*ip)) {
+    return (ptrdiff_t)offset + 2 + (int8_t)ip[1];
+  }
+  return (ptrdiff_t)offset + 3 + (int16_t)fetch_u16(ip + 1);
+}
+
+// The module called by a CALL or referenced by an LDFTN.
+static size_t callee(size_t index, size_t offset) {
+  const module *m = &modules[index];
+  const mango_module_def *def = (const mango_module_def *)m->image;
+  uint8_t import = m->image[offset + 1];
+
+  if (import == INVALID_MODULE) {
+    return index;
+  }
+  if (import >= def->import_count) {
+    fail("bad image format", &m->name);
+  }
+  return (size_t)m->imports[import];
+}
+
+static void mark(size_t index, ptrdiff_t offset, uint8_t flags) {
+  module *m = &modules[index];
+
+  if (offset < 0 || (size_t)offset >= m->size) {
+    fail("bad image format", &m->name);
+  }
+  m->flags[offset] |= flags;
+}
+
+static void mark_function(size_t index, size_t offset) {
+  if (offset < sizeof(mango_module_def)) {
+    fail("bad image format", &modules[index].name);
+  }
+  mark(index, (ptrdiff_t)offset, FUNCTION);
+  mark(index, (ptrdiff_t)(offset + sizeof(mango_func_def)), REACHED);
+}
+
+static void discover(void) {
+  int changed;
+
+  do {
+    changed = 0;
+
+    for (size_t i = 0; i < module_count; i++) {
+      const module *m = &modules[i];
+
+      for (size_t offset = 0; offset < m->size; offset++) {
+        if ((m->flags[offset] & (REACHED | DECODED)) != REACHED) {
+          continue;
+        }
+        m->flags[offset] |= DECODED;
+        changed = 1;
+
+        const uint8_t *ip = m->image + offset;
+        size_t n = instruction_size(m, offset);
+        if (n == 0) {
+          fail("invalid instruction", &m->name);
+        }
+
+        if (is_branch(*ip)) {
+          mark(i, branch_target(m, offset), REACHED);
+        } else if (*ip == CALL_S) {
+          mark_function(i, fetch_u16(ip + 1));
+        } else if (*ip == CALL || *ip == LDFTN) {
+          mark_function(callee(i, offset), fetch_u16(ip + 2));
+        }
+
+        if (falls_through(*ip)) {
+          mark(i, (ptrdiff_t)(offset + n), REACHED);
+        }
+      }
+    }
+  } while (changed);
+}
+
+// Functions keep the order of their instructions, so a function that falls
+// through to the next instruction still does after linking. Unreached code
+// between the instructions of a function is dropped.
+static void check_layout(const module *m) {
+  size_t end = 0;
+  size_t next = SIZE_MAX;
+
+  for (size_t offset = 0; offset < m->size; offset++) {
+    uint8_t flags = m->flags[offset];
+    if ((flags & (FUNCTION | DECODED)) == 0) {
+      continue;
+    }
+    if (offset < end || (next != SIZE_MAX && next != offset) ||
+        (flags & (FUNCTION | DECODED)) == (FUNCTION | DECODED)) {
+      fail("bad image format", &m->name);
+    }
+
+    if ((flags & FUNCTION) != 0) {
+      end = offset + sizeof(mango_func_def);
+      next = end;
+    } else {
+      end = offset + instruction_size(m, offset);
+      next = falls_through(m->image[offset]) ? end : SIZE_MAX;
+    }
+  }
+  if (next != SIZE_MAX) {
+    fail("bad image format", &m->name);
+  }
+}
+
+static size_t encoded_size(const module *m, size_t offset) {
+  uint8_t op = m->image[offset];
+
+  if (op == CALL) {
+    return 3;
+  } else if (is_short_branch(op) && (m->flags[offset] & WIDE) != 0) {
+    return 3;
+  } else {
+    return instruction_size(m, offset);
+  }
+}
+
+static size_t layout(size_t start) {
+  size_t offset = start;
+
+  for (size_t i = 0; i < module_count; i++) {
+    module *m = &modules[i];
+    if (!m->linked) {
+      continue;
+    }
+
+    for (size_t j = 0; j < m->size; j++) {
+      if ((m->flags[j] & FUNCTION) != 0) {
+        m->offsets[j] = (uint32_t)offset;
+        offset += sizeof(mango_func_def);
+      } else if ((m->flags[j] & DECODED) != 0) {
+        m->offsets[j] = (uint32_t)offset;
+        offset += encoded_size(m, j);
+      }
+    }
+  }
+
+  return offset;
+}
+
+static ptrdiff_t displacement(const module *m, size_t offset) {
+  size_t target = (size_t)branch_target(m, offset);
+
+  return (ptrdiff_t)m->offsets[target] -
+         (ptrdiff_t)(m->offsets[offset] + encoded_size(m, offset));
+}
+
+// Short branches whose targets have moved out of range are widened until
+// the layout no longer changes.
+static size_t relax(size_t start) {
+  int changed;
+  size_t size;
+
+  do {
+    changed = 0;
+    size = layout(start);
+
+    for (size_t i = 0; i < module_count; i++) {
+      module *m = &modules[i];
+      if (!m->linked) {
+        continue;
+      }
+
+      for (size_t j = 0; j < m->size; j++) {
+        if ((m->flags[j] & (DECODED | WIDE)) == DECODED &&
+            is_short_branch(m->image[j])) {
+          ptrdiff_t d = displacement(m, j);
+          if (d < INT8_MIN || d > INT8_MAX) {
+            m->flags[j] |= WIDE;
+            changed = 1;
+          }
+        }
+      }
+    }
+  } while (changed);
+
+  return size;
+}
+
+// Replays the init walk of mango_run: a module is initialized after the
+// modules it imports, with imports visited from the last to the first.
+static size_t init_order(size_t *order) {
+  size_t count = 0;
+  int head = 0;
+
+  while (head >= 0) {
+    module *m = &modules[head];
+
+    if (!m->visited) {
+      m->visited = 1;
+
+      const mango_module_def *def = (const mango_module_def *)m->image;
+      for (size_t i = 0; i < def->import_count; i++) {
+        int p = m->imports[i];
+        module *import = &modules[p];
+
+        if (!import->visited && head != p) {
+          if (import->init_prev >= 0) {
+            modules[import->init_prev].init_next = import->init_next;
+          }
+          if (import->init_next >= 0) {
+            modules[import->init_next].init_prev = import->init_prev;
+          }
+          modules[head].init_prev = p;
+          import->init_next = head;
+          import->init_prev = -1;
+          head = p;
+        }
+      }
+    } else {
+      order[count++] = (size_t)head;
+
+      head = m->init_next;
+      m->init_next = -1;
+      m->init_prev = -1;
+      if (head >= 0) {
+        modules[head].init_prev = -1;
+      }
+    }
+  }
+
+  return count;
+}
+
+static int has_initializer(const module *m) {
+  return ((const mango_module_def *)m->image)->entry_point[0] == CALL_S;
+}
+
+static uint32_t initializer(const module *m) {
+  const mango_module_def *def = (const mango_module_def *)m->image;
+  return m->offsets[fetch_u16(def->entry_point + 1)];
+}
+
+static void emit_instruction(uint8_t *out, size_t index, size_t offset) {
+  const module *m = &modules[index];
+  const uint8_t *ip = m->image + offset;
+  size_t n = instruction_size(m, offset);
+
+  if (*ip == CALL) {
+    out[0] = CALL_S;
+    store_u16(out + 1,
+              modules[callee(index, offset)].offsets[fetch_u16(ip + 2)]);
+  } else if (*ip == CALL_S) {
+    out[0] = CALL_S;
+    store_u16(out + 1, m->offsets[fetch_u16(ip + 1)]);
+  } else if (*ip == LDFTN) {
+    out[0] = LDFTN;
+    out[1] = INVALID_MODULE;
+    store_u16(out + 2,
+              modules[callee(index, offset)].offsets[fetch_u16(ip + 2)]);
+  } else if (is_branch(*ip)) {
+    ptrdiff_t d = displacement(m, offset);
+    if (is_short_branch(*ip) && (m->flags[offset] & WIDE) == 0) {
+      out[0] = *ip;
+      out[1] = (uint8_t)(int8_t)d;
+    } else if (d < INT16_MIN || d > INT16_MAX) {
+      fail("branch out of range", &m->name);
+    } else {
+      out[0] = *ip == BR_S        ? BR
+               : *ip == BRFALSE_S ? BRFALSE
+               : *ip == BRTRUE_S  ? BRTRUE
+                                  : *ip;
+      store_u16(out + 1, (uint16_t)(int16_t)d);
+    }
+  } else {
+    memcpy(out, ip, n);
+  }
+}
+
+static uint8_t *link_modules(size_t *size) {
+  const module *startup = &modules[0];
+  const mango_module_def *def = (const mango_module_def *)startup->image;
+  size_t *order = calloc(module_count, sizeof(size_t));
+
+  if (!order) {
+    fail("out of memory", NULL);
+  }
+
+  size_t order_count = init_order(order);
+  size_t initializer_count = 0;
+  for (size_t i = 0; i < order_count; i++) {
+    if (has_initializer(&modules[order[i]])) {
+      initializer_count++;
+    }
+  }
+
+  size_t exports = sizeof(mango_module_def);
+  size_t slot_count = (def->features & MANGO_FEATURE_EXPORTS) != 0
+                          ? fetch_u16(startup->image + exports +
+                                      def->import_count *
+                                          sizeof(mango_module_name))
+                          : 0;
+  size_t start = slot_count != 0 ? exports + sizeof(mango_exports_def) +
+                                       slot_count * sizeof(mango_export_def)
+                                 : exports;
+  size_t wrapper = start;
+  if (initializer_count > 1) {
+    start += sizeof(mango_func_def) + 3 * initializer_count + 1;
+  }
+
+  *size = relax(start);
+  if (*size > UINT16_MAX) {
+    fail("linked image too large", NULL);
+  }
+
+  uint8_t *out = calloc(*size, 1);
+  if (!out) {
+    fail("out of memory", NULL);
+  }
+
+  mango_module_def *header = (mango_module_def *)out;
+  header->version = def->version;
+  header->features = def->features & MANGO_FEATURE_EXPORTS;
+  header->module_count = 1;
+  header->import_count = 0;
+  for (size_t i = 0; i < module_count; i++) {
+    if (modules[i].linked) {
+      const mango_module_def *d = (const mango_module_def *)modules[i].image;
+      header->features |= d->features & ~MANGO_FEATURE_EXPORTS;
+    }
+  }
+
+  if (slot_count != 0) {
+    const uint8_t *slots =
+        startup->image + exports +
+        def->import_count * sizeof(mango_module_name) +
+        sizeof(mango_exports_def);
+    memcpy(out + exports,
+           slots - sizeof(mango_exports_def),
+           sizeof(mango_exports_def) + slot_count * sizeof(mango_export_def));
+    for (size_t i = 0; i < slot_count; i++) {
+      size_t slot = exports + sizeof(mango_exports_def) +
+                    i * sizeof(mango_export_def) +
+                    offsetof(mango_export_def, offset);
+      uint16_t offset = fetch_u16(out + slot);
+      if (offset != 0) {
+        store_u16(out + slot, startup->offsets[offset]);
+      }
+    }
+  }
+
+  if (initializer_count == 0) {
+    memcpy(header->entry_point, (const uint8_t[]){NOP, NOP, NOP, HALT}, 4);
+  } else if (initializer_count == 1) {
+    for (size_t i = 0; i < order_count; i++) {
+      if (has_initializer(&modules[order[i]])) {
+        header->entry_point[0] = CALL_S;
+        store_u16(header->entry_point + 1, initializer(&modules[order[i]]));
+      }
+    }
+    header->entry_point[3] = HALT;
+  } else {
+    header->entry_point[0] = CALL_S;
+    store_u16(header->entry_point + 1, (uint32_t)wrapper);
+    header->entry_point[3] = HALT;
+
+    uint8_t *p = out + wrapper + sizeof(mango_func_def);
+    for (size_t i = 0; i < order_count; i++) {
+      if (has_initializer(&modules[order[i]])) {
+        p[0] = CALL_S;
+        store_u16(p + 1, initializer(&modules[order[i]]));
+        p += 3;
+      }
+    }
+    p[0] = RET;
+  }
+
+  for (size_t i = 0; i < module_count; i++) {
+    const module *m = &modules[i];
+    if (!m->linked) {
+      continue;
+    }
+
+    for (size_t j = 0; j < m->size; j++) {
+      if ((m->flags[j] & FUNCTION) != 0) {
+        memcpy(out + m->offsets[j], m->image + j, sizeof(mango_func_def));
+      } else if ((m->flags[j] & DECODED) != 0) {
+        emit_instruction(out + m->offsets[j], i, j);
+      }
+    }
+  }
+
+  free(order);
+  return out;
+}
+
+static uint8_t *read_image(const char *path, size_t *size) {
+  FILE *file = fopen(path, "rb");
+  uint8_t *image = malloc(UINT16_MAX + 1);
+
+  if (!file || !image) {
+    return NULL;
+  }
+
+  *size = fread(image, 1, UINT16_MAX + 1, file);
+  fclose(file);
+  if (*size < sizeof(mango_module_def) || *size > UINT16_MAX) {
+    free(image);
+    return NULL;
+  }
+  return image;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3 || argc % 2 != 1) {
+    fputs("usage: mango-link name image [name image]...\n", stderr);
+    return EXIT_FAILURE;
+  }
+
+  module_count = (size_t)(argc - 1) / 2;
+  modules = calloc(module_count, sizeof(module));
+  if (!modules) {
+    fail("out of memory", NULL);
+  }
+
+  for (size_t i = 0; i < module_count; i++) {
+    const char *name = argv[1 + 2 * i];
+    const char *path = argv[2 + 2 * i];
+    module *m = &modules[i];
+
+    if (strlen(name) > sizeof(m->name.bytes)) {
+      fprintf(stderr, "mango-link: module name too long: %s\n", name);
+      return EXIT_FAILURE;
+    }
+    memcpy(m->name.bytes, name, strlen(name));
+
+    uint8_t *image = read_image(path, &m->size);
+    if (!image) {
+      fprintf(stderr, "mango-link: cannot read image: %s\n", path);
+      return EXIT_FAILURE;
+    }
+    m->image = image;
+
+    const mango_module_def *def = (const mango_module_def *)image;
+    if (sizeof(mango_module_def) +
+                def->import_count * sizeof(mango_module_name) >
+            m->size ||
+        def->entry_point[3] != HALT) {
+      fail("bad image format", &m->name);
+    }
+    if (has_initializer(m)) {
+      if (fetch_u16(def->entry_point + 1) + sizeof(mango_func_def) >=
+          m->size) {
+        fail("bad image format", &m->name);
+      }
+    } else if (def->entry_point[0] != NOP || def->entry_point[1] != NOP ||
+               def->entry_point[2] != NOP) {
+      fail("unsupported entry point", &m->name);
+    }
+
+    m->flags = calloc(m->size, 1);
+    m->imports = calloc(def->import_count + 1u, sizeof(int));
+    m->offsets = calloc(m->size, sizeof(uint32_t));
+    if (!m->flags || !m->imports || !m->offsets) {
+      fail("out of memory", NULL);
+    }
+    m->init_next = -1;
+    m->init_prev = -1;
+  }
+
+  for (size_t i = 0; i < module_count; i++) {
+    module *m = &modules[i];
+    const mango_module_def *def = (const mango_module_def *)m->image;
+
+    for (size_t j = 0; j < def->import_count; j++) {
+      m->imports[j] = -1;
+      for (size_t k = 0; k < module_count; k++) {
+        if (memcmp(&def->imports[j], &modules[k].name,
+                   sizeof(mango_module_name)) == 0) {
+          m->imports[j] = (int)k;
+        }
+      }
+    }
+  }
+
+  int changed;
+  modules[0].linked = 1;
+  do {
+    changed = 0;
+    for (size_t i = 0; i < module_count; i++) {
+      const module *m = &modules[i];
+      const mango_module_def *def = (const mango_module_def *)m->image;
+      if (!m->linked) {
+        continue;
+      }
+
+      for (size_t j = 0; j < def->import_count; j++) {
+        if (m->imports[j] < 0) {
+          fail("missing module", &def->imports[j]);
+        }
+        if (!modules[m->imports[j]].linked) {
+          modules[m->imports[j]].linked = 1;
+          changed = 1;
+        }
+      }
+    }
+  } while (changed);
+
+  for (size_t i = 0; i < module_count; i++) {
+    const module *m = &modules[i];
+    const mango_module_def *def = (const mango_module_def *)m->image;
+    if (m->linked && has_initializer(m)) {
+      mark_function(i, fetch_u16(def->entry_point + 1));
+    }
+  }
+
+  const mango_module_def *def = (const mango_module_def *)modules[0].image;
+  if ((def->features & MANGO_FEATURE_EXPORTS) != 0) {
+    size_t start = sizeof(mango_module_def) +
+                   def->import_count * sizeof(mango_module_name);
+    size_t slot_count = start + sizeof(mango_exports_def) <= modules[0].size
+                            ? fetch_u16(modules[0].image + start)
+                            : 0;
+    if (slot_count == 0 ||
+        start + sizeof(mango_exports_def) +
+                slot_count * sizeof(mango_export_def) >
+            modules[0].size) {
+      fail("bad image format", &modules[0].name);
+    }
+
+    const uint8_t *slots = modules[0].image + start + sizeof(mango_exports_def);
+    for (size_t j = 0; j < slot_count; j++) {
+      uint16_t offset = fetch_u16(slots + j * sizeof(mango_export_def) +
+                                  offsetof(mango_export_def, offset));
+      if (offset != 0) {
+        mark_function(0, offset);
+      }
+    }
+  }
+
+  discover();
+  for (size_t i = 0; i < module_count; i++) {
+    if (modules[i].linked) {
+      check_layout(&modules[i]);
+    }
+  }
+
+  size_t size;
+  uint8_t *image = link_modules(&size);
+  if (fwrite(image, 1, size, stdout) != size) {
+    fail("cannot write image", NULL);
+  }
+  return EXIT_SUCCESS;
+}
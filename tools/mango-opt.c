@@ -0,0 +1,1425 @@
+/*
+ *  _____ _____ _____ _____ _____
+ * |     |  _  |   | |   __|     |
+ * | | | |     | | | |  |  |  |  |
+ * |_|_|_|__|__|_|___|_____|_____|
+ *
+ * Mango Virtual Machine 1.0-dev
+ *
+ * Copyright (c) 2018 Klaus Hartke
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+// mango-opt rewrites the functions of a module image into equivalent code
+// that runs faster:
+//
+//   mango-opt name image [name image]... > optimized.bin
+//
+// The first module is optimized. The remaining modules are only scanned for
+// calls into the first one, as in mango-aot. Every function keeps its offset,
+// so calls from other modules and exports stay valid; the optimized code of a
+// function is written over the original and the bytes left over are unused.
+//
+// The passes are driven by the pop and push counts in mango_opcodes.inc:
+// jump threading, removal of unreachable code, constant folding, strength
+// reduction, dead store removal and inlining of small leaf functions at
+// CALL_S sites. Finally, loc_count and max_stack of each function are
+// recomputed. Functions whose stack depth cannot be tracked, because they
+// call into another module or through a function token, only get the passes
+// that do not depend on it.
+
+#include "mango.h"
+#include "mango_metadata.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INVALID_MODULE 255
+
+#define REACHED 1
+#define DECODED 2
+#define FUNCTION 4
+
+#define LEADER 1
+#define REMOVED 2
+#define LIVE 4
+
+#define MAX_INLINE 8
+#define MAX_HOPS 16
+
+typedef enum opcode {
+#define OPCODE(c, s, pop, push, args, i) c,
+#include "mango_opcodes.inc"
+#undef OPCODE
+} opcode;
+
+static const int8_t opcode_args[] = {
+#define OPCODE(c, s, pop, push, args, i) args,
+#include "mango_opcodes.inc"
+#undef OPCODE
+};
+
+static const uint8_t opcode_pops[] = {
+#define OPCODE(c, s, pop, push, args, i) pop,
+#include "mango_opcodes.inc"
+#undef OPCODE
+};
+
+static const uint8_t opcode_pushes[] = {
+#define OPCODE(c, s, pop, push, args, i) push,
+#include "mango_opcodes.inc"
+#undef OPCODE
+};
+
+static const char *const opcode_names[] = {
+#define OPCODE(c, s, pop, push, args, i) s,
+#include "mango_opcodes.inc"
+#undef OPCODE
+};
+
+#define OPCODE_COUNT (sizeof(opcode_args) / sizeof(opcode_args[0]))
+
+typedef struct module {
+  mango_module_name name;
+  const uint8_t *image;
+  size_t size;
+  uint8_t *flags;
+  int *imports;
+} module;
+
+// Constants are kept as LDC_X32 and branches in their long form; both are
+// encoded in the shortest form that fits. Loads and stores of locals refer
+// to the local rather than the stack slot once the stack depth is known.
+typedef struct instruction {
+  uint8_t op;
+  uint8_t flags;
+  uint8_t slot;
+  int local;
+  int32_t value;
+  size_t target;
+  const uint8_t *code;
+  size_t size;
+  int depth;
+} instruction;
+
+typedef struct function {
+  size_t offset;
+  size_t end;
+  uint8_t arg_count;
+  uint8_t loc_count;
+  uint8_t max_stack;
+  int returns;
+  int fixed;
+  int analyzed;
+  int opaque;
+  int escapes;
+  instruction *code;
+  size_t count;
+} function;
+
+static size_t module_count;
+static module *modules;
+
+static size_t function_count;
+static function *functions;
+
+static void *allocate(size_t count, size_t size) {
+  void *p = calloc(count ? count : 1, size);
+  if (!p) {
+    fputs("mango-opt: out of memory\n", stderr);
+    exit(EXIT_FAILURE);
+  }
+  return p;
+}
+
+static int is_valid_opcode(unsigned int op) {
+  return op < OPCODE_COUNT &&
+         (opcode_args[op] != 0 || strcmp(opcode_names[op], "unused") != 0);
+}
+
+static int is_return(uint8_t op) {
+  return op == RET || op == RET_X32 || op == RET_X64;
+}
+
+static int falls_through(uint8_t op) {
+  return is_valid_opcode(op) && op != HALT && !is_return(op) && op != BR_S &&
+         op != BR;
+}
+
+static int is_branch(uint8_t op) {
+  return op == BR_S || op == BRFALSE_S || op == BRTRUE_S || op == BR ||
+         op == BRFALSE || op == BRTRUE;
+}
+
+static int is_constant(uint8_t op) {
+  return (op >= LDC_I32_M1 && op <= LDC_I32_S) || op == LDC_X32;
+}
+
+static int is_load(uint8_t op) {
+  return op >= LDLOC_I8 && op <= LDLOC_X32;
+}
+
+static int is_local(uint8_t op) {
+  return op >= LDLOC_I8 && op <= STLOC_X64;
+}
+
+static uint16_t fetch_u16(const uint8_t *p) {
+  return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static uint32_t fetch_u32(const uint8_t *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+         (uint32_t)p[3] << 24;
+}
+
+static void store_u16(uint8_t *p, uint32_t value) {
+  p[0] = (uint8_t)value;
+  p[1] = (uint8_t)(value >> 8);
+}
+
+static size_t instruction_size(const module *m, size_t offset) {
+  uint8_t op = m->image[offset];
+  size_t n;
+
+  if (!is_valid_opcode(op)) {
+    return 0;
+  } else if (opcode_args[op] >= 0) {
+    n = 1 + (size_t)opcode_args[op];
+  } else if (m->size - offset >= 5) {
+    n = 5 + (size_t)fetch_u16(m->image + offset + 1) *
+                (size_t)fetch_u16(m->image + offset + 3);
+  } else {
+    return 0;
+  }
+
+  return n <= m->size - offset ? n : 0;
+}
+
+static ptrdiff_t branch_target(const module *m, size_t offset) {
+  const uint8_t *ip = m->image + offset;
+
+  if (*ip == BR_S || *ip == BRFALSE_S || *ip == BRTRUE_S) {
+    return (ptrdiff_t)offset + 2 + (int8_t)ip[1];
+  }
+  return (ptrdiff_t)offset + 3 + (int16_t)fetch_u16(ip + 1);
+}
+
+static void mark(size_t index, ptrdiff_t offset, uint8_t flags) {
+  module *m = &modules[index];
+
+  if (offset >= 0 && (size_t)offset < m->size) {
+    m->flags[offset] |= flags;
+  }
+}
+
+static void mark_function(size_t index, size_t offset) {
+  mark(index, (ptrdiff_t)offset, FUNCTION);
+  mark(index, (ptrdiff_t)(offset + sizeof(mango_func_def)), REACHED);
+}
+
+static void discover(void) {
+  int changed;
+
+  do {
+    changed = 0;
+
+    for (size_t i = 0; i < module_count; i++) {
+      const module *m = &modules[i];
+
+      for (size_t offset = 0; offset < m->size; offset++) {
+        if ((m->flags[offset] & (REACHED | DECODED)) != REACHED) {
+          continue;
+        }
+        m->flags[offset] |= DECODED;
+        changed = 1;
+
+        const uint8_t *ip = m->image + offset;
+        size_t n = instruction_size(m, offset);
+        if (n == 0) {
+          continue;
+        }
+
+        if (is_branch(*ip)) {
+          mark(i, branch_target(m, offset), REACHED);
+        } else if (*ip == CALL_S) {
+          mark_function(i, fetch_u16(ip + 1));
+        } else if (*ip == CALL || *ip == LDFTN) {
+          const mango_module_def *def = (const mango_module_def *)m->image;
+          if (ip[1] == INVALID_MODULE) {
+            mark_function(i, fetch_u16(ip + 2));
+          } else if (ip[1] < def->import_count && m->imports[ip[1]] >= 0) {
+            mark_function((size_t)m->imports[ip[1]], fetch_u16(ip + 2));
+          }
+        }
+
+        if (falls_through(*ip)) {
+          mark(i, (ptrdiff_t)(offset + n), REACHED);
+        }
+      }
+    }
+  } while (changed);
+}
+
+static function *find_function(size_t offset) {
+  for (size_t i = 0; i < function_count; i++) {
+    if (functions[i].offset == offset) {
+      return &functions[i];
+    }
+  }
+  return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Decodes the instructions reachable from the start of a function in the
+// order of their offsets. A function that branches outside the image, falls
+// through to code it does not own or runs into another function is left as
+// it is.
+static void decode_function(const module *m, function *f) {
+  size_t start = f->offset + sizeof(mango_func_def);
+  uint8_t *reached = allocate(m->size, 1);
+  size_t *pending = allocate(m->size, sizeof(size_t));
+  size_t *index = allocate(m->size, sizeof(size_t));
+  size_t count = 0;
+
+  f->fixed = start >= m->size;
+  if (!f->fixed) {
+    const mango_func_def *def = (const mango_func_def *)(m->image + f->offset);
+    f->arg_count = def->arg_count;
+    f->loc_count = def->loc_count;
+    f->max_stack = def->max_stack;
+    pending[count++] = start;
+  }
+
+  while (count != 0 && !f->fixed) {
+    size_t offset = pending[--count];
+    if (reached[offset]) {
+      continue;
+    }
+    reached[offset] = 1;
+
+    size_t n = instruction_size(m, offset);
+    if (n == 0) {
+      f->fixed = 1;
+      break;
+    }
+    uint8_t op = m->image[offset];
+    if (is_branch(op)) {
+      ptrdiff_t target = branch_target(m, offset);
+      if (target < (ptrdiff_t)start || (size_t)target >= m->size) {
+        f->fixed = 1;
+        break;
+      }
+      pending[count++] = (size_t)target;
+    }
+    if (falls_through(op)) {
+      if (offset + n >= m->size) {
+        f->fixed = 1;
+        break;
+      }
+      pending[count++] = offset + n;
+    }
+  }
+
+  size_t n = 0;
+  size_t end = start;
+  for (size_t offset = start; offset < m->size && !f->fixed; offset++) {
+    if (!reached[offset]) {
+      continue;
+    }
+    if (offset < end || (m->flags[offset] & FUNCTION) != 0) {
+      f->fixed = 1;
+    }
+    index[offset] = n++;
+    end = offset + instruction_size(m, offset);
+  }
+  for (size_t offset = f->offset + 1; offset < end && !f->fixed; offset++) {
+    if ((m->flags[offset] & FUNCTION) != 0) {
+      f->fixed = 1;
+    }
+  }
+  f->end = end;
+
+  if (!f->fixed) {
+    f->code = allocate(n, sizeof(instruction));
+    f->count = 0;
+
+    for (size_t offset = start; offset < end; offset++) {
+      if (!reached[offset]) {
+        continue;
+      }
+
+      instruction *insn = &f->code[f->count++];
+      const uint8_t *ip = m->image + offset;
+      *insn = (instruction){*ip, 0, 0, -1, 0, 0, ip,
+                            instruction_size(m, offset), -1};
+
+      if (is_constant(*ip)) {
+        insn->op = LDC_X32;
+        insn->value = *ip == LDC_I32_S   ? (int8_t)ip[1]
+                      : *ip == LDC_X32   ? (int32_t)fetch_u32(ip + 1)
+                                         : (int)*ip - LDC_I32_0;
+      } else if (is_branch(*ip)) {
+        insn->op = *ip == BR_S        ? BR
+                   : *ip == BRFALSE_S ? BRFALSE
+                   : *ip == BRTRUE_S  ? BRTRUE
+                                      : *ip;
+        insn->target = index[branch_target(m, offset)];
+      } else if (*ip == CALL_S) {
+        insn->value = fetch_u16(ip + 1);
+      } else if (*ip == CALL && ip[1] == INVALID_MODULE) {
+        insn->op = CALL_S;
+        insn->value = fetch_u16(ip + 2);
+      } else if (is_local(*ip)) {
+        insn->slot = ip[1];
+      }
+    }
+  }
+
+  free(index);
+  free(pending);
+  free(reached);
+}
+
+static void find_leaders(function *f) {
+  for (size_t i = 0; i < f->count; i++) {
+    f->code[i].flags &= (uint8_t)~LEADER;
+  }
+  if (f->count != 0) {
+    f->code[0].flags |= LEADER;
+  }
+  for (size_t i = 0; i < f->count; i++) {
+    instruction *insn = &f->code[i];
+    if (is_branch(insn->op)) {
+      f->code[insn->target].flags |= LEADER;
+    }
+    if ((is_branch(insn->op) || !falls_through(insn->op)) && i + 1 < f->count) {
+      f->code[i + 1].flags |= LEADER;
+    }
+  }
+}
+
+// Drops removed instructions. A branch to a removed instruction goes to the
+// next one that is kept; passes only remove instructions that have no effect
+// on the paths that branch to them.
+static void compact(function *f) {
+  size_t *map = allocate(f->count + 1, sizeof(size_t));
+  size_t n = 0;
+
+  for (size_t i = 0; i < f->count; i++) {
+    map[i] = n;
+    if ((f->code[i].flags & REMOVED) == 0) {
+      f->code[n++] = f->code[i];
+    }
+  }
+  map[f->count] = n;
+  f->count = n;
+
+  for (size_t i = 0; i < f->count; i++) {
+    if (is_branch(f->code[i].op)) {
+      f->code[i].target = map[f->code[i].target];
+    }
+  }
+  free(map);
+  find_leaders(f);
+}
+
+// Returns the number of stack slots a function returns, or -1 if it returns
+// values of different sizes.
+static int returns_of(const function *f) {
+  int returns = -1;
+
+  for (size_t i = 0; i < f->count; i++) {
+    uint8_t op = f->code[i].op;
+    if (is_return(op)) {
+      int n = op == RET ? 0 : op == RET_X32 ? 1 : 2;
+      if (returns >= 0 && returns != n) {
+        return -1;
+      }
+      returns = n;
+    }
+  }
+  return returns < 0 ? 0 : returns;
+}
+
+// Tracks the stack depth before each instruction. Locals are identified by
+// their index once the depth is known.
+static void analyze(function *f) {
+  size_t *pending = allocate(f->count, sizeof(size_t));
+  size_t count = 0;
+  int locals = f->arg_count + f->loc_count;
+
+  f->analyzed = 1;
+  f->opaque = 0;
+  f->escapes = 0;
+  for (size_t i = 0; i < f->count; i++) {
+    f->code[i].depth = -1;
+  }
+  if (f->count != 0) {
+    f->code[0].depth = 0;
+    pending[count++] = 0;
+  }
+
+  while (count != 0 && f->analyzed) {
+    size_t i = pending[--count];
+    instruction *insn = &f->code[i];
+    int depth = insn->depth;
+    int after;
+
+    if (insn->op == CALL_S) {
+      const function *callee = find_function((size_t)insn->value);
+      if (!callee || callee->fixed) {
+        f->analyzed = 0;
+        f->opaque = 1;
+        break;
+      }
+      after = depth - callee->arg_count + callee->returns;
+      if (depth < callee->arg_count) {
+        f->analyzed = 0;
+      }
+    } else if (insn->op == CALL || insn->op == CALLI) {
+      f->analyzed = 0;
+      f->opaque = 1;
+      break;
+    } else if (insn->op == SYSCALL) {
+      after = depth - (int8_t)insn->code[1];
+    } else {
+      if (depth < opcode_pops[insn->op]) {
+        f->analyzed = 0;
+      }
+      after = depth - opcode_pops[insn->op] + opcode_pushes[insn->op];
+    }
+
+    if (is_local(insn->op)) {
+      int local = insn->local >= 0 ? insn->local : insn->slot - depth;
+      if (local < 0 ||
+          local + (insn->op == LDLOC_X64 || insn->op == STLOC_X64) >= locals) {
+        f->analyzed = 0;
+      }
+      if (insn->local < 0 || insn->local == local) {
+        insn->local = local;
+      } else {
+        f->analyzed = 0;
+      }
+      if (insn->op == LDLOCA) {
+        f->escapes = 1;
+      }
+    }
+    if (after < 0) {
+      f->analyzed = 0;
+    }
+
+    size_t next[2];
+    size_t n = 0;
+    if (falls_through(insn->op) && i + 1 < f->count) {
+      next[n++] = i + 1;
+    }
+    if (is_branch(insn->op)) {
+      next[n++] = insn->target;
+    }
+    for (size_t j = 0; j < n && f->analyzed; j++) {
+      instruction *successor = &f->code[next[j]];
+      if (successor->depth < 0) {
+        successor->depth = after;
+        pending[count++] = next[j];
+      } else if (successor->depth != after) {
+        f->analyzed = 0;
+      }
+    }
+  }
+
+  if (!f->analyzed) {
+    for (size_t i = 0; i < f->count; i++) {
+      f->code[i].local = -1;
+    }
+  }
+  free(pending);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static int thread_jumps(function *f) {
+  int changed = 0;
+
+  for (size_t i = 0; i < f->count; i++) {
+    instruction *insn = &f->code[i];
+    if (!is_branch(insn->op)) {
+      continue;
+    }
+
+    size_t target = insn->target;
+    for (int hops = 0; hops < MAX_HOPS && f->code[target].op == BR; hops++) {
+      target = f->code[target].target;
+    }
+    if (f->code[target].op != BR && target != insn->target) {
+      insn->target = target;
+      changed = 1;
+    }
+
+    if (insn->op == BR && is_return(f->code[target].op)) {
+      *insn = f->code[target];
+      changed = 1;
+    } else if (insn->target == i + 1) {
+      if (insn->op == BR) {
+        insn->flags |= REMOVED;
+      } else {
+        *insn = (instruction){POP_X32, insn->flags, 0, -1, 0, 0, NULL, 1, -1};
+      }
+      changed = 1;
+    }
+  }
+
+  if (changed) {
+    compact(f);
+  }
+  return changed;
+}
+
+static int remove_unreachable(function *f) {
+  size_t *pending = allocate(f->count, sizeof(size_t));
+  size_t count = 0;
+  int changed = 0;
+
+  for (size_t i = 0; i < f->count; i++) {
+    f->code[i].flags &= (uint8_t)~LIVE;
+  }
+  if (f->count != 0) {
+    pending[count++] = 0;
+  }
+  while (count != 0) {
+    instruction *insn = &f->code[pending[--count]];
+    size_t i = (size_t)(insn - f->code);
+    if ((insn->flags & LIVE) != 0) {
+      continue;
+    }
+    insn->flags |= LIVE;
+    if (falls_through(insn->op) && i + 1 < f->count) {
+      pending[count++] = i + 1;
+    }
+    if (is_branch(insn->op)) {
+      pending[count++] = insn->target;
+    }
+  }
+  for (size_t i = 0; i < f->count; i++) {
+    if ((f->code[i].flags & LIVE) == 0) {
+      f->code[i].flags |= REMOVED;
+      changed = 1;
+    }
+  }
+
+  free(pending);
+  if (changed) {
+    compact(f);
+  }
+  return changed;
+}
+
+static int fold_binary(uint8_t op, int32_t a, int32_t b, int32_t *result) {
+  uint32_t x = (uint32_t)a;
+  uint32_t y = (uint32_t)b;
+
+  switch (op) {
+  case ADD_I32:
+    *result = (int32_t)(x + y);
+    return 1;
+  case SUB_I32:
+    *result = (int32_t)(x - y);
+    return 1;
+  case MUL_I32:
+    *result = (int32_t)(x * y);
+    return 1;
+  case DIV_I32:
+  case REM_I32:
+    if (b == 0 || (b == -1 && a == INT32_MIN)) {
+      return 0;
+    }
+    *result = op == DIV_I32 ? a / b : a % b;
+    return 1;
+  case DIV_I32_UN:
+  case REM_I32_UN:
+    if (y == 0) {
+      return 0;
+    }
+    *result = (int32_t)(op == DIV_I32_UN ? x / y : x % y);
+    return 1;
+  case SHL_I32:
+    *result = (int32_t)(x << (b & 31));
+    return 1;
+  case SHR_I32:
+    *result = a >> (b & 31);
+    return 1;
+  case SHR_I32_UN:
+    *result = (int32_t)(x >> (b & 31));
+    return 1;
+  case AND_I32:
+    *result = (int32_t)(x & y);
+    return 1;
+  case OR_I32:
+    *result = (int32_t)(x | y);
+    return 1;
+  case XOR_I32:
+    *result = (int32_t)(x ^ y);
+    return 1;
+  case CEQ_I32:
+    *result = x == y;
+    return 1;
+  case CNE_I32:
+    *result = x != y;
+    return 1;
+  case CGT_I32:
+    *result = a > b;
+    return 1;
+  case CGT_I32_UN:
+    *result = x > y;
+    return 1;
+  case CGE_I32:
+    *result = a >= b;
+    return 1;
+  case CGE_I32_UN:
+    *result = x >= y;
+    return 1;
+  case CLT_I32:
+    *result = a < b;
+    return 1;
+  case CLT_I32_UN:
+    *result = x < y;
+    return 1;
+  case CLE_I32:
+    *result = a <= b;
+    return 1;
+  case CLE_I32_UN:
+    *result = x <= y;
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+static int fold_unary(uint8_t op, int32_t a, int32_t *result) {
+  switch (op) {
+  case NEG_I32:
+    *result = (int32_t)(0u - (uint32_t)a);
+    return 1;
+  case NOT_I32:
+    *result = (int32_t)~(uint32_t)a;
+    return 1;
+  case CONV_I8_I32:
+    *result = (int8_t)a;
+    return 1;
+  case CONV_U8_I32:
+    *result = (uint8_t)a;
+    return 1;
+  case CONV_I16_I32:
+    *result = (int16_t)a;
+    return 1;
+  case CONV_U16_I32:
+    *result = (uint16_t)a;
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+static int is_power_of_two(int32_t value) {
+  uint32_t x = (uint32_t)value;
+  return x != 0 && (x & (x - 1)) == 0;
+}
+
+static int32_t log2_of(int32_t value) {
+  int32_t k = 0;
+  while (((uint32_t)value >> k) != 1) {
+    k++;
+  }
+  return k;
+}
+
+// Folds operations on constants and replaces multiplications and unsigned
+// divisions by powers of two with shifts. The instructions that are folded
+// into the first one must not be branch targets.
+static int fold_constants(function *f) {
+  int changed = 0;
+
+  for (size_t i = 0; i + 1 < f->count; i++) {
+    instruction *a = &f->code[i];
+    instruction *b = &f->code[i + 1];
+    instruction *c = i + 2 < f->count ? &f->code[i + 2] : NULL;
+    int32_t value;
+    int folded = 0;
+
+    if ((a->flags & REMOVED) != 0 || a->op != LDC_X32 ||
+        (b->flags & (LEADER | REMOVED)) != 0) {
+      continue;
+    }
+
+    if (fold_unary(b->op, a->value, &value)) {
+      a->value = value;
+      b->flags |= REMOVED;
+      folded = 1;
+    } else if (b->op == BRTRUE || b->op == BRFALSE) {
+      if ((a->value != 0) == (b->op == BRTRUE)) {
+        a->flags |= REMOVED;
+        b->op = BR;
+      } else {
+        a->flags |= REMOVED;
+        b->flags |= REMOVED;
+      }
+      folded = 1;
+    } else if (b->op == LDC_X32 && c && (c->flags & LEADER) == 0 &&
+               fold_binary(c->op, a->value, b->value, &value)) {
+      a->value = value;
+      b->flags |= REMOVED;
+      c->flags |= REMOVED;
+      folded = 1;
+    } else if ((a->flags & LEADER) == 0) {
+      // The operand below the constant is unknown here.
+      if (a->value == 0 &&
+          (b->op == ADD_I32 || b->op == SUB_I32 || b->op == OR_I32 ||
+           b->op == XOR_I32 || b->op == SHL_I32 || b->op == SHR_I32 ||
+           b->op == SHR_I32_UN)) {
+        a->flags |= REMOVED;
+        b->flags |= REMOVED;
+        folded = 1;
+      } else if (a->value == 1 && (b->op == MUL_I32 || b->op == DIV_I32 ||
+                                   b->op == DIV_I32_UN)) {
+        a->flags |= REMOVED;
+        b->flags |= REMOVED;
+        folded = 1;
+      } else if (is_power_of_two(a->value) && a->value != 1) {
+        if (b->op == MUL_I32) {
+          a->value = log2_of(a->value);
+          b->op = SHL_I32;
+          folded = 1;
+        } else if (b->op == DIV_I32_UN) {
+          a->value = log2_of(a->value);
+          b->op = SHR_I32_UN;
+          folded = 1;
+        } else if (b->op == REM_I32_UN) {
+          a->value = (int32_t)((uint32_t)a->value - 1);
+          b->op = AND_I32;
+          folded = 1;
+        }
+      }
+    }
+    if (folded) {
+      b->code = NULL;
+      b->size = 1;
+      changed = 1;
+    }
+  }
+
+  if (changed) {
+    compact(f);
+  }
+  return changed;
+}
+
+typedef struct liveness {
+  uint64_t bits[4];
+} liveness;
+
+static void set_live(liveness *l, int local, int live) {
+  if (live) {
+    l->bits[local >> 6] |= (uint64_t)1 << (local & 63);
+  } else {
+    l->bits[local >> 6] &= ~((uint64_t)1 << (local & 63));
+  }
+}
+
+static int is_live(const liveness *l, int local) {
+  return (l->bits[local >> 6] >> (local & 63)) & 1;
+}
+
+// Replaces stores to locals that are not read again with pops. A debugger may
+// look at the locals of a function when it stops at a breakpoint, so all
+// locals are live there. Functions that take the address of a local are left
+// alone.
+static int remove_dead_stores(function *f) {
+  if (!f->analyzed || f->escapes) {
+    return 0;
+  }
+
+  liveness *in = allocate(f->count, sizeof(liveness));
+  int changed;
+
+  do {
+    changed = 0;
+    for (size_t i = f->count; i-- > 0;) {
+      const instruction *insn = &f->code[i];
+      liveness out = {{0, 0, 0, 0}};
+
+      if (insn->op == BREAK) {
+        memset(&out, 0xFF, sizeof(out));
+      } else {
+        if (falls_through(insn->op) && i + 1 < f->count) {
+          for (size_t k = 0; k < 4; k++) {
+            out.bits[k] |= in[i + 1].bits[k];
+          }
+        }
+        if (is_branch(insn->op)) {
+          for (size_t k = 0; k < 4; k++) {
+            out.bits[k] |= in[insn->target].bits[k];
+          }
+        }
+      }
+
+      if (insn->op == STLOC_X32) {
+        set_live(&out, insn->local, 0);
+      } else if (insn->op == STLOC_X64) {
+        set_live(&out, insn->local, 0);
+        set_live(&out, insn->local + 1, 0);
+      } else if (is_load(insn->op)) {
+        set_live(&out, insn->local, 1);
+      } else if (insn->op == LDLOC_X64) {
+        set_live(&out, insn->local, 1);
+        set_live(&out, insn->local + 1, 1);
+      }
+
+      if (memcmp(&out, &in[i], sizeof(liveness)) != 0) {
+        in[i] = out;
+        changed = 1;
+      }
+    }
+  } while (changed);
+
+  for (size_t i = 0; i < f->count; i++) {
+    instruction *insn = &f->code[i];
+    liveness out = {{0, 0, 0, 0}};
+
+    if (insn->op != STLOC_X32 && insn->op != STLOC_X64) {
+      continue;
+    }
+    if (i + 1 < f->count) {
+      out = in[i + 1];
+    }
+    if (!is_live(&out, insn->local) &&
+        (insn->op == STLOC_X32 || !is_live(&out, insn->local + 1))) {
+      insn->op = insn->op == STLOC_X32 ? POP_X32 : POP_X64;
+      insn->local = -1;
+      insn->code = NULL;
+      insn->size = 1;
+      changed = 1;
+    }
+  }
+  free(in);
+
+  // A value that is pushed only to be popped again is not pushed at all.
+  for (size_t i = 0; i + 1 < f->count; i++) {
+    instruction *a = &f->code[i];
+    instruction *b = &f->code[i + 1];
+    int pushes = a->op == LDC_X32 || is_load(a->op) || a->op == DUP_X32 ||
+                         a->op == LDLOCA
+                     ? 1
+                 : a->op == LDC_X64 || a->op == LDLOC_X64 || a->op == DUP_X64
+                     ? 2
+                     : 0;
+
+    if ((a->flags & REMOVED) == 0 && (b->flags & LEADER) == 0 &&
+        pushes != 0 && b->op == (pushes == 1 ? POP_X32 : POP_X64)) {
+      a->flags |= REMOVED;
+      b->flags |= REMOVED;
+      changed = 1;
+    }
+  }
+
+  if (changed) {
+    compact(f);
+  }
+  return changed;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// A leaf function without locals, branches or system calls whose arguments
+// are all read as 32-bit values can be inlined. The arguments are stored to
+// new locals of the caller, and the body follows with its return removed.
+static int can_inline(const function *f) {
+  if (f->fixed || !f->analyzed || f->loc_count != 0 || f->count == 0 ||
+      f->count > MAX_INLINE || !is_return(f->code[f->count - 1].op)) {
+    return 0;
+  }
+
+  liveness read = {{0, 0, 0, 0}};
+  for (size_t i = 0; i < f->count; i++) {
+    const instruction *insn = &f->code[i];
+    uint8_t op = insn->op;
+    if (i + 1 < f->count && !falls_through(op)) {
+      return 0;
+    }
+    if (is_branch(op) || op == CALL_S || op == CALL || op == CALLI ||
+        op == SYSCALL || op == BREAK || op == HALT || op == LDLOCA ||
+        op == LDLOC_X64 || op == STLOC_X64 || op == MAKEARR) {
+      return 0;
+    }
+    if (is_load(op)) {
+      set_live(&read, insn->local, 1);
+    }
+  }
+  for (int i = 0; i < f->arg_count; i++) {
+    if (!is_live(&read, i)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static size_t emit_function(const function *f, uint8_t *out, size_t limit);
+
+static int inline_calls(function *f) {
+  if (f->fixed || !f->analyzed) {
+    return 0;
+  }
+
+  int changed = 0;
+
+  for (size_t i = 0; i < f->count; i++) {
+    const function *callee = find_function((size_t)f->code[i].value);
+    if (f->code[i].op != CALL_S || !callee || callee == f ||
+        !can_inline(callee) ||
+        f->arg_count + f->loc_count + callee->arg_count > UINT8_MAX ||
+        f->max_stack + callee->max_stack > UINT8_MAX) {
+      continue;
+    }
+
+    size_t added = callee->arg_count + callee->count - 1;
+    instruction *code = allocate(f->count + added, sizeof(instruction));
+    int base = f->loc_count;
+
+    memcpy(code, f->code, i * sizeof(instruction));
+    for (size_t j = 0; j < callee->arg_count; j++) {
+      code[i + j] = (instruction){STLOC_X32, 0,    0, base + (int)j, 0, 0,
+                                  NULL,      2,    -1};
+    }
+    for (size_t j = 0; j + 1 < callee->count; j++) {
+      instruction *insn = &code[i + callee->arg_count + j];
+      *insn = callee->code[j];
+      insn->flags = 0;
+      if (insn->local >= 0) {
+        insn->local += base;
+      }
+    }
+    memcpy(code + i + added, f->code + i + 1,
+           (f->count - i - 1) * sizeof(instruction));
+
+    for (size_t j = 0; j < f->count + added; j++) {
+      instruction *insn = &code[j];
+      int inlined = j >= i && j < i + added;
+      if (is_branch(insn->op) && !inlined && insn->target > i) {
+        insn->target += added - 1;
+      }
+      if (insn->local >= base && !inlined) {
+        insn->local += callee->arg_count;
+      }
+    }
+
+    function candidate = *f;
+    candidate.code = code;
+    candidate.count = f->count + added;
+    candidate.loc_count = (uint8_t)(f->loc_count + callee->arg_count);
+    candidate.max_stack = (uint8_t)(f->max_stack + callee->max_stack);
+    find_leaders(&candidate);
+    analyze(&candidate);
+
+    if (candidate.analyzed &&
+        emit_function(&candidate, NULL, f->end - f->offset) != 0) {
+      free(f->code);
+      *f = candidate;
+      changed = 1;
+      i += added - 1;
+    } else {
+      free(code);
+    }
+  }
+
+  return changed;
+}
+
+// Removes locals that are never accessed and recomputes the stack space the
+// function needs.
+static void finish_function(function *f) {
+  if (!f->analyzed) {
+    return;
+  }
+
+  if (!f->escapes) {
+    int map[UINT8_MAX + 1];
+    liveness used = {{0, 0, 0, 0}};
+    int n = 0;
+
+    for (size_t i = 0; i < f->count; i++) {
+      const instruction *insn = &f->code[i];
+      if (insn->local >= 0) {
+        set_live(&used, insn->local, 1);
+        if (insn->op == LDLOC_X64 || insn->op == STLOC_X64) {
+          set_live(&used, insn->local + 1, 1);
+        }
+      }
+    }
+    for (int i = 0; i < f->loc_count + f->arg_count; i++) {
+      map[i] = i < f->loc_count && !is_live(&used, i) ? -1 : n++;
+    }
+    for (size_t i = 0; i < f->count; i++) {
+      if (f->code[i].local >= 0) {
+        f->code[i].local = map[f->code[i].local];
+      }
+    }
+    f->loc_count = (uint8_t)(n - f->arg_count);
+  }
+
+  int max_stack = 0;
+  for (size_t i = 0; i < f->count; i++) {
+    const instruction *insn = &f->code[i];
+    int depth = insn->depth;
+    if (depth < 0) {
+      continue;
+    }
+    if (insn->op == SYSCALL) {
+      depth -= (int8_t)insn->code[1];
+    } else if (insn->op != CALL_S) {
+      depth += opcode_pushes[insn->op] - opcode_pops[insn->op];
+    } else {
+      depth = -1;
+    }
+    if (insn->depth > max_stack) {
+      max_stack = insn->depth;
+    }
+    if (depth > max_stack) {
+      max_stack = depth;
+    }
+  }
+  for (size_t i = 0; i + 1 < f->count; i++) {
+    if (f->code[i].op == CALL_S && f->code[i + 1].depth > max_stack) {
+      max_stack = f->code[i + 1].depth;
+    }
+  }
+  if (max_stack < f->max_stack) {
+    f->max_stack = (uint8_t)max_stack;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static size_t encoded_size(const instruction *insn, int wide) {
+  if (insn->op == LDC_X32) {
+    return insn->value >= -1 && insn->value <= 8           ? 1
+           : insn->value >= INT8_MIN && insn->value <= INT8_MAX ? 2
+                                                                : 5;
+  } else if (is_branch(insn->op)) {
+    return wide ? 3 : 2;
+  } else if (insn->op == CALL_S || insn->op == CALL) {
+    return insn->op == CALL_S ? 3 : insn->size;
+  } else if (is_local(insn->op)) {
+    return 2;
+  } else {
+    return insn->size;
+  }
+}
+
+// Encodes the function into out, or only computes its size if out is NULL.
+// Branches start out short and are widened until they fit. Returns zero if
+// the function does not fit into limit bytes.
+static size_t emit_function(const function *f, uint8_t *out, size_t limit) {
+  size_t *offsets = allocate(f->count + 1, sizeof(size_t));
+  uint8_t *wide = allocate(f->count, 1);
+  size_t size;
+  int changed;
+
+  do {
+    changed = 0;
+    size = sizeof(mango_func_def);
+    for (size_t i = 0; i < f->count; i++) {
+      offsets[i] = size;
+      size += encoded_size(&f->code[i], wide[i]);
+    }
+    offsets[f->count] = size;
+
+    for (size_t i = 0; i < f->count; i++) {
+      if (is_branch(f->code[i].op) && !wide[i]) {
+        ptrdiff_t d = (ptrdiff_t)offsets[f->code[i].target] -
+                      (ptrdiff_t)offsets[i + 1];
+        if (d < INT8_MIN || d > INT8_MAX) {
+          wide[i] = 1;
+          changed = 1;
+        }
+      }
+    }
+  } while (changed);
+
+  for (size_t i = 0; i < f->count && size <= limit; i++) {
+    const instruction *insn = &f->code[i];
+    if (is_local(insn->op) &&
+        (insn->local >= 0 ? insn->local + insn->depth : insn->slot) >
+            UINT8_MAX) {
+      size = SIZE_MAX;
+    }
+    if (is_branch(insn->op)) {
+      ptrdiff_t d = (ptrdiff_t)offsets[insn->target] -
+                    (ptrdiff_t)offsets[i + 1];
+      if (d < INT16_MIN || d > INT16_MAX) {
+        size = SIZE_MAX;
+      }
+    }
+  }
+  if (size > limit) {
+    size = 0;
+  }
+
+  if (out && size != 0) {
+    out[0] = f->arg_count;
+    out[1] = f->loc_count;
+    out[2] = f->max_stack;
+
+    for (size_t i = 0; i < f->count; i++) {
+      const instruction *insn = &f->code[i];
+      uint8_t *p = out + offsets[i];
+      int32_t v = insn->value;
+
+      if (insn->op == LDC_X32) {
+        if (v >= -1 && v <= 8) {
+          p[0] = (uint8_t)(LDC_I32_0 + v);
+        } else if (v >= INT8_MIN && v <= INT8_MAX) {
+          p[0] = LDC_I32_S;
+          p[1] = (uint8_t)(int8_t)v;
+        } else {
+          p[0] = LDC_X32;
+          store_u16(p + 1, (uint32_t)v);
+          store_u16(p + 3, (uint32_t)v >> 16);
+        }
+      } else if (is_branch(insn->op)) {
+        ptrdiff_t d = (ptrdiff_t)offsets[insn->target] -
+                      (ptrdiff_t)offsets[i + 1];
+        if (wide[i]) {
+          p[0] = insn->op;
+          store_u16(p + 1, (uint16_t)(int16_t)d);
+        } else {
+          p[0] = insn->op == BR        ? BR_S
+                 : insn->op == BRFALSE ? BRFALSE_S
+                                       : BRTRUE_S;
+          p[1] = (uint8_t)(int8_t)d;
+        }
+      } else if (insn->op == CALL_S) {
+        p[0] = CALL_S;
+        store_u16(p + 1, (uint32_t)v);
+      } else if (is_local(insn->op)) {
+        p[0] = insn->op;
+        p[1] = (uint8_t)(insn->local >= 0 ? insn->local + insn->depth
+                                          : insn->slot);
+      } else if (insn->code) {
+        memcpy(p, insn->code, insn->size);
+      } else {
+        p[0] = insn->op;
+      }
+    }
+  }
+
+  free(wide);
+  free(offsets);
+  return size;
+}
+
+static void optimize_function(function *f) {
+  int changed;
+
+  find_leaders(f);
+  do {
+    changed = thread_jumps(f);
+    changed |= remove_unreachable(f);
+    changed |= fold_constants(f);
+    analyze(f);
+    changed |= remove_dead_stores(f);
+    analyze(f);
+  } while (changed);
+}
+
+static uint8_t *read_image(const char *path, size_t *size) {
+  FILE *file = fopen(path, "rb");
+  uint8_t *image = malloc(UINT16_MAX + 1);
+
+  if (!file || !image) {
+    return NULL;
+  }
+
+  *size = fread(image, 1, UINT16_MAX + 1, file);
+  fclose(file);
+  if (*size < sizeof(mango_module_def) || *size > UINT16_MAX) {
+    free(image);
+    return NULL;
+  }
+  return image;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3 || argc % 2 != 1) {
+    fputs("usage: mango-opt name image [name image]...\n", stderr);
+    return EXIT_FAILURE;
+  }
+
+  module_count = (size_t)(argc - 1) / 2;
+  modules = allocate(module_count, sizeof(module));
+
+  for (size_t i = 0; i < module_count; i++) {
+    const char *name = argv[1 + 2 * i];
+    const char *path = argv[2 + 2 * i];
+    module *m = &modules[i];
+
+    if (strlen(name) > sizeof(m->name.bytes)) {
+      fprintf(stderr, "mango-opt: module name too long: %s\n", name);
+      return EXIT_FAILURE;
+    }
+    memcpy(m->name.bytes, name, strlen(name));
+
+    uint8_t *image = read_image(path, &m->size);
+    if (!image) {
+      fprintf(stderr, "mango-opt: cannot read image: %s\n", path);
+      return EXIT_FAILURE;
+    }
+    m->image = image;
+
+    const mango_module_def *def = (const mango_module_def *)image;
+    if (sizeof(mango_module_def) +
+            def->import_count * sizeof(mango_module_name) >
+        m->size) {
+      fprintf(stderr, "mango-opt: bad image format: %s\n", path);
+      return EXIT_FAILURE;
+    }
+
+    m->flags = allocate(m->size, 1);
+    m->imports = allocate(def->import_count + 1u, sizeof(int));
+    m->flags[offsetof(mango_module_def, entry_point)] |= REACHED;
+
+    if ((def->features & MANGO_FEATURE_EXPORTS) != 0) {
+      size_t start = sizeof(mango_module_def) +
+                     def->import_count * sizeof(mango_module_name);
+      size_t slot_count = start + sizeof(mango_exports_def) <= m->size
+                              ? fetch_u16(image + start)
+                              : 0;
+      if (slot_count == 0 ||
+          start + sizeof(mango_exports_def) +
+                  slot_count * sizeof(mango_export_def) >
+              m->size) {
+        fprintf(stderr, "mango-opt: bad image format: %s\n", path);
+        return EXIT_FAILURE;
+      }
+
+      const uint8_t *slots = image + start + sizeof(mango_exports_def);
+      for (size_t j = 0; j < slot_count; j++) {
+        uint16_t offset =
+            fetch_u16(slots + j * sizeof(mango_export_def) +
+                      offsetof(mango_export_def, offset));
+        if (offset != 0) {
+          mark_function(i, offset);
+        }
+      }
+    }
+  }
+
+  for (size_t i = 0; i < module_count; i++) {
+    const module *m = &modules[i];
+    const mango_module_def *def = (const mango_module_def *)m->image;
+
+    for (size_t j = 0; j < def->import_count; j++) {
+      m->imports[j] = -1;
+      for (size_t k = 0; k < module_count; k++) {
+        if (memcmp(&def->imports[j], &modules[k].name,
+                   sizeof(mango_module_name)) == 0) {
+          m->imports[j] = (int)k;
+        }
+      }
+    }
+  }
+
+  discover();
+
+  const module *m = &modules[0];
+  for (size_t offset = 0; offset < m->size; offset++) {
+    if ((m->flags[offset] & FUNCTION) != 0) {
+      function_count++;
+    }
+  }
+  functions = allocate(function_count, sizeof(function));
+  function_count = 0;
+  for (size_t offset = 0; offset < m->size; offset++) {
+    if ((m->flags[offset] & FUNCTION) != 0) {
+      function *f = &functions[function_count++];
+      f->offset = offset;
+      decode_function(m, f);
+    }
+  }
+  for (size_t i = 0; i + 1 < function_count; i++) {
+    if (functions[i].end > functions[i + 1].offset) {
+      functions[i].fixed = 1;
+      functions[i + 1].fixed = 1;
+    }
+  }
+
+  // Functions the verifier would reject are left as they are, so that the
+  // optimizer does not turn an invalid image into a valid one.
+  for (size_t i = 0; i < function_count; i++) {
+    function *f = &functions[i];
+    if (!f->fixed) {
+      f->returns = returns_of(f);
+      f->fixed = f->returns < 0;
+    }
+  }
+  for (size_t i = 0; i < function_count; i++) {
+    function *f = &functions[i];
+    if (!f->fixed) {
+      analyze(f);
+      f->fixed = !f->analyzed && !f->opaque;
+    }
+  }
+  for (size_t i = 0; i < function_count; i++) {
+    if (!functions[i].fixed) {
+      optimize_function(&functions[i]);
+    }
+  }
+  for (size_t i = 0; i < function_count; i++) {
+    function *f = &functions[i];
+    if (!f->fixed && inline_calls(f)) {
+      optimize_function(f);
+    }
+  }
+
+  uint8_t *image = allocate(m->size, 1);
+  memcpy(image, m->image, m->size);
+
+  for (size_t i = 0; i < function_count; i++) {
+    function *f = &functions[i];
+    if (f->fixed) {
+      continue;
+    }
+
+    finish_function(f);
+
+    uint8_t *out = allocate(f->end - f->offset, 1);
+    if (emit_function(f, out, f->end - f->offset) != 0) {
+      memcpy(image + f->offset, out, f->end - f->offset);
+    }
+    free(out);
+  }
+
+  if (fwrite(image, 1, m->size, stdout) != m->size) {
+    fputs("mango-opt: cannot write image\n", stderr);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}